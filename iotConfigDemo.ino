@@ -2,7 +2,7 @@
 #include "iotconfig.hpp"
 
 unsigned long currentMillis=0;
-unsigned long nextEvent=0;
+unsigned long lastEvent=0;
 
 iotConfig ic;
 int merker1;
@@ -46,7 +46,7 @@ void loop(){
 
   currentMillis=millis();
   
-  if (currentMillis > nextEvent)
+  if (currentMillis - lastEvent >= 5000)
   {
      if (!configured)
      {
@@ -61,7 +61,7 @@ void loop(){
         Serial.print(", IP: ");
         Serial.println(ic.getIP());
      }
-     nextEvent += 5000;
+     lastEvent = currentMillis;
   }
 
 
@@ -74,7 +74,7 @@ void loop(){
 
   if (client)
   {
-     if (client.connected() && (!closeConn || client.available()) && (currentMillis < (clientConnectTime+clientTimeOut)))
+     if (client.connected() && (!closeConn || client.available()) && (currentMillis - clientConnectTime < clientTimeOut))
      {
         if (client.available())
         {
@@ -1,133 +1,320 @@
+#include "iotconfig.hpp"
 #ifndef ESP8266
 #include "driver/rtc_io.h"
+#include "esp_system.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
+#if IOTCONFIG_FEATURE_WPA2_ENTERPRISE
 #include "esp_wpa2.h"
 #endif
-#include "iotconfig.hpp"
+#include "mbedtls/md.h"
+#if IOTCONFIG_FEATURE_DELTA_OTA
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include <Update.h>
+#endif
+#else
+#include <bearssl/bearssl_hmac.h>
+#if IOTCONFIG_FEATURE_DELTA_OTA
+#include <Updater.h>
+#endif
+#endif
 
 #ifndef min
 #define min(a,b) (((a)<(b))?(a):(b))
 #endif
 
-IPAddress iotConfigApIP(192, 168, 4, 1);
-DNSServer iotConfigDnsServer;
-WiFiServer iotConfigServer(80);
-WiFiClient iotConfigClient;
-static bool iotConfigUseWiFi = true;
-static bool useOTA = true;
-
+// context of an instance constructed without one, RTC memory is a device wide resource
 #ifdef ESP8266
-union {
-   uint8_t buf[4];
-   uint32_t val;
-} rtc4;
-uint8_t firstBoot = 1;
-uint32_t iot_rtc_data[(IOT_RTC_DATA_SIZE+1)/4];
+// restored from/saved to the RTC user memory by begin() and reboot()
+iotConfigRTC_t iotConfigDefaultRTC = { {0}, 1 };
+#else
+RTC_DATA_ATTR iotConfigRTC_t iotConfigDefaultRTC = { {0}, 1 };
+#endif
+#if IOTCONFIG_FEATURE_SNAPSHOT
+#define IOT_SNAPSHOT_MAGIC 0x534e4150
+#endif
+
+#ifdef IOTCONFIG_PROFILE
+enum {iotProfileCalcCRC, iotProfileQueryToAscii, iotProfileGetQueryParam, iotProfileAddVariable,
+      iotProfileUpdateEEPROM, iotProfileUpdateRTCDATA, iotProfileRenderPage, iotProfileKernels};
+static const char * const iotProfileNames[iotProfileKernels] = {
+   "calcCRC", "queryToAscii", "getQueryParam", "addVariableInfo",
+   "updateEEPROM", "updateRTCDATA", "renderPage"
+};
+static struct
+{
+   uint32_t calls;
+   uint32_t totalUS;
+   uint32_t maxUS;
+} iotProfile[iotProfileKernels];
+
+// accumulates the run time of the enclosing scope into iotProfile[kernel]
+class iotConfigProfileScope
+{
+   public:
+      iotConfigProfileScope(const int kernelN) : kernel(kernelN), start(micros()) {}
+      ~iotConfigProfileScope()
+      {
+         uint32_t elapsed = micros() - start;
+         iotProfile[kernel].calls++;
+         iotProfile[kernel].totalUS += elapsed;
+         if (elapsed > iotProfile[kernel].maxUS) { iotProfile[kernel].maxUS = elapsed; }
+      }
+   private:
+      int kernel;
+      unsigned long start;
+};
+#define IOT_PROFILE(kernel) iotConfigProfileScope iotProfileScope(kernel)
 #else
-RTC_DATA_ATTR uint8_t firstBoot = 1;
-RTC_DATA_ATTR uint8_t iot_rtc_data[IOT_RTC_DATA_SIZE];
+#define IOT_PROFILE(kernel)
 #endif
 
-static bool factoryResetted = false;
+static uint32_t iotConfigMillis()
+{
+   return millis();
+}
+
+static uint32_t iotConfigMicros()
+{
+   return micros();
+}
+
+// reads a scan result from the raw record, WiFi.SSID(i) would allocate a String
+static bool iotConfigScanRecord(const int i, char *ssid, const size_t ssidSize, int32_t *rssi, uint8_t *encryptionType)
+{
+   size_t len;
+
+#ifdef ESP8266
+   bss_info *record = WiFi.getScanInfoByIndex(i);
+   if (record == NULL) { return false; }
+   len = (record->ssid_len < sizeof(record->ssid)) ? record->ssid_len : sizeof(record->ssid);
+#else
+   wifi_ap_record_t *record = (wifi_ap_record_t *)WiFi.getScanInfoByIndex(i);
+   if (record == NULL) { return false; }
+   len = strnlen((const char *)record->ssid, sizeof(record->ssid));
+#endif
+   if ((len == 0) || (len >= ssidSize)) { return false; }
+   memcpy(ssid, record->ssid, len);
+   ssid[len] = 0;
+   *rssi = record->rssi;
+   *encryptionType = WiFi.encryptionType(i);
+   return true;
+}
 
-unsigned long iotConfigCurrentMillis=0;
-static bool iotConfigOtaPrio = false;
-static bool iotConfigOnline = false;
-static unsigned long iotConfigWifiLossTS=0;
-static bool iotConfigResetState = false;
+// only the variant matching the switches iotconfig.cpp is built with
+const char IOTCONFIG_LAYOUT_TAG = 0;
 
-iotConfig::iotConfig()
+iotConfig::iotConfig(iotConfigRTC_t *rtcContext, iotConfigClock_t clock, iotConfigClock_t clockUS, const char *) :
+#if IOTCONFIG_FEATURE_PORTAL
+   iotConfigServer(80),
+#endif
+#if IOTCONFIG_FEATURE_DELTA_OTA
+   iotConfigDeltaServer(IOT_DELTA_OTA_PORT),
+#endif
+#if IOTCONFIG_FEATURE_METRICS
+   iotConfigMetricsServer(IOT_METRICS_PORT),
+#endif
+   apIP(192, 168, 4, 1),
+   rtc(rtcContext ? rtcContext : &iotConfigDefaultRTC),
+   clockSource(clock ? clock : iotConfigMillis),
+   clockSourceUS(clockUS ? clockUS : iotConfigMicros)
 {
+#ifdef IOTCONFIG_NO_HEAP
+   eepromAllocData = eepromAllocStore;
+   rtcAllocData = rtcAllocStore;
+   eepromAllocCapacity = IOT_MAX_EEPROM_VARIABLES;
+   rtcAllocCapacity = IOT_MAX_RTC_VARIABLES;
+#else
    eepromAllocData = NULL;
    rtcAllocData = NULL;
+   eepromAllocCapacity = 0;
+   rtcAllocCapacity = 0;
+#endif
    eepromDataIndex = 0;
    rtcDataIndex = 0;
+   // a heap allocated instance is not zeroed like the usual global one
+   bootUps = 0;
+   eepromCRC = 0;
+   eepromSize = 0;
+   configStart = 0;
+   eepromTotalSize = 0;
+   eepromAssignPointer = 0;
+   rtcDataSize = 0;
+   rtcDataAssignPointer = 0;
+   memset(friendlyName, 0, sizeof(friendlyName));
+   memset(wifiApPassword, 0, sizeof(wifiApPassword));
+   memset(wifiClientSSID, 0, sizeof(wifiClientSSID));
+   memset(wifiClientUsername, 0, sizeof(wifiClientUsername));
+   memset(wifiClientPassword, 0, sizeof(wifiClientPassword));
+   memset(otaPassword, 0, sizeof(otaPassword));
    iotConfigMode = iotConfigNoneMode;
-   iotConfigServerState = iotConfigServerState;
+   iotConfigServerState = iotConfigScanSSIDs;
+   iotConfigUseWiFi = true;
+   useOTA = true;
+   iotConfigOnline = false;
+   iotConfigResetState = false;
+   memset(timers, 0, sizeof(timers));
+   iotConfigOtaPrio = false;
+   memset(&iotConfigOtaStats, 0, sizeof(iotConfigOtaStats));
+   iotConfigOtaStartTS = 0;
+   iotConfigOtaChunkTS = 0;
+   iotConfigOtaPercent = 0;
+   factoryResetted = false;
+   wifiEventsRegistered = false;
    numScannedNetworks = 0;
    joinedNetworkIndex = 0;
-   clientConnectTime = 0;
    clientTimeOut = 2000;
    closeConn = false;
-   currentLine = "";
-   apExpireTime = 0;
+#if IOTCONFIG_FEATURE_PORTAL
+   memset(&joinedNetwork, 0, sizeof(joinedNetwork));
+   probeResponse[0] = 0;
+   probeResponseLen = 0;
+   currentLine[0] = 0;
+   currentLineLen = 0;
+   clientBytes = 0;
+   requestLineDone = false;
+#endif
+   memset(&portalStats, 0, sizeof(portalStats));
+   freeHeapAtBegin = 0;
+   minFreeHeap = 0;
    watchDogTimeout = 20000;
    otaInitialized = false;
+   sleepModeSet = false;
+   provisionPort = 0;
+   deltaOtaPort = 0;
+   mdnsPort = 0;
+   metricsPort = 0;
+   serialProvisionWindow = 0;
+   serialProvisionPin = -1;
+#if IOTCONFIG_FEATURE_METRICS
+   metricsStarted = false;
+   metricsFirstLine = true;
+   metricsLineLen = 0;
+   metricsRequestLine[0] = 0;
+#endif
+   reconnectCount = 0;
+   handleCalls = 0;
+   handleMaxUS = 0;
+   handleTotalUS = 0;
+   memset(&uptime, 0, sizeof(uptime));
+#if IOTCONFIG_FEATURE_MDNS || IOTCONFIG_FEATURE_DELTA_OTA
+   sketchMD5[0] = 0;
+#endif
+#if IOTCONFIG_FEATURE_MDNS
+   mdnsStarted = false;
+   mdnsService[0] = 0;
+   mdnsFirmware[0] = 0;
+#endif
+   useSnapshot = false;
+   warmBoot = false;
+   memset(profiles, 0, sizeof(profiles));
+   profileSequence = 0;
+   activeProfile = -1;
+   reconnectAttempts = 0;
+   profileScanRunning = false;
+   connectStartTS = 0;
+   wasOnline = false;
+   memset(&configBackup, 0, sizeof(configBackup));
+   reconfigureFromClient = false;
+   provisionUdpStarted = false;
+   provisionSequence = 0;
+   provisionSequenceDirty = false;
+   memset(&commitStats, 0, sizeof(commitStats));
+   commitWindow = IOT_COMMIT_WINDOW;
+   commitAutoDetect = false;
+   commitPending = false;
+   variablesDirty = false;
+   eepromStarted = false;
+#if IOTCONFIG_FEATURE_PROVISIONING
+   memset(provisionStagingSSID, 0, sizeof(provisionStagingSSID));
+   memset(provisionStagingPassword, 0, sizeof(provisionStagingPassword));
+#endif
 }
 
 iotConfig::~iotConfig()
 {
-}
-
-
-#ifdef ESP8266
-#define EVENT_STA_GOT_IP     const WiFiEventStationModeGotIP&
-#define EVENT_STA_DISCONNECT const WiFiEventStationModeDisconnected&
-#define EVENT_AP_CONNECT     const WiFiEventSoftAPModeStationConnected&
-#else
-#define EVENT_STA_GOT_IP     void
-#define EVENT_STA_DISCONNECT void
-#define EVENT_AP_CONNECT     void
+#ifndef ESP8266
+   if (wifiEventsRegistered)
+   {
+      WiFi.removeEvent(wifiEventId);
+   }
+#endif
+#ifndef IOTCONFIG_NO_HEAP
+   free(eepromAllocData);
+   free(rtcAllocData);
 #endif
+}
 
-void onStaGotIP(EVENT_STA_GOT_IP) {
+void iotConfig::onStaGotIP() {
    Serial.println("WiFi connected");
    Serial.println("IP address: ");
    Serial.println(WiFi.localIP());
    iotConfigOnline=true;
 }
 
-void onStaDisconnect(EVENT_STA_DISCONNECT) {
+void iotConfig::onStaDisconnect() {
    Serial.println("WiFi lost connection");
    iotConfigOnline=false;
-   iotConfigWifiLossTS=iotConfigCurrentMillis;
+   timerStart(iotTimerWatchdog, watchDogTimeout);
 }
 
-void onApConnected(EVENT_AP_CONNECT) {
+void iotConfig::onApConnected() {
    iotConfigResetState=true;
 }
 
+void iotConfig::registerWiFiEvents()
+{
 #ifdef ESP8266
-WiFiEventHandler  onStaGotIPHandler;
-WiFiEventHandler  onStaDisconnectHandler;
-WiFiEventHandler  onApConnectedHandler;
+   onStaGotIPHandler      = WiFi.onStationModeGotIP([this](const WiFiEventStationModeGotIP&) { onStaGotIP(); });
+   onStaDisconnectHandler = WiFi.onStationModeDisconnected([this](const WiFiEventStationModeDisconnected&) { onStaDisconnect(); });
+   onApConnectedHandler   = WiFi.onSoftAPModeStationConnected([this](const WiFiEventSoftAPModeStationConnected&) { onApConnected(); });
 #else
-
-static void iotConfigWiFiEvent(WiFiEvent_t event)
-{
-   Serial.printf("[WiFi-event] event: %d\n", event);
-
-   switch(event)
-   {
-      case SYSTEM_EVENT_STA_GOT_IP:
-          onStaGotIP();
-          break;
-      case SYSTEM_EVENT_STA_DISCONNECTED:
-      case SYSTEM_EVENT_STA_STOP:
-      case SYSTEM_EVENT_STA_LOST_IP:
-      case SYSTEM_EVENT_STA_AUTHMODE_CHANGE:
-          onStaDisconnect();
-          break;
-      case SYSTEM_EVENT_AP_STACONNECTED:
-      case SYSTEM_EVENT_AP_STAIPASSIGNED:
-          onApConnected();
-          break;
-      default:
-          break;
+   if (wifiEventsRegistered)
+   {
+      WiFi.removeEvent(wifiEventId);
    }
-}
+   wifiEventId = WiFi.onEvent([this](system_event_id_t event, system_event_info_t info) {
+      Serial.printf("[WiFi-event] event: %d\n", event);
+
+      switch(event)
+      {
+         case SYSTEM_EVENT_STA_GOT_IP:
+             onStaGotIP();
+             break;
+         case SYSTEM_EVENT_STA_DISCONNECTED:
+         case SYSTEM_EVENT_STA_STOP:
+         case SYSTEM_EVENT_STA_LOST_IP:
+         case SYSTEM_EVENT_STA_AUTHMODE_CHANGE:
+             onStaDisconnect();
+             break;
+         case SYSTEM_EVENT_AP_STACONNECTED:
+         case SYSTEM_EVENT_AP_STAIPASSIGNED:
+             onApConnected();
+             break;
+         default:
+             break;
+      }
+   });
 #endif
+   wifiEventsRegistered = true;
+}
 
 bool iotConfig::begin(const char *deviceName, const char *initialPasswordN,
                       const size_t eepromSizeN, const size_t rtcDataSizeN, const uint16_t coldBootAPtime, bool enableOTA)
  
 {
 #ifdef ESP8266
+   union {
+      uint8_t buf[4];
+      uint32_t val;
+   } rtc4;
    rtc4.val=0;
    ESP.rtcUserMemoryRead(0, (uint32_t*)&rtc4.val, 4);
    if (strncmp((const char*)&rtc4.val, "init", 4)==0) {
-      firstBoot = 0;
-      ESP.rtcUserMemoryRead(4, (uint32_t*)&iot_rtc_data, IOT_RTC_DATA_SIZE);
+      rtc->firstBoot = 0;
+      ESP.rtcUserMemoryRead(4, (uint32_t*)rtc->data, IOT_RTC_DATA_SIZE);
+      ESP.rtcUserMemoryRead(4 + IOT_RTC_DATA_SIZE/4, &rtc->watchdogReboots, sizeof(rtc->watchdogReboots));
    }
    memcpy(&rtc4.buf, "init", 4);
    ESP.rtcUserMemoryWrite(0, (uint32_t*)&rtc4, 4);
@@ -139,75 +326,110 @@ bool iotConfig::begin(const char *deviceName, const char *initialPasswordN,
 #endif
 
    useOTA = enableOTA;
+   freeHeapAtBegin = ESP.getFreeHeap();
+   minFreeHeap = freeHeapAtBegin;
    if (rtcDataSizeN > IOT_RTC_DATA_SIZE)
    {
       return false;
    }
-   eepromSize=eepromSizeN+
-              sizeof(eepromCRC)+
-              sizeof(friendlyName)+
-              sizeof(wifiApPassword)+
-              sizeof(wifiClientSSID)+
-              sizeof(wifiClientUsername)+
-              sizeof(wifiClientPassword)+
-              sizeof(otaPassword);
+   // CRC, record header and user variables keep fixed offsets, the
+   // built-in configuration records follow with room for every field
+   configStart=sizeof(eepromCRC)+
+               IOT_CONFIG_HEADER_SIZE+
+               eepromSizeN;
+   eepromSize=configStart+
+              6*IOT_CONFIG_RECORD_OVERHEAD+
+              sizeof(friendlyName)-1+
+              sizeof(wifiApPassword)-1+
+              sizeof(wifiClientSSID)-1+
+              sizeof(wifiClientUsername)-1+
+              sizeof(wifiClientPassword)-1+
+              sizeof(otaPassword)-1+
+              IOT_CONFIG_RECORD_OVERHEAD+sizeof(provisionSequence);
+   // the network profile table follows the CRC protected store with its own CRC
+   eepromTotalSize=eepromSize+
+                   sizeof(uint32_t)+
+                   sizeof(profileSequence)+
+                   sizeof(profiles);
    rtcDataSize=rtcDataSizeN;
 
-   EEPROM.begin(eepromSize);
+   warmBoot = restoreSnapshot();
+   if (warmBoot)
+   {
+      Serial.println("INFO: Warm boot, using RTC snapshot of EEPROM");
+   }
+   else
+   {
+      beginEEPROM();
+   }
 
    assignVariableEEPROM((uint8_t*)&eepromCRC, sizeof(eepromCRC));
+   // the record header is maintained by writeConfigRecords()
+   eepromAssignPointer+=IOT_CONFIG_HEADER_SIZE;
 
-   if (firstBoot)
+   if (rtc->firstBoot)
    {
       Serial.println("INFO: First boot, cleaning RTC_DATA memory");
       for (int i=0; i<rtcDataSizeN; i++)
       {
-         iot_rtc_data[i]=0;
+         rtc->data[i]=0;
       }
    }
-   if (eepromCRC != calcCRC())
+   if ((!warmBoot) && (readNV(sizeof(eepromCRC)) != IOT_CONFIG_FORMAT) && upgradeLegacyConfig(eepromSizeN))
+   {
+      updateEEPROM();
+      commitEEPROM();
+   }
+   if ((!warmBoot) && (eepromCRC != calcCRC()))
    {
       Serial.println("WARN: EEPROM CRC mismatch, erasing EEPROM");
       factoryResetted = true;
       factoryReset();
    }
+   else if (!warmBoot)
+   {
+      takeSnapshot();
+   }
+#if IOTCONFIG_FEATURE_SERIAL_PROVISIONING
+   if ((serialProvisionWindow > 0) && serialProvisioningAllowed())
+   {
+      serialProvisioning();
+   }
+#endif
 
-   assignVariableEEPROM((uint8_t*)&friendlyName, sizeof(friendlyName));
-   assignVariableEEPROM((uint8_t*)&wifiApPassword, sizeof(wifiApPassword));
+   loadConfigRecords();
    if (strlen(friendlyName)==0)
    {
       strncpy(friendlyName,
               deviceName,
-              min(  strlen(deviceName),sizeof(friendlyName)  ) ); 
+              min(  strlen(deviceName),sizeof(friendlyName)-1  ) ); 
       strncpy(wifiApPassword,
               initialPasswordN,
-              min(  strlen(initialPasswordN),sizeof(wifiApPassword)  ) ); 
+              min(  strlen(initialPasswordN),sizeof(wifiApPassword)-1  ) ); 
       Serial.print("INFO: Setting default friendlyName to: ");
       Serial.println(friendlyName);
    }
-
-   assignVariableEEPROM((uint8_t*)&wifiClientSSID, sizeof(wifiClientSSID));
-   assignVariableEEPROM((uint8_t*)&wifiClientUsername, sizeof(wifiClientUsername));
-   assignVariableEEPROM((uint8_t*)&wifiClientPassword, sizeof(wifiClientPassword));
-   assignVariableEEPROM((uint8_t*)&otaPassword, sizeof(otaPassword));
+   loadNetworkProfiles();
+#if IOTCONFIG_FEATURE_MDNS || IOTCONFIG_FEATURE_DELTA_OTA
+   if ((mdnsPort > 0) || (deltaOtaPort > 0))
+   {
+      // hash the sketch now, so neither needs a String once running
+      getSketchMD5();
+   }
+#endif
 
    if (strlen(deviceName)==0) { iotConfigUseWiFi = false; }
    if (iotConfigUseWiFi) {
-#ifdef ESP8266
-      onStaGotIPHandler      = WiFi.onStationModeGotIP(onStaGotIP);
-      onStaDisconnectHandler = WiFi.onStationModeDisconnected(onStaDisconnect);
-      onApConnectedHandler   = WiFi.onSoftAPModeStationConnected(onApConnected);
-#else
-      WiFi.onEvent(iotConfigWiFiEvent);
-#endif
+      registerWiFiEvents();
    }
-   if ((strlen(otaPassword)>0) && ((!firstBoot)||(coldBootAPtime==0)))
+   if ((strlen(otaPassword)>0) && ((!rtc->firstBoot)||(coldBootAPtime==0)))
    {
       Serial.println();
       Serial.println();
       Serial.print("Connecting to ");
       Serial.println(wifiClientSSID);
 
+      timerStart(iotTimerWatchdog, watchDogTimeout);
       reconnect();
       iotConfigMode=iotConfigClientMode;
    }
@@ -215,75 +437,498 @@ bool iotConfig::begin(const char *deviceName, const char *initialPasswordN,
    {
       Serial.print("INFO: Setting up Access Point with SSID: ");
       Serial.println(friendlyName);
-      if (iotConfigUseWiFi) {
-         WiFi.mode(WIFI_AP);
-         WiFi.softAPConfig(iotConfigApIP, iotConfigApIP, IPAddress(255, 255, 255, 0));
-         WiFi.softAP(friendlyName);
-         // if DNSServer is started with "*" for domain name, it will reply with
-         // provided IP to all DNS request
-         iotConfigDnsServer.start(53, "*", iotConfigApIP);
-         iotConfigServer.begin();
+      if (iotConfigUseWiFi)
+      {
+         startAccessPoint();
       }
       iotConfigMode=iotConfigServerMode;
-      apExpireTime=millis() + coldBootAPtime;
+      timerStart(iotTimerApExpire, coldBootAPtime);
    }
    
    return true;
 }
 
+void iotConfig::startAccessPoint()
+{
+#if IOTCONFIG_FEATURE_PROVISIONING
+   bool useStaging = (provisionPort > 0) && (strlen(provisionStagingSSID) > 0);
+#else
+   bool useStaging = false;
+#endif
+   stopPowerSave();
+   WiFi.mode(useStaging ? WIFI_AP_STA : WIFI_AP);
+   WiFi.softAPConfig(apIP, apIP, IPAddress(255, 255, 255, 0));
+   WiFi.softAP(friendlyName);
+#if IOTCONFIG_FEATURE_PORTAL
+   // if DNSServer is started with "*" for domain name, it will reply with
+   // provided IP to all DNS request
+   iotConfigDnsServer.start(53, "*", apIP);
+   iotConfigServer.begin();
+   // connectivity probes are redirected to the portal address without rendering it
+   probeResponseLen = snprintf(probeResponse, sizeof(probeResponse),
+                               "HTTP/1.1 302 Found\r\nLocation: http://%u.%u.%u.%u/\r\n"
+                               "Content-Length: 0\r\nConnection: close\r\n\r\n",
+                               apIP[0], apIP[1], apIP[2], apIP[3]);
+#endif
+#if IOTCONFIG_FEATURE_PROVISIONING
+   if (provisionPort > 0)
+   {
+      if (useStaging)
+      {
+         Serial.print("INFO: Joining staging network for bulk provisioning: ");
+         Serial.println(provisionStagingSSID);
+         WiFi.begin(provisionStagingSSID, provisionStagingPassword);
+      }
+      iotConfigProvisionUdp.begin(provisionPort);
+      provisionUdpStarted = true;
+   }
+#endif
+}
+
 void iotConfig::reconnect() {
    if (!iotConfigUseWiFi) { return; }
+
+   const char *ssid = wifiClientSSID;
+   const char *username = wifiClientUsername;
+   const char *password = wifiClientPassword;
+   if ((iotConfigMode == iotConfigTestWiFi) || (iotConfigMode == iotConfigWiFiTestWaitConnect))
+   {
+      // credentials under test are not a stored profile yet
+      activeProfile = -1;
+   }
+   else if (!selectNetworkProfile())
+   {
+      // profile scan still running, poll it instead of blocking handle()
+      timerStart(iotTimerReconnect, IOT_SCAN_POLL_INTERVAL);
+      return;
+   }
    WiFi.disconnect();
-   if (strlen(wifiClientUsername) == 0) {
+   if (activeProfile >= 0)
+   {
+      ssid = profiles[activeProfile].ssid;
+      username = profiles[activeProfile].username;
+      password = profiles[activeProfile].password;
+   }
+   connectStartTS = clockSource();
+   reconnectCount++;
+   timerStart(iotTimerReconnect, watchDogTimeout/2 + WIFI_CONNECT_TIME);
+
+   if (strlen(username) == 0) {
       // WPA(2)-PSK / WEP
       WiFi.mode(WIFI_STA);
+#if IOTCONFIG_FEATURE_WPA2_ENTERPRISE
+      esp_wifi_sta_wpa2_ent_disable();
+#endif
 #ifndef ESP8266
       WiFi.setHostname(friendlyName);
 #endif
-      WiFi.begin(wifiClientSSID, wifiClientPassword);
+      WiFi.begin(ssid, password);
    } else {
       // WPA(2)-Enterprise
-#ifndef ESP8266
+#if IOTCONFIG_FEATURE_WPA2_ENTERPRISE
       WiFi.mode(WIFI_STA);
       WiFi.mode(WIFI_STA); // init wifi mode
-      esp_wifi_sta_wpa2_ent_set_identity((uint8_t *)wifiClientUsername, strlen(wifiClientUsername));
-      esp_wifi_sta_wpa2_ent_set_username((uint8_t *)wifiClientUsername, strlen(wifiClientUsername));
-      esp_wifi_sta_wpa2_ent_set_password((uint8_t *)wifiClientPassword, strlen(wifiClientPassword));
+      esp_wifi_sta_wpa2_ent_set_identity((uint8_t *)username, strlen(username));
+      esp_wifi_sta_wpa2_ent_set_username((uint8_t *)username, strlen(username));
+      esp_wifi_sta_wpa2_ent_set_password((uint8_t *)password, strlen(password));
       esp_wifi_sta_wpa2_ent_enable(); // set config settings to enable function
       WiFi.setHostname(friendlyName);
 #endif
-      WiFi.begin(wifiClientSSID); // connect to wifi
+      WiFi.begin(ssid); // connect to wifi
+   }
+}
+
+/*
+ * The first attempt after boot or a connection loss goes to the last
+ * known good profile. Every further attempt counts as a failure of the
+ * current profile and picks the best visible one from an async scan,
+ * ranked by RSSI, failures and average connect time. Returns false while
+ * that scan is still running.
+ */
+bool iotConfig::selectNetworkProfile()
+{
+   int best = -1;
+   int32_t bestScore = INT32_MIN;
+   int found;
+
+   for (int p=0; p<IOT_NETWORK_PROFILES; p++)
+   {
+      if ((strlen(profiles[p].ssid) > 0) &&
+          ((best < 0) || (profiles[p].lastSuccess > profiles[best].lastSuccess)))
+      {
+         best = p;
+      }
+   }
+   if ((best < 0) || (reconnectAttempts == 0))
+   {
+      reconnectAttempts++;
+      activeProfile = best;
+      return true;
+   }
+   if (!profileScanRunning)
+   {
+      if ((activeProfile >= 0) && (profiles[activeProfile].failures < 255))
+      {
+         profiles[activeProfile].failures++;
+      }
+      WiFi.disconnect();
+      WiFi.mode(WIFI_STA);
+      profileScanRunning = (WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING);
+      if (profileScanRunning) { return false; }
+      found = 0;
+   }
+   else
+   {
+      found = WiFi.scanComplete();
+      if (found == WIFI_SCAN_RUNNING) { return false; }
+      profileScanRunning = false;
+      if (found < 0) { found = 0; }
+   }
+   reconnectAttempts++;
+
+   best = -1;
+   for (int i=0; i<found; i++)
+   {
+      char ssid[IOT_SSID_MAX+1];
+      int32_t rssi;
+      uint8_t encryptionType;
+
+      if (!iotConfigScanRecord(i, ssid, sizeof(ssid), &rssi, &encryptionType)) { continue; }
+      for (int p=0; p<IOT_NETWORK_PROFILES; p++)
+      {
+         if ((strlen(profiles[p].ssid) == 0) || (strcmp(ssid, profiles[p].ssid) != 0)) { continue; }
+         int32_t score = rssi - 10*profiles[p].failures - profiles[p].avgConnectTime/500;
+         if (score > bestScore)
+         {
+            bestScore = score;
+            best = p;
+         }
+      }
+   }
+   WiFi.scanDelete();
+   if (best < 0)
+   {
+      // nothing visible, keep cycling through the stored profiles
+      for (int n=1; n<=IOT_NETWORK_PROFILES; n++)
+      {
+         int p = (activeProfile + n) % IOT_NETWORK_PROFILES;
+         if ((p >= 0) && (strlen(profiles[p].ssid) > 0)) { best = p; break; }
+      }
+   }
+   activeProfile = best;
+   return true;
+}
+
+void iotConfig::networkProfileConnected()
+{
+   int lastGood = -1;
+
+   reconnectAttempts = 0;
+   if (activeProfile < 0) { return; }
+   for (int p=0; p<IOT_NETWORK_PROFILES; p++)
+   {
+      if ((strlen(profiles[p].ssid) > 0) &&
+          ((lastGood < 0) || (profiles[p].lastSuccess > profiles[lastGood].lastSuccess)))
+      {
+         lastGood = p;
+      }
+   }
+   networkProfile_t *profile = &profiles[activeProfile];
+   uint32_t connectTime = clockSource() - connectStartTS;
+   if (connectTime > 0xffff) { connectTime = 0xffff; }
+   profile->avgConnectTime = (profile->lastSuccess > 0) ? (profile->avgConnectTime*3 + connectTime)/4 : connectTime;
+   profile->lastSuccess = ++profileSequence;
+   profile->failures = 0;
+   // statistics are persisted with the next commit, the last known good profile right away
+   if ((lastGood != activeProfile) || (profile->lastSuccess == 1))
+   {
+      writeNetworkProfiles();
+      scheduleCommit();
+   }
+}
+
+bool iotConfig::addNetworkProfile(const char *ssid, const char *username, const char *password)
+{
+   int slot = -1;
+
+   if ((!ssid) || (strlen(ssid) == 0) || (strlen(ssid) >= sizeof(profiles[0].ssid)))
+   {
+      return false;
+   }
+   for (int p=0; p<IOT_NETWORK_PROFILES; p++)
+   {
+      if (strcmp(profiles[p].ssid, ssid) == 0) { slot = p; break; }
+      if ((slot < 0) || (profiles[p].lastSuccess < profiles[slot].lastSuccess)) { slot = p; }
+   }
+   networkProfile_t *profile = &profiles[slot];
+   if (strcmp(profile->ssid, ssid) != 0)
+   {
+      memset(profile, 0, sizeof(networkProfile_t));
+      strncpy(profile->ssid, ssid, sizeof(profile->ssid)-1);
+   }
+   memset(profile->username, 0, sizeof(profile->username));
+   memset(profile->password, 0, sizeof(profile->password));
+   strncpy(profile->username, username ? username : "", sizeof(profile->username)-1);
+   strncpy(profile->password, password ? password : "", sizeof(profile->password)-1);
+   profile->failures = 0;
+   return true;
+}
+
+/*
+ * Switches to new WiFi credentials without a reboot. The new network is
+ * tested first, if it does not connect the previous configuration is
+ * restored. authPassword has to match the OTA password.
+ */
+bool iotConfig::reconfigure(const char *ssid, const char *username, const char *password, const char *authPassword)
+{
+   if ((iotConfigMode != iotConfigClientMode) || (!ssid) ||
+       (strlen(ssid) == 0) || (strlen(ssid) >= sizeof(wifiClientSSID)) ||
+       (username && (strlen(username) >= sizeof(wifiClientUsername))) ||
+       (password && (strlen(password) >= sizeof(wifiClientPassword))))
+   {
+      return false;
+   }
+   if ((strlen(otaPassword) > 0) &&
+       ((!authPassword) || (strncmp(otaPassword, authPassword, sizeof(otaPassword)) != 0)))
+   {
+      Serial.println("WARN: Reconfiguration rejected, wrong password");
+      return false;
+   }
+   backupConfig();
+   memset((char*)wifiClientSSID, 0, sizeof(wifiClientSSID));
+   memset((char*)wifiClientUsername, 0, sizeof(wifiClientUsername));
+   memset((char*)wifiClientPassword, 0, sizeof(wifiClientPassword));
+   strncpy(wifiClientSSID, ssid, sizeof(wifiClientSSID)-1);
+   strncpy(wifiClientUsername, username ? username : "", sizeof(wifiClientUsername)-1);
+   strncpy(wifiClientPassword, password ? password : "", sizeof(wifiClientPassword)-1);
+   startReconfiguration();
+   return true;
+}
+
+void iotConfig::backupConfig()
+{
+   memcpy(configBackup.friendlyName, friendlyName, sizeof(configBackup.friendlyName));
+   memcpy(configBackup.ssid, wifiClientSSID, sizeof(configBackup.ssid));
+   memcpy(configBackup.username, wifiClientUsername, sizeof(configBackup.username));
+   memcpy(configBackup.password, wifiClientPassword, sizeof(configBackup.password));
+   memcpy(configBackup.otaPassword, otaPassword, sizeof(configBackup.otaPassword));
+}
+
+void iotConfig::restoreConfig()
+{
+   memcpy(friendlyName, configBackup.friendlyName, sizeof(friendlyName));
+   memcpy(wifiClientSSID, configBackup.ssid, sizeof(wifiClientSSID));
+   memcpy(wifiClientUsername, configBackup.username, sizeof(wifiClientUsername));
+   memcpy(wifiClientPassword, configBackup.password, sizeof(wifiClientPassword));
+   memcpy(otaPassword, configBackup.otaPassword, sizeof(otaPassword));
+}
+
+void iotConfig::startReconfiguration()
+{
+   reconfigureFromClient = (iotConfigMode == iotConfigClientMode);
+   stopPowerSave();
+   iotConfigMode = iotConfigTestWiFi;
+}
+
+/*
+ * Ends a WiFi test. A working configuration is persisted with one EEPROM
+ * commit and used right away, a failed one is rolled back to the mode the
+ * device was in. Either way the sketch keeps running. The commit is not
+ * atomic on ESP8266: it erases and rewrites the flash sector, a power loss
+ * in between leaves a store that fails its CRC in begin(), so the device
+ * comes up unconfigured. On ESP32 the NVS keeps the old blob until the new
+ * one is written.
+ */
+void iotConfig::finishReconfiguration(const bool success)
+{
+   rtc->firstBoot = 0;
+   if (success)
+   {
+      Serial.println("INFO: New configuration works, switching over without reboot");
+      addNetworkProfile(wifiClientSSID, wifiClientUsername, wifiClientPassword);
+      for (int p=0; p<IOT_NETWORK_PROFILES; p++)
+      {
+         if (strcmp(profiles[p].ssid, wifiClientSSID) == 0) { activeProfile = p; }
+      }
+      updateEEPROM();
+      commitEEPROM();
+      // the transition to online records the profile's success in handle()
+      wasOnline = false;
+      reconnectAttempts = 0;
+      // recoveryChanceWait() must not keep setup() waiting on the portal window
+      timerStop(iotTimerApExpire);
+      timerStart(iotTimerWatchdog, watchDogTimeout);
+      iotConfigMode = iotConfigClientMode;
+   }
+   else if (reconfigureFromClient ||
+            ((strlen(configBackup.otaPassword) > 0) && (strlen(configBackup.ssid) > 0)))
+   {
+      // a configured device only visits the portal, it goes back to its working network
+      Serial.println("WARN: New configuration did not connect, restoring the previous one");
+      restoreConfig();
+      reconnectAttempts = 0;
+      timerStop(iotTimerApExpire);
+      timerStart(iotTimerWatchdog, watchDogTimeout);
+      iotConfigMode = iotConfigClientMode;
+      reconnect();
+   }
+   else
+   {
+      Serial.println("WARN: New configuration did not connect, back to access point mode");
+      restoreConfig();
+      WiFi.disconnect();
+      startAccessPoint();
+      iotConfigServerState = iotConfigError;
+      iotConfigErrorType = iotConfigErrorConnectFailed;
+      iotConfigMode = iotConfigServerMode;
+   }
+   if ((!success) && provisionSequenceDirty)
+   {
+      // keep the previous configuration but never accept the failed blob again
+      updateEEPROM();
+      commitEEPROM();
+   }
+   provisionSequenceDirty = false;
+   reconfigureFromClient = false;
+}
+
+void iotConfig::loadNetworkProfiles()
+{
+   uint8_t *raw = (uint8_t*)profiles;
+   uint32_t storedCRC = 0;
+
+   for (size_t i=0; i<sizeof(storedCRC); i++)
+   {
+      ((uint8_t*)&storedCRC)[i] = readNV(eepromSize+i);
+   }
+   for (size_t i=0; i<sizeof(profileSequence); i++)
+   {
+      ((uint8_t*)&profileSequence)[i] = readNV(eepromSize+sizeof(storedCRC)+i);
+   }
+   for (size_t i=0; i<sizeof(profiles); i++)
+   {
+      raw[i] = readNV(eepromSize+sizeof(storedCRC)+sizeof(profileSequence)+i);
+   }
+   if (storedCRC != iotConfigCRC((uint8_t*)&profileSequence, sizeof(profileSequence), raw, sizeof(profiles)))
+   {
+      // upgrade from a single stored network
+      memset(profiles, 0, sizeof(profiles));
+      profileSequence = 0;
+      if (strlen(wifiClientSSID) > 0)
+      {
+         addNetworkProfile(wifiClientSSID, wifiClientUsername, wifiClientPassword);
+      }
+   }
+}
+
+void iotConfig::writeNetworkProfiles()
+{
+   uint8_t *raw = (uint8_t*)profiles;
+   uint32_t crc = iotConfigCRC((uint8_t*)&profileSequence, sizeof(profileSequence), raw, sizeof(profiles));
+   size_t index = eepromSize;
+
+   beginEEPROM();
+   for (size_t i=0; i<sizeof(crc); i++)
+   {
+      EEPROM.write(index++, ((uint8_t*)&crc)[i]);
+   }
+   for (size_t i=0; i<sizeof(profileSequence); i++)
+   {
+      EEPROM.write(index++, ((uint8_t*)&profileSequence)[i]);
+   }
+   for (size_t i=0; i<sizeof(profiles); i++)
+   {
+      EEPROM.write(index++, raw[i]);
+   }
+}
+
+/*
+ * An update runs to completion inside a single handle() call, so the
+ * application loop() is starved from the start of the update until here.
+ */
+void iotConfig::finishOTAStats()
+{
+   iotConfigOtaStats.durationMS = clockSource() - iotConfigOtaStartTS;
+   iotConfigOtaStats.loopStarvedMS += iotConfigOtaStats.durationMS;
+   if (iotConfigOtaStats.durationMS > iotConfigOtaStats.maxLoopStarvedMS)
+   {
+      iotConfigOtaStats.maxLoopStarvedMS = iotConfigOtaStats.durationMS;
    }
+   printOTAStats();
+}
+
+// one machine readable line per update, so regressions can be tracked from serial logs
+void iotConfig::printOTAStats()
+{
+   const otaStats_t &st = iotConfigOtaStats;
+   uint32_t meanChunkMS = (st.chunks > 0) ? st.durationMS / st.chunks : 0;
+   uint32_t bytesPerSecond = (st.durationMS > 0) ? (uint32_t)((uint64_t)st.bytes * 1000 / st.durationMS) : 0;
+
+   Serial.printf("OTA-STATS {\"attempts\":%u,\"failures\":%u,\"bytes\":%u,\"ms\":%u,\"bytesPerSecond\":%u,"
+                 "\"chunks\":%u,\"meanChunkMs\":%u,\"maxChunkMs\":%u,\"progressPrintUs\":%u,"
+                 "\"loopStarvedMs\":%u,\"maxLoopStarvedMs\":%u}\n",
+                 st.attempts, st.failures, st.bytes, st.durationMS, bytesPerSecond,
+                 st.chunks, meanChunkMS, st.maxChunkLatencyMS, st.progressPrintUS,
+                 st.loopStarvedMS, st.maxLoopStarvedMS);
 }
 
 void iotConfig::arduinoOTAsetup(const char *friendlyName, const char *otaPassword)
 {
+#if IOTCONFIG_FEATURE_OTA
    if (!iotConfigUseWiFi) { return; }
    if (!useOTA) { return; }
    ArduinoOTA.setHostname(friendlyName);
    ArduinoOTA.setPassword(otaPassword);
    ArduinoOTA
-     .onStart([]() {
-       String type;
+     .onStart([this]() {
+       const char *type;
        if (ArduinoOTA.getCommand() == U_FLASH)
          type = "sketch";
        else // U_SPIFFS
         type = "filesystem";
          // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
-       Serial.println("Start updating " + type);
+       Serial.print("Start updating ");
+       Serial.println(type);
+       stopPowerSave();
        iotConfigOtaPrio = true;
+       iotConfigOtaStats.attempts++;
+       iotConfigOtaStats.bytes = 0;
+       iotConfigOtaStats.chunks = 0;
+       iotConfigOtaStats.durationMS = 0;
+       iotConfigOtaStats.maxChunkLatencyMS = 0;
+       iotConfigOtaStats.progressPrintUS = 0;
+       iotConfigOtaStartTS = clockSource();
+       iotConfigOtaChunkTS = iotConfigOtaStartTS;
+       iotConfigOtaPercent = 101;
      });
    ArduinoOTA
-     .onEnd([]() {
+     .onEnd([this]() {
        Serial.println("\nEnd");
        iotConfigOtaPrio = false;
+       finishOTAStats();
      });
    ArduinoOTA
-     .onProgress([](unsigned int progress, unsigned int total) {
-       Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+     .onProgress([this](unsigned int progress, unsigned int total) {
+       unsigned long now = clockSource();
+       unsigned int percent = (total > 0) ? (uint32_t)((uint64_t)progress * 100 / total) : 0;
+       iotConfigOtaStats.chunks++;
+       iotConfigOtaStats.bytes = progress;
+       if (now - iotConfigOtaChunkTS > iotConfigOtaStats.maxChunkLatencyMS)
+       {
+          iotConfigOtaStats.maxChunkLatencyMS = now - iotConfigOtaChunkTS;
+       }
+       iotConfigOtaChunkTS = now;
+       // printing every chunk costs more than the chunk itself on slow UARTs
+       if (percent != iotConfigOtaPercent)
+       {
+          unsigned long printStart = clockSourceUS();
+          Serial.printf("Progress: %u%%\r", percent);
+          iotConfigOtaStats.progressPrintUS += clockSourceUS() - printStart;
+          iotConfigOtaPercent = percent;
+       }
      });
    ArduinoOTA
-     .onError([](ota_error_t error) {
+     .onError([this](ota_error_t error) {
        Serial.printf("Error[%u]: ", error);
        if (error == OTA_AUTH_ERROR) Serial.println("Auth Failed");
        else if (error == OTA_BEGIN_ERROR) Serial.println("Begin Failed");
@@ -291,222 +936,1728 @@ void iotConfig::arduinoOTAsetup(const char *friendlyName, const char *otaPasswor
        else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
        else if (error == OTA_END_ERROR) Serial.println("End Failed");
        iotConfigOtaPrio = false;
+       iotConfigOtaStats.failures++;
+       finishOTAStats();
      });
    ArduinoOTA.begin();
+#endif
 }
 
 void iotConfig::recoveryChanceWait()
 {
-   while (millis() < apExpireTime)
+   while (timers[iotTimerApExpire].armed && !timerExpired(iotTimerApExpire))
    {
       handle();
+      sleepUntilDeadline(timerRemaining(iotTimerApExpire));
    }
 }
 
 void iotConfig::setWiFiClientWatchDogTimeout(const uint32_t timeoutMS)
 {
    watchDogTimeout = timeoutMS;
+   // running timers pick up the new timeout
+   timers[iotTimerWatchdog].interval = watchDogTimeout;
+   timers[iotTimerReconnect].interval = watchDogTimeout/2 + WIFI_CONNECT_TIME;
 }
 
-bool iotConfig::assignVariableEEPROM(uint8_t *pointer, const size_t varSize)
+void iotConfig::enableBulkProvisioning(const uint16_t port, const char *stagingSSID, const char *stagingPassword)
 {
-   memAllocation_t newInfo;
-
-   if ((eepromAssignPointer+varSize) > eepromSize)
+#if IOTCONFIG_FEATURE_PROVISIONING
+   provisionPort = port;
+   memset(provisionStagingSSID, 0, sizeof(provisionStagingSSID));
+   memset(provisionStagingPassword, 0, sizeof(provisionStagingPassword));
+   if (stagingSSID)
    {
-      Serial.println("ERROR: No variable space available for EEPROM");
-      return false;
+      strncpy(provisionStagingSSID, stagingSSID, sizeof(provisionStagingSSID)-1);
    }
-   newInfo.varPtr=pointer;
-   newInfo.nvIndex=eepromAssignPointer;
-   newInfo.allocSize=varSize;
-   if (addVariableInfo(&eepromAllocData, &eepromDataIndex, &newInfo))
+   if (stagingPassword)
    {
-      if (!factoryResetted) {
-         Serial.print("Reading ");
-         Serial.print(varSize);
-         Serial.print(" bytes of EEPROM data at index ");
-         Serial.print(eepromAssignPointer);
-         Serial.print(" into RAM @");
-         Serial.println((int)pointer,HEX);
-         for (int i=0; i<varSize; i++)
-         {
-            pointer[i]=EEPROM.read(eepromAssignPointer+i);
-            //Serial.println(pointer[i]);
-         }
-      }
-      eepromAssignPointer+=varSize;
-      return true;
+      strncpy(provisionStagingPassword, stagingPassword, sizeof(provisionStagingPassword)-1);
    }
-   return false;
+#else
+   Serial.println("WARN: bulk provisioning not compiled in (IOTCONFIG_FEATURE_PROVISIONING)");
+#endif
+}
+
+#if IOTCONFIG_FEATURE_PROVISIONING || IOTCONFIG_FEATURE_DELTA_OTA
+static bool iotConfigHMAC(const uint8_t *key, const size_t keyLen,
+                          const uint8_t *data, const size_t dataLen, uint8_t *mac)
+{
+#ifdef ESP8266
+   br_hmac_key_context keyCtx;
+   br_hmac_context ctx;
+
+   br_hmac_key_init(&keyCtx, &br_sha256_vtable, key, keyLen);
+   br_hmac_init(&ctx, &keyCtx, 0);
+   br_hmac_update(&ctx, data, dataLen);
+   br_hmac_out(&ctx, mac);
+   return true;
+#else
+   return mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                          key, keyLen, data, dataLen, mac) == 0;
+#endif
+}
+#endif
+
+#if IOTCONFIG_FEATURE_PROVISIONING
+void iotConfig::handleBulkProvisioning()
+{
+   uint8_t blob[IOT_PROVISION_BLOB_MAX];
+   uint8_t ack[IOT_PROVISION_ACK_SIZE];
+   uint8_t mac[6];
+   int blobSize = iotConfigProvisionUdp.parsePacket();
+
+   if (blobSize <= 0) { return; }
+
+   uint8_t status = IOT_PROVISION_ACK_BAD_FORMAT;
+   if (blobSize <= IOT_PROVISION_BLOB_MAX)
+   {
+      blobSize = iotConfigProvisionUdp.read(blob, blobSize);
+      backupConfig();
+      status = applyProvisioningBlob(blob, blobSize);
+   }
+
+   WiFi.macAddress(mac);
+   iotConfigProvisionAck(ack, status, mac);
+   iotConfigProvisionUdp.beginPacket(iotConfigProvisionUdp.remoteIP(), iotConfigProvisionUdp.remotePort());
+   iotConfigProvisionUdp.write(ack, sizeof(ack));
+   iotConfigProvisionUdp.endPacket();
+
+   if (status == IOT_PROVISION_ACK_OK)
+   {
+      Serial.print("INFO: Bulk provisioning accepted, friendlyName: ");
+      Serial.println(friendlyName);
+      startReconfiguration();
+   }
+   else
+   {
+      Serial.print("WARN: Bulk provisioning blob rejected, status ");
+      Serial.println(status);
+   }
+}
+
+// blob layout in iotconfigprovision.h
+uint8_t iotConfig::applyProvisioningBlob(const uint8_t *blob, const size_t blobSize)
+{
+   const size_t fieldMax[IOT_PROVISION_FIELDS] = { sizeof(wifiClientSSID), sizeof(wifiClientUsername), sizeof(wifiClientPassword),
+                                                   sizeof(friendlyName), sizeof(otaPassword) };
+   iotConfigProvisionBlob_t parsed;
+   uint8_t digest[IOT_PROVISION_HMAC_SIZE];
+   uint8_t mac[6];
+
+   if (iotConfigProvisionParse(blob, blobSize, fieldMax, &parsed) != IOT_PROVISION_ACK_OK)
+   {
+      return IOT_PROVISION_ACK_BAD_FORMAT;
+   }
+
+   const char *key = (strlen(otaPassword) > 0) ? otaPassword : wifiApPassword;
+   if (!iotConfigHMAC((const uint8_t*)key, strlen(key), blob, parsed.payloadLen, digest))
+   {
+      return IOT_PROVISION_ACK_BAD_SIGNATURE;
+   }
+   uint8_t diff = 0;
+   for (int i=0; i<IOT_PROVISION_HMAC_SIZE; i++)
+   {
+      diff |= digest[i] ^ blob[parsed.payloadLen+i];
+   }
+   if (diff != 0) { return IOT_PROVISION_ACK_BAD_SIGNATURE; }
+
+   if ((parsed.fieldLen[3] == 0) || ((strlen(otaPassword) == 0) && (parsed.fieldLen[4] == 0)))
+   {
+      return IOT_PROVISION_ACK_BAD_FORMAT;
+   }
+   // a captured blob must not roll the device back to older credentials
+   if (parsed.sequence <= provisionSequence)
+   {
+      return IOT_PROVISION_ACK_REPLAY;
+   }
+   provisionSequence = parsed.sequence;
+   provisionSequenceDirty = true;
+
+   memset((char*)wifiClientSSID, 0, sizeof(wifiClientSSID));
+   memset((char*)wifiClientUsername, 0, sizeof(wifiClientUsername));
+   memset((char*)wifiClientPassword, 0, sizeof(wifiClientPassword));
+   memcpy(wifiClientSSID, parsed.field[0], parsed.fieldLen[0]);
+   memcpy(wifiClientUsername, parsed.field[1], parsed.fieldLen[1]);
+   memcpy(wifiClientPassword, parsed.field[2], parsed.fieldLen[2]);
+   WiFi.macAddress(mac);
+   iotConfigExpandNamePattern((const char*)parsed.field[3], parsed.fieldLen[3], mac, friendlyName, sizeof(friendlyName));
+   if (strlen(otaPassword) == 0)
+   {
+      memset((char*)otaPassword, 0, sizeof(otaPassword));
+      memcpy(otaPassword, parsed.field[4], parsed.fieldLen[4]);
+   }
+   return IOT_PROVISION_ACK_OK;
+}
+
+#endif
+
+#if IOTCONFIG_FEATURE_MDNS || IOTCONFIG_FEATURE_DELTA_OTA
+// ESP.getSketchMD5() returns a String, so the hash is copied once
+const char *iotConfig::getSketchMD5()
+{
+   if (sketchMD5[0] == 0)
+   {
+      strncpy(sketchMD5, ESP.getSketchMD5().c_str(), sizeof(sketchMD5)-1);
+      sketchMD5[sizeof(sketchMD5)-1] = 0;
+   }
+   return sketchMD5;
+}
+#endif
+
+void iotConfig::enableDeltaOTA(const uint16_t port)
+{
+#if IOTCONFIG_FEATURE_DELTA_OTA
+   deltaOtaPort = port;
+#else
+   Serial.println("WARN: delta OTA not compiled in (IOTCONFIG_FEATURE_DELTA_OTA)");
+#endif
+}
+
+void iotConfig::enableMetrics(const uint16_t port)
+{
+#if IOTCONFIG_FEATURE_METRICS
+   metricsPort = port;
+#else
+   Serial.println("WARN: metrics endpoint not compiled in (IOTCONFIG_FEATURE_METRICS)");
+#endif
+}
+
+void iotConfig::enableSerialProvisioning(const uint32_t windowMS, const int forcePin)
+{
+#if IOTCONFIG_FEATURE_SERIAL_PROVISIONING
+   serialProvisionWindow = windowMS;
+   serialProvisionPin = forcePin;
+#else
+   Serial.println("WARN: serial provisioning not compiled in (IOTCONFIG_FEATURE_SERIAL_PROVISIONING)");
+#endif
+}
+
+void iotConfig::enableServiceAdvertisement(const uint16_t port, const char *firmwareVersion, const char *service)
+{
+#if IOTCONFIG_FEATURE_MDNS
+   mdnsPort = port;
+   memset(mdnsService, 0, sizeof(mdnsService));
+   memset(mdnsFirmware, 0, sizeof(mdnsFirmware));
+   strncpy(mdnsService, service, sizeof(mdnsService)-1);
+   if (firmwareVersion)
+   {
+      strncpy(mdnsFirmware, firmwareVersion, sizeof(mdnsFirmware)-1);
+   }
+#else
+   Serial.println("WARN: mDNS advertisement not compiled in (IOTCONFIG_FEATURE_MDNS)");
+#endif
+}
+
+#if IOTCONFIG_FEATURE_MDNS
+/*
+ * Advertises _<service>._tcp with TXT records fn (friendly name), fw
+ * (firmware build), mac, gen (configuration CRC) and up (uptime in s).
+ * The responder keeps the records, so answering a query costs nothing
+ * in handle().
+ */
+void iotConfig::startServiceAdvertisement()
+{
+   bool mdnsRunning = false;
+#if IOTCONFIG_FEATURE_OTA
+   // ArduinoOTA already started the responder under the friendly name
+   mdnsRunning = useOTA && otaInitialized;
+#endif
+   if ((!mdnsRunning) && (!MDNS.begin(friendlyName)))
+   {
+      Serial.println("WARN: mDNS responder could not be started");
+      mdnsPort = 0;
+      return;
+   }
+   if (strlen(mdnsFirmware) == 0)
+   {
+      // the sketch MD5 identifies the build if the sketch did not name one
+      strncpy(mdnsFirmware, getSketchMD5(), 8);
+   }
+
+   uint8_t mac[6];
+   char macStr[18];
+   WiFi.macAddress(mac);
+   snprintf(macStr, sizeof(macStr), "%02X:%02X:%02X:%02X:%02X:%02X",
+            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+#ifdef ESP8266
+   mdnsServiceHandle = MDNS.addService(NULL, mdnsService, "tcp", mdnsPort);
+   MDNS.addServiceTxt(mdnsServiceHandle, "fw", mdnsFirmware);
+   MDNS.addServiceTxt(mdnsServiceHandle, "mac", macStr);
+   refreshServiceTxt();
+   // uptime is filled in when a query is answered
+   MDNS.setDynamicServiceTxtCallback(mdnsServiceHandle, [this](const MDNSResponder::hMDNSService service) {
+      MDNS.addDynamicServiceTxt(service, "up", (uint32_t)(uptimeMS()/1000));
+   });
+#else
+   MDNS.addService(mdnsService, "tcp", mdnsPort);
+   MDNS.addServiceTxt(mdnsService, "tcp", "fw", mdnsFirmware);
+   MDNS.addServiceTxt(mdnsService, "tcp", "mac", macStr);
+   refreshServiceTxt();
+#endif
+   mdnsStarted = true;
+   Serial.printf("INFO: Advertising _%s._tcp on port %u\n", mdnsService, mdnsPort);
+}
+
+// updates the records that change at runtime, called every IOT_MDNS_TXT_REFRESH ms and after commits
+void iotConfig::refreshServiceTxt()
+{
+   char value[11];
+   snprintf(value, sizeof(value), "%08X", eepromCRC);
+#ifdef ESP8266
+   MDNS.addServiceTxt(mdnsServiceHandle, "fn", friendlyName);
+   MDNS.addServiceTxt(mdnsServiceHandle, "gen", value);
+#else
+   MDNS.addServiceTxt(mdnsService, "tcp", "fn", friendlyName);
+   MDNS.addServiceTxt(mdnsService, "tcp", "gen", value);
+   snprintf(value, sizeof(value), "%lu", (unsigned long)(uptimeMS()/1000));
+   MDNS.addServiceTxt(mdnsService, "tcp", "up", value);
+#endif
+   timerStart(iotTimerMdnsRefresh, IOT_MDNS_TXT_REFRESH);
+}
+#endif
+
+#if IOTCONFIG_FEATURE_SERIAL_PROVISIONING
+// power-on or reset pin; deep sleep wakes, reboot() and watchdog resets are no cold boot
+static bool iotConfigColdBoot()
+{
+#ifdef ESP8266
+   uint32_t reason = ESP.getResetInfoPtr()->reason;
+   return (reason == REASON_DEFAULT_RST) || (reason == REASON_EXT_SYS_RST);
+#else
+   esp_reset_reason_t reason = esp_reset_reason();
+   return (reason == ESP_RST_POWERON) || (reason == ESP_RST_EXT);
+#endif
+}
+
+// a factory line powers the device up; the strap pin pulled low opens the window on any boot
+bool iotConfig::serialProvisioningAllowed()
+{
+   if (iotConfigColdBoot()) { return true; }
+   if (serialProvisionPin < 0) { return false; }
+   pinMode(serialProvisionPin, INPUT_PULLUP);
+   return digitalRead(serialProvisionPin) == LOW;
+}
+
+static bool iotConfigSerialReadExact(uint8_t *buf, const size_t len, const unsigned long timeoutMS,
+                                     iotConfigClock_t clock)
+{
+   unsigned long start = clock();
+   size_t got = 0;
+
+   while (got < len)
+   {
+      if (Serial.available() > 0)
+      {
+         buf[got++] = Serial.read();
+         start = clock();
+      }
+      else if (clock() - start >= timeoutMS)
+      {
+         return false;
+      }
+      else
+      {
+         yield();
+      }
+   }
+   return true;
+}
+
+/*
+ * Factory provisioning over Serial, offered for serialProvisionWindow ms
+ * during begin() after a cold boot or with the strap pin low. Every request
+ * frame (see iotconfigserial.h) is answered with a reply frame. The session
+ * ends with DONE or after IOT_SERIAL_PROV_TIMEOUT ms without a frame.
+ */
+void iotConfig::serialProvisioning()
+{
+   uint8_t frame[IOT_SERIAL_FRAME_MAX];
+   uint8_t reply[255];
+   unsigned long windowStart = clockSource();
+   bool session = false;
+
+   while (true)
+   {
+      unsigned long waited = clockSource() - windowStart;
+      unsigned long limit = session ? IOT_SERIAL_PROV_TIMEOUT : serialProvisionWindow;
+      if (waited >= limit) { break; }
+      if (Serial.available() <= 0)
+      {
+         yield();
+         continue;
+      }
+      if (Serial.read() != IOT_SERIAL_PROV_SYNC) { continue; }
+
+      if ((!iotConfigSerialReadExact(frame, 2, IOT_SERIAL_PROV_TIMEOUT, clockSource)) ||
+          (!iotConfigSerialReadExact(&frame[2], frame[1] + 4, IOT_SERIAL_PROV_TIMEOUT, clockSource)))
+      {
+         break;
+      }
+      windowStart = clockSource();
+      if (!iotConfigSerialFrameValid(frame))
+      {
+         serialProvisioningReply(IOT_SERIAL_NAK_CRC, NULL, 0);
+         continue;
+      }
+      if (!session)
+      {
+         session = true;
+         beginEEPROM();
+      }
+      uint8_t replyLen = 0;
+      uint8_t status = serialProvisioningCommand(frame[0], &frame[2], frame[1], reply, &replyLen);
+      serialProvisioningReply(status, reply, replyLen);
+      if ((frame[0] == IOT_SERIAL_CMD_DONE) && (status == IOT_SERIAL_ACK)) { break; }
+   }
+   if (session)
+   {
+      Serial.println();
+      Serial.println("INFO: Serial provisioning session ended");
+   }
+}
+
+uint8_t iotConfig::serialProvisioningCommand(const uint8_t cmd, const uint8_t *payload, const uint8_t len,
+                                              uint8_t *reply, uint8_t *replyLen)
+{
+   switch (cmd)
+   {
+      case IOT_SERIAL_CMD_HELLO:
+           // protocol version, CRC protected size, total size incl. profiles, station MAC, start of the records
+           reply[0] = IOT_SERIAL_PROV_VERSION;
+           reply[1] = eepromSize & 0xff;
+           reply[2] = eepromSize >> 8;
+           reply[3] = eepromTotalSize & 0xff;
+           reply[4] = eepromTotalSize >> 8;
+           WiFi.macAddress(&reply[5]);
+           reply[11] = configStart & 0xff;
+           reply[12] = configStart >> 8;
+           *replyLen = 13;
+           return IOT_SERIAL_ACK;
+
+      case IOT_SERIAL_CMD_SET_FIELD:
+      {
+           // field id, value; the record area is re-encoded with the new value
+           size_t fieldSize = 0;
+           char *field = (len >= 1) ? configField(payload[0], &fieldSize) : NULL;
+           if ((!field) || (len - 1 >= fieldSize))
+           {
+              return IOT_SERIAL_NAK_ARG;
+           }
+           loadConfigRecords();
+           memset(field, 0, fieldSize);
+           memcpy(field, &payload[1], len - 1);
+#if IOTCONFIG_FEATURE_SNAPSHOT
+           rtc->snapshotValid = 0;
+#endif
+           writeConfigRecords();
+           return IOT_SERIAL_ACK;
+      }
+
+      case IOT_SERIAL_CMD_WRITE:
+      {
+           // offset (LE16), raw bytes; the CRC word is maintained by COMMIT
+           if (len < 2) { return IOT_SERIAL_NAK_ARG; }
+           size_t offset = payload[0] | (payload[1] << 8);
+           if ((offset < sizeof(eepromCRC)) || (offset + len - 2 > eepromTotalSize))
+           {
+              return IOT_SERIAL_NAK_ARG;
+           }
+#if IOTCONFIG_FEATURE_SNAPSHOT
+           rtc->snapshotValid = 0;
+#endif
+           for (size_t i=2; i<len; i++)
+           {
+              EEPROM.write(offset + i - 2, payload[i]);
+           }
+           return IOT_SERIAL_ACK;
+      }
+
+      case IOT_SERIAL_CMD_READ:
+      {
+           // offset (LE16), count
+           if (len != 3) { return IOT_SERIAL_NAK_ARG; }
+           size_t offset = payload[0] | (payload[1] << 8);
+           if (offset + payload[2] > eepromTotalSize) { return IOT_SERIAL_NAK_ARG; }
+           for (size_t i=0; i<payload[2]; i++)
+           {
+              reply[i] = EEPROM.read(offset + i);
+           }
+           *replyLen = payload[2];
+           return IOT_SERIAL_ACK;
+      }
+
+      case IOT_SERIAL_CMD_COMMIT:
+      {
+           eepromCRC = calcCRC();
+           const uint8_t *crcBytes = (const uint8_t*)&eepromCRC;
+           for (size_t i=0; i<sizeof(eepromCRC); i++)
+           {
+              EEPROM.write(i, crcBytes[i]);
+           }
+           commitEEPROM();
+           // the store is valid now, begin() reads the new values back
+           factoryResetted = false;
+           memcpy(reply, crcBytes, sizeof(eepromCRC));
+           *replyLen = sizeof(eepromCRC);
+           return IOT_SERIAL_ACK;
+      }
+
+      case IOT_SERIAL_CMD_DONE:
+           return IOT_SERIAL_ACK;
+
+      default:
+           return IOT_SERIAL_NAK_ARG;
+   }
+}
+
+void iotConfig::serialProvisioningReply(const uint8_t status, const uint8_t *payload, const uint8_t len)
+{
+   uint8_t frame[IOT_SERIAL_FRAME_MAX];
+
+   Serial.write(frame, iotConfigSerialFrame(frame, IOT_SERIAL_PROV_REPLY, status, payload, len));
+   Serial.flush();
+}
+#endif
+
+#if IOTCONFIG_FEATURE_DELTA_OTA
+static bool iotConfigReadExact(WiFiClient &client, uint8_t *buf, size_t len, iotConfigClock_t clock)
+{
+   unsigned long lastData = clock();
+
+   while (len > 0)
+   {
+      int avail = client.available();
+      if (avail > 0)
+      {
+         int n = client.read(buf, min((size_t)avail, len));
+         if (n > 0)
+         {
+            buf += n;
+            len -= n;
+            lastData = clock();
+         }
+      }
+      else if ((!client.connected()) || (clock() - lastData > IOT_DELTA_OTA_TIMEOUT))
+      {
+         return false;
+      }
+      else
+      {
+         yield();
+      }
+   }
+   return true;
+}
+
+static bool iotConfigReadRunningImage(uint32_t offset, uint8_t *buf, size_t len)
+{
+#ifdef ESP8266
+   // flash reads must be word aligned, the sketch starts at flash offset 0
+   uint32_t words[(IOT_DELTA_OTA_CHUNK + 8) / 4];
+   uint32_t alignedOffset = offset & ~3UL;
+   size_t alignedLen = (len + (offset - alignedOffset) + 3) & ~3UL;
+
+   if ((len > IOT_DELTA_OTA_CHUNK) || (!ESP.flashRead(alignedOffset, words, alignedLen)))
+   {
+      return false;
+   }
+   memcpy(buf, (uint8_t*)words + (offset - alignedOffset), len);
+   return true;
+#else
+   return esp_partition_read(esp_ota_get_running_partition(), offset, buf, len) == ESP_OK;
+#endif
+}
+
+void iotConfig::handleDeltaOTA()
+{
+   WiFiClient client = iotConfigDeltaServer.available();
+
+   if (!client) { return; }
+   Serial.println("INFO: Delta OTA update started");
+   stopPowerSave();
+   iotConfigOtaStats.attempts++;
+   iotConfigOtaStats.bytes = 0;
+   iotConfigOtaStats.chunks = 0;
+   iotConfigOtaStats.maxChunkLatencyMS = 0;
+   iotConfigOtaStats.progressPrintUS = 0;
+   iotConfigOtaStartTS = clockSource();
+   iotConfigOtaChunkTS = iotConfigOtaStartTS;
+   bool success = applyDeltaOTA(client);
+   if (!success)
+   {
+      iotConfigOtaStats.failures++;
+   }
+   finishOTAStats();
+   if (success)
+   {
+      client.println("OK");
+      client.stop();
+      Serial.println("INFO: Delta OTA update verified, rebooting");
+      reboot();
+   }
+#ifdef ESP8266
+   // there is no abort on ESP8266, end() resets the Updater once the
+   // partial image fails its MD5 check, so later updates can begin()
+   if (Update.isRunning())
+   {
+      Update.end(true);
+   }
+#else
+   Update.abort();
+#endif
+   client.println("ERR");
+   client.stop();
+   Serial.println("ERROR: Delta OTA update failed");
+}
+
+/*
+ * Patch layout: "IOTD", version (1), 3 reserved bytes, MD5 of the running
+ * image, target size (LE32), MD5 of the target image, followed by a
+ * HMAC-SHA256 over these 44 header bytes keyed with the OTA password.
+ * The op stream then rebuilds the target from COPY (offset, length out of
+ * the running image), ADD (length, literal bytes) and RUN (length, fill
+ * byte) ops and is terminated by END. Everything is streamed through a
+ * single chunk buffer; the target MD5 is verified before switching.
+ */
+bool iotConfig::applyDeltaOTA(WiFiClient &client)
+{
+   uint8_t header[IOT_DELTA_OTA_HEADER_SIZE];
+   uint8_t mac[IOT_PROVISION_HMAC_SIZE];
+   uint8_t hmac[IOT_PROVISION_HMAC_SIZE];
+   uint8_t buf[IOT_DELTA_OTA_CHUNK];
+   char md5Hex[33];
+   uint32_t sourceSize = ESP.getSketchSize();
+   uint32_t targetSize;
+   uint32_t written = 0;
+
+   if ((!iotConfigReadExact(client, header, sizeof(header), clockSource)) ||
+       (!iotConfigReadExact(client, hmac, sizeof(hmac), clockSource)) ||
+       (memcmp(header, "IOTD", 4) != 0) || (header[4] != 1))
+   {
+      return false;
+   }
+   if (!iotConfigHMAC((const uint8_t*)otaPassword, strnlen(otaPassword, sizeof(otaPassword)), header, sizeof(header), mac))
+   {
+      return false;
+   }
+   uint8_t diff = 0;
+   for (int i=0; i<IOT_PROVISION_HMAC_SIZE; i++)
+   {
+      diff |= mac[i] ^ hmac[i];
+   }
+   if (diff != 0)
+   {
+      Serial.println("ERROR: Delta OTA authentication failed");
+      return false;
+   }
+
+   for (int i=0; i<16; i++)
+   {
+      snprintf(&md5Hex[i*2], 3, "%02x", header[8+i]);
+   }
+   if (strcasecmp(md5Hex, getSketchMD5()) != 0)
+   {
+      Serial.println("ERROR: Delta OTA patch does not match the running image");
+      return false;
+   }
+   targetSize = iotConfigLE32(&header[24]);
+   for (int i=0; i<16; i++)
+   {
+      snprintf(&md5Hex[i*2], 3, "%02x", header[28+i]);
+   }
+   if (!Update.begin(targetSize, U_FLASH))
+   {
+      return false;
+   }
+   Update.setMD5(md5Hex);
+
+   for (;;)
+   {
+      uint8_t op;
+      uint8_t arg[8];
+      uint32_t offset = 0;
+      uint32_t len;
+
+      if (!iotConfigReadExact(client, &op, 1, clockSource)) { return false; }
+      if (op == IOT_DELTA_OP_END) { break; }
+      switch (op)
+      {
+         case IOT_DELTA_OP_COPY:
+              if (!iotConfigReadExact(client, arg, 8, clockSource)) { return false; }
+              offset = iotConfigLE32(&arg[0]);
+              len = iotConfigLE32(&arg[4]);
+              if ((offset > sourceSize) || (len > sourceSize - offset)) { return false; }
+              break;
+         case IOT_DELTA_OP_ADD:
+              if (!iotConfigReadExact(client, arg, 2, clockSource)) { return false; }
+              len = arg[0] | (arg[1] << 8);
+              break;
+         case IOT_DELTA_OP_RUN:
+              if (!iotConfigReadExact(client, arg, 3, clockSource)) { return false; }
+              len = arg[0] | (arg[1] << 8);
+              memset(buf, arg[2], sizeof(buf));
+              break;
+         default:
+              return false;
+      }
+      if (len > targetSize - written) { return false; }
+
+      while (len > 0)
+      {
+         size_t n = min(len, (uint32_t)sizeof(buf));
+         if ((op == IOT_DELTA_OP_COPY) && (!iotConfigReadRunningImage(offset, buf, n))) { return false; }
+         if ((op == IOT_DELTA_OP_ADD) && (!iotConfigReadExact(client, buf, n, clockSource))) { return false; }
+         if (Update.write(buf, n) != n) { return false; }
+         unsigned long now = clockSource();
+         if (now - iotConfigOtaChunkTS > iotConfigOtaStats.maxChunkLatencyMS)
+         {
+            iotConfigOtaStats.maxChunkLatencyMS = now - iotConfigOtaChunkTS;
+         }
+         iotConfigOtaChunkTS = now;
+         iotConfigOtaStats.chunks++;
+         iotConfigOtaStats.bytes += n;
+         offset += n;
+         written += n;
+         len -= n;
+      }
+   }
+   if (written != targetSize)
+   {
+      return false;
+   }
+   return Update.end();
+}
+
+#endif
+
+bool iotConfig::assignVariableEEPROM(uint8_t *pointer, const size_t varSize)
+{
+   memAllocation_t newInfo;
+
+   if ((eepromAssignPointer+varSize) > configStart)
+   {
+      Serial.println("ERROR: No variable space available for EEPROM");
+      return false;
+   }
+   newInfo.varPtr=pointer;
+   newInfo.nvIndex=eepromAssignPointer;
+   newInfo.allocSize=varSize;
+   if (addVariableInfo(&eepromAllocData, &eepromDataIndex, &eepromAllocCapacity, &newInfo))
+   {
+      if (!factoryResetted) {
+         Serial.print("Reading ");
+         Serial.print(varSize);
+         Serial.print(" bytes of EEPROM data at index ");
+         Serial.print(eepromAssignPointer);
+         Serial.print(" into RAM @");
+         Serial.println((uintptr_t)pointer,HEX);
+         for (int i=0; i<varSize; i++)
+         {
+            pointer[i]=readNV(eepromAssignPointer+i);
+            //Serial.println(pointer[i]);
+         }
+      }
+      eepromAssignPointer+=varSize;
+      return true;
+   }
+   return false;
+}
+
+bool iotConfig::assignVariableRTCDATA(uint8_t *pointer, const size_t varSize)
+{
+   memAllocation_t newInfo;
+
+   if ((rtcDataAssignPointer+varSize) > rtcDataSize)
+   {
+      Serial.println("ERROR: No variable space available for RTC_DATA");
+      return false;
+   }
+   newInfo.varPtr=pointer;
+   newInfo.nvIndex=rtcDataAssignPointer;
+   newInfo.allocSize=varSize;
+   if (addVariableInfo(&rtcAllocData, &rtcDataIndex, &rtcAllocCapacity, &newInfo))
+   {
+      Serial.print("Reading ");
+      Serial.print(varSize);
+      Serial.print(" bytes of RTC_DATA at index ");
+      Serial.print(rtcDataAssignPointer);
+      Serial.print(" into RAM @");
+      Serial.println((uintptr_t)pointer,HEX);
+      for (int i=0; i<varSize; i++)
+      {
+         pointer[i]=rtc->data[rtcDataAssignPointer+i];
+         //Serial.println(pointer[i]);
+      }
+      rtcDataAssignPointer+=varSize;
+      return true;
+   }
+   return false;
+}
+
+bool iotConfig::addVariableInfo(memAllocation_t **store,
+                                int *indexPtr,
+                                int *capacityPtr,
+                                memAllocation_t *info)
+{
+   IOT_PROFILE(iotProfileAddVariable);
+   int idx=*indexPtr;
+
+   if (idx >= *capacityPtr)
+   {
+#ifdef IOTCONFIG_NO_HEAP
+      Serial.println("ERROR no space left for variable storage info");
+      return false;
+#else
+      // grow geometrically, so registering n variables copies O(n) entries
+      int newCapacity=(*capacityPtr > 0) ? *capacityPtr*2 : 4;
+      memAllocation_t *newStore;
+
+      newStore=(memAllocation_t*)malloc(newCapacity*sizeof(memAllocation_t));
+      if (!newStore)
+      {
+         Serial.println("ERROR allocating space for variable storage info");
+         return false;
+      }
+      if (*store)
+      {
+         memcpy(newStore,*store,idx*sizeof(memAllocation_t));
+         free(*store);
+      }
+      *store=newStore;
+      *capacityPtr=newCapacity;
+#endif
+   }
+   memcpy((void*)(*(store)+idx),(void*)info,sizeof(memAllocation_t));
+   (*indexPtr)++;
+   return true;
+}
+
+void iotConfig::factoryReset()
+{
+   beginEEPROM();
+   for (int i=0; i<eepromTotalSize; i++)
+   {
+      EEPROM.write(i, 0);
+   }
+   commitEEPROM();
+   // RAM copies must not be written back over the erased store
+   variablesDirty = false;
+}
+
+void iotConfig::enableWarmBootSnapshot(const bool enable)
+{
+#if IOTCONFIG_FEATURE_SNAPSHOT
+   useSnapshot = enable;
+#else
+   if (enable) { Serial.println("WARN: warm boot snapshot not compiled in (IOTCONFIG_FEATURE_SNAPSHOT)"); }
+#endif
+}
+
+void iotConfig::beginEEPROM()
+{
+   if (!eepromStarted)
+   {
+      EEPROM.begin(eepromTotalSize);
+      eepromStarted = true;
+   }
+}
+
+void iotConfig::commitEEPROM()
+{
+   unsigned long start = clockSourceUS();
+
+   EEPROM.commit();
+   uint32_t latency = clockSourceUS() - start;
+   commitStats.commits++;
+   commitStats.lastLatencyUS = latency;
+   commitStats.totalLatencyUS += latency;
+   if (latency > commitStats.maxLatencyUS) { commitStats.maxLatencyUS = latency; }
+   commitPending = false;
+   variablesDirty = false;
+   timerStop(iotTimerCommit);
+   takeSnapshot();
+#if IOTCONFIG_FEATURE_MDNS
+   // the gen record tracks the committed configuration
+   if (mdnsStarted)
+   {
+      refreshServiceTxt();
+   }
+#endif
+}
+
+void iotConfig::setCommitWindow(const uint32_t windowMS, const bool autoDetect)
+{
+   commitWindow = windowMS;
+   commitAutoDetect = autoDetect;
+   if (commitAutoDetect)
+   {
+      timerStart(iotTimerCommitCheck, commitWindow);
+   }
+   else
+   {
+      timerStop(iotTimerCommitCheck);
+   }
+}
+
+void iotConfig::markDirty()
+{
+   variablesDirty = true;
+   scheduleCommit();
+}
+
+void iotConfig::scheduleCommit()
+{
+   if (commitPending)
+   {
+      commitStats.commitsAvoided++;
+      return;
+   }
+   commitPending = true;
+   timerStart(iotTimerCommit, commitWindow);
+}
+
+void iotConfig::flush()
+{
+   if (variablesDirty)
+   {
+      updateEEPROM();
+   }
+   if (commitPending)
+   {
+      commitEEPROM();
+   }
+}
+
+// true if any registered variable differs from the EEPROM contents
+bool iotConfig::variablesChanged()
+{
+   for (int n=1; n<eepromDataIndex; n++)
+   {
+      for (int i=0; i<eepromAllocData[n].allocSize; i++)
+      {
+         if (eepromAllocData[n].varPtr[i] != readNV(eepromAllocData[n].nvIndex+i))
+         {
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+/*
+ * Pending writes are coalesced for commitWindow ms and committed while
+ * no portal client, OTA update or connection attempt is in progress,
+ * but never deferred longer than IOT_COMMIT_MAX_DEFER windows.
+ */
+void iotConfig::handleCommitScheduler()
+{
+   if (commitAutoDetect && (!variablesDirty) && timerExpired(iotTimerCommitCheck))
+   {
+      timerStart(iotTimerCommitCheck, commitWindow);
+      if (variablesChanged())
+      {
+         markDirty();
+      }
+   }
+   if (!commitPending) { return; }
+
+   unsigned long pendingFor = timerElapsed(iotTimerCommit);
+   bool idle = (!iotConfigOtaPrio) &&
+               ((iotConfigMode != iotConfigClientMode) || iotConfigOnline);
+#if IOTCONFIG_FEATURE_PORTAL
+   idle = idle && (!iotConfigClient);
+#endif
+   if ((pendingFor >= commitWindow) &&
+       (idle || (pendingFor >= commitWindow*IOT_COMMIT_MAX_DEFER)))
+   {
+      flush();
+   }
+}
+
+/*
+ * Returns the time in ms until handle() has to run again, 0 if it
+ * should be called right away. Sockets that can only be polled (DNS,
+ * ArduinoOTA invitations) are covered by a poll interval.
+ */
+uint32_t iotConfig::nextDeadline()
+{
+   uint32_t next = UINT32_MAX;
+
+   if (!iotConfigUseWiFi) { return next; }
+
+   switch(iotConfigMode)
+   {
+      case iotConfigClientMode:
+           if (iotConfigOnline != wasOnline) { return 0; }
+           if (!iotConfigOnline)
+           {
+              next = min(next, timerRemaining(iotTimerReconnect));
+              if (watchDogTimeout > 0)
+              {
+                 next = min(next, timerRemaining(iotTimerWatchdog));
+              }
+           }
+#if IOTCONFIG_FEATURE_OTA
+           else if (useOTA)
+           {
+              if ((!otaInitialized) || iotConfigOtaPrio) { return 0; }
+              next = min(next, (uint32_t)IOT_IDLE_POLL_INTERVAL);
+           }
+#endif
+#if IOTCONFIG_FEATURE_PROVISIONING
+           if ((provisionPort > 0) && iotConfigOnline)
+           {
+              next = min(next, (uint32_t)IOT_IDLE_POLL_INTERVAL);
+           }
+#endif
+#if IOTCONFIG_FEATURE_METRICS
+           if ((metricsPort > 0) && iotConfigOnline)
+           {
+              if ((!metricsStarted) || iotConfigMetricsClient) { return 0; }
+              next = min(next, (uint32_t)IOT_IDLE_POLL_INTERVAL);
+           }
+#endif
+#if IOTCONFIG_FEATURE_MDNS
+           if ((mdnsPort > 0) && iotConfigOnline)
+           {
+              if (!mdnsStarted) { return 0; }
+#ifdef ESP8266
+              next = min(next, (uint32_t)IOT_IDLE_POLL_INTERVAL);
+#else
+              next = min(next, timerRemaining(iotTimerMdnsRefresh));
+#endif
+           }
+#endif
+           break;
+
+      case iotConfigServerMode:
+#if IOTCONFIG_FEATURE_PORTAL
+           if (iotConfigClient) { return 0; }
+#endif
+           next = min(next, (uint32_t)IOT_PORTAL_POLL_INTERVAL);
+           break;
+
+      case iotConfigTestWiFi:
+           return 0;
+
+      case iotConfigWiFiTestWaitConnect:
+           next = min(next, timerRemaining(iotTimerTestConnect));
+           break;
+
+      default:
+           break;
+   }
+
+   if (commitPending)
+   {
+      uint32_t commitDue = timerRemaining(iotTimerCommit);
+      if (commitDue == 0)
+      {
+         // deferred because the device is busy, the forced commit is next
+         unsigned long pendingFor = timerElapsed(iotTimerCommit);
+         unsigned long maxDefer = commitWindow*IOT_COMMIT_MAX_DEFER;
+         commitDue = (pendingFor >= maxDefer) ? 0 : maxDefer - pendingFor;
+      }
+      next = min(next, commitDue);
+   }
+   else if (commitAutoDetect)
+   {
+      next = min(next, timerRemaining(iotTimerCommitCheck));
+   }
+   return next;
+}
+
+// the timer table runs on clockSource, see iotconfigtimer.h
+void iotConfig::timerStart(const iotConfigTimerId_t id, const unsigned long interval)
+{
+   iotConfigTimerStart(&timers[id], clockSource(), interval);
+}
+
+void iotConfig::timerStop(const iotConfigTimerId_t id)
+{
+   timers[id].armed = false;
+}
+
+unsigned long iotConfig::timerElapsed(const iotConfigTimerId_t id)
+{
+   return iotConfigTimerElapsed(&timers[id], clockSource());
+}
+
+bool iotConfig::timerExpired(const iotConfigTimerId_t id)
+{
+   return iotConfigTimerExpired(&timers[id], clockSource());
+}
+
+uint32_t iotConfig::timerRemaining(const iotConfigTimerId_t id)
+{
+   return iotConfigTimerRemaining(&timers[id], clockSource());
+}
+
+/*
+ * Time since boot in ms, 64 bit so it does not wrap after 49.7 days. The
+ * hardware timer is used with the default clock, an injected clock is
+ * extended to 64 bit, handle() reads it often enough to catch every wrap.
+ */
+uint64_t iotConfig::uptimeMS()
+{
+   if (clockSource == iotConfigMillis)
+   {
+#ifdef ESP8266
+      return micros64() / 1000ULL;
+#else
+      return esp_timer_get_time() / 1000LL;
+#endif
+   }
+   return iotConfigUptimeExtend(&uptime, clockSource());
+}
+
+// true if a WiFi event or a new connection needs handle() before the deadline
+bool iotConfig::wakeRequested()
+{
+   if (((iotConfigMode == iotConfigClientMode) || (iotConfigMode == iotConfigWiFiTestWaitConnect)) &&
+       (iotConfigOnline != wasOnline))
+   {
+      return true;
+   }
+#if IOTCONFIG_FEATURE_PORTAL
+   if ((iotConfigMode == iotConfigServerMode) && iotConfigServer.hasClient())
+   {
+      return true;
+   }
+#endif
+#if IOTCONFIG_FEATURE_DELTA_OTA
+   if (otaInitialized && (deltaOtaPort > 0) && iotConfigDeltaServer.hasClient())
+   {
+      return true;
+   }
+#endif
+#if IOTCONFIG_FEATURE_METRICS
+   if (metricsStarted && iotConfigMetricsServer.hasClient())
+   {
+      return true;
+   }
+#endif
+   return false;
+}
+
+/*
+ * Sleeps until nextDeadline(), at most maxMS. While connected as a client
+ * the modem sleeps between beacons (ESP32) or the CPU light-sleeps inside
+ * delay() (ESP8266). WiFi events and new connections end the sleep early.
+ */
+void iotConfig::sleepUntilDeadline(const uint32_t maxMS)
+{
+   uint32_t sleepMS = min(nextDeadline(), maxMS);
+   if (sleepMS == 0) { return; }
+
+   if ((iotConfigMode != iotConfigClientMode) || (!iotConfigOnline))
+   {
+      stopPowerSave();
+   }
+   else if (!sleepModeSet)
+   {
+#ifdef ESP8266
+      WiFi.setSleepMode(WIFI_LIGHT_SLEEP);
+#else
+      WiFi.setSleep(true);
+#endif
+      sleepModeSet = true;
+   }
+
+   unsigned long sleepStart = clockSource();
+   unsigned long slept = 0;
+   while (slept < sleepMS)
+   {
+      delay(min((uint32_t)IOT_SLEEP_SLICE, (uint32_t)(sleepMS - slept)));
+      if (wakeRequested()) { break; }
+      slept = clockSource() - sleepStart;
+   }
+}
+
+// undoes the power save of sleepUntilDeadline() once the device is no online client
+void iotConfig::stopPowerSave()
+{
+   if (!sleepModeSet) { return; }
+#ifdef ESP8266
+   WiFi.setSleepMode(WIFI_NONE_SLEEP);
+#else
+   WiFi.setSleep(false);
+#endif
+   sleepModeSet = false;
+}
+
+commitStats_t iotConfig::getCommitStats()
+{
+   return commitStats;
+}
+
+uint8_t iotConfig::readNV(const size_t index)
+{
+#if IOTCONFIG_FEATURE_SNAPSHOT
+   if (!eepromStarted)
+   {
+      return rtc->snapshot[index];
+   }
+#endif
+   return EEPROM.read(index);
+}
+
+/*
+ * A snapshot is only trusted on wake from deep sleep, when it was taken
+ * for the same EEPROM size, its contents still match the CRC taken with
+ * them and the EEPROM CRC word it carries is valid for those contents.
+ * Flash is then left untouched until the first write.
+ */
+bool iotConfig::restoreSnapshot()
+{
+#if IOTCONFIG_FEATURE_SNAPSHOT
+   uint32_t storedCRC;
+
+   // only a deep sleep wake, reboot() included, keeps RTC memory; firstBoot says
+   // nothing here, a device that never opened the portal keeps it set
+   if ((!useSnapshot) || (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED) ||
+       (rtc->snapshotValid != IOT_SNAPSHOT_MAGIC) ||
+       (rtc->snapshotSize != eepromTotalSize) || (eepromTotalSize > IOT_RTC_SNAPSHOT_SIZE))
+   {
+      return false;
+   }
+   if (rtc->snapshotCRC != iotConfigCRC(&rtc->snapshot[sizeof(storedCRC)], rtc->snapshotSize-sizeof(storedCRC), NULL, 0))
+   {
+      Serial.println("WARN: RTC snapshot corrupted, loading EEPROM");
+      return false;
+   }
+   memcpy(&storedCRC, rtc->snapshot, sizeof(storedCRC));
+   return storedCRC == calcCRC(rtc->snapshot);
+#else
+   return false;
+#endif
+}
+
+void iotConfig::takeSnapshot()
+{
+#if IOTCONFIG_FEATURE_SNAPSHOT
+   rtc->snapshotValid = 0;
+   if ((!useSnapshot) || (!eepromStarted) || (eepromTotalSize > IOT_RTC_SNAPSHOT_SIZE))
+   {
+      return;
+   }
+   for (size_t i=0; i<eepromTotalSize; i++)
+   {
+      rtc->snapshot[i] = EEPROM.read(i);
+   }
+   rtc->snapshotCRC = iotConfigCRC(&rtc->snapshot[sizeof(eepromCRC)], eepromTotalSize-sizeof(eepromCRC), NULL, 0);
+   rtc->snapshotSize = eepromTotalSize;
+   rtc->snapshotValid = IOT_SNAPSHOT_MAGIC;
+#endif
+}
+
+void iotConfig::updateEEPROM()
+{
+   IOT_PROFILE(iotProfileUpdateEEPROM);
+   beginEEPROM();
+#if IOTCONFIG_FEATURE_SNAPSHOT
+   // the RAM copy may get committed from outside, so the snapshot is stale now
+   rtc->snapshotValid = 0;
+#endif
+   writeConfigRecords();
+   for (int n=eepromDataIndex-1; n>=0; n--)
+   {
+      if (n==0)
+      {
+         Serial.print("INFO: Calculating CRC: ");
+         eepromCRC=calcCRC();
+         Serial.println(eepromCRC,HEX);
+      }
+      Serial.print("INFO: Writing variable (@");
+      Serial.print((uintptr_t)eepromAllocData[n].varPtr,HEX);
+      Serial.print(") of ");
+      Serial.print(eepromAllocData[n].allocSize,DEC);
+      Serial.print(" bytes into EEPROM at addr ");
+      Serial.println(eepromAllocData[n].nvIndex,DEC);
+      for (int i=0; i<eepromAllocData[n].allocSize; i++)
+      {
+         EEPROM.write(eepromAllocData[n].nvIndex+i,
+                      eepromAllocData[n].varPtr[i]);
+      }
+   }  
+   writeNetworkProfiles();
+}
+
+void iotConfig::updateRTCDATA()
+{
+   IOT_PROFILE(iotProfileUpdateRTCDATA);
+   for (int n=rtcDataIndex-1; n>=0; n--)
+   {
+      Serial.print("INFO: Writing variable (@");
+      Serial.print((uintptr_t)rtcAllocData[n].varPtr,HEX);
+      Serial.print(") of ");
+      Serial.print(rtcAllocData[n].allocSize,DEC);
+      Serial.print(" bytes into RTC_DATA at addr ");
+      Serial.println(rtcAllocData[n].nvIndex,DEC);
+      for (int i=0; i<rtcAllocData[n].allocSize; i++)
+      {
+         rtc->data[rtcAllocData[n].nvIndex+i]=rtcAllocData[n].varPtr[i];
+      }
+   }  
+}
+
+#if IOTCONFIG_FEATURE_PORTAL
+/*
+ * Copies the scan results into scanCache once, keeping only the strongest
+ * BSSID per SSID, sorted by RSSI and truncated to IOT_SCAN_CACHE_SIZE.
+ */
+void iotConfig::cacheScanResults(const int found)
+{
+   numScannedNetworks = 0;
+   for (int i=0; i<found; i++)
+   {
+      char ssid[sizeof(scanCache[0].ssid)];
+      int32_t rssi;
+      uint8_t encryptionType;
+      int n;
+
+      if (!iotConfigScanRecord(i, ssid, sizeof(ssid), &rssi, &encryptionType))
+      {
+         continue;
+      }
+      for (n=0; n<numScannedNetworks; n++)
+      {
+         if (strcmp(scanCache[n].ssid, ssid) == 0) { break; }
+      }
+      if (n < numScannedNetworks)
+      {
+         if (rssi <= scanCache[n].rssi) { continue; }
+      }
+      else if (numScannedNetworks < IOT_SCAN_CACHE_SIZE)
+      {
+         n = numScannedNetworks++;
+      }
+      else
+      {
+         // cache is full and sorted, so the last entry is the weakest one
+         n = numScannedNetworks-1;
+         if (rssi <= scanCache[n].rssi) { continue; }
+      }
+      strncpy(scanCache[n].ssid, ssid, sizeof(scanCache[n].ssid));
+      scanCache[n].rssi = rssi;
+      scanCache[n].encryptionType = encryptionType;
+      while ((n > 0) && (scanCache[n-1].rssi < scanCache[n].rssi))
+      {
+         scanEntry_t tmp = scanCache[n-1];
+         scanCache[n-1] = scanCache[n];
+         scanCache[n] = tmp;
+         n--;
+      }
+   }
+   WiFi.scanDelete();
+}
+
+// drops the portal client so a slow or broken one cannot hold the portal
+void iotConfig::evictPortalClient(const char *response, uint32_t *counter)
+{
+   (*counter)++;
+   Serial.println("WARN: Portal client evicted");
+   if (response)
+   {
+      iotConfigClient.print(response);
+   }
+   iotConfigClient.stop();
+#ifndef ESP8266
+   iotConfigClient = NULL;
+#endif
+   closeConn = false;
+   currentLineLen = 0;
+   currentLine[0] = 0;
+}
+#endif
+
+// CRC of the EEPROM store, or of a copy of it in data
+uint32_t iotConfig::calcCRC(const uint8_t *data)
+{
+   IOT_PROFILE(iotProfileCalcCRC);
+   if (!data)
+   {
+#ifdef ESP8266
+      data = EEPROM.getConstDataPtr();
+#else
+      data = EEPROM.getDataPtr();
+#endif
+   }
+
+   // only the records in use are covered, the rest of the record area is ignored
+   size_t used = configStart;
+   size_t length;
+   if (iotConfigRecordsLength(&data[sizeof(uint32_t)], eepromSize-configStart, &length))
+   {
+      used += length;
+   }
+   return iotConfigCRC(&data[sizeof(uint32_t)], used-sizeof(uint32_t), NULL, 0);
+}
+
+char *iotConfig::configField(const uint8_t id, size_t *fieldSize)
+{
+   switch (id)
+   {
+      case IOT_FIELD_FRIENDLY_NAME: *fieldSize = sizeof(friendlyName); return friendlyName;
+      case IOT_FIELD_AP_PASSWORD: *fieldSize = sizeof(wifiApPassword); return wifiApPassword;
+      case IOT_FIELD_SSID: *fieldSize = sizeof(wifiClientSSID); return wifiClientSSID;
+      case IOT_FIELD_USERNAME: *fieldSize = sizeof(wifiClientUsername); return wifiClientUsername;
+      case IOT_FIELD_PASSWORD: *fieldSize = sizeof(wifiClientPassword); return wifiClientPassword;
+      case IOT_FIELD_OTA_PASSWORD: *fieldSize = sizeof(otaPassword); return otaPassword;
+      default: *fieldSize = 0; return NULL;
+   }
+}
+
+void iotConfig::configFields(iotConfigRecordField_t *fields)
+{
+   for (uint8_t id=IOT_FIELD_FRIENDLY_NAME; id<=IOT_FIELD_OTA_PASSWORD; id++)
+   {
+      fields[id-IOT_FIELD_FRIENDLY_NAME].value = configField(id, &fields[id-IOT_FIELD_FRIENDLY_NAME].size);
+   }
+}
+
+// the record area follows the user variables, see iotconfigrecords.h
+bool iotConfig::loadConfigRecords()
+{
+   iotConfigRecordField_t fields[IOT_CONFIG_FIELDS];
+   const uint8_t *data;
+
+#if IOTCONFIG_FEATURE_SNAPSHOT
+   if (!eepromStarted)
+   {
+      data = rtc->snapshot;
+   }
+   else
+#endif
+   {
+#ifdef ESP8266
+      data = EEPROM.getConstDataPtr();
+#else
+      data = EEPROM.getDataPtr();
+#endif
+   }
+   configFields(fields);
+   switch (iotConfigRecordsDecode(&data[sizeof(eepromCRC)], &data[configStart], eepromSize-configStart,
+                                  fields, &provisionSequence))
+   {
+      case iotConfigRecordsOk:
+           return true;
+      case iotConfigRecordsTruncated:
+           Serial.println("WARN: Truncated configuration record");
+           return false;
+      default:
+           return false;
+   }
+}
+
+void iotConfig::writeConfigRecords()
+{
+   iotConfigRecordField_t fields[IOT_CONFIG_FIELDS];
+
+   beginEEPROM();
+   configFields(fields);
+   uint8_t *data = EEPROM.getDataPtr();
+   // the area has room for every field at full length, encoding cannot fail
+   iotConfigRecordsEncode(&data[sizeof(eepromCRC)], &data[configStart], eepromSize-configStart,
+                          fields, provisionSequence);
+}
+
+// network profile as stored next to the fixed size fields
+typedef struct
+{
+  char ssid[IOT_LEGACY_FIELD_SIZE];
+  char username[IOT_LEGACY_FIELD_SIZE];
+  char password[IOT_LEGACY_FIELD_SIZE];
+  uint32_t lastSuccess;
+  uint16_t avgConnectTime;
+  uint8_t failures;
+  uint8_t reserved;
+} iotConfigLegacyProfile_t;
+
+/*
+ * Converts the layout of earlier versions (CRC, six 32 byte fields, user
+ * variables, profile table) into RAM and moves the user variables down
+ * to their new offset. The caller writes and commits the new layout.
+ */
+bool iotConfig::upgradeLegacyConfig(const size_t userSize)
+{
+#ifdef ESP8266
+   const uint8_t *data = EEPROM.getConstDataPtr();
+#else
+   const uint8_t *data = EEPROM.getDataPtr();
+#endif
+   const size_t legacyUser = sizeof(eepromCRC) + 6*IOT_LEGACY_FIELD_SIZE;
+   const size_t legacySize = legacyUser + userSize;
+   const size_t legacyProfiles = sizeof(uint32_t) + sizeof(profileSequence) +
+                                 IOT_NETWORK_PROFILES*sizeof(iotConfigLegacyProfile_t);
+   uint32_t storedCRC;
+   iotConfigRecordField_t fields[IOT_CONFIG_FIELDS];
+
+   if (legacySize + legacyProfiles > eepromTotalSize)
+   {
+      return false;
+   }
+   memcpy(&storedCRC, data, sizeof(storedCRC));
+   if (storedCRC != iotConfigCRC(&data[sizeof(eepromCRC)], legacySize-sizeof(eepromCRC), NULL, 0))
+   {
+      return false;
+   }
+   Serial.println("INFO: Converting fixed size configuration fields to records");
+   configFields(fields);
+   iotConfigRecordsFromLegacy(&data[sizeof(eepromCRC)], fields);
+
+   const uint8_t *table = &data[legacySize];
+   memset(profiles, 0, sizeof(profiles));
+   profileSequence = 0;
+   memcpy(&storedCRC, table, sizeof(storedCRC));
+   if (storedCRC == iotConfigCRC(&table[sizeof(storedCRC)], legacyProfiles-sizeof(storedCRC), NULL, 0))
+   {
+      memcpy(&profileSequence, &table[sizeof(storedCRC)], sizeof(profileSequence));
+      for (int p=0; p<IOT_NETWORK_PROFILES; p++)
+      {
+         iotConfigLegacyProfile_t legacy;
+         memcpy(&legacy, &table[sizeof(storedCRC)+sizeof(profileSequence)+p*sizeof(legacy)], sizeof(legacy));
+         memcpy(profiles[p].ssid, legacy.ssid, strnlen(legacy.ssid, sizeof(legacy.ssid)));
+         memcpy(profiles[p].username, legacy.username, strnlen(legacy.username, sizeof(legacy.username)));
+         memcpy(profiles[p].password, legacy.password, strnlen(legacy.password, sizeof(legacy.password)));
+         profiles[p].lastSuccess = legacy.lastSuccess;
+         profiles[p].avgConnectTime = legacy.avgConnectTime;
+         profiles[p].failures = legacy.failures;
+      }
+   }
+   else if (strlen(wifiClientSSID) > 0)
+   {
+      addNetworkProfile(wifiClientSSID, wifiClientUsername, wifiClientPassword);
+   }
+
+   // destination is below the source, so copying upwards is safe
+   for (size_t i=0; i<userSize; i++)
+   {
+      EEPROM.write(configStart-userSize+i, data[legacyUser+i]);
+   }
+   return true;
+}
+
+void iotConfig::reboot()
+{
+   flush();
+#ifdef ESP8266
+   ESP.rtcUserMemoryWrite(4, (uint32_t*)rtc->data, IOT_RTC_DATA_SIZE);
+   ESP.rtcUserMemoryWrite(4 + IOT_RTC_DATA_SIZE/4, &rtc->watchdogReboots, sizeof(rtc->watchdogReboots));
+   ESP.restart();
+#else
+   esp_deep_sleep(1000000ULL*2);   
+#endif
+}
+
+void iotConfig::saveAndReboot()
+{
+   updateRTCDATA();
+   updateEEPROM();
+   commitEEPROM();
+   reboot();
+}
+
+static bool iotConfigStartsWith(const char *str, const char *prefix)
+{
+   return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+static bool iotConfigEndsWith(const char *str, const size_t len, const char *suffix)
+{
+   size_t suffixLen = strlen(suffix);
+   return (len >= suffixLen) && (memcmp(&str[len-suffixLen], suffix, suffixLen) == 0);
 }
 
-bool iotConfig::assignVariableRTCDATA(uint8_t *pointer, const size_t varSize)
+#if IOTCONFIG_FEATURE_PORTAL
+// connectivity checks of Android, Apple and Windows, redirected to the portal without rendering it
+static const char * const iotConfigProbePaths[] = {
+   "/generate_204", "/gen_204", "/hotspot-detect.html", "/connecttest.txt",
+   "/ncsi.txt", "/library/test/success.html", "/success.txt", "/canonical.html"
+};
+
+static const char iotConfigResponseTimeout[] =
+   "HTTP/1.1 408 Request Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char iotConfigResponseUriTooLong[] =
+   "HTTP/1.1 414 URI Too Long\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char iotConfigResponseTooLarge[] =
+   "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static bool iotConfigIsProbe(const char *line)
 {
-   memAllocation_t newInfo;
-
-   if ((rtcDataAssignPointer+varSize) > rtcDataSize)
-   {
-      Serial.println("ERROR: No variable space available for RTC_DATA");
-      return false;
-   }
-   newInfo.varPtr=pointer;
-   newInfo.nvIndex=rtcDataAssignPointer;
-   newInfo.allocSize=varSize;
-   if (addVariableInfo(&rtcAllocData, &rtcDataIndex, &newInfo))
+   if (!iotConfigStartsWith(line, "GET ")) { return false; }
+   const char *path = &line[4];
+   for (size_t n=0; n<sizeof(iotConfigProbePaths)/sizeof(iotConfigProbePaths[0]); n++)
    {
-      Serial.print("Reading ");
-      Serial.print(varSize);
-      Serial.print(" bytes of RTC_DATA at index ");
-      Serial.print(rtcDataAssignPointer);
-      Serial.print(" into RAM @");
-      Serial.println((int)pointer,HEX);
-      for (int i=0; i<varSize; i++)
+      size_t len = strlen(iotConfigProbePaths[n]);
+      if ((strncmp(path, iotConfigProbePaths[n], len) == 0) &&
+          ((path[len] == ' ') || (path[len] == '?')))
       {
-         pointer[i]=iot_rtc_data[rtcDataAssignPointer+i];
-         //Serial.println(pointer[i]);
+         return true;
       }
-      rtcDataAssignPointer+=varSize;
-      return true;
    }
    return false;
 }
+#endif
 
-bool iotConfig::addVariableInfo(memAllocation_t **store,
-                                int *indexPtr,
-                                memAllocation_t *info)
+#if IOTCONFIG_FEATURE_METRICS
+// renders the counters into metricsBuffer, returns the length
+size_t iotConfig::renderMetrics(const bool json)
 {
-   memAllocation_t *newStore;
-   int idx=*indexPtr;
+   uint32_t uptime = uptimeMS() / 1000;
+#ifdef ESP8266
+   uint32_t largestBlock = ESP.getMaxFreeBlockSize();
+#else
+   uint32_t largestBlock = ESP.getMaxAllocHeap();
+#endif
+   uint32_t handleMeanUS = (handleCalls > 0) ? (uint32_t)(handleTotalUS / handleCalls) : 0;
+   int len;
 
-   newStore=(memAllocation_t*)malloc((idx+1)*sizeof(memAllocation_t));
-   if (!newStore)
+   if (json)
    {
-      Serial.println("ERROR allocating space for variable storage info");
-      return false;
+      len = snprintf(metricsBuffer, sizeof(metricsBuffer),
+                     "{\"uptimeSeconds\":%u,\"rssi\":%d,\"reconnects\":%u,\"watchdogReboots\":%u,"
+                     "\"heapFree\":%u,\"heapLargestBlock\":%u,\"handleMaxUs\":%u,\"handleMeanUs\":%u,"
+                     "\"eepromCommits\":%u,\"otaAttempts\":%u}\n",
+                     uptime, (int)WiFi.RSSI(), reconnectCount, rtc->watchdogReboots,
+                     ESP.getFreeHeap(), largestBlock, handleMaxUS, handleMeanUS,
+                     commitStats.commits, iotConfigOtaStats.attempts);
    }
-   if (*store)
+   else
    {
-      memcpy(newStore,*store,idx*sizeof(memAllocation_t));
-      free(*store);
+      len = snprintf(metricsBuffer, sizeof(metricsBuffer),
+                     "# TYPE iotconfig_uptime_seconds counter\niotconfig_uptime_seconds %u\n"
+                     "# TYPE iotconfig_wifi_rssi_dbm gauge\niotconfig_wifi_rssi_dbm %d\n"
+                     "# TYPE iotconfig_reconnects_total counter\niotconfig_reconnects_total %u\n"
+                     "# TYPE iotconfig_watchdog_reboots_total counter\niotconfig_watchdog_reboots_total %u\n"
+                     "# TYPE iotconfig_heap_free_bytes gauge\niotconfig_heap_free_bytes %u\n"
+                     "# TYPE iotconfig_heap_largest_block_bytes gauge\niotconfig_heap_largest_block_bytes %u\n"
+                     "# TYPE iotconfig_handle_latency_max_us gauge\niotconfig_handle_latency_max_us %u\n"
+                     "# TYPE iotconfig_handle_latency_mean_us gauge\niotconfig_handle_latency_mean_us %u\n"
+                     "# TYPE iotconfig_eeprom_commits_total counter\niotconfig_eeprom_commits_total %u\n"
+                     "# TYPE iotconfig_ota_attempts_total counter\niotconfig_ota_attempts_total %u\n",
+                     uptime, (int)WiFi.RSSI(), reconnectCount, rtc->watchdogReboots,
+                     ESP.getFreeHeap(), largestBlock, handleMaxUS, handleMeanUS,
+                     commitStats.commits, iotConfigOtaStats.attempts);
    }
-   *store=newStore;
-   memcpy((void*)(*(store)+idx),(void*)info,sizeof(memAllocation_t));
-   (*indexPtr)++;
-   return true;
+   if (len < 0) { return 0; }
+   return min((size_t)len, sizeof(metricsBuffer)-1);
 }
 
-void iotConfig::factoryReset()
+/*
+ * Serves GET /metrics (Prometheus text) and GET /metrics.json. Only the
+ * bytes already received are read, so a scrape never blocks handle().
+ */
+void iotConfig::handleMetrics()
 {
-   for (int i=0; i<eepromSize; i++)
+   if (!metricsStarted)
    {
-      EEPROM.write(i, 0);
+      iotConfigMetricsServer.begin(metricsPort);
+      metricsStarted = true;
+      Serial.printf("INFO: Metrics available on port %u\n", metricsPort);
+      return;
+   }
+   if (!iotConfigMetricsClient)
+   {
+      iotConfigMetricsClient = iotConfigMetricsServer.available();
+      if (!iotConfigMetricsClient) { return; }
+      metricsFirstLine = true;
+      metricsLineLen = 0;
+      metricsRequestLine[0] = 0;
+      timerStart(iotTimerMetricsClient, clientTimeOut);
    }
-   EEPROM.commit();
-}
 
-void iotConfig::updateEEPROM()
-{
-   for (int n=eepromDataIndex-1; n>=0; n--)
+   bool headersDone = false;
+   while ((!headersDone) && iotConfigMetricsClient.available())
    {
-      if (n==0)
+      char c = iotConfigMetricsClient.read();
+      if (c == '\r') { continue; }
+      if (c == '\n')
       {
-         Serial.print("INFO: Calculating CRC: ");
-         eepromCRC=calcCRC();
-         Serial.println(eepromCRC,HEX);
+         // the empty line ends the request headers
+         headersDone = (!metricsFirstLine) && (metricsLineLen == 0);
+         metricsFirstLine = false;
+         metricsLineLen = 0;
+         continue;
       }
-      Serial.print("INFO: Writing variable (@");
-      Serial.print((int)eepromAllocData[n].varPtr,HEX);
-      Serial.print(") of ");
-      Serial.print(eepromAllocData[n].allocSize,DEC);
-      Serial.print(" bytes into EEPROM at addr ");
-      Serial.println(eepromAllocData[n].nvIndex,DEC);
-      for (int i=0; i<eepromAllocData[n].allocSize; i++)
+      if (metricsFirstLine && (metricsLineLen < sizeof(metricsRequestLine)-1))
       {
-         EEPROM.write(eepromAllocData[n].nvIndex+i,
-                      eepromAllocData[n].varPtr[i]);
+         metricsRequestLine[metricsLineLen] = c;
+         metricsRequestLine[metricsLineLen+1] = 0;
       }
-   }  
-}
+      metricsLineLen++;
+   }
 
-void iotConfig::updateRTCDATA()
-{
-   for (int n=rtcDataIndex-1; n>=0; n--)
+   if (headersDone)
    {
-      Serial.print("INFO: Writing variable (@");
-      Serial.print((int)rtcAllocData[n].varPtr,HEX);
-      Serial.print(") of ");
-      Serial.print(rtcAllocData[n].allocSize,DEC);
-      Serial.print(" bytes into RTC_DATA at addr ");
-      Serial.println(rtcAllocData[n].nvIndex,DEC);
-      for (int i=0; i<rtcAllocData[n].allocSize; i++)
+      bool json = iotConfigStartsWith(metricsRequestLine, "GET /metrics.json ");
+      if (json || iotConfigStartsWith(metricsRequestLine, "GET /metrics "))
       {
-         iot_rtc_data[rtcAllocData[n].nvIndex+i]=rtcAllocData[n].varPtr[i];
+         size_t len = renderMetrics(json);
+         // formatted on the stack, Print::printf() allocates for anything over 64 bytes
+         char header[IOT_METRICS_HEADER_MAX];
+         int headerLen = snprintf(header, sizeof(header),
+                                  "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %u\r\n"
+                                  "Connection: close\r\n\r\n",
+                                  json ? "application/json" : "text/plain; version=0.0.4",
+                                  (unsigned int)len);
+         if (headerLen > 0)
+         {
+            iotConfigMetricsClient.write((const uint8_t*)header, min((size_t)headerLen, sizeof(header)-1));
+            iotConfigMetricsClient.write((const uint8_t*)metricsBuffer, len);
+         }
+      }
+      else
+      {
+         iotConfigMetricsClient.print("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
       }
-   }  
-}
-
-uint32_t iotConfig::calcCRC()
-{
-   const unsigned long crc_table[16] = {
-     0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
-     0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
-     0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
-     0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
-   }; 
- 
-   unsigned long crc = ~0L;
- 
-   for (int index = sizeof(uint32_t) ; index < eepromSize ; index++)
-   {
-     uint8_t readByte = EEPROM.read(index);
-     crc = crc_table[(crc ^ readByte) & 0x0f] ^ (crc >> 4);
-     crc = crc_table[(crc ^ (readByte >> 4)) & 0x0f] ^ (crc >> 4);
-     crc = ~crc;
    }
-   return crc;
-}
-
-void iotConfig::reboot()
-{
-#ifdef ESP8266
-   ESP.rtcUserMemoryWrite(4, (uint32_t*)iot_rtc_data, IOT_RTC_DATA_SIZE);
-   ESP.restart();
-#else
-   esp_deep_sleep(1000000ULL*2);   
-#endif
-}
-
-void iotConfig::saveAndReboot()
-{
-   updateRTCDATA();
-#ifdef ESP8266
-   ESP.rtcUserMemoryWrite(4, (uint32_t*)iot_rtc_data, IOT_RTC_DATA_SIZE);
-   ESP.restart();
-#endif
-   updateEEPROM();
-   EEPROM.commit();
+   if (headersDone || (!iotConfigMetricsClient.connected()) || timerExpired(iotTimerMetricsClient))
+   {
+      iotConfigMetricsClient.stop();
 #ifndef ESP8266
-   esp_deep_sleep(1000000ULL*2);   
+      iotConfigMetricsClient = NULL;
 #endif
+   }
 }
+#endif
 
 bool iotConfig::handle()
 {
-   iotConfigCurrentMillis = millis();
-   static unsigned long iotConfigReconnectTS = 0;
+   unsigned long handleStart = clockSourceUS();
+   uptimeMS();
+   uint32_t freeHeap = ESP.getFreeHeap();
+   if (freeHeap < minFreeHeap) { minFreeHeap = freeHeap; }
 
    if (!iotConfigUseWiFi) { return false; }
    
    switch(iotConfigMode)
    {
       case iotConfigClientMode:
+           if (iotConfigOnline != wasOnline)
+           {
+              wasOnline = iotConfigOnline;
+              if (iotConfigOnline)
+              {
+                 networkProfileConnected();
+              }
+           }
+#if IOTCONFIG_FEATURE_OTA
            if (otaInitialized)
            {        
               if (useOTA) {
+                 // starvation is accounted in onEnd/onError, the device restarts after onEnd
                  do {
                     ArduinoOTA.handle();
                  } while (iotConfigOtaPrio);
+#if IOTCONFIG_FEATURE_DELTA_OTA
+                 if (deltaOtaPort > 0)
+                 {
+                    handleDeltaOTA();
+                 }
+#endif
               }
            }
            else
@@ -514,57 +2665,126 @@ bool iotConfig::handle()
               if ((iotConfigOnline) && (!otaInitialized) && (useOTA))
               {
                  arduinoOTAsetup(friendlyName, otaPassword);
+#if IOTCONFIG_FEATURE_DELTA_OTA
+                 if (deltaOtaPort > 0)
+                 {
+                    iotConfigDeltaServer.begin(deltaOtaPort);
+                 }
+#endif
                  otaInitialized = true;
               }
            }
+#endif
+#if IOTCONFIG_FEATURE_MDNS
+           if ((mdnsPort > 0) && iotConfigOnline)
+           {
+              if (!mdnsStarted)
+              {
+                 startServiceAdvertisement();
+              }
+#ifdef ESP8266
+              else if (!(useOTA && otaInitialized))
+              {
+                 // ArduinoOTA.handle() runs the responder otherwise
+                 MDNS.update();
+              }
+#else
+              else if (timerExpired(iotTimerMdnsRefresh))
+              {
+                 refreshServiceTxt();
+              }
+#endif
+           }
+#endif
+#if IOTCONFIG_FEATURE_METRICS
+           if ((metricsPort > 0) && iotConfigOnline)
+           {
+              handleMetrics();
+           }
+#endif
+#if IOTCONFIG_FEATURE_PROVISIONING
+           // signed provisioning blobs also rotate the credentials of a running device
+           if ((provisionPort > 0) && iotConfigOnline)
+           {
+              if (!provisionUdpStarted)
+              {
+                 iotConfigProvisionUdp.begin(provisionPort);
+                 provisionUdpStarted = true;
+              }
+              handleBulkProvisioning();
+              if (iotConfigMode != iotConfigClientMode) { break; }
+           }
+#endif
            
-           if ((!iotConfigOnline) && (iotConfigCurrentMillis > iotConfigReconnectTS + watchDogTimeout/2 + WIFI_CONNECT_TIME))
+           if ((!iotConfigOnline) && timerExpired(iotTimerReconnect))
            {
-              iotConfigReconnectTS = iotConfigCurrentMillis;
               reconnect();
            }
            if ((!iotConfigOnline) && (watchDogTimeout > 0))
            {
-              if (iotConfigCurrentMillis > iotConfigWifiLossTS + watchDogTimeout)
+              if (timerExpired(iotTimerWatchdog))
               {
+                 rtc->watchdogReboots++;
                  reboot();
               }
            }
            break;
 
       case iotConfigServerMode:   
+#if IOTCONFIG_FEATURE_PORTAL
            iotConfigDnsServer.processNextRequest();
+#endif
+#if IOTCONFIG_FEATURE_PROVISIONING
+           if (provisionPort > 0)
+           {
+              handleBulkProvisioning();
+              if (iotConfigMode != iotConfigServerMode) { break; }
+           }
+#endif
 
-           if ((firstBoot) && (iotConfigCurrentMillis > apExpireTime) && (strlen(otaPassword)>0))
+           if ((rtc->firstBoot) && timerExpired(iotTimerApExpire) && (strlen(otaPassword)>0))
            {
               Serial.println("INFO: Change from AP mode to Client mode");
-              firstBoot = 0;
+              rtc->firstBoot = 0;
               WiFi.disconnect(true);
               WiFi.mode(WIFI_STA);
               reboot();
            }
                     
+#if IOTCONFIG_FEATURE_PORTAL
            if (iotConfigClient)
            {
-              firstBoot = 0;
-              if (iotConfigClient.connected() && (!closeConn || iotConfigClient.available()) && (iotConfigCurrentMillis < (clientConnectTime+clientTimeOut)))
+              rtc->firstBoot = 0;
+              if ((!closeConn) && iotConfigClient.connected() && timerExpired(iotTimerClientBudget))
               {
-                 if (iotConfigClient.available())
+                 // the budget is not extended by received bytes, unlike the idle timeout
+                 evictPortalClient(iotConfigResponseTimeout, &portalStats.evictedSlow);
+              }
+              else if (iotConfigClient.connected() && (!closeConn || iotConfigClient.available()) && (!timerExpired(iotTimerClient)))
+              {
+                 // a bounded number of bytes per call keeps handle() responsive
+                 for (int n=0; (n < IOT_PORTAL_BYTES_PER_HANDLE) && iotConfigClient.available(); n++)
                  {
-                    clientConnectTime = iotConfigCurrentMillis;
+                    timerStart(iotTimerClient, clientTimeOut);
                     char c = iotConfigClient.read();
+                    if (++clientBytes > IOT_CLIENT_MAX_BYTES)
+                    {
+                       evictPortalClient(iotConfigResponseTooLarge, &portalStats.evictedTooLarge);
+                       break;
+                    }
                     if (c == '\n') 
                     {
-                       if (currentLine.length() == 0)
+                       if (currentLineLen == 0)
                        {
+                          IOT_PROFILE(iotProfileRenderPage);
 #ifdef ESP8266
-                          String wpaTypes[] = { "", "", "WPA-PSK (TKIP)", "", "WPA-PSK (CCMP)", "WEP", "", "OPEN", "WPA-PSK (auto)", "*unsupported (WPA-enterprise)*" };
+                          static const char * const wpaTypes[] = { "", "", "WPA-PSK (TKIP)", "", "WPA-PSK (CCMP)", "WEP", "", "OPEN", "WPA-PSK (auto)", "*unsupported (WPA-enterprise)*" };
                           const int wpaTypesMax = 9;
 #else
-                          String wpaTypes[] = { "OPEN", "WEP", "WPA-PSK", "WPA2-PSK", "WPA/WPA2-PSK","WPA2-Enterprise", "*unsupported*" };
+                          static const char * const wpaTypes[] = { "OPEN", "WEP", "WPA-PSK", "WPA2-PSK", "WPA/WPA2-PSK","WPA2-Enterprise", "*unsupported*" };
                           const int wpaTypesMax = 6;
 #endif
-                          apExpireTime=iotConfigCurrentMillis + 60000;
+                          timerStart(iotTimerApExpire, 60000);
                           iotConfigClient.println("HTTP/1.1 200 OK");
                           iotConfigClient.println("Content-type:text/html");
                           iotConfigClient.println();
@@ -581,7 +2801,10 @@ bool iotConfig::handle()
                           iotConfigClient.print(friendlyName);
                           iotConfigClient.print(" device configuration</b><br>");
                           iotConfigClient.print("MAC-Address: ");
-                          iotConfigClient.print(WiFi.macAddress());
+                          uint8_t mac[6];
+                          WiFi.macAddress(mac);
+                          iotConfigClient.printf("%02X:%02X:%02X:%02X:%02X:%02X",
+                                                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
                           iotConfigClient.print("<br><br>");
                           switch(iotConfigServerState)
                           {
@@ -592,7 +2815,7 @@ bool iotConfig::handle()
                                   iotConfigClient.stop();
                                   
                                   // WiFi.scanNetworks will return the number of networks found
-                                  numScannedNetworks = WiFi.scanNetworks();
+                                  cacheScanResults(WiFi.scanNetworks());
                                   Serial.println("scan done");
                                   iotConfigServerState=iotConfigShowSSIDs;
                                   break;
@@ -615,11 +2838,11 @@ bool iotConfig::handle()
                                           iotConfigClient.print("<td><a href=\"/join/");
                                           iotConfigClient.print(i + 1);
                                           iotConfigClient.print("\">");
-                                          iotConfigClient.print(WiFi.SSID(i));
+                                          iotConfigClient.print(scanCache[i].ssid);
                                           iotConfigClient.print(" </a></td><td>");
-                                          iotConfigClient.print(WiFi.RSSI(i));
+                                          iotConfigClient.print(scanCache[i].rssi);
                                           iotConfigClient.print(" dB</td><td>");
-                                          iotConfigClient.println(wpaTypes[min(wpaTypesMax,WiFi.encryptionType(i))]);
+                                          iotConfigClient.println(wpaTypes[min(wpaTypesMax,scanCache[i].encryptionType)]);
                                           iotConfigClient.println("</td>");
                                           iotConfigClient.println("</tr>");
                                       }
@@ -631,10 +2854,10 @@ bool iotConfig::handle()
                                   
                              case iotConfigJoinForm:
                                   iotConfigClient.print("Logging into WiFi <b>");
-                                  iotConfigClient.print(WiFi.SSID(joinedNetworkIndex-1));
+                                  iotConfigClient.print(joinedNetwork.ssid);
                                   iotConfigClient.println("</b><br><br>");
                                   iotConfigClient.print("<form method=\"get\" onsubmit=\"javascript:document.location='/login.cgi' + $('pass') + '';\">");
-                                  switch (WiFi.encryptionType(joinedNetworkIndex-1))
+                                  switch (joinedNetwork.encryptionType)
                                   {
 #ifdef ESP8266
                                      case ENC_TYPE_WEP:
@@ -648,27 +2871,27 @@ bool iotConfig::handle()
                                      case WIFI_AUTH_WPA_WPA2_PSK:
 #endif
                                           iotConfigClient.print("WiFi PSK-Key: ");
-                                          iotConfigClient.print("<input type=\"password\" name=\"pass\" id=\"pass\" /><br>");
+                                          iotConfigClient.print("<input type=\"password\" name=\"pass\" id=\"pass\" maxlength=\"" IOT_STRINGIFY(IOT_PASSPHRASE_MAX) "\" /><br>");
                                           break;
-#ifndef ESP8266
+#if IOTCONFIG_FEATURE_WPA2_ENTERPRISE
                                      case WIFI_AUTH_WPA2_ENTERPRISE:
                                           iotConfigClient.print("WiFi EAP Identity: ");
-                                          iotConfigClient.print("<input type=\"text\" name=\"ident\" id=\"ident\" /><br>");
+                                          iotConfigClient.print("<input type=\"text\" name=\"ident\" id=\"ident\" maxlength=\"" IOT_STRINGIFY(IOT_IDENTITY_MAX) "\" /><br>");
                                           iotConfigClient.print("WiFi EAP Password: ");
-                                          iotConfigClient.print("<input type=\"password\" name=\"pass\" id=\"pass\" /><br>");
+                                          iotConfigClient.print("<input type=\"password\" name=\"pass\" id=\"pass\" maxlength=\"" IOT_STRINGIFY(IOT_PASSPHRASE_MAX) "\" /><br>");
 #endif
                                           break;
                                      default:
                                           break;
                                   }
                                   iotConfigClient.print("Friendly Name: ");
-                                  iotConfigClient.print("<input type=\"text\" name=\"fname\" id=\"fname\" /><br>");
+                                  iotConfigClient.print("<input type=\"text\" name=\"fname\" id=\"fname\" maxlength=\"" IOT_STRINGIFY(IOT_SSID_MAX) "\" /><br>");
                                   if (strlen(otaPassword) == 0)
                                   {
                                      iotConfigClient.print("New OTA-Password: ");
-                                     iotConfigClient.print("<input type=\"password\" name=\"ota\" id=\"ota\" /><br>");
+                                     iotConfigClient.print("<input type=\"password\" name=\"ota\" id=\"ota\" maxlength=\"" IOT_STRINGIFY(IOT_OTA_PASSWORD_MAX) "\" /><br>");
                                      iotConfigClient.print("repeat OTA-Password: ");
-                                     iotConfigClient.print("<input type=\"password\" name=\"otar\" id=\"otar\" /><br>");
+                                     iotConfigClient.print("<input type=\"password\" name=\"otar\" id=\"otar\" maxlength=\"" IOT_STRINGIFY(IOT_OTA_PASSWORD_MAX) "\" /><br>");
                                   }
                                   iotConfigClient.print("<input type=\"submit\" value=\"ok\"/></form>");
                                   break;
@@ -710,6 +2933,9 @@ bool iotConfig::handle()
                                      case iotConfigErrorWrongPassword:
                                           iotConfigClient.print("Wrong password - Access denied!");
                                           break;
+                                     case iotConfigErrorConnectFailed:
+                                          iotConfigClient.print("Could not connect to the selected network.");
+                                          break;
                                   }
                                   iotConfigClient.print("</font><br>");
                                   iotConfigServerState = iotConfigScanSSIDs;
@@ -722,31 +2948,70 @@ bool iotConfig::handle()
                           closeConn = true;
                           break;
                        } else {
-                          currentLine = "";
+                          currentLineLen = 0;
+                          currentLine[0] = 0;
+                          requestLineDone = true;
                        }
                     } else if (c != '\r')
                     {
-                       currentLine += c;
+                       if (currentLineLen >= sizeof(currentLine)-1)
+                       {
+                          if (requestLineDone)
+                          {
+                             evictPortalClient(iotConfigResponseTooLarge, &portalStats.evictedTooLarge);
+                          }
+                          else
+                          {
+                             evictPortalClient(iotConfigResponseUriTooLong, &portalStats.evictedOversize);
+                          }
+                          break;
+                       }
+                       currentLine[currentLineLen++] = c;
+                       currentLine[currentLineLen] = 0;
+                    }
+
+                    if ( iotConfigEndsWith(currentLine, currentLineLen, " HTTP") &&
+                         iotConfigIsProbe(currentLine)
+                       )
+                    {
+                       // answered from the request line, no scan and no page render
+                       timerStart(iotTimerApExpire, 60000);
+                       iotConfigClient.write((const uint8_t*)probeResponse, probeResponseLen);
+                       iotConfigClient.stop();
+#ifndef ESP8266
+                       iotConfigClient = NULL;
+#endif
+                       closeConn = false;
+                       currentLineLen = 0;
+                       currentLine[0] = 0;
+                       break;
                     }
 
-                    if ( currentLine.startsWith("GET /join/") &&
-                         currentLine.endsWith(" HTTP")
+                    if ( iotConfigStartsWith(currentLine, "GET /join/") &&
+                         iotConfigEndsWith(currentLine, currentLineLen, " HTTP")
                        )
                     {
-                       currentLine.remove(0,10);
-                       currentLine.remove(currentLine.length()-5,5);
-                       if (currentLine.length() > 6)
+                       currentLineLen -= 10 + 5;
+                       memmove(currentLine, &currentLine[10], currentLineLen);
+                       currentLine[currentLineLen] = 0;
+                       if ((currentLineLen > 6) && (joinedNetworkIndex > 0))
                        {
-                          String decodedUsernameString=queryToAscii(getQueryParam(currentLine,"ident"));
-                          String decodedPSKString=queryToAscii(getQueryParam(currentLine,"pass"));
-                          String decodedOTAString=queryToAscii(getQueryParam(currentLine,"ota"));
-                          String decodedOTARString=queryToAscii(getQueryParam(currentLine,"otar"));
-                          String decodedString=queryToAscii(getQueryParam(currentLine,"fname"));
+                          char decodedUsername[sizeof(wifiClientUsername)];
+                          char decodedPSK[sizeof(wifiClientPassword)];
+                          char decodedOTA[sizeof(otaPassword)];
+                          char decodedOTAR[sizeof(otaPassword)];
+                          char decodedName[sizeof(friendlyName)];
+                          getQueryParam(currentLine, "ident", decodedUsername, sizeof(decodedUsername));
+                          getQueryParam(currentLine, "pass", decodedPSK, sizeof(decodedPSK));
+                          getQueryParam(currentLine, "ota", decodedOTA, sizeof(decodedOTA));
+                          getQueryParam(currentLine, "otar", decodedOTAR, sizeof(decodedOTAR));
+                          getQueryParam(currentLine, "fname", decodedName, sizeof(decodedName));
+                          backupConfig();
                           iotConfigMode = iotConfigTestWiFi;
 
-                          if (decodedString.length() > 0)
+                          if (strlen(decodedName) > 0)
                           {
-                             strncpy(friendlyName, decodedString.c_str(), sizeof(friendlyName));
+                             strncpy(friendlyName, decodedName, sizeof(friendlyName));
                           }
                           else
                           {
@@ -757,7 +3022,7 @@ bool iotConfig::handle()
 
                           if ((strlen(otaPassword)==0) && (iotConfigMode == iotConfigTestWiFi))
                           {
-                             if (decodedOTAString != decodedOTARString)
+                             if (strcmp(decodedOTA, decodedOTAR) != 0)
                              {
                                 iotConfigServerState = iotConfigError;
                                 iotConfigErrorType = iotConfigErrorTypo;
@@ -765,7 +3030,7 @@ bool iotConfig::handle()
                              }
                              else
                              {
-                                strncpy(otaPassword, decodedOTAString.c_str(), sizeof(otaPassword));
+                                strncpy(otaPassword, decodedOTA, sizeof(otaPassword));
                              }
                           }
 
@@ -775,28 +3040,39 @@ bool iotConfig::handle()
                              memset((char*)wifiClientSSID, 0, sizeof(wifiClientSSID));
                              memset((char*)wifiClientUsername, 0, sizeof(wifiClientUsername));
                              memset((char*)wifiClientPassword, 0, sizeof(wifiClientPassword));
-                             strncpy(wifiClientSSID, WiFi.SSID(joinedNetworkIndex-1).c_str(), sizeof(wifiClientSSID));
-                             strncpy(wifiClientUsername, decodedUsernameString.c_str(), sizeof(wifiClientUsername));
-                             strncpy(wifiClientPassword, decodedPSKString.c_str(), sizeof(wifiClientPassword));
+                             strncpy(wifiClientSSID, joinedNetwork.ssid, sizeof(wifiClientSSID));
+                             strncpy(wifiClientUsername, decodedUsername, sizeof(wifiClientUsername));
+                             strncpy(wifiClientPassword, decodedPSK, sizeof(wifiClientPassword));
                           }
                        }
                        else
                        {
-                          joinedNetworkIndex=currentLine.toInt();
-                          iotConfigServerState=iotConfigJoinForm;
+                          joinedNetworkIndex=atoi(currentLine);
+                          if ((joinedNetworkIndex > 0) && (joinedNetworkIndex <= numScannedNetworks))
+                          {
+                             // a rescan may reorder scanCache before the form is submitted
+                             joinedNetwork = scanCache[joinedNetworkIndex-1];
+                             iotConfigServerState=iotConfigJoinForm;
+                          }
+                          else
+                          {
+                             joinedNetworkIndex=0;
+                             iotConfigServerState=iotConfigShowSSIDs;
+                          }
                        }
                     }
-                    if ( currentLine.startsWith("GET /reset") &&
-                         currentLine.endsWith(" HTTP")
+                    if ( iotConfigStartsWith(currentLine, "GET /reset") &&
+                         iotConfigEndsWith(currentLine, currentLineLen, " HTTP")
                        )
                     {
                        iotConfigServerState = iotConfigResetForm;
-                       currentLine.remove(currentLine.length()-5,5);
+                       currentLineLen -= 5;
+                       currentLine[currentLineLen] = 0;
 
-                       String decodedPassString=queryToAscii(getQueryParam(currentLine,"fdpass"));
-                       if (currentLine.indexOf("fdpass") >= 0)
+                       char decodedPass[sizeof(otaPassword)+1];
+                       if (getQueryParam(currentLine, "fdpass", decodedPass, sizeof(decodedPass)))
                        {
-                          if (strncmp(otaPassword, decodedPassString.c_str(), sizeof(otaPassword)) == 0)
+                          if (strncmp(otaPassword, decodedPass, sizeof(otaPassword)) == 0)
                           {
                              factoryReset();
                              reboot();
@@ -808,25 +3084,30 @@ bool iotConfig::handle()
                           }
                        }
                     }
-                    if ( currentLine.startsWith("GET /recovery") &&
-                         currentLine.endsWith(" HTTP")
+                    if ( iotConfigStartsWith(currentLine, "GET /recovery") &&
+                         iotConfigEndsWith(currentLine, currentLineLen, " HTTP")
                        )
                     {
                        iotConfigServerState = iotConfigRecoveryForm;
-                       currentLine.remove(currentLine.length()-5,5);
+                       currentLineLen -= 5;
+                       currentLine[currentLineLen] = 0;
 
-                       String decodedPassString=queryToAscii(getQueryParam(currentLine,"fdpass"));
-                       if (currentLine.indexOf("fdpass") >= 0)
+                       char decodedPass[sizeof(otaPassword)+1];
+                       if (getQueryParam(currentLine, "fdpass", decodedPass, sizeof(decodedPass)))
                        {
-                          if (strncmp(otaPassword, decodedPassString.c_str(), sizeof(otaPassword)) == 0)
+                          if (strncmp(otaPassword, decodedPass, sizeof(otaPassword)) == 0)
                           {
+#if IOTCONFIG_FEATURE_OTA
                              if (useOTA) {
-                                arduinoOTAsetup(String("recovery " + String(friendlyName)).c_str(), otaPassword);
+                                char recoveryName[sizeof(friendlyName)+10];
+                                snprintf(recoveryName, sizeof(recoveryName), "recovery %s", friendlyName);
+                                arduinoOTAsetup(recoveryName, otaPassword);
                                 while (1)
                                 {
                                    ArduinoOTA.handle();
                                 }
                              }
+#endif
                           }
                           else
                           {
@@ -835,12 +3116,21 @@ bool iotConfig::handle()
                           }
                        }
                     }
+
+                    if (iotConfigMode != iotConfigServerMode)
+                    {
+                       break;
+                    }
                  }
               }
               else
               {
+                 if ((!closeConn) && iotConfigClient.connected())
+                 {
+                    portalStats.evictedIdle++;
+                 }
                  Serial.println("Connection closed");
-                 clientConnectTime = iotConfigCurrentMillis;
+                 timerStart(iotTimerClient, clientTimeOut);
                  closeConn = false;
                  iotConfigClient.stop();
 #ifndef ESP8266
@@ -851,24 +3141,36 @@ bool iotConfig::handle()
            else
            {
               iotConfigClient = iotConfigServer.available();   // listen for incoming clients
-              currentLine = "";
-              clientConnectTime = iotConfigCurrentMillis;
+              currentLine[0] = 0;
+              currentLineLen = 0;
+              timerStart(iotTimerClient, clientTimeOut);
+              if (iotConfigClient)
+              {
+                 portalStats.connections++;
+                 clientBytes = 0;
+                 requestLineDone = false;
+                 timerStart(iotTimerClientBudget, IOT_CLIENT_BUDGET);
+              }
            }
+#endif
            break;
 
       case iotConfigTestWiFi:
-           firstBoot = 0;
+           rtc->firstBoot = 0;
+#if IOTCONFIG_FEATURE_PORTAL
            iotConfigServer.stop();
+           iotConfigDnsServer.stop();
+#endif
+#if IOTCONFIG_FEATURE_PROVISIONING
+           iotConfigProvisionUdp.stop();
+           provisionUdpStarted = false;
+#endif
+           // a staging network connection must not count as a successful test
+           iotConfigOnline = false;
            WiFi.mode(WIFI_STA);
            WiFi.enableAP(false);
            WiFi.enableSTA(true);
-#ifdef ESP8266
-           onStaGotIPHandler      = WiFi.onStationModeGotIP(onStaGotIP);
-           onStaDisconnectHandler = WiFi.onStationModeDisconnected(onStaDisconnect);
-           onApConnectedHandler   = WiFi.onSoftAPModeStationConnected(onApConnected);
-#else
-           WiFi.onEvent(iotConfigWiFiEvent);
-#endif
+           registerWiFiEvents();
            Serial.println();
            Serial.println();
            Serial.print("Connecting to ");
@@ -877,100 +3179,98 @@ bool iotConfig::handle()
            reconnect();
 
            iotConfigMode=iotConfigWiFiTestWaitConnect;
-           clientConnectTime = iotConfigCurrentMillis;
+           timerStart(iotTimerTestConnect, 15000);
            break;
 
       case iotConfigWiFiTestWaitConnect:
            if (iotConfigOnline)
            {
-              saveAndReboot();
-           } else if (iotConfigCurrentMillis > (clientConnectTime + 15000))
+              finishReconfiguration(true);
+           } else if (timerExpired(iotTimerTestConnect))
            {
-              reboot();
+              finishReconfiguration(false);
            }
            break;
       default:
            break;
    }
+   handleCommitScheduler();
+
+   uint32_t handleUS = clockSourceUS() - handleStart;
+   handleCalls++;
+   handleTotalUS += handleUS;
+   if (handleUS > handleMaxUS) { handleMaxUS = handleUS; }
    return isOnline();
 }
 
-String iotConfig::queryToAscii(String queryString)
+char *iotConfig::getFriendlyName()
 {
-   String decodedString="";
-   for (int i=0; i<queryString.length(); i++)
-   {
-      if (queryString[i]=='%')
-      {
-         char hexVal=strtol((queryString.substring(i+1,i+3)).c_str(), NULL, 16);
-         //Serial.print("hexVal=");
-         //Serial.println(hexVal);
-         decodedString=decodedString+hexVal;
-         i+=2;
-      }
-      else if (queryString[i]=='+')
-      {
-         decodedString=decodedString+" ";
-      }
-      else
-      {
-         decodedString=decodedString+queryString[i];
-      }
-   }
-   return decodedString;
+   return friendlyName;
 }
 
-String iotConfig::getQueryParam(String queryString, String paramName)
+char *iotConfig::getSSID()
 {
-   int qmIndex = queryString.indexOf("?");
-   if (qmIndex > -1)
+   if (activeProfile >= 0)
    {
-      queryString.remove(0, qmIndex+1);
+      return profiles[activeProfile].ssid;
    }
+   return wifiClientSSID;
+}
 
-   int lastIndex;
-   do {
-      lastIndex = queryString.indexOf("&");
-      String param;
-      if (lastIndex >= 0)
-      {
-         param = queryString.substring(0, lastIndex);
-         queryString.remove(0, lastIndex + 1);
-      }
-      else
-      {
-         param = queryString;
-      }
-      int eqIndex = param.indexOf("=");
-      if (eqIndex >= 0)
-      {
-         if (param.substring(0, eqIndex)==paramName)
-         {
-            return String(param.substring(eqIndex+1));
-         }
-      }
-   } while (lastIndex>=0);
-   return String();
+IPAddress iotConfig::getIP()
+{
+   return WiFi.localIP();
 }
 
-char *iotConfig::getFriendlyName()
+bool iotConfig::isOnline()
 {
-   return friendlyName;
+  return iotConfigOnline;
 }
 
-char *iotConfig::getSSID()
+portalStats_t iotConfig::getPortalStats()
 {
-   return wifiClientSSID;
+   return portalStats;
 }
 
-IPAddress iotConfig::getIP()
+otaStats_t iotConfig::getOTAStats()
 {
-   return WiFi.localIP();
+  return iotConfigOtaStats;
 }
 
-bool iotConfig::isOnline()
+footprint_t iotConfig::getFootprint()
 {
-  return iotConfigOnline;
+  footprint_t fp;
+
+  fp.staticRAM = sizeof(*this) + sizeof(*rtc);
+  fp.freeHeapAtBegin = freeHeapAtBegin;
+  fp.minFreeHeap = minFreeHeap;
+  fp.peakHeapUsed = (freeHeapAtBegin > minFreeHeap) ? freeHeapAtBegin - minFreeHeap : 0;
+  fp.sketchSize = ESP.getSketchSize();
+  return fp;
+}
+
+void iotConfig::printProfile()
+{
+  Serial.print("PROFILE {");
+#ifdef IOTCONFIG_PROFILE
+  for (int k=0; k<iotProfileKernels; k++)
+  {
+     Serial.printf("%s\"%s\":{\"calls\":%u,\"meanUs\":%u,\"maxUs\":%u}",
+                   (k > 0) ? "," : "", iotProfileNames[k], iotProfile[k].calls,
+                   (iotProfile[k].calls > 0) ? iotProfile[k].totalUS / iotProfile[k].calls : 0,
+                   iotProfile[k].maxUS);
+  }
+#endif
+  Serial.println("}");
+}
+
+void iotConfig::printFootprint()
+{
+  footprint_t fp = getFootprint();
+
+  Serial.printf("FOOTPRINT {\"staticRAM\":%u,\"freeHeapAtBegin\":%u,\"minFreeHeap\":%u,"
+                "\"peakHeapUsed\":%u,\"sketchSize\":%u}\n",
+                fp.staticRAM, fp.freeHeapAtBegin, fp.minFreeHeap, fp.peakHeapUsed, fp.sketchSize);
 }
 
 
@@ -978,6 +3278,18 @@ bool iotConfig::isOnline()
 
 
 
+size_t queryToAscii(const char *query, const size_t queryLen, char *decoded, const size_t decodedSize)
+{
+   IOT_PROFILE(iotProfileQueryToAscii);
+   return iotConfigQueryDecode(query, queryLen, decoded, decodedSize);
+}
+
+bool getQueryParam(const char *query, const char *paramName, char *value, const size_t valueSize)
+{
+   IOT_PROFILE(iotProfileGetQueryParam);
+   return iotConfigQueryParam(query, paramName, value, valueSize);
+}
+
 String queryToAscii(String queryString)
 {
    String decodedString="";
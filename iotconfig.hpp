@@ -1,7 +1,49 @@
 #ifndef IOTCONFIG_H
 #define IOTCONFIG_H IOTCONFIG_H
 
+// compile-time feature selection, set any of these to 0 to leave the code out
+#ifndef IOTCONFIG_FEATURE_OTA
+#define IOTCONFIG_FEATURE_OTA 1
+#endif
+#ifndef IOTCONFIG_FEATURE_DELTA_OTA
+#define IOTCONFIG_FEATURE_DELTA_OTA IOTCONFIG_FEATURE_OTA
+#endif
+#ifndef IOTCONFIG_FEATURE_PORTAL
+#define IOTCONFIG_FEATURE_PORTAL 1
+#endif
+#ifndef IOTCONFIG_FEATURE_PROVISIONING
+#define IOTCONFIG_FEATURE_PROVISIONING 1
+#endif
+#ifndef IOTCONFIG_FEATURE_WPA2_ENTERPRISE
+#define IOTCONFIG_FEATURE_WPA2_ENTERPRISE 1
+#endif
+#ifndef IOTCONFIG_FEATURE_MDNS
+#define IOTCONFIG_FEATURE_MDNS 1
+#endif
+#ifndef IOTCONFIG_FEATURE_METRICS
+#define IOTCONFIG_FEATURE_METRICS 1
+#endif
+#ifndef IOTCONFIG_FEATURE_SERIAL_PROVISIONING
+#define IOTCONFIG_FEATURE_SERIAL_PROVISIONING 1
+#endif
+// off by default, the warm boot snapshot reserves IOT_RTC_SNAPSHOT_SIZE bytes of RTC memory
+#ifndef IOTCONFIG_FEATURE_SNAPSHOT
+#define IOTCONFIG_FEATURE_SNAPSHOT 0
+#endif
+#ifdef ESP8266
+#undef IOTCONFIG_FEATURE_WPA2_ENTERPRISE
+#define IOTCONFIG_FEATURE_WPA2_ENTERPRISE 0
+#undef IOTCONFIG_FEATURE_SNAPSHOT
+#define IOTCONFIG_FEATURE_SNAPSHOT 0
+#endif
+
+#if IOTCONFIG_FEATURE_DELTA_OTA && !IOTCONFIG_FEATURE_OTA
+#error "IOTCONFIG_FEATURE_DELTA_OTA requires IOTCONFIG_FEATURE_OTA"
+#endif
+
+#if IOTCONFIG_FEATURE_PORTAL
 #include <DNSServer.h>
+#endif
 
 #ifdef ESP8266
 #include <ESP8266WiFi.h>
@@ -12,13 +54,88 @@
 #endif
 
 #include <WiFiUdp.h>
+#if IOTCONFIG_FEATURE_OTA
 #include <ArduinoOTA.h>
+#endif
 #include <EEPROM.h>
+#include "iotconfigtimer.h"
+#include "iotconfigquery.h"
+#include "iotconfigrecords.h"
+#include "iotconfigprovision.h"
+#include "iotconfigserial.h"
 
 #define IOT_RTC_DATA_SIZE 64
+#define IOT_RTC_SNAPSHOT_SIZE 2048
 #define WIFI_CONNECT_TIME 10000
+#define IOT_NETWORK_PROFILES 4
+#define IOT_SSID_MAX 32
+#define IOT_IDENTITY_MAX 64
+#define IOT_PASSPHRASE_MAX 64
+#define IOT_COMMIT_WINDOW 5000
+#define IOT_COMMIT_MAX_DEFER 4
+#define IOT_SCAN_CACHE_SIZE 20
+#define IOT_OTA_PASSWORD_MAX 31
+#define IOT_STRINGIFY_(x) #x
+#define IOT_STRINGIFY(x) IOT_STRINGIFY_(x)
+// the longest join request, every field at its maximum and every byte sent as "%XX"
+#define IOT_JOIN_REQUEST_TEMPLATE "GET /join/20?ident=&pass=&fname=&ota=&otar= HTTP/1.1"
+#define IOT_REQUEST_LINE_MAX (sizeof(IOT_JOIN_REQUEST_TEMPLATE) + \
+                              3*(IOT_IDENTITY_MAX+IOT_PASSPHRASE_MAX+IOT_SSID_MAX+2*IOT_OTA_PASSWORD_MAX))
+#define IOT_PROBE_RESPONSE_MAX 128
+#define IOT_CLIENT_BUDGET 5000
+#define IOT_CLIENT_MAX_BYTES 4096
+#define IOT_PORTAL_BYTES_PER_HANDLE 64
+#define IOT_SLEEP_SLICE 10
+#define IOT_PORTAL_POLL_INTERVAL 20
+#define IOT_IDLE_POLL_INTERVAL 250
+#define IOT_SCAN_POLL_INTERVAL 100
+#define IOT_MDNS_SERVICE "iotconfig"
+#define IOT_MDNS_TXT_REFRESH 60000
+#define IOT_METRICS_PORT 9100
+#define IOT_METRICS_BUFFER 1024
+#define IOT_METRICS_REQUEST_MAX 64
+#define IOT_METRICS_HEADER_MAX 128
+#define IOT_DELTA_OTA_PORT 3233
+#define IOT_DELTA_OTA_CHUNK 256
+#define IOT_DELTA_OTA_HEADER_SIZE 44
+#define IOT_DELTA_OTA_TIMEOUT 5000
+#define IOT_DELTA_OP_END 0x00
+#define IOT_DELTA_OP_COPY 0x01
+#define IOT_DELTA_OP_ADD 0x02
+#define IOT_DELTA_OP_RUN 0x03
 
-extern unsigned long iotConfigCurrentMillis;
+#define IOTCONFIG_PASTE_(a, b) a##b
+#define IOTCONFIG_PASTE(a, b) IOTCONFIG_PASTE_(a, b)
+
+// define IOTCONFIG_NO_HEAP to keep the variable bookkeeping in fixed arrays
+#ifdef IOTCONFIG_NO_HEAP
+#ifndef IOT_MAX_EEPROM_VARIABLES
+#define IOT_MAX_EEPROM_VARIABLES 16
+#endif
+#ifndef IOT_MAX_RTC_VARIABLES
+#define IOT_MAX_RTC_VARIABLES 8
+#endif
+#define IOTCONFIG_NO_HEAP_LAYOUT IOTCONFIG_PASTE(IOTCONFIG_PASTE(1_, IOT_MAX_EEPROM_VARIABLES), \
+                                                 IOTCONFIG_PASTE(_, IOT_MAX_RTC_VARIABLES))
+#else
+#define IOTCONFIG_NO_HEAP_LAYOUT 0
+#endif
+
+// The switches above change the layout of class iotConfig, so the sketch and
+// iotconfig.cpp have to be compiled with the same ones: set them as build flags
+// (or edit the defaults here), a #define in the sketch does not reach the library.
+// The constructor takes the address of a symbol named after the switches in
+// effect, iotconfig.cpp only defines its own, so a mismatch fails to link.
+#define IOTCONFIG_LAYOUT_TAG \
+   IOTCONFIG_PASTE(iotConfigLayout_, \
+   IOTCONFIG_PASTE(IOTCONFIG_PASTE(IOTCONFIG_PASTE(IOTCONFIG_FEATURE_OTA, IOTCONFIG_FEATURE_DELTA_OTA), \
+                                   IOTCONFIG_PASTE(IOTCONFIG_FEATURE_PORTAL, IOTCONFIG_FEATURE_PROVISIONING)), \
+   IOTCONFIG_PASTE(IOTCONFIG_PASTE(IOTCONFIG_PASTE(IOTCONFIG_FEATURE_WPA2_ENTERPRISE, IOTCONFIG_FEATURE_MDNS), \
+                                   IOTCONFIG_PASTE(IOTCONFIG_FEATURE_METRICS, IOTCONFIG_FEATURE_SERIAL_PROVISIONING)), \
+                   IOTCONFIG_PASTE(IOTCONFIG_PASTE(IOTCONFIG_FEATURE_SNAPSHOT, _), IOTCONFIG_NO_HEAP_LAYOUT))))
+extern const char IOTCONFIG_LAYOUT_TAG;
+
+// define IOTCONFIG_PROFILE to time the library's hot paths, see printProfile()
 
 typedef struct
 {
@@ -27,28 +144,153 @@ typedef struct
   size_t allocSize;
 } memAllocation_t;
 
+// state that has to survive deep sleep, kept in RTC memory by default
+typedef struct
+{
+  uint8_t data[IOT_RTC_DATA_SIZE] __attribute__((aligned(4)));
+  uint8_t firstBoot;
+  uint32_t watchdogReboots;
+#if IOTCONFIG_FEATURE_SNAPSHOT
+  uint32_t snapshotValid;
+  uint32_t snapshotSize;
+  uint32_t snapshotCRC;      // over snapshot[4..snapshotSize), the EEPROM CRC word excluded
+  uint8_t snapshot[IOT_RTC_SNAPSHOT_SIZE];
+#endif
+} iotConfigRTC_t;
+
+typedef struct
+{
+  uint32_t attempts;
+  uint32_t failures;
+  uint32_t bytes;
+  uint32_t chunks;
+  uint32_t durationMS;
+  uint32_t maxChunkLatencyMS;
+  uint32_t progressPrintUS;
+  uint32_t loopStarvedMS;
+  uint32_t maxLoopStarvedMS;
+} otaStats_t;
+
+typedef struct
+{
+  uint32_t commits;
+  uint32_t commitsAvoided;
+  uint32_t lastLatencyUS;
+  uint32_t maxLatencyUS;
+  uint32_t totalLatencyUS;
+} commitStats_t;
+
+typedef struct
+{
+  uint32_t staticRAM;
+  uint32_t freeHeapAtBegin;
+  uint32_t minFreeHeap;
+  uint32_t peakHeapUsed;
+  uint32_t sketchSize;
+} footprint_t;
+
+typedef struct
+{
+  uint32_t connections;
+  uint32_t evictedIdle;      // no byte received for clientTimeOut ms
+  uint32_t evictedSlow;      // request not complete within IOT_CLIENT_BUDGET ms
+  uint32_t evictedOversize;  // request line longer than IOT_REQUEST_LINE_MAX
+  uint32_t evictedTooLarge;  // header line too long or more than IOT_CLIENT_MAX_BYTES
+} portalStats_t;
+
+typedef struct
+{
+  char ssid[IOT_SSID_MAX+1];
+  char username[IOT_IDENTITY_MAX+1];
+  char password[IOT_PASSPHRASE_MAX+1];
+  uint32_t lastSuccess;      // sequence number of the last successful connect, 0 = never
+  uint16_t avgConnectTime;   // ms, moving average
+  uint8_t failures;          // failed attempts since the last success
+  uint8_t reserved;
+} networkProfile_t;
+
+// library timeouts, checked with wrap-safe (now - start >= interval) arithmetic
+typedef enum
+{
+  iotTimerReconnect,
+  iotTimerWatchdog,
+  iotTimerApExpire,
+  iotTimerClient,
+  iotTimerClientBudget,
+  iotTimerTestConnect,
+  iotTimerCommit,
+  iotTimerCommitCheck,
+  iotTimerMdnsRefresh,
+  iotTimerMetricsClient,
+  iotTimerCount
+} iotConfigTimerId_t;
+
+typedef struct
+{
+  char ssid[33];
+  int32_t rssi;
+  uint8_t encryptionType;
+} scanEntry_t;
+
+// configuration in effect before a reconfiguration, restored if the new one fails
+typedef struct
+{
+  char friendlyName[IOT_SSID_MAX+1];
+  char ssid[IOT_SSID_MAX+1];
+  char username[IOT_IDENTITY_MAX+1];
+  char password[IOT_PASSPHRASE_MAX+1];
+  char otaPassword[IOT_OTA_PASSWORD_MAX+1];
+} configBackup_t;
+
 String queryToAscii(String queryString);
 String getQueryParam(String queryString, String paramName);
+size_t queryToAscii(const char *query, const size_t queryLen, char *decoded, const size_t decodedSize);
+bool getQueryParam(const char *query, const char *paramName, char *value, const size_t valueSize);
 
 class iotConfig
 {
    public:
-      iotConfig();
+      // all state is kept per instance, the RTC context defaults to iotConfigDefaultRTC
+      // layoutTag is only there to check the feature switches at link time, leave it out
+      // clock and clockUS replace millis() and micros() as the library's time sources
+      iotConfig(iotConfigRTC_t *rtcContext = NULL, iotConfigClock_t clock = NULL, iotConfigClock_t clockUS = NULL,
+                const char *layoutTag = &IOTCONFIG_LAYOUT_TAG);
       ~iotConfig();
       bool begin(const char *deviceName, const char *initialPasswordN,
                  const size_t eepromSizeN, const size_t rtcDataSizeN, const uint16_t coldBootAPtime, bool enableOTA = true);
       void setWiFiClientWatchDogTimeout(const uint32_t timeoutMS);
+      void enableBulkProvisioning(const uint16_t port = IOT_PROVISION_PORT,
+                                  const char *stagingSSID = NULL, const char *stagingPassword = NULL);
+      void enableDeltaOTA(const uint16_t port = IOT_DELTA_OTA_PORT);
+      void enableWarmBootSnapshot(const bool enable = true);
+      void enableMetrics(const uint16_t port = IOT_METRICS_PORT);
+      void enableSerialProvisioning(const uint32_t windowMS, const int forcePin = -1);
+      void enableServiceAdvertisement(const uint16_t port = 80, const char *firmwareVersion = NULL,
+                                      const char *service = IOT_MDNS_SERVICE);
       void recoveryChanceWait();
       bool assignVariableEEPROM(uint8_t *pointer, const size_t varSize);
       bool assignVariableRTCDATA(uint8_t *pointer, const size_t varSize);
       void factoryReset();
       void updateEEPROM();
+      void markDirty();
+      void flush();
+      void setCommitWindow(const uint32_t windowMS, const bool autoDetect = false);
+      commitStats_t getCommitStats();
       void updateRTCDATA();
       void reboot();
       void saveAndReboot();
       void reconnect();
+      bool addNetworkProfile(const char *ssid, const char *username, const char *password);
+      bool reconfigure(const char *ssid, const char *username, const char *password, const char *authPassword);
       bool handle();
+      uint32_t nextDeadline();
+      void sleepUntilDeadline(const uint32_t maxMS = 1000);
       bool isOnline();
+      otaStats_t getOTAStats();
+      portalStats_t getPortalStats();
+      footprint_t getFootprint();
+      void printFootprint();
+      void printProfile();
       char *getFriendlyName();
       char *getSSID();
       IPAddress getIP();
@@ -56,35 +298,207 @@ class iotConfig
    private:
       bool addVariableInfo(memAllocation_t **store,
                            int *indexPtr,
+                           int *capacityPtr,
                            memAllocation_t *info);
-      uint32_t calcCRC();
-      String queryToAscii(String queryString);
-      String getQueryParam(String queryString, String paramName);
+      uint32_t calcCRC(const uint8_t *data = NULL);
+      char *configField(const uint8_t id, size_t *fieldSize);
+      void configFields(iotConfigRecordField_t *fields);
+      bool loadConfigRecords();
+      void writeConfigRecords();
+      bool upgradeLegacyConfig(const size_t userSize);
+      void beginEEPROM();
+      void commitEEPROM();
+      void scheduleCommit();
+      bool variablesChanged();
+      void handleCommitScheduler();
+      bool wakeRequested();
+#if IOTCONFIG_FEATURE_MDNS
+      void startServiceAdvertisement();
+      void refreshServiceTxt();
+#endif
+#if IOTCONFIG_FEATURE_METRICS
+      void handleMetrics();
+      size_t renderMetrics(const bool json);
+#endif
+#if IOTCONFIG_FEATURE_SERIAL_PROVISIONING
+      void serialProvisioning();
+      bool serialProvisioningAllowed();
+      uint8_t serialProvisioningCommand(const uint8_t cmd, const uint8_t *payload, const uint8_t len,
+                                        uint8_t *reply, uint8_t *replyLen);
+      void serialProvisioningReply(const uint8_t status, const uint8_t *payload, const uint8_t len);
+#endif
+      void timerStart(const iotConfigTimerId_t id, const unsigned long interval);
+      void timerStop(const iotConfigTimerId_t id);
+      bool timerExpired(const iotConfigTimerId_t id);
+      unsigned long timerElapsed(const iotConfigTimerId_t id);
+      uint32_t timerRemaining(const iotConfigTimerId_t id);
+      uint64_t uptimeMS();
+      uint8_t readNV(const size_t index);
+      bool restoreSnapshot();
+      void takeSnapshot();
       void arduinoOTAsetup(const char *friendlyName, const char *otaPassword);
+      void finishOTAStats();
+      void printOTAStats();
+      void registerWiFiEvents();
+      void onStaGotIP();
+      void onStaDisconnect();
+      void onApConnected();
+#if IOTCONFIG_FEATURE_PORTAL
+      void cacheScanResults(const int found);
+      void evictPortalClient(const char *response, uint32_t *counter);
+#endif
+      bool selectNetworkProfile();
+#if IOTCONFIG_FEATURE_MDNS || IOTCONFIG_FEATURE_DELTA_OTA
+      const char *getSketchMD5();
+#endif
+      void networkProfileConnected();
+      void loadNetworkProfiles();
+      void writeNetworkProfiles();
+      void startAccessPoint();
+      void stopPowerSave();
+      void backupConfig();
+      void restoreConfig();
+      void startReconfiguration();
+      void finishReconfiguration(const bool success);
+#if IOTCONFIG_FEATURE_DELTA_OTA
+      void handleDeltaOTA();
+      bool applyDeltaOTA(WiFiClient &client);
+#endif
+#if IOTCONFIG_FEATURE_PROVISIONING
+      void handleBulkProvisioning();
+      uint8_t applyProvisioningBlob(const uint8_t *blob, const size_t blobSize);
+#endif
+
+#if IOTCONFIG_FEATURE_PORTAL
+      DNSServer iotConfigDnsServer;
+      WiFiServer iotConfigServer;
+      WiFiClient iotConfigClient;
+#endif
+#if IOTCONFIG_FEATURE_PROVISIONING
+      WiFiUDP iotConfigProvisionUdp;
+#endif
+#if IOTCONFIG_FEATURE_DELTA_OTA
+      WiFiServer iotConfigDeltaServer;
+#endif
+#if IOTCONFIG_FEATURE_METRICS
+      WiFiServer iotConfigMetricsServer;
+      WiFiClient iotConfigMetricsClient;
+#endif
+      IPAddress apIP;
+      iotConfigRTC_t *rtc;
+#ifdef ESP8266
+      WiFiEventHandler onStaGotIPHandler;
+      WiFiEventHandler onStaDisconnectHandler;
+      WiFiEventHandler onApConnectedHandler;
+#else
+      wifi_event_id_t wifiEventId;
+#endif
+      bool wifiEventsRegistered;
+      bool iotConfigUseWiFi;
+      bool useOTA;
+      bool iotConfigOnline;
+      bool iotConfigResetState;
+      bool iotConfigOtaPrio;
+      bool factoryResetted;
+      iotConfigClock_t clockSource;
+      iotConfigClock_t clockSourceUS;
+      iotConfigUptime_t uptime;
+      iotConfigTimer_t timers[iotTimerCount];
+      otaStats_t iotConfigOtaStats;
+      unsigned long iotConfigOtaStartTS;
+      unsigned long iotConfigOtaChunkTS;
+      unsigned int iotConfigOtaPercent;
 
       enum {iotConfigNoneMode, iotConfigServerMode, iotConfigClientMode, iotConfigTestWiFi, iotConfigWiFiTestWaitConnect} iotConfigMode;
       enum {iotConfigScanSSIDs, iotConfigShowSSIDs, iotConfigJoinForm, iotConfigResetForm, iotConfigRecoveryForm, iotConfigError} iotConfigServerState;
-      enum {iotConfigErrorTypo, iotConfigErrorNoName, iotConfigErrorWrongPassword} iotConfigErrorType;
+      enum {iotConfigErrorTypo, iotConfigErrorNoName, iotConfigErrorWrongPassword, iotConfigErrorConnectFailed} iotConfigErrorType;
       int numScannedNetworks;
+#if IOTCONFIG_FEATURE_PORTAL
+      scanEntry_t scanCache[IOT_SCAN_CACHE_SIZE];
+      scanEntry_t joinedNetwork;
+#endif
       int joinedNetworkIndex;
 
-      char friendlyName[32];
-      char wifiApPassword[32];
-      char wifiClientSSID[32];
-      char wifiClientUsername[32];
-      char wifiClientPassword[32];
-      char otaPassword[32];
-      unsigned long clientConnectTime;
+      char friendlyName[IOT_SSID_MAX+1];
+      char wifiApPassword[IOT_PASSPHRASE_MAX+1];
+      char wifiClientSSID[IOT_SSID_MAX+1];
+      char wifiClientUsername[IOT_IDENTITY_MAX+1];
+      char wifiClientPassword[IOT_PASSPHRASE_MAX+1];
+      char otaPassword[IOT_OTA_PASSWORD_MAX+1];
+      networkProfile_t profiles[IOT_NETWORK_PROFILES];
+      uint32_t profileSequence;
+      int activeProfile;
+      int reconnectAttempts;
+      bool profileScanRunning;
+      unsigned long connectStartTS;
+      bool wasOnline;
+      configBackup_t configBackup;
+      bool reconfigureFromClient;
+      bool provisionUdpStarted;
+      uint32_t provisionSequence;
+      bool provisionSequenceDirty;
+      commitStats_t commitStats;
+      uint32_t commitWindow;
+      bool commitAutoDetect;
+      bool commitPending;
+      bool variablesDirty;
       bool closeConn;
       unsigned long clientTimeOut;
-      unsigned long apExpireTime;
       unsigned long watchDogTimeout;
       bool otaInitialized;
-      String currentLine;
+      bool sleepModeSet;
+#if IOTCONFIG_FEATURE_PORTAL
+      char currentLine[IOT_REQUEST_LINE_MAX];
+      size_t currentLineLen;
+      size_t clientBytes;
+      bool requestLineDone;
+      char probeResponse[IOT_PROBE_RESPONSE_MAX];
+      int probeResponseLen;
+#endif
+      portalStats_t portalStats;
+      uint32_t freeHeapAtBegin;
+      uint32_t minFreeHeap;
+      uint16_t provisionPort;
+#if IOTCONFIG_FEATURE_PROVISIONING
+      char provisionStagingSSID[32];
+      char provisionStagingPassword[64];
+#endif
+      uint16_t deltaOtaPort;
+      uint16_t mdnsPort;
+      uint16_t metricsPort;
+      uint32_t serialProvisionWindow;
+      int serialProvisionPin;
+#if IOTCONFIG_FEATURE_METRICS
+      bool metricsStarted;
+      bool metricsFirstLine;
+      size_t metricsLineLen;
+      char metricsRequestLine[IOT_METRICS_REQUEST_MAX];
+      char metricsBuffer[IOT_METRICS_BUFFER];
+#endif
+      uint32_t reconnectCount;
+      uint32_t handleCalls;
+      uint32_t handleMaxUS;
+      uint64_t handleTotalUS;
+#if IOTCONFIG_FEATURE_MDNS || IOTCONFIG_FEATURE_DELTA_OTA
+      char sketchMD5[33];
+#endif
+#if IOTCONFIG_FEATURE_MDNS
+      bool mdnsStarted;
+      char mdnsService[16];
+      char mdnsFirmware[32];
+#ifdef ESP8266
+      MDNSResponder::hMDNSService mdnsServiceHandle;
+#endif
+#endif
+      bool useSnapshot;
+      bool warmBoot;
+      bool eepromStarted;
 
       uint16_t bootUps;
       uint32_t eepromCRC;
       size_t eepromSize;
+      size_t configStart;
+      size_t eepromTotalSize;
       size_t eepromAssignPointer;
       size_t rtcDataSize;
       size_t rtcDataAssignPointer;
@@ -93,6 +507,12 @@ class iotConfig
       memAllocation_t *rtcAllocData;
       int eepromDataIndex;
       int rtcDataIndex;
+      int eepromAllocCapacity;
+      int rtcAllocCapacity;
+#ifdef IOTCONFIG_NO_HEAP
+      memAllocation_t eepromAllocStore[IOT_MAX_EEPROM_VARIABLES];
+      memAllocation_t rtcAllocStore[IOT_MAX_RTC_VARIABLES];
+#endif
 };
 
 #endif
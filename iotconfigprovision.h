@@ -0,0 +1,128 @@
+#ifndef IOTCONFIGPROVISION_H
+#define IOTCONFIGPROVISION_H IOTCONFIGPROVISION_H
+
+// bulk provisioning blob and ack, kept free of Arduino headers so senders and tests can use it on a host
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#define IOT_PROVISION_PORT 4210
+#define IOT_PROVISION_BLOB_MAX 320
+#define IOT_PROVISION_HEADER_SIZE 10
+#define IOT_PROVISION_HMAC_SIZE 32
+#define IOT_PROVISION_FIELDS 5
+#define IOT_PROVISION_ACK_SIZE 12
+#define IOT_PROVISION_ACK_OK 0
+#define IOT_PROVISION_ACK_BAD_FORMAT 1
+#define IOT_PROVISION_ACK_BAD_SIGNATURE 2
+#define IOT_PROVISION_ACK_REPLAY 3
+
+/*
+ * Blob layout: "IOTP", version (2), flags (0), sequence number (LE32, has
+ * to be higher than the last accepted one), then five length-prefixed
+ * strings (SSID, EAP identity, password, friendly name pattern, OTA password)
+ * followed by a HMAC-SHA256 over everything before it. The HMAC key is the
+ * OTA password, or the initial admin password while in delivery state.
+ */
+typedef struct
+{
+   uint32_t sequence;
+   const uint8_t *field[IOT_PROVISION_FIELDS];
+   uint8_t fieldLen[IOT_PROVISION_FIELDS];
+   size_t payloadLen;           // bytes covered by the HMAC, which follows them
+} iotConfigProvisionBlob_t;
+
+static inline uint32_t iotConfigLE32(const uint8_t *buf)
+{
+   return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+// checks the framing, fieldMax[f] includes the terminating zero; the HMAC is left to the caller
+static inline uint8_t iotConfigProvisionParse(const uint8_t *blob, const size_t blobSize, const size_t *fieldMax,
+                                              iotConfigProvisionBlob_t *parsed)
+{
+   size_t pos = IOT_PROVISION_HEADER_SIZE;
+
+   if ((blobSize < pos + IOT_PROVISION_HMAC_SIZE) || (blobSize > IOT_PROVISION_BLOB_MAX) ||
+       (memcmp(blob, "IOTP", 4) != 0) || (blob[4] != 2))
+   {
+      return IOT_PROVISION_ACK_BAD_FORMAT;
+   }
+   parsed->sequence = iotConfigLE32(&blob[6]);
+   parsed->payloadLen = blobSize - IOT_PROVISION_HMAC_SIZE;
+   for (int f=0; f<IOT_PROVISION_FIELDS; f++)
+   {
+      if (pos >= parsed->payloadLen) { return IOT_PROVISION_ACK_BAD_FORMAT; }
+      parsed->fieldLen[f] = blob[pos++];
+      if ((pos + parsed->fieldLen[f] > parsed->payloadLen) || (parsed->fieldLen[f] >= fieldMax[f]))
+      {
+         return IOT_PROVISION_ACK_BAD_FORMAT;
+      }
+      parsed->field[f] = &blob[pos];
+      pos += parsed->fieldLen[f];
+   }
+   return (pos == parsed->payloadLen) ? IOT_PROVISION_ACK_OK : IOT_PROVISION_ACK_BAD_FORMAT;
+}
+
+// writes header and fields, returns the payload length to sign (the HMAC goes right after it), 0 if it does not fit
+static inline size_t iotConfigProvisionBuild(uint8_t *blob, const size_t blobSize, const uint32_t sequence,
+                                             const char * const *fields)
+{
+   size_t pos = IOT_PROVISION_HEADER_SIZE;
+
+   if (blobSize < pos + IOT_PROVISION_HMAC_SIZE) { return 0; }
+   memcpy(blob, "IOTP", 4);
+   blob[4] = 2;
+   blob[5] = 0;
+   for (int i=0; i<4; i++) { blob[6+i] = (uint8_t)(sequence >> (8*i)); }
+   for (int f=0; f<IOT_PROVISION_FIELDS; f++)
+   {
+      size_t len = strlen(fields[f]);
+      if ((len > 0xff) || (pos + 1 + len + IOT_PROVISION_HMAC_SIZE > blobSize)) { return 0; }
+      blob[pos++] = (uint8_t)len;
+      memcpy(&blob[pos], fields[f], len);
+      pos += len;
+   }
+   return pos;
+}
+
+// ack: "IOTA", version, status, station MAC
+static inline void iotConfigProvisionAck(uint8_t *ack, const uint8_t status, const uint8_t *mac)
+{
+   memcpy(ack, "IOTA", 4);
+   ack[4] = 2;
+   ack[5] = status;
+   memcpy(&ack[6], mac, 6);
+}
+
+// "%m" expands to the last three, "%M" to all six bytes of the MAC in hex
+static inline void iotConfigExpandNamePattern(const char *pattern, const size_t patternLen, const uint8_t *mac,
+                                              char *name, const size_t nameSize)
+{
+   char hexMac[13];
+   size_t out = 0;
+
+   snprintf(hexMac, sizeof(hexMac), "%02X%02X%02X%02X%02X%02X",
+            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+   memset(name, 0, nameSize);
+   for (size_t i=0; (i<patternLen) && (out<nameSize-1); i++)
+   {
+      if ((pattern[i] == '%') && (i+1 < patternLen) && ((pattern[i+1] == 'm') || (pattern[i+1] == 'M')))
+      {
+         const char *src = (pattern[i+1] == 'm') ? &hexMac[6] : hexMac;
+         while (*src && (out<nameSize-1))
+         {
+            name[out++] = *src++;
+         }
+         i++;
+      }
+      else
+      {
+         name[out++] = pattern[i];
+      }
+   }
+}
+
+#endif
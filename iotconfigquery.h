@@ -0,0 +1,66 @@
+#ifndef IOTCONFIGQUERY_H
+#define IOTCONFIGQUERY_H IOTCONFIGQUERY_H
+
+// URL query decoding of the portal, kept free of Arduino headers so it can be tested on a host
+
+#include <stddef.h>
+#include <string.h>
+
+static inline int iotConfigHexNibble(const char c)
+{
+   if ((c >= '0') && (c <= '9')) return c - '0';
+   if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+   if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+   return -1;
+}
+
+// decodes "%XX" and '+' into at most decodedSize-1 bytes plus a 0, returns the decoded length
+static inline size_t iotConfigQueryDecode(const char *query, const size_t queryLen, char *decoded, const size_t decodedSize)
+{
+   size_t out=0;
+
+   if (decodedSize == 0) { return 0; }
+   for (size_t i=0; (i<queryLen) && (out<decodedSize-1); i++)
+   {
+      if ((query[i]=='%') && (i+2<queryLen) &&
+          (iotConfigHexNibble(query[i+1]) >= 0) && (iotConfigHexNibble(query[i+2]) >= 0))
+      {
+         decoded[out++]=(iotConfigHexNibble(query[i+1]) << 4) | iotConfigHexNibble(query[i+2]);
+         i+=2;
+      }
+      else if (query[i]=='+')
+      {
+         decoded[out++]=' ';
+      }
+      else
+      {
+         decoded[out++]=query[i];
+      }
+   }
+   decoded[out]=0;
+   return out;
+}
+
+// decoded value of paramName from the part after '?' (or all of query), false if it is missing
+static inline bool iotConfigQueryParam(const char *query, const char *paramName, char *value, const size_t valueSize)
+{
+   const char *qm = strchr(query, '?');
+   size_t nameLen = strlen(paramName);
+
+   if (valueSize > 0) { value[0]=0; }
+   if (qm) { query = qm+1; }
+   while (*query)
+   {
+      const char *end = strchr(query, '&');
+      if (!end) { end = query + strlen(query); }
+      if (((size_t)(end-query) > nameLen) && (strncmp(query, paramName, nameLen) == 0) && (query[nameLen] == '='))
+      {
+         iotConfigQueryDecode(&query[nameLen+1], end-query-nameLen-1, value, valueSize);
+         return true;
+      }
+      query = (*end) ? end+1 : end;
+   }
+   return false;
+}
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef IOTCONFIGRECORDS_H
+#define IOTCONFIGRECORDS_H IOTCONFIGRECORDS_H
+
+// encoding of the EEPROM store, kept free of Arduino headers so it can be tested on a host
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define IOT_CONFIG_FORMAT 0xC1
+#define IOT_CONFIG_HEADER_SIZE 4
+#define IOT_CONFIG_RECORD_OVERHEAD 2
+#define IOT_LEGACY_FIELD_SIZE 32
+#define IOT_FIELD_FRIENDLY_NAME 1
+#define IOT_FIELD_AP_PASSWORD 2
+#define IOT_FIELD_SSID 3
+#define IOT_FIELD_USERNAME 4
+#define IOT_FIELD_PASSWORD 5
+#define IOT_FIELD_OTA_PASSWORD 6
+#define IOT_RECORD_PROVISION_SEQUENCE 7
+#define IOT_CONFIG_FIELDS (IOT_FIELD_OTA_PASSWORD-IOT_FIELD_FRIENDLY_NAME+1)
+
+// a zero terminated field, fields[id-IOT_FIELD_FRIENDLY_NAME] in the functions below
+typedef struct
+{
+   char *value;
+   size_t size;                 // including the terminating zero
+} iotConfigRecordField_t;
+
+typedef enum
+{
+   iotConfigRecordsOk,
+   iotConfigRecordsNoFormat,    // no record header, or a length beyond the area
+   iotConfigRecordsTruncated    // a record runs past the length, the fields before it are kept
+} iotConfigRecordsResult_t;
+
+// CRC over two consecutive buffers, in the same (non-standard) variant as the EEPROM store;
+// 32 bit arithmetic, so a host with a 64 bit long computes what the device does
+static inline uint32_t iotConfigCRC(const uint8_t *data, const size_t len, const uint8_t *data2, const size_t len2)
+{
+   const uint32_t crc_table[16] = {
+     0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+     0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+     0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+     0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+   };
+
+   uint32_t crc = ~0U;
+
+   for (size_t index = 0 ; index < len+len2 ; index++)
+   {
+     uint8_t readByte = (index < len) ? data[index] : data2[index-len];
+     crc = crc_table[(crc ^ readByte) & 0x0f] ^ (crc >> 4);
+     crc = crc_table[(crc ^ (readByte >> 4)) & 0x0f] ^ (crc >> 4);
+     crc = ~crc;
+   }
+   return crc;
+}
+
+/*
+ * Header: format byte, reserved byte, length (LE16) of the records. The
+ * records follow the user variables: IOT_FIELD_* id, value length, value
+ * (no terminating zero), one per non-empty field.
+ */
+static inline bool iotConfigRecordsLength(const uint8_t *header, const size_t areaSize, size_t *length)
+{
+   *length = header[2] | (header[3] << 8);
+   return (header[0] == IOT_CONFIG_FORMAT) && (*length <= areaSize);
+}
+
+static inline void iotConfigRecordsSetHeader(uint8_t *header, const size_t length)
+{
+   header[0] = IOT_CONFIG_FORMAT;
+   header[1] = 0;
+   header[2] = length & 0xff;
+   header[3] = length >> 8;
+}
+
+// clears the fields and sequence, then fills them; unknown ids and values too long for their field are skipped
+static inline iotConfigRecordsResult_t iotConfigRecordsDecode(const uint8_t *header, const uint8_t *records, const size_t areaSize,
+                                                              const iotConfigRecordField_t *fields, uint32_t *sequence)
+{
+   size_t length;
+   size_t pos = 0;
+
+   for (int f=0; f<IOT_CONFIG_FIELDS; f++)
+   {
+      memset(fields[f].value, 0, fields[f].size);
+   }
+   *sequence = 0;
+   if (!iotConfigRecordsLength(header, areaSize, &length))
+   {
+      return iotConfigRecordsNoFormat;
+   }
+   while (pos + IOT_CONFIG_RECORD_OVERHEAD <= length)
+   {
+      uint8_t id = records[pos];
+      uint8_t valueLen = records[pos+1];
+      pos += IOT_CONFIG_RECORD_OVERHEAD;
+      if (pos + valueLen > length)
+      {
+         return iotConfigRecordsTruncated;
+      }
+      if ((id >= IOT_FIELD_FRIENDLY_NAME) && (id <= IOT_FIELD_OTA_PASSWORD))
+      {
+         const iotConfigRecordField_t *field = &fields[id-IOT_FIELD_FRIENDLY_NAME];
+         if (valueLen < field->size)
+         {
+            memcpy(field->value, &records[pos], valueLen);
+         }
+      }
+      else if ((id == IOT_RECORD_PROVISION_SEQUENCE) && (valueLen == sizeof(*sequence)))
+      {
+         for (size_t i=0; i<valueLen; i++)
+         {
+            *sequence |= (uint32_t)records[pos+i] << (8*i);
+         }
+      }
+      pos += valueLen;
+   }
+   return iotConfigRecordsOk;
+}
+
+// writes the records and the header, false if they do not fit areaSize
+static inline bool iotConfigRecordsEncode(uint8_t *header, uint8_t *records, const size_t areaSize,
+                                          const iotConfigRecordField_t *fields, const uint32_t sequence)
+{
+   size_t pos = 0;
+
+   for (int f=0; f<IOT_CONFIG_FIELDS; f++)
+   {
+      size_t valueLen = strnlen(fields[f].value, fields[f].size-1);
+      if (valueLen == 0) { continue; }
+      if ((valueLen > 0xff) || (pos + IOT_CONFIG_RECORD_OVERHEAD + valueLen > areaSize)) { return false; }
+      records[pos++] = IOT_FIELD_FRIENDLY_NAME + f;
+      records[pos++] = valueLen;
+      memcpy(&records[pos], fields[f].value, valueLen);
+      pos += valueLen;
+   }
+   if (sequence > 0)
+   {
+      if (pos + IOT_CONFIG_RECORD_OVERHEAD + sizeof(sequence) > areaSize) { return false; }
+      records[pos++] = IOT_RECORD_PROVISION_SEQUENCE;
+      records[pos++] = sizeof(sequence);
+      for (size_t i=0; i<sizeof(sequence); i++)
+      {
+         records[pos++] = (sequence >> (8*i)) & 0xff;
+      }
+   }
+   iotConfigRecordsSetHeader(header, pos);
+   return true;
+}
+
+// fields of the earlier fixed layout, six IOT_LEGACY_FIELD_SIZE fields in IOT_FIELD_* order
+static inline void iotConfigRecordsFromLegacy(const uint8_t *legacy, const iotConfigRecordField_t *fields)
+{
+   for (int f=0; f<IOT_CONFIG_FIELDS; f++)
+   {
+      const char *value = (const char*)&legacy[f*IOT_LEGACY_FIELD_SIZE];
+      size_t valueLen = strnlen(value, IOT_LEGACY_FIELD_SIZE);
+      memset(fields[f].value, 0, fields[f].size);
+      memcpy(fields[f].value, value, (valueLen < fields[f].size-1) ? valueLen : fields[f].size-1);
+   }
+}
+
+#endif
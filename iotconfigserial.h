@@ -0,0 +1,52 @@
+#ifndef IOTCONFIGSERIAL_H
+#define IOTCONFIGSERIAL_H IOTCONFIGSERIAL_H
+
+// serial provisioning frames, kept free of Arduino headers so the protocol can be tested on a host
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "iotconfigrecords.h"
+
+#define IOT_SERIAL_PROV_SYNC 0xA5
+#define IOT_SERIAL_PROV_REPLY 0x5A
+#define IOT_SERIAL_PROV_TIMEOUT 1000
+#define IOT_SERIAL_PROV_VERSION 2
+#define IOT_SERIAL_FRAME_MAX (3+255+4)
+#define IOT_SERIAL_CMD_HELLO 0x01
+#define IOT_SERIAL_CMD_SET_FIELD 0x02
+#define IOT_SERIAL_CMD_WRITE 0x03
+#define IOT_SERIAL_CMD_READ 0x04
+#define IOT_SERIAL_CMD_COMMIT 0x05
+#define IOT_SERIAL_CMD_DONE 0x06
+#define IOT_SERIAL_ACK 0
+#define IOT_SERIAL_NAK_CRC 1
+#define IOT_SERIAL_NAK_ARG 2
+
+/*
+ * Request: sync (0xA5), command, payload length, payload, CRC32 (iotConfigCRC,
+ * little endian) over command, length and payload. Replies use sync 0x5A and
+ * a status in place of the command, with the same length, payload and CRC.
+ */
+static inline size_t iotConfigSerialFrame(uint8_t *frame, const uint8_t sync, const uint8_t code,
+                                          const uint8_t *payload, const uint8_t len)
+{
+   frame[0] = sync;
+   frame[1] = code;
+   frame[2] = len;
+   if (len > 0) { memcpy(&frame[3], payload, len); }
+   uint32_t crc = iotConfigCRC(&frame[1], 2 + len, NULL, 0);
+   for (int i=0; i<4; i++) { frame[3+len+i] = (uint8_t)(crc >> (8*i)); }
+   return 3 + len + 4;
+}
+
+// frame without its sync byte: code, length, payload and CRC as received
+static inline bool iotConfigSerialFrameValid(const uint8_t *frame)
+{
+   const uint8_t *crcBytes = &frame[2 + frame[1]];
+   uint32_t crc = (uint32_t)crcBytes[0] | ((uint32_t)crcBytes[1] << 8) |
+                  ((uint32_t)crcBytes[2] << 16) | ((uint32_t)crcBytes[3] << 24);
+   return crc == iotConfigCRC(frame, 2 + frame[1], NULL, 0);
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef IOTCONFIGTIMER_H
+#define IOTCONFIGTIMER_H IOTCONFIGTIMER_H
+
+// timer arithmetic of the library, kept free of Arduino headers so it can be tested on a host
+
+#include <stdint.h>
+
+// time source in ms (millis() by default) or us (micros()), wraps after 2^32 ticks like on ESP
+typedef uint32_t (*iotConfigClock_t)(void);
+
+// 32 bit clock extended to 64 bit, read it at least once per wrap
+typedef struct
+{
+  uint32_t last;
+  uint32_t wraps;
+} iotConfigUptime_t;
+
+typedef struct
+{
+  uint32_t start;
+  uint32_t interval;
+  bool armed;
+} iotConfigTimer_t;
+
+static inline void iotConfigTimerStart(iotConfigTimer_t *timer, const uint32_t now, const uint32_t interval)
+{
+   timer->start = now;
+   timer->interval = interval;
+   timer->armed = true;
+}
+
+// unsigned subtraction keeps working when the clock wraps after ~49.7 days
+static inline uint32_t iotConfigTimerElapsed(const iotConfigTimer_t *timer, const uint32_t now)
+{
+   return now - timer->start;
+}
+
+static inline bool iotConfigTimerExpired(const iotConfigTimer_t *timer, const uint32_t now)
+{
+   return timer->armed && (iotConfigTimerElapsed(timer, now) >= timer->interval);
+}
+
+// ms until the timer expires, 0 if expired, UINT32_MAX if not running
+static inline uint32_t iotConfigTimerRemaining(const iotConfigTimer_t *timer, const uint32_t now)
+{
+   if (!timer->armed) { return UINT32_MAX; }
+   uint32_t elapsed = iotConfigTimerElapsed(timer, now);
+   return (elapsed >= timer->interval) ? 0 : timer->interval - elapsed;
+}
+
+static inline uint64_t iotConfigUptimeExtend(iotConfigUptime_t *uptime, const uint32_t now)
+{
+   if (now < uptime->last) { uptime->wraps++; }
+   uptime->last = now;
+   return ((uint64_t)uptime->wraps << 32) | now;
+}
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ * Microbenchmarks of the library's hot paths on the simulated ESP32 core,
+ * with the input sizes devices see: a fully %-encoded 64 character
+ * password and join line, a 4 KB EEPROM with 256 variables, 100 networks
+ * in range of the portal.
+ *
+ *   g++ -std=gnu++11 -O2 -I. -Itest/host iotconfig.cpp test/host/core.cpp test/host/hash.cpp \
+ *       test/bench.cpp -o bench
+ *   ./bench [--filter NAME] [--min-ms 50] > results.json
+ *   ./bench --baseline test/bench_baseline.json [--tolerance 30]
+ *
+ * Every kernel is repeated until a batch takes --min-ms, the fastest of
+ * seven batches is reported in ns per operation. The scan list is cached
+ * once per scan (IOT_SCAN_CACHE_SIZE strongest networks), so the page
+ * kernel renders that cache. With --baseline, kernels more than
+ * --tolerance percent slower than the stored value fail the run (exit
+ * code 1). Host timings only compare against a baseline taken on the same
+ * machine; regenerate test/bench_baseline.json with ./bench > it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+#define BENCH_REPETITIONS 7
+#define BENCH_VARIABLES 256
+#define BENCH_VARIABLE_SIZE 16
+#define BENCH_RTC_VARIABLES 16
+#define BENCH_NETWORKS 100
+
+typedef uint64_t (*benchFn_t)(const uint32_t iterations);
+
+typedef struct
+{
+   const char *name;
+   benchFn_t run;               // returns the ns spent on iterations operations
+} bench_t;
+
+static simDevice_t *dev;
+static iotConfigRTC_t rtc;
+static uint8_t eepromVars[BENCH_VARIABLES][BENCH_VARIABLE_SIZE];
+static uint32_t rtcVars[BENCH_RTC_VARIABLES];
+static volatile uint32_t sink;
+
+static uint64_t nowNS()
+{
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string encode(const std::string &s)
+{
+   std::string out;
+   char hex[4];
+
+   for (size_t i=0; i<s.size(); i++)
+   {
+      snprintf(hex, sizeof(hex), "%%%02X", (uint8_t)s[i]);
+      out += hex;
+   }
+   return out;
+}
+
+static const std::string &password()
+{
+   static const std::string encoded = encode(std::string(IOT_PASSPHRASE_MAX, 'p'));
+   return encoded;
+}
+
+// the longest join query the portal form produces
+static const std::string &joinQuery()
+{
+   static const std::string query = "ident=" + encode(std::string(IOT_IDENTITY_MAX, 'i')) + "&pass=" + password() +
+                                    "&fname=" + encode(std::string(IOT_SSID_MAX, 'f')) +
+                                    "&ota=" + encode(std::string(IOT_OTA_PASSWORD_MAX, 'o')) +
+                                    "&otar=" + encode(std::string(IOT_OTA_PASSWORD_MAX, 'o'));
+   return query;
+}
+
+// a fresh device with a 4 KB user area and 256 variables, in portal mode
+static iotConfig *freshDevice(const bool assign)
+{
+   memset(&rtc, 0, sizeof(rtc));
+   rtc.firstBoot = 1;
+   dev->flash.clear();
+   simBoot(dev, SIM_RST_POWERON);
+   iotConfig *config = new iotConfig(&rtc);
+   config->begin("node", "admin", sizeof(eepromVars), sizeof(rtcVars), 0);
+   if (assign)
+   {
+      for (int v=0; v<BENCH_VARIABLES; v++) { config->assignVariableEEPROM(eepromVars[v], BENCH_VARIABLE_SIZE); }
+      for (int v=0; v<BENCH_RTC_VARIABLES; v++) { config->assignVariableRTCDATA((uint8_t*)&rtcVars[v], sizeof(rtcVars[v])); }
+   }
+   return config;
+}
+
+static uint64_t benchCRC(const uint32_t iterations)
+{
+   static uint8_t store[4096];
+   for (size_t i=0; i<sizeof(store); i++) { store[i] = (uint8_t)(i * 131); }
+
+   uint64_t start = nowNS();
+   for (uint32_t i=0; i<iterations; i++) { sink += iotConfigCRC(store, sizeof(store), NULL, 0); }
+   return nowNS() - start;
+}
+
+static uint64_t benchQueryToAscii(const uint32_t iterations)
+{
+   const std::string &query = password();
+   char decoded[IOT_PASSPHRASE_MAX + 1];
+
+   uint64_t start = nowNS();
+   for (uint32_t i=0; i<iterations; i++) { sink += queryToAscii(query.c_str(), query.size(), decoded, sizeof(decoded)); }
+   return nowNS() - start;
+}
+
+static uint64_t benchGetQueryParam(const uint32_t iterations)
+{
+   const std::string &query = joinQuery();
+   char value[IOT_OTA_PASSWORD_MAX + 1];
+
+   uint64_t start = nowNS();
+   for (uint32_t i=0; i<iterations; i++) { sink += getQueryParam(query.c_str(), "otar", value, sizeof(value)); }
+   return nowNS() - start;
+}
+
+static uint64_t benchGetQueryParamString(const uint32_t iterations)
+{
+   const String query(joinQuery().c_str());
+
+   uint64_t start = nowNS();
+   for (uint32_t i=0; i<iterations; i++) { sink += getQueryParam(query, "otar").length(); }
+   return nowNS() - start;
+}
+
+// one op: registering all 256 variables with a fresh instance
+static uint64_t benchAddVariables(const uint32_t iterations)
+{
+   uint64_t spent = 0;
+
+   for (uint32_t i=0; i<iterations; i++)
+   {
+      iotConfig *config = freshDevice(false);
+      uint64_t start = nowNS();
+      for (int v=0; v<BENCH_VARIABLES; v++) { config->assignVariableEEPROM(eepromVars[v], BENCH_VARIABLE_SIZE); }
+      spent += nowNS() - start;
+      delete config;
+   }
+   return spent;
+}
+
+static uint64_t benchUpdateEEPROM(const uint32_t iterations)
+{
+   iotConfig *config = freshDevice(true);
+
+   uint64_t start = nowNS();
+   for (uint32_t i=0; i<iterations; i++)
+   {
+      eepromVars[i % BENCH_VARIABLES][0]++;
+      config->updateEEPROM();
+   }
+   uint64_t spent = nowNS() - start;
+   delete config;
+   return spent;
+}
+
+static uint64_t benchUpdateRTCDATA(const uint32_t iterations)
+{
+   iotConfig *config = freshDevice(true);
+
+   uint64_t start = nowNS();
+   for (uint32_t i=0; i<iterations; i++)
+   {
+      rtcVars[i % BENCH_RTC_VARIABLES]++;
+      config->updateRTCDATA();
+   }
+   uint64_t spent = nowNS() - start;
+   delete config;
+   return spent;
+}
+
+// loop() until the device closes the connection
+static size_t request(iotConfig *config, const std::string &line)
+{
+   std::shared_ptr<simConn_t> conn = simConnect(dev, 80, IPAddress(192, 168, 4, 2));
+   std::string request = line + "\r\n\r\n";
+
+   simSend(conn, request.data(), request.size());
+   for (uint32_t ms=0; (ms<5000) && !conn->deviceClosed; ms+=10)
+   {
+      simDeliver(dev);
+      config->handle();
+   }
+   size_t len = simReceive(conn).size();
+   simClose(conn);
+   return len;
+}
+
+// one op: a GET / answered with the list of the networks in range
+static uint64_t benchPortalScanPage(const uint32_t iterations)
+{
+   iotConfig *config = freshDevice(true);
+   // the first page starts the scan
+   request(config, "GET / HTTP/1.1");
+   delay(3000);
+
+   uint64_t start = nowNS();
+   for (uint32_t i=0; i<iterations; i++) { sink += request(config, "GET / HTTP/1.1"); }
+   uint64_t spent = nowNS() - start;
+   delete config;
+   return spent;
+}
+
+static const bench_t benchmarks[] = {
+   { "crc_4k", benchCRC },
+   { "query_to_ascii_password", benchQueryToAscii },
+   { "get_query_param_join", benchGetQueryParam },
+   { "get_query_param_join_string", benchGetQueryParamString },
+   { "add_variable_256", benchAddVariables },
+   { "update_eeprom_4k", benchUpdateEEPROM },
+   { "update_rtcdata_16", benchUpdateRTCDATA },
+   { "portal_scan_page_100", benchPortalScanPage },
+};
+
+static double measure(const bench_t &bench, const uint32_t minMS, uint32_t *iterations)
+{
+   double nsPerOp[BENCH_REPETITIONS];
+
+   // kernels with an untimed setup per operation stop growing once a batch takes 10 * minMS of wall time
+   *iterations = 1;
+   while (*iterations < (1U << 30))
+   {
+      uint64_t wallStart = nowNS();
+      uint64_t spent = bench.run(*iterations);
+      if ((spent >= minMS * 1000000ULL) || (nowNS() - wallStart >= 10 * minMS * 1000000ULL)) { break; }
+      *iterations *= 2;
+   }
+   for (int r=0; r<BENCH_REPETITIONS; r++) { nsPerOp[r] = (double)bench.run(*iterations) / *iterations; }
+   // the fastest batch, the others only add scheduler and cache noise of the host
+   return *std::min_element(nsPerOp, nsPerOp + BENCH_REPETITIONS);
+}
+
+// ns_per_op of name in a file written by this program, 0 if missing
+static double baselineValue(const std::string &baseline, const char *name)
+{
+   size_t pos = baseline.find("\"name\": \"" + std::string(name) + "\"");
+   if (pos == std::string::npos) { return 0; }
+   pos = baseline.find("\"ns_per_op\":", pos);
+   return (pos == std::string::npos) ? 0 : atof(baseline.c_str() + pos + 12);
+}
+
+int main(int argc, char **argv)
+{
+   const char *filter = NULL;
+   const char *baselineFile = NULL;
+   uint32_t minMS = 50;
+   double tolerance = 30;
+
+   for (int i=1; i+1<argc; i+=2)
+   {
+      if (strcmp(argv[i], "--filter") == 0) { filter = argv[i+1]; }
+      else if (strcmp(argv[i], "--min-ms") == 0) { minMS = atoi(argv[i+1]); }
+      else if (strcmp(argv[i], "--baseline") == 0) { baselineFile = argv[i+1]; }
+      else if (strcmp(argv[i], "--tolerance") == 0) { tolerance = atof(argv[i+1]); }
+      else { fprintf(stderr, "unknown option %s\n", argv[i]); return 2; }
+   }
+   std::string baseline;
+   if (baselineFile)
+   {
+      FILE *f = fopen(baselineFile, "r");
+      if (!f)
+      {
+         perror(baselineFile);
+         return 2;
+      }
+      char buf[1024];
+      size_t len;
+      while ((len = fread(buf, 1, sizeof(buf), f)) > 0) { baseline.append(buf, len); }
+      fclose(f);
+   }
+
+   for (int n=0; n<BENCH_NETWORKS; n++)
+   {
+      char ssid[16];
+      snprintf(ssid, sizeof(ssid), "net-%03d", n);
+      simAddNetwork(ssid, "password", WIFI_AUTH_WPA2_PSK, -40 - (n % 50));
+   }
+   dev = simCreateDevice(1);
+   simSelect(dev);
+
+   int regressions = 0;
+   bool first = true;
+   printf("{\n  \"benchmarks\": [");
+   for (size_t b=0; b<sizeof(benchmarks)/sizeof(benchmarks[0]); b++)
+   {
+      if (filter && !strstr(benchmarks[b].name, filter)) { continue; }
+      uint32_t iterations;
+      double nsPerOp = measure(benchmarks[b], minMS, &iterations);
+      printf("%s\n    {\"name\": \"%s\", \"ns_per_op\": %.1f, \"iterations\": %u", first ? "" : ",",
+             benchmarks[b].name, nsPerOp, iterations);
+      first = false;
+      if (baselineFile)
+      {
+         double reference = baselineValue(baseline, benchmarks[b].name);
+         bool regressed = (reference > 0) && (nsPerOp > reference * (1 + tolerance / 100));
+         printf(", \"baseline_ns_per_op\": %.1f, \"ratio\": %.2f, \"regressed\": %s",
+                reference, (reference > 0) ? nsPerOp / reference : 0, regressed ? "true" : "false");
+         if (regressed) { regressions++; }
+      }
+      printf("}");
+      fflush(stdout);
+   }
+   printf("\n  ]");
+   if (baselineFile) { printf(",\n  \"tolerance_percent\": %.0f,\n  \"regressions\": %d", tolerance, regressions); }
+   printf("\n}\n");
+
+   simDestroyDevice(dev);
+   return regressions ? 1 : 0;
+}
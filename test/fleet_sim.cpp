@@ -0,0 +1,445 @@
+/*
+ * Fleet simulator: runs many iotConfig instances in one process on the
+ * host port of the core (test/host/sim.h), with a virtual clock per
+ * device and simulated access points.
+ *
+ *   g++ -std=gnu++11 -O2 -I. -Itest/host iotconfig.cpp test/host/core.cpp test/host/hash.cpp \
+ *       test/fleet_sim.cpp -o fleet_sim
+ *   ./fleet_sim --devices 1000 --scenario provision|storm|watchdog [--seed N] [--admit N] [--outage S]
+ *
+ * provision: fresh devices power up over 10 s, join the staging network
+ *            and are provisioned with one signed blob broadcast every
+ *            second, then join the plant network.
+ * storm:     a provisioned fleet loses the plant AP for --outage seconds,
+ *            the AP comes back admitting --admit stations per second.
+ * watchdog:  the storm with a 90 s outage, once per watchdog timeout.
+ *
+ * Results are printed as JSON. Time only advances through events, so a
+ * run covers minutes of fleet time in seconds.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <queue>
+#include <chrono>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+#define FLEET_STAGING_SSID "staging"
+#define FLEET_STAGING_PSK "stagingpsk"
+#define FLEET_PLANT_SSID "plant"
+#define FLEET_PLANT_PSK "plantpsk"
+#define FLEET_ADMIN_PASSWORD "admin"
+#define FLEET_OTA_PASSWORD "fleetota"
+#define FLEET_POWER_ON_SPREAD_MS 10000
+#define FLEET_BROADCAST_START_MS 5000
+#define FLEET_BROADCAST_INTERVAL_MS 1000
+#define FLEET_MAX_SLEEP_MS 1000
+
+typedef struct
+{
+   simDevice_t *dev;
+   iotConfigRTC_t rtc;
+   iotConfig *config;
+   uint64_t plannedUS;      // next wake, UINT64_MAX if none
+   uint64_t powerOnUS;
+   uint64_t onlineUS;       // first time online on the plant network
+   bool powered;
+   bool onPlant;            // online on the plant network at its last handle()
+   bool acked;
+   uint8_t ackStatus;
+   uint32_t reboots;
+} node_t;
+
+typedef struct
+{
+   uint32_t devices;
+   uint32_t seed;
+   uint32_t admitPerSecond;
+   uint32_t outageS;
+   uint32_t watchdogMS;
+   uint32_t limitS;
+   bool storm;
+} fleetParams_t;
+
+typedef struct
+{
+   uint32_t acks[4];
+   uint32_t provisioned;
+   uint32_t online;
+   uint64_t provisionDoneMS;
+   uint32_t onlineP50MS;
+   uint32_t onlineP95MS;
+   uint64_t recoveryMS;     // AP back until the whole fleet is online again, 0 if it never was
+   uint32_t attempts;
+   uint32_t rejected;
+   uint32_t watchdogReboots;
+   uint32_t reboots;
+   uint32_t commits;
+   uint64_t handleCalls;
+   uint64_t simulatedMS;
+} fleetResult_t;
+
+typedef std::pair<uint64_t, uint32_t> wake_t;
+
+static std::vector<node_t> nodes;
+static std::priority_queue<wake_t, std::vector<wake_t>, std::greater<wake_t> > wakeQueue;
+static uint64_t fleetNowUS;
+static uint64_t handleCalls;
+static uint32_t onPlantCount;
+static bool verbose;
+
+static void schedule(const uint32_t n, uint64_t atUS)
+{
+   if (atUS < fleetNowUS) { atUS = fleetNowUS; }
+   if (atUS < nodes[n].plannedUS)
+   {
+      nodes[n].plannedUS = atUS;
+      wakeQueue.push(wake_t(atUS, n));
+   }
+}
+
+static void onRadioEvent(simDevice_t *dev, uint64_t atUS)
+{
+   schedule(dev->id, atUS);
+}
+
+static void onDatagram(simDevice_t *dev, const IPAddress &to, const uint16_t port, const uint8_t *data, const size_t len)
+{
+   (void)to;
+   (void)port;
+   if ((len == IOT_PROVISION_ACK_SIZE) && (memcmp(data, "IOTA", 4) == 0) && (data[5] <= IOT_PROVISION_ACK_REPLAY))
+   {
+      nodes[dev->id].acked = true;
+      nodes[dev->id].ackStatus = data[5];
+   }
+}
+
+static void onSerial(simDevice_t *dev, const uint8_t *data, const size_t len)
+{
+   if (verbose && (dev->id == 0)) { fwrite(data, 1, len, stderr); }
+}
+
+static uint32_t nextRandom(uint32_t *state)
+{
+   uint32_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *state = x;
+   return x;
+}
+
+// the blob the provisioning tool sends, see iotconfigprovision.h
+static size_t buildBlob(uint8_t *blob, const uint32_t sequence)
+{
+   const char *fields[IOT_PROVISION_FIELDS] = { FLEET_PLANT_SSID, "", FLEET_PLANT_PSK, "node-%m", FLEET_OTA_PASSWORD };
+   size_t payloadLen = iotConfigProvisionBuild(blob, IOT_PROVISION_BLOB_MAX, sequence, fields);
+
+   simHmacSHA256((const uint8_t*)FLEET_ADMIN_PASSWORD, strlen(FLEET_ADMIN_PASSWORD), blob, payloadLen, &blob[payloadLen]);
+   return payloadLen + IOT_PROVISION_HMAC_SIZE;
+}
+
+static void bootNode(node_t &node, const fleetParams_t &params)
+{
+   node.config = new iotConfig(&node.rtc);
+   node.config->enableBulkProvisioning(IOT_PROVISION_PORT, FLEET_STAGING_SSID, FLEET_STAGING_PSK);
+   node.config->begin("node", FLEET_ADMIN_PASSWORD, 16, 0, 0);
+   node.config->setWiFiClientWatchDogTimeout(params.watchdogMS);
+}
+
+static void setOnPlant(node_t &node, const bool onPlant)
+{
+   if (onPlant == node.onPlant) { return; }
+   node.onPlant = onPlant;
+   if (onPlant) { onPlantCount++; }
+   else { onPlantCount--; }
+}
+
+// one loop() pass of a device: deliver its WiFi events, run handle(), plan the next wake
+static void runNode(const uint32_t n, const fleetParams_t &params)
+{
+   node_t &node = nodes[n];
+   simNetwork_t *plant = simFindNetwork(FLEET_PLANT_SSID);
+
+   node.plannedUS = UINT64_MAX;
+   simSetTime(node.dev, fleetNowUS);
+   simSelect(node.dev);
+   try
+   {
+      if (!node.powered)
+      {
+         simBoot(node.dev, SIM_RST_POWERON);
+         node.powered = true;
+      }
+      if (!node.config) { bootNode(node, params); }
+      simDeliver(node.dev);
+      node.config->handle();
+      handleCalls++;
+   }
+   catch (simReboot_t &reboot)
+   {
+      delete node.config;
+      node.config = NULL;
+      node.reboots++;
+      setOnPlant(node, false);
+      simAdvance(node.dev, reboot.sleepUS);
+      simBoot(node.dev, (reboot.sleepUS > 0) ? SIM_RST_DEEPSLEEP : SIM_RST_SW);
+      simSelect(NULL);
+      schedule(n, node.dev->nowUS);
+      return;
+   }
+   setOnPlant(node, node.config->isOnline() && (node.dev->network == plant));
+   if ((node.onlineUS == 0) && node.onPlant)
+   {
+      node.onlineUS = node.dev->nowUS;
+   }
+   uint32_t sleepMS = std::min(node.config->nextDeadline(), (uint32_t)FLEET_MAX_SLEEP_MS);
+   uint64_t wakeUS = node.dev->nowUS + std::max(sleepMS, (uint32_t)1) * 1000ULL;
+   wakeUS = std::min(wakeUS, std::max(simNextEvent(node.dev), node.dev->nowUS + 1000));
+   simSelect(NULL);
+   schedule(n, wakeUS);
+}
+
+static bool allOnline()
+{
+   return onPlantCount == nodes.size();
+}
+
+// runs the fleet until untilUS, or until done() holds
+static void runUntil(const uint64_t untilUS, const fleetParams_t &params, bool (*done)())
+{
+   while ((!wakeQueue.empty()) && (wakeQueue.top().first <= untilUS))
+   {
+      wake_t wake = wakeQueue.top();
+      wakeQueue.pop();
+      if (wake.first != nodes[wake.second].plannedUS) { continue; }
+      fleetNowUS = wake.first;
+      runNode(wake.second, params);
+      if (done && done()) { return; }
+   }
+   fleetNowUS = std::max(fleetNowUS, untilUS);
+}
+
+static uint32_t percentileMS(std::vector<uint32_t> values, const uint32_t percent)
+{
+   if (values.empty()) { return 0; }
+   std::sort(values.begin(), values.end());
+   return values[std::min(values.size() - 1, values.size() * percent / 100)];
+}
+
+static fleetResult_t runFleet(const fleetParams_t &params)
+{
+   fleetResult_t result;
+   uint32_t rng = params.seed ? params.seed : 1;
+   uint8_t blob[IOT_PROVISION_BLOB_MAX];
+   size_t blobSize = buildBlob(blob, 1);
+   const uint64_t limitUS = params.limitS * 1000000ULL;
+
+   memset(&result, 0, sizeof(result));
+   fleetNowUS = 0;
+   handleCalls = 0;
+   onPlantCount = 0;
+   simNetwork_t *staging = simAddNetwork(FLEET_STAGING_SSID, FLEET_STAGING_PSK, WIFI_AUTH_WPA2_PSK, -55);
+   simNetwork_t *plant = simAddNetwork(FLEET_PLANT_SSID, FLEET_PLANT_PSK, WIFI_AUTH_WPA2_PSK, -60);
+   staging->connectJitterMS = 1000;
+   plant->connectJitterMS = 1000;
+   if (!params.storm) { plant->admitPerSecond = params.admitPerSecond; }
+
+   nodes.assign(params.devices, node_t());
+   for (uint32_t n=0; n<params.devices; n++)
+   {
+      node_t &node = nodes[n];
+      memset(&node.rtc, 0, sizeof(node.rtc));
+      node.rtc.firstBoot = 1;
+      node.dev = simCreateDevice(n);
+      node.config = NULL;
+      node.plannedUS = UINT64_MAX;
+      node.powerOnUS = (nextRandom(&rng) % FLEET_POWER_ON_SPREAD_MS) * 1000ULL;
+      node.onlineUS = 0;
+      node.powered = false;
+      node.onPlant = false;
+      node.acked = false;
+      node.ackStatus = 0;
+      node.reboots = 0;
+      schedule(n, node.powerOnUS);
+   }
+
+   // provisioning: the tool rebroadcasts until every device on staging has answered
+   uint64_t broadcastUS = FLEET_BROADCAST_START_MS * 1000ULL;
+   while ((!allOnline()) && (broadcastUS < limitUS))
+   {
+      runUntil(broadcastUS, params, NULL);
+      for (size_t n=0; n<nodes.size(); n++)
+      {
+         if ((!nodes[n].acked) && (nodes[n].dev->network == staging) &&
+             simSendUdp(nodes[n].dev, IOT_PROVISION_PORT, IPAddress(10, 0, 0, 1), 40000, blob, blobSize))
+         {
+            schedule(n, fleetNowUS);
+         }
+      }
+      broadcastUS += FLEET_BROADCAST_INTERVAL_MS * 1000ULL;
+   }
+   runUntil(limitUS, params, allOnline);
+
+   std::vector<uint32_t> onlineMS;
+   for (size_t n=0; n<nodes.size(); n++)
+   {
+      if (nodes[n].acked) { result.acks[nodes[n].ackStatus]++; }
+      if (nodes[n].onlineUS > 0)
+      {
+         onlineMS.push_back((nodes[n].onlineUS - nodes[n].powerOnUS) / 1000);
+         result.provisionDoneMS = std::max(result.provisionDoneMS, nodes[n].onlineUS / 1000);
+      }
+   }
+   result.provisioned = result.acks[IOT_PROVISION_ACK_OK];
+   result.onlineP50MS = percentileMS(onlineMS, 50);
+   result.onlineP95MS = percentileMS(onlineMS, 95);
+
+   if (params.storm)
+   {
+      // settle, then take the plant AP away
+      runUntil(fleetNowUS + 30000000ULL, params, NULL);
+      uint32_t attemptsBefore = plant->attempts;
+      uint32_t watchdogBefore = 0;
+      for (size_t n=0; n<nodes.size(); n++) { watchdogBefore += nodes[n].rtc.watchdogReboots; }
+      simSetNetworkUp(plant, false);
+      runUntil(fleetNowUS + params.outageS * 1000000ULL, params, NULL);
+      plant->admitPerSecond = params.admitPerSecond;
+      plant->rejected = 0;
+      simSetNetworkUp(plant, true);
+      uint64_t upUS = fleetNowUS;
+      runUntil(upUS + limitUS, params, allOnline);
+      if (allOnline()) { result.recoveryMS = (fleetNowUS - upUS) / 1000; }
+      result.attempts = plant->attempts - attemptsBefore;
+      result.rejected = plant->rejected;
+      for (size_t n=0; n<nodes.size(); n++) { result.watchdogReboots += nodes[n].rtc.watchdogReboots; }
+      result.watchdogReboots -= watchdogBefore;
+   }
+   else
+   {
+      result.attempts = plant->attempts;
+      result.rejected = plant->rejected;
+   }
+
+   for (size_t n=0; n<nodes.size(); n++)
+   {
+      if (nodes[n].onPlant) { result.online++; }
+      result.reboots += nodes[n].reboots;
+      result.commits += nodes[n].dev->commits;
+      simSelect(nodes[n].dev);
+      delete nodes[n].config;
+      simSelect(NULL);
+      simDestroyDevice(nodes[n].dev);
+   }
+   nodes.clear();
+   while (!wakeQueue.empty()) { wakeQueue.pop(); }
+   simClearNetworks();
+   result.handleCalls = handleCalls;
+   result.simulatedMS = fleetNowUS / 1000;
+   return result;
+}
+
+static void printResult(const fleetResult_t &result, const char *indent)
+{
+   printf("%s\"acks\": { \"ok\": %u, \"bad_format\": %u, \"bad_signature\": %u, \"replay\": %u },\n", indent,
+          result.acks[IOT_PROVISION_ACK_OK], result.acks[IOT_PROVISION_ACK_BAD_FORMAT],
+          result.acks[IOT_PROVISION_ACK_BAD_SIGNATURE], result.acks[IOT_PROVISION_ACK_REPLAY]);
+   printf("%s\"provisioned\": %u,\n", indent, result.provisioned);
+   printf("%s\"online\": %u,\n", indent, result.online);
+   printf("%s\"fleet_online_ms\": %llu,\n", indent, (unsigned long long)result.provisionDoneMS);
+   printf("%s\"time_to_online_p50_ms\": %u,\n", indent, result.onlineP50MS);
+   printf("%s\"time_to_online_p95_ms\": %u,\n", indent, result.onlineP95MS);
+   printf("%s\"recovery_ms\": %llu,\n", indent, (unsigned long long)result.recoveryMS);
+   printf("%s\"plant_attempts\": %u,\n", indent, result.attempts);
+   printf("%s\"plant_rejected\": %u,\n", indent, result.rejected);
+   printf("%s\"watchdog_reboots\": %u,\n", indent, result.watchdogReboots);
+   printf("%s\"reboots\": %u,\n", indent, result.reboots);
+   printf("%s\"eeprom_commits\": %u,\n", indent, result.commits);
+   printf("%s\"handle_calls\": %llu,\n", indent, (unsigned long long)result.handleCalls);
+   printf("%s\"simulated_ms\": %llu", indent, (unsigned long long)result.simulatedMS);
+}
+
+static uint32_t argValue(int argc, char **argv, const char *name, const uint32_t fallback)
+{
+   for (int i=1; i<argc-1; i++)
+   {
+      if (strcmp(argv[i], name) == 0) { return strtoul(argv[i+1], NULL, 10); }
+   }
+   return fallback;
+}
+
+static const char *argString(int argc, char **argv, const char *name, const char *fallback)
+{
+   for (int i=1; i<argc-1; i++)
+   {
+      if (strcmp(argv[i], name) == 0) { return argv[i+1]; }
+   }
+   return fallback;
+}
+
+int main(int argc, char **argv)
+{
+   fleetParams_t params;
+   const char *scenario = argString(argc, argv, "--scenario", "provision");
+
+   params.devices = argValue(argc, argv, "--devices", 1000);
+   params.seed = argValue(argc, argv, "--seed", 1);
+   params.admitPerSecond = argValue(argc, argv, "--admit", 20);
+   params.outageS = argValue(argc, argv, "--outage", 30);
+   params.limitS = argValue(argc, argv, "--limit", 900);
+   params.watchdogMS = 20000;
+   params.storm = false;
+   for (int i=1; i<argc; i++)
+   {
+      if (strcmp(argv[i], "--verbose") == 0) { verbose = true; }
+   }
+   if ((params.devices == 0) || (params.devices > SIM_MAX_DEVICES))
+   {
+      fprintf(stderr, "ERROR: --devices has to be 1..%u\n", SIM_MAX_DEVICES);
+      return 2;
+   }
+   simSetEventHook(onRadioEvent);
+   simSetUdpHook(onDatagram);
+   simSetSerialHook(onSerial);
+
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   printf("{\n  \"scenario\": \"%s\",\n  \"devices\": %u,\n  \"seed\": %u,\n", scenario, params.devices, params.seed);
+   if (strcmp(scenario, "provision") == 0)
+   {
+      if (argValue(argc, argv, "--admit", 0) == 0) { params.admitPerSecond = 0; }
+      printf("  \"admit_per_second\": %u,\n", params.admitPerSecond);
+      printResult(runFleet(params), "  ");
+      printf(",\n");
+   }
+   else if (strcmp(scenario, "storm") == 0)
+   {
+      params.storm = true;
+      printf("  \"admit_per_second\": %u,\n  \"outage_s\": %u,\n", params.admitPerSecond, params.outageS);
+      printResult(runFleet(params), "  ");
+      printf(",\n");
+   }
+   else if (strcmp(scenario, "watchdog") == 0)
+   {
+      static const uint32_t timeouts[] = { 10000, 20000, 60000, 0 };
+      params.storm = true;
+      params.outageS = argValue(argc, argv, "--outage", 90);
+      printf("  \"admit_per_second\": %u,\n  \"outage_s\": %u,\n  \"policies\": [\n", params.admitPerSecond, params.outageS);
+      for (size_t p=0; p<sizeof(timeouts)/sizeof(timeouts[0]); p++)
+      {
+         params.watchdogMS = timeouts[p];
+         printf("    {\n      \"watchdog_ms\": %u,\n", params.watchdogMS);
+         printResult(runFleet(params), "      ");
+         printf("\n    }%s\n", (p+1 < sizeof(timeouts)/sizeof(timeouts[0])) ? "," : "");
+      }
+      printf("  ],\n");
+   }
+   else
+   {
+      fprintf(stderr, "ERROR: unknown scenario %s, use provision, storm or watchdog\n", scenario);
+      return 2;
+   }
+   uint64_t wallMS = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+   printf("  \"wall_ms\": %llu\n}\n", (unsigned long long)wallMS);
+   return 0;
+}
@@ -0,0 +1,187 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H HOST_ARDUINO_H
+
+// host port of the parts of the Arduino ESP32 core used by iotconfig, see sim.h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <functional>
+
+#define RTC_DATA_ATTR
+#define HEX 16
+#define DEC 10
+#define OCT 8
+#define BIN 2
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define LOW 0
+#define HIGH 1
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+
+class String
+{
+   public:
+      String(const char *str = "");
+      String(const String &str);
+      explicit String(char c);
+      explicit String(int value, unsigned char base = DEC);
+      explicit String(unsigned int value, unsigned char base = DEC);
+      explicit String(long value, unsigned char base = DEC);
+      explicit String(unsigned long value, unsigned char base = DEC);
+      ~String();
+      String &operator=(const String &rhs);
+      String &operator=(const char *rhs);
+      String &operator+=(const String &rhs);
+      String &operator+=(const char *rhs);
+      String &operator+=(char c);
+      friend String operator+(const String &lhs, const String &rhs);
+      friend String operator+(const String &lhs, const char *rhs);
+      friend String operator+(const char *lhs, const String &rhs);
+      friend String operator+(const String &lhs, char c);
+      bool operator==(const String &rhs) const;
+      bool operator==(const char *rhs) const;
+      bool operator!=(const String &rhs) const { return !(*this == rhs); }
+      bool operator!=(const char *rhs) const { return !(*this == rhs); }
+      char operator[](unsigned int index) const;
+      char &operator[](unsigned int index);
+      unsigned int length() const { return len; }
+      const char *c_str() const { return buffer; }
+      bool startsWith(const String &prefix) const;
+      bool endsWith(const String &suffix) const;
+      int indexOf(char c, unsigned int from = 0) const;
+      int indexOf(const String &str, unsigned int from = 0) const;
+      String substring(unsigned int left) const;
+      String substring(unsigned int left, unsigned int right) const;
+      void remove(unsigned int index);
+      void remove(unsigned int index, unsigned int count);
+      long toInt() const;
+
+   private:
+      void assign(const char *str, size_t length);
+      void append(const char *str, size_t length);
+      char *buffer;
+      unsigned int len;
+      char dummy;
+};
+
+class Print;
+
+class Printable
+{
+   public:
+      virtual ~Printable() {}
+      virtual size_t printTo(Print &p) const = 0;
+};
+
+class Print
+{
+   public:
+      virtual ~Print() {}
+      virtual size_t write(uint8_t c) = 0;
+      virtual size_t write(const uint8_t *buffer, size_t size);
+      size_t write(const char *str) { return str ? write((const uint8_t*)str, strlen(str)) : 0; }
+      size_t write(const char *buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+      size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+      size_t print(const char *str);
+      size_t print(const String &str);
+      size_t print(char c);
+      size_t print(unsigned char value, int base = DEC);
+      size_t print(int value, int base = DEC);
+      size_t print(unsigned int value, int base = DEC);
+      size_t print(long value, int base = DEC);
+      size_t print(unsigned long value, int base = DEC);
+      size_t print(double value, int digits = 2);
+      size_t print(const Printable &value);
+      size_t println();
+      size_t println(const char *str);
+      size_t println(const String &str);
+      size_t println(char c);
+      size_t println(unsigned char value, int base = DEC);
+      size_t println(int value, int base = DEC);
+      size_t println(unsigned int value, int base = DEC);
+      size_t println(long value, int base = DEC);
+      size_t println(unsigned long value, int base = DEC);
+      size_t println(double value, int digits = 2);
+      size_t println(const Printable &value);
+
+   private:
+      size_t printNumber(unsigned long value, int base, bool negative);
+};
+
+class Stream : public Print
+{
+   public:
+      virtual int available() = 0;
+      virtual int read() = 0;
+      virtual int peek() = 0;
+};
+
+class HardwareSerial : public Stream
+{
+   public:
+      void begin(unsigned long baud);
+      void end();
+      int available();
+      int read();
+      int peek();
+      void flush();
+      size_t write(uint8_t c);
+      size_t write(const uint8_t *buffer, size_t size);
+      using Print::write;
+      operator bool() const { return true; }
+};
+
+extern HardwareSerial Serial;
+
+class IPAddress : public Printable
+{
+   public:
+      IPAddress() { address.dword = 0; }
+      IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+      IPAddress(uint32_t dword) { address.dword = dword; }
+      operator uint32_t() const { return address.dword; }
+      uint8_t operator[](int index) const { return address.bytes[index]; }
+      uint8_t &operator[](int index) { return address.bytes[index]; }
+      bool operator==(const IPAddress &rhs) const { return address.dword == rhs.address.dword; }
+      size_t printTo(Print &p) const;
+      String toString() const;
+
+   private:
+      union {
+         uint8_t bytes[4];
+         uint32_t dword;
+      } address;
+};
+
+class EspClass
+{
+   public:
+      void restart() __attribute__((noreturn));
+      uint32_t getFreeHeap();
+      uint32_t getMinFreeHeap();
+      uint32_t getMaxAllocHeap();
+      uint32_t getHeapSize();
+      uint32_t getSketchSize();
+      uint32_t getFreeSketchSpace();
+      String getSketchMD5();
+      uint64_t getEfuseMac();
+};
+
+extern EspClass ESP;
+
+#endif
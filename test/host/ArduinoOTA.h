@@ -0,0 +1,33 @@
+#ifndef HOST_ARDUINOOTA_H
+#define HOST_ARDUINOOTA_H HOST_ARDUINOOTA_H
+
+#include "ESPmDNS.h"
+#include "Update.h"
+
+typedef enum { OTA_AUTH_ERROR, OTA_BEGIN_ERROR, OTA_CONNECT_ERROR, OTA_RECEIVE_ERROR, OTA_END_ERROR } ota_error_t;
+
+// handle() runs an update offered with simOfferOTA() to completion, like the core does
+class ArduinoOTAClass
+{
+   public:
+      typedef std::function<void(void)> THandlerFunction;
+      typedef std::function<void(ota_error_t)> THandlerFunction_Error;
+      typedef std::function<void(unsigned int, unsigned int)> THandlerFunction_Progress;
+
+      ArduinoOTAClass &setPort(uint16_t port);
+      ArduinoOTAClass &setHostname(const char *hostname);
+      ArduinoOTAClass &setPassword(const char *password);
+      ArduinoOTAClass &setMdnsEnabled(bool enabled);
+      ArduinoOTAClass &onStart(THandlerFunction fn);
+      ArduinoOTAClass &onEnd(THandlerFunction fn);
+      ArduinoOTAClass &onError(THandlerFunction_Error fn);
+      ArduinoOTAClass &onProgress(THandlerFunction_Progress fn);
+      void begin();
+      void end();
+      void handle();
+      int getCommand();
+};
+
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef HOST_DNSSERVER_H
+#define HOST_DNSSERVER_H HOST_DNSSERVER_H
+
+#include "WiFiUdp.h"
+
+// answers nothing, the simulated clients connect to the portal address directly
+class DNSServer
+{
+   public:
+      DNSServer() : requests(0) {}
+      bool start(const uint16_t port, const String &domainName, const IPAddress &resolvedIP)
+      {
+         (void)port; (void)domainName; (void)resolvedIP;
+         return true;
+      }
+      void processNextRequest() { requests++; }
+      void stop() {}
+      uint32_t requests;
+};
+
+#endif
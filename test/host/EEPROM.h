@@ -0,0 +1,22 @@
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H HOST_EEPROM_H
+
+#include "Arduino.h"
+
+// RAM copy of the selected device's flash, commit() writes it back
+class EEPROMClass
+{
+   public:
+      bool begin(size_t size);
+      void end();
+      uint8_t read(int address);
+      void write(int address, uint8_t value);
+      bool commit();
+      uint8_t *getDataPtr();
+      const uint8_t *getConstDataPtr() const;
+      uint16_t length();
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef HOST_ESPMDNS_H
+#define HOST_ESPMDNS_H HOST_ESPMDNS_H
+
+#include "Arduino.h"
+
+// the TXT records end up in the device state of sim.h
+class MDNSResponder
+{
+   public:
+      bool begin(const char *hostName);
+      void end();
+      bool addService(const char *service, const char *proto, uint16_t port);
+      bool addServiceTxt(const char *service, const char *proto, const char *key, const char *value);
+      void enableArduino(uint16_t port = 3232, bool auth = false);
+};
+
+extern MDNSResponder MDNS;
+
+#endif
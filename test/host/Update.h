@@ -0,0 +1,26 @@
+#ifndef HOST_UPDATE_H
+#define HOST_UPDATE_H HOST_UPDATE_H
+
+#include "Arduino.h"
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+#define U_FLASH 0
+#define U_SPIFFS 100
+
+// writes into the inactive image of the selected device, it runs after the next reboot
+class UpdateClass
+{
+   public:
+      bool begin(size_t size = UPDATE_SIZE_UNKNOWN, int command = U_FLASH);
+      size_t write(uint8_t *data, size_t len);
+      bool end(bool evenIfRemaining = false);
+      bool setMD5(const char *expectedMD5);
+      void abort();
+      bool hasError();
+      bool isRunning();
+      void printError(Print &out);
+};
+
+extern UpdateClass Update;
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H HOST_WIFI_H
+
+// host port of the ESP32 WiFi library, the radio is simulated by sim.cpp
+
+#include "Arduino.h"
+#include <memory>
+
+typedef enum
+{
+   SYSTEM_EVENT_WIFI_READY = 0,
+   SYSTEM_EVENT_SCAN_DONE,
+   SYSTEM_EVENT_STA_START,
+   SYSTEM_EVENT_STA_STOP,
+   SYSTEM_EVENT_STA_CONNECTED,
+   SYSTEM_EVENT_STA_DISCONNECTED,
+   SYSTEM_EVENT_STA_AUTHMODE_CHANGE,
+   SYSTEM_EVENT_STA_GOT_IP,
+   SYSTEM_EVENT_STA_LOST_IP,
+   SYSTEM_EVENT_AP_START = 13,
+   SYSTEM_EVENT_AP_STOP,
+   SYSTEM_EVENT_AP_STACONNECTED,
+   SYSTEM_EVENT_AP_STADISCONNECTED,
+   SYSTEM_EVENT_AP_STAIPASSIGNED,
+   SYSTEM_EVENT_MAX = 26
+} system_event_id_t;
+
+typedef struct
+{
+   uint8_t reason;
+} system_event_info_t;
+
+typedef enum
+{
+   WIFI_AUTH_OPEN = 0,
+   WIFI_AUTH_WEP,
+   WIFI_AUTH_WPA_PSK,
+   WIFI_AUTH_WPA2_PSK,
+   WIFI_AUTH_WPA_WPA2_PSK,
+   WIFI_AUTH_WPA2_ENTERPRISE,
+   WIFI_AUTH_MAX
+} wifi_auth_mode_t;
+
+typedef struct
+{
+   uint8_t bssid[6];
+   uint8_t ssid[33];
+   uint8_t primary;
+   int8_t rssi;
+   wifi_auth_mode_t authmode;
+} wifi_ap_record_t;
+
+typedef enum { WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3 } wifi_mode_t;
+typedef enum { WL_IDLE_STATUS = 0, WL_NO_SSID_AVAIL = 1, WL_CONNECTED = 3, WL_CONNECT_FAILED = 4, WL_DISCONNECTED = 6 } wl_status_t;
+
+#define WIFI_SCAN_RUNNING (-1)
+#define WIFI_SCAN_FAILED (-2)
+
+typedef std::function<void(system_event_id_t event, system_event_info_t info)> WiFiEventFuncCb;
+typedef uint16_t wifi_event_id_t;
+
+struct simConn_t;
+
+class WiFiClient : public Stream
+{
+   public:
+      WiFiClient() {}
+      // the library resets clients with "= NULL", the core's WiFiClient(int fd) warns about that
+      WiFiClient(const void *none) { (void)none; }
+      WiFiClient(const std::shared_ptr<simConn_t> &connN) : conn(connN) {}
+      uint8_t connected();
+      int available();
+      int read();
+      int read(uint8_t *buf, size_t size);
+      int peek();
+      void flush() {}
+      void stop();
+      size_t write(uint8_t c);
+      size_t write(const uint8_t *buffer, size_t size);
+      using Print::write;
+      IPAddress remoteIP();
+      void setNoDelay(bool) {}
+      operator bool() { return connected(); }
+
+   private:
+      std::shared_ptr<simConn_t> conn;
+};
+
+class WiFiServer
+{
+   public:
+      WiFiServer(uint16_t portN = 80) : port(portN), dev(NULL) {}
+      ~WiFiServer() { stop(); }
+      void begin(uint16_t portN = 0);
+      void stop();
+      void close() { stop(); }
+      bool hasClient();
+      WiFiClient available();
+      void setNoDelay(bool) {}
+
+   private:
+      uint16_t port;
+      struct simDevice_t *dev;
+};
+
+class WiFiClass
+{
+   public:
+      bool mode(wifi_mode_t m);
+      wifi_mode_t getMode();
+      bool enableAP(bool enable);
+      bool enableSTA(bool enable);
+      bool softAPConfig(IPAddress local, IPAddress gateway, IPAddress subnet);
+      bool softAP(const char *ssid, const char *passphrase = NULL);
+      bool softAPdisconnect(bool wifiOff = false);
+      IPAddress softAPIP();
+      int begin(const char *ssid, const char *passphrase = NULL);
+      bool disconnect(bool wifiOff = false);
+      bool isConnected();
+      wl_status_t status();
+      bool setHostname(const char *hostname);
+      bool setSleep(bool enable);
+      bool getSleep();
+      bool setAutoReconnect(bool) { return true; }
+      IPAddress localIP();
+      uint8_t *macAddress(uint8_t *mac);
+      String macAddress();
+      String SSID();
+      String SSID(uint8_t i);
+      int32_t RSSI();
+      int32_t RSSI(uint8_t i);
+      wifi_auth_mode_t encryptionType(uint8_t i);
+      int16_t scanNetworks(bool async = false, bool showHidden = false, bool passive = false, uint32_t maxMSPerChannel = 300);
+      int16_t scanComplete();
+      void scanDelete();
+      void *getScanInfoByIndex(int i);
+      wifi_event_id_t onEvent(WiFiEventFuncCb cb, system_event_id_t event = SYSTEM_EVENT_MAX);
+      void removeEvent(wifi_event_id_t id);
+};
+
+extern WiFiClass WiFi;
+
+#endif
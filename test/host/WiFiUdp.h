@@ -0,0 +1,41 @@
+#ifndef HOST_WIFIUDP_H
+#define HOST_WIFIUDP_H HOST_WIFIUDP_H
+
+#include "WiFi.h"
+#include <string>
+
+class WiFiUDP : public Stream
+{
+   public:
+      WiFiUDP() : port(0), dev(NULL), rxPos(0), remotePortN(0), txPort(0) {}
+      ~WiFiUDP() { stop(); }
+      uint8_t begin(uint16_t portN);
+      void stop();
+      int parsePacket();
+      int available();
+      int read();
+      int read(uint8_t *buffer, size_t len);
+      int read(char *buffer, size_t len) { return read((uint8_t*)buffer, len); }
+      int peek();
+      void flush() {}
+      int beginPacket(IPAddress ip, uint16_t portN);
+      int endPacket();
+      size_t write(uint8_t c);
+      size_t write(const uint8_t *buffer, size_t size);
+      using Print::write;
+      IPAddress remoteIP() { return remote; }
+      uint16_t remotePort() { return remotePortN; }
+
+   private:
+      uint16_t port;
+      struct simDevice_t *dev;
+      std::string rx;
+      size_t rxPos;
+      IPAddress remote;
+      uint16_t remotePortN;
+      std::string tx;
+      IPAddress txIP;
+      uint16_t txPort;
+};
+
+#endif
@@ -0,0 +1,1888 @@
+/*
+ * Host port of the ESP32 core, see sim.h. Everything acts on the device
+ * selected with simSelect().
+ */
+
+#include "sim.h"
+#include "EEPROM.h"
+#include "ESPmDNS.h"
+#include "ArduinoOTA.h"
+#include "Update.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wpa2.h"
+#include "esp_ota_ops.h"
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+EEPROMClass EEPROM;
+MDNSResponder MDNS;
+ArduinoOTAClass ArduinoOTA;
+UpdateClass Update;
+
+int simCoreDepth = 0;
+
+static simDevice_t *current = NULL;
+static std::vector<simDevice_t*> devices;
+static std::vector<simNetwork_t*> networks;
+static bool realtime = false;
+static uint64_t fallbackUS = 0;
+static void (*eventHook)(simDevice_t *dev, uint64_t atUS) = NULL;
+static void (*pollHook)() = NULL;
+static void (*udpHook)(simDevice_t *dev, const IPAddress &to, const uint16_t port,
+                       const uint8_t *data, const size_t len) = NULL;
+static void (*serialHook)(simDevice_t *dev, const uint8_t *data, const size_t len) = NULL;
+
+#define SIM_DEFAULT_CONNECT_MS 1500
+#define SIM_SCAN_MS 2000
+#define SIM_REASON_ASSOC_LEAVE 8
+#define SIM_REASON_BEACON_TIMEOUT 200
+#define SIM_REASON_NO_AP_FOUND 201
+#define SIM_REASON_AUTH_FAIL 202
+#define SIM_REASON_ASSOC_FAIL 203
+
+/*
+ * time
+ */
+
+static uint64_t wallUS()
+{
+   return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t deviceNow()
+{
+   if (!current)
+   {
+      if (realtime) { fallbackUS = wallUS(); }
+      return fallbackUS;
+   }
+   if (realtime) { current->nowUS = wallUS(); }
+   return current->nowUS;
+}
+
+static uint64_t sinceBoot()
+{
+   uint64_t now = deviceNow();
+   return current ? now - current->bootUS : now;
+}
+
+unsigned long millis()
+{
+   return (uint32_t)(sinceBoot() / 1000);
+}
+
+unsigned long micros()
+{
+   return (uint32_t)sinceBoot();
+}
+
+int64_t esp_timer_get_time()
+{
+   return (int64_t)sinceBoot();
+}
+
+void delay(uint32_t ms)
+{
+   if (!realtime)
+   {
+      if (current)
+      {
+         current->nowUS += (uint64_t)ms * 1000;
+         simDeliver(current);
+      }
+      else
+      {
+         fallbackUS += (uint64_t)ms * 1000;
+      }
+      return;
+   }
+   uint64_t until = wallUS() + (uint64_t)ms * 1000;
+   do
+   {
+      if (pollHook) { pollHook(); }
+      if (current) { simDeliver(current); }
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+   } while (wallUS() < until);
+}
+
+// busy waits of the library yield(), a virtual 1 ms passes per call
+void yield()
+{
+   if (!realtime)
+   {
+      delay(1);
+      return;
+   }
+   if (pollHook) { pollHook(); }
+   if (current) { simDeliver(current); }
+   std::this_thread::sleep_for(std::chrono::microseconds(100));
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+   (void)pin;
+   (void)mode;
+}
+
+int digitalRead(uint8_t pin)
+{
+   if ((!current) || (pin >= sizeof(current->pins)/sizeof(current->pins[0]))) { return HIGH; }
+   return current->pins[pin];
+}
+
+/*
+ * String, allocates like the core's String does
+ */
+
+void String::assign(const char *str, size_t length)
+{
+   char *fresh = (char*)malloc(length + 1);
+   if (!fresh) { abort(); }
+   memcpy(fresh, str, length);
+   fresh[length] = 0;
+   free(buffer);
+   buffer = fresh;
+   len = length;
+}
+
+void String::append(const char *str, size_t length)
+{
+   char *grown = (char*)realloc(buffer, len + length + 1);
+   if (!grown) { abort(); }
+   memcpy(&grown[len], str, length);
+   len += length;
+   grown[len] = 0;
+   buffer = grown;
+}
+
+String::String(const char *str) : buffer(NULL), len(0)
+{
+   if (!str) { str = ""; }
+   assign(str, strlen(str));
+}
+
+String::String(const String &str) : buffer(NULL), len(0)
+{
+   assign(str.buffer, str.len);
+}
+
+String::String(char c) : buffer(NULL), len(0)
+{
+   assign(&c, 1);
+}
+
+String::String(int value, unsigned char base) : buffer(NULL), len(0)
+{
+   char buf[34];
+   if (base == 10) { snprintf(buf, sizeof(buf), "%d", value); }
+   else { snprintf(buf, sizeof(buf), (base == 16) ? "%x" : "%o", (unsigned int)value); }
+   assign(buf, strlen(buf));
+}
+
+String::String(unsigned int value, unsigned char base) : buffer(NULL), len(0)
+{
+   char buf[34];
+   snprintf(buf, sizeof(buf), (base == 16) ? "%x" : ((base == 8) ? "%o" : "%u"), value);
+   assign(buf, strlen(buf));
+}
+
+String::String(long value, unsigned char base) : buffer(NULL), len(0)
+{
+   char buf[34];
+   if (base == 10) { snprintf(buf, sizeof(buf), "%ld", value); }
+   else { snprintf(buf, sizeof(buf), (base == 16) ? "%lx" : "%lo", (unsigned long)value); }
+   assign(buf, strlen(buf));
+}
+
+String::String(unsigned long value, unsigned char base) : buffer(NULL), len(0)
+{
+   char buf[34];
+   snprintf(buf, sizeof(buf), (base == 16) ? "%lx" : ((base == 8) ? "%lo" : "%lu"), value);
+   assign(buf, strlen(buf));
+}
+
+String::~String()
+{
+   free(buffer);
+}
+
+String &String::operator=(const String &rhs)
+{
+   if (this != &rhs) { assign(rhs.buffer, rhs.len); }
+   return *this;
+}
+
+String &String::operator=(const char *rhs)
+{
+   if (!rhs) { rhs = ""; }
+   assign(rhs, strlen(rhs));
+   return *this;
+}
+
+String &String::operator+=(const String &rhs)
+{
+   String copy(rhs);
+   append(copy.buffer, copy.len);
+   return *this;
+}
+
+String &String::operator+=(const char *rhs)
+{
+   if (rhs) { append(rhs, strlen(rhs)); }
+   return *this;
+}
+
+String &String::operator+=(char c)
+{
+   append(&c, 1);
+   return *this;
+}
+
+String operator+(const String &lhs, const String &rhs)
+{
+   String result(lhs);
+   result += rhs;
+   return result;
+}
+
+String operator+(const String &lhs, const char *rhs)
+{
+   String result(lhs);
+   result += rhs;
+   return result;
+}
+
+String operator+(const char *lhs, const String &rhs)
+{
+   String result(lhs);
+   result += rhs;
+   return result;
+}
+
+String operator+(const String &lhs, char c)
+{
+   String result(lhs);
+   result += c;
+   return result;
+}
+
+bool String::operator==(const String &rhs) const
+{
+   return (len == rhs.len) && (memcmp(buffer, rhs.buffer, len) == 0);
+}
+
+bool String::operator==(const char *rhs) const
+{
+   return rhs && (strcmp(buffer, rhs) == 0);
+}
+
+char String::operator[](unsigned int index) const
+{
+   return (index < len) ? buffer[index] : 0;
+}
+
+char &String::operator[](unsigned int index)
+{
+   if (index >= len)
+   {
+      dummy = 0;
+      return dummy;
+   }
+   return buffer[index];
+}
+
+bool String::startsWith(const String &prefix) const
+{
+   return (prefix.len <= len) && (memcmp(buffer, prefix.buffer, prefix.len) == 0);
+}
+
+bool String::endsWith(const String &suffix) const
+{
+   return (suffix.len <= len) && (memcmp(&buffer[len - suffix.len], suffix.buffer, suffix.len) == 0);
+}
+
+int String::indexOf(char c, unsigned int from) const
+{
+   for (unsigned int i=from; i<len; i++)
+   {
+      if (buffer[i] == c) { return i; }
+   }
+   return -1;
+}
+
+int String::indexOf(const String &str, unsigned int from) const
+{
+   if (from > len) { return -1; }
+   const char *found = strstr(&buffer[from], str.buffer);
+   return found ? (int)(found - buffer) : -1;
+}
+
+String String::substring(unsigned int left) const
+{
+   return substring(left, len);
+}
+
+String String::substring(unsigned int left, unsigned int right) const
+{
+   String result;
+   if (left > right) { std::swap(left, right); }
+   if (right > len) { right = len; }
+   if (left < right) { result.assign(&buffer[left], right - left); }
+   return result;
+}
+
+void String::remove(unsigned int index)
+{
+   if (index < len) { remove(index, len - index); }
+}
+
+void String::remove(unsigned int index, unsigned int count)
+{
+   if (index >= len) { return; }
+   if (count > len - index) { count = len - index; }
+   memmove(&buffer[index], &buffer[index + count], len - index - count + 1);
+   len -= count;
+}
+
+long String::toInt() const
+{
+   return atol(buffer);
+}
+
+/*
+ * Print
+ */
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+   size_t n = 0;
+   while (size--)
+   {
+      if (write(*buffer++)) { n++; }
+      else { break; }
+   }
+   return n;
+}
+
+// like the ESP32 core: formatted on the stack, anything longer than 63 characters on the heap
+size_t Print::printf(const char *format, ...)
+{
+   char loc[64];
+   char *temp = loc;
+   va_list arg;
+   va_list copy;
+
+   va_start(arg, format);
+   va_copy(copy, arg);
+   int len = vsnprintf(temp, sizeof(loc), format, copy);
+   va_end(copy);
+   if (len < 0)
+   {
+      va_end(arg);
+      return 0;
+   }
+   if (len >= (int)sizeof(loc))
+   {
+      temp = (char*)malloc(len + 1);
+      if (!temp)
+      {
+         va_end(arg);
+         return 0;
+      }
+      vsnprintf(temp, len + 1, format, arg);
+   }
+   va_end(arg);
+   len = write((const uint8_t*)temp, len);
+   if (temp != loc) { free(temp); }
+   return len;
+}
+
+size_t Print::printNumber(unsigned long value, int base, bool negative)
+{
+   char buf[8 * sizeof(long) + 2];
+   char *str = &buf[sizeof(buf) - 1];
+
+   if (base < 2) { base = 10; }
+   *str = 0;
+   do
+   {
+      int digit = value % base;
+      value /= base;
+      *--str = (digit < 10) ? '0' + digit : 'A' + digit - 10;
+   } while (value);
+   if (negative) { *--str = '-'; }
+   return write(str);
+}
+
+size_t Print::print(const char *str) { return write(str); }
+size_t Print::print(const String &str) { return write((const uint8_t*)str.c_str(), str.length()); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(unsigned char value, int base) { return printNumber(value, base, false); }
+size_t Print::print(unsigned int value, int base) { return printNumber(value, base, false); }
+size_t Print::print(unsigned long value, int base) { return printNumber(value, base, false); }
+size_t Print::print(const Printable &value) { return value.printTo(*this); }
+
+size_t Print::print(int value, int base)
+{
+   return print((long)value, base);
+}
+
+size_t Print::print(long value, int base)
+{
+   if ((base == 10) && (value < 0)) { return printNumber(-(unsigned long)value, 10, true); }
+   return printNumber((unsigned long)value, base, false);
+}
+
+size_t Print::print(double value, int digits)
+{
+   char buf[40];
+   snprintf(buf, sizeof(buf), "%.*f", digits, value);
+   return write(buf);
+}
+
+size_t Print::println() { return write("\r\n"); }
+size_t Print::println(const char *str) { return print(str) + println(); }
+size_t Print::println(const String &str) { return print(str) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(unsigned char value, int base) { return print(value, base) + println(); }
+size_t Print::println(int value, int base) { return print(value, base) + println(); }
+size_t Print::println(unsigned int value, int base) { return print(value, base) + println(); }
+size_t Print::println(long value, int base) { return print(value, base) + println(); }
+size_t Print::println(unsigned long value, int base) { return print(value, base) + println(); }
+size_t Print::println(double value, int digits) { return print(value, digits) + println(); }
+size_t Print::println(const Printable &value) { return print(value) + println(); }
+
+/*
+ * Serial
+ */
+
+void HardwareSerial::begin(unsigned long baud)
+{
+   (void)baud;
+}
+
+void HardwareSerial::end()
+{
+}
+
+int HardwareSerial::available()
+{
+   return current ? current->serialIn.size() : 0;
+}
+
+int HardwareSerial::read()
+{
+   if ((!current) || current->serialIn.empty()) { return -1; }
+   uint8_t c = current->serialIn.front();
+   current->serialIn.pop_front();
+   return c;
+}
+
+int HardwareSerial::peek()
+{
+   if ((!current) || current->serialIn.empty()) { return -1; }
+   return current->serialIn.front();
+}
+
+void HardwareSerial::flush()
+{
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+   return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+   simCoreScope scope;
+   if (!current)
+   {
+      fwrite(buffer, 1, size, stderr);
+      return size;
+   }
+   if (current->captureSerial) { current->serialOut.append((const char*)buffer, size); }
+   if (serialHook) { serialHook(current, buffer, size); }
+   if (realtime && (current->serialBaud > 0))
+   {
+      // 10 bit times per byte, the TX FIFO is not modelled
+      std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)size * 10000000ULL / current->serialBaud));
+   }
+   return size;
+}
+
+/*
+ * IPAddress, ESP
+ */
+
+IPAddress::IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+   address.bytes[0] = a;
+   address.bytes[1] = b;
+   address.bytes[2] = c;
+   address.bytes[3] = d;
+}
+
+size_t IPAddress::printTo(Print &p) const
+{
+   char buf[16];
+   snprintf(buf, sizeof(buf), "%u.%u.%u.%u", address.bytes[0], address.bytes[1], address.bytes[2], address.bytes[3]);
+   return p.print(buf);
+}
+
+String IPAddress::toString() const
+{
+   char buf[16];
+   snprintf(buf, sizeof(buf), "%u.%u.%u.%u", address.bytes[0], address.bytes[1], address.bytes[2], address.bytes[3]);
+   return String(buf);
+}
+
+void EspClass::restart()
+{
+   simReboot_t reboot = { 0 };
+   throw reboot;
+}
+
+uint32_t EspClass::getFreeHeap() { return 180000; }
+uint32_t EspClass::getMinFreeHeap() { return 170000; }
+uint32_t EspClass::getMaxAllocHeap() { return 110000; }
+uint32_t EspClass::getHeapSize() { return 320000; }
+uint32_t EspClass::getFreeSketchSpace() { return 1310720; }
+
+uint32_t EspClass::getSketchSize()
+{
+   return current ? current->image.size() : 0;
+}
+
+String EspClass::getSketchMD5()
+{
+   char hex[33];
+   if (!current) { return String(); }
+   simMD5Hex(current->image.data(), current->image.size(), hex);
+   return String(hex);
+}
+
+uint64_t EspClass::getEfuseMac()
+{
+   uint64_t mac = 0;
+   if (!current) { return 0; }
+   for (int i=0; i<6; i++) { mac |= (uint64_t)current->mac[i] << (8*i); }
+   return mac;
+}
+
+/*
+ * radio
+ */
+
+static uint32_t nextRandom(simDevice_t *dev)
+{
+   // xorshift32, deterministic per device
+   uint32_t x = dev->rng;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   dev->rng = x;
+   return x;
+}
+
+static void queueEvent(simDevice_t *dev, const uint64_t atUS, const system_event_id_t event, const uint8_t reason)
+{
+   simCoreScope scope;
+   simEvent_t ev = { atUS, event, reason };
+   std::deque<simEvent_t>::iterator it = dev->events.end();
+   while ((it != dev->events.begin()) && ((it - 1)->atUS > atUS)) { --it; }
+   dev->events.insert(it, ev);
+   if (eventHook) { eventHook(dev, atUS); }
+}
+
+static void dropConnection(simDevice_t *dev, const uint64_t atUS, const uint8_t reason)
+{
+   if (!dev->network) { return; }
+   dev->network->clients--;
+   dev->network = NULL;
+   dev->ip = IPAddress();
+   queueEvent(dev, atUS, SYSTEM_EVENT_STA_DISCONNECTED, reason);
+}
+
+static void cancelJoin(simDevice_t *dev)
+{
+   dev->joining = NULL;
+   dev->joinDueUS = UINT64_MAX;
+}
+
+static int8_t deviceRSSI(const simDevice_t *dev, const simNetwork_t *net)
+{
+   return net->rssi - (int8_t)(dev->id % 7);
+}
+
+// a connect attempt resolves once its time has come
+static void resolveJoin(simDevice_t *dev)
+{
+   simNetwork_t *net = dev->joining;
+   uint64_t due = dev->joinDueUS;
+   uint8_t reason = SIM_REASON_NO_AP_FOUND;
+
+   if ((dev->joinDueUS == UINT64_MAX) || (dev->nowUS < dev->joinDueUS)) { return; }
+   cancelJoin(dev);
+   if (net && net->up)
+   {
+      bool credentials;
+      if (net->authmode == WIFI_AUTH_OPEN)
+      {
+         credentials = true;
+      }
+      else if (net->authmode == WIFI_AUTH_WPA2_ENTERPRISE)
+      {
+         credentials = dev->enterprise && (dev->eapIdentity == net->identity) && (dev->eapPassword == net->password);
+      }
+      else
+      {
+         credentials = (!dev->enterprise) && dev->joinAdmitted;
+      }
+      net->attempts++;
+      uint64_t second = due / 1000000;
+      if (second != net->admitSecond)
+      {
+         net->admitSecond = second;
+         net->admitCount = 0;
+      }
+      if (!credentials)
+      {
+         reason = SIM_REASON_AUTH_FAIL;
+      }
+      else if ((net->admitPerSecond > 0) && (net->admitCount >= net->admitPerSecond))
+      {
+         net->rejected++;
+         reason = SIM_REASON_ASSOC_FAIL;
+      }
+      else
+      {
+         net->admitCount++;
+         net->admitted++;
+         net->clients++;
+         dev->network = net;
+         dev->ip = IPAddress(10, (uint8_t)((dev->id + 2) >> 16), (uint8_t)((dev->id + 2) >> 8), (uint8_t)(dev->id + 2));
+         queueEvent(dev, due, SYSTEM_EVENT_STA_CONNECTED, 0);
+         queueEvent(dev, due, SYSTEM_EVENT_STA_GOT_IP, 0);
+         return;
+      }
+   }
+   queueEvent(dev, due, SYSTEM_EVENT_STA_DISCONNECTED, reason);
+}
+
+static void fillScan(simDevice_t *dev)
+{
+   simCoreScope scope;
+   dev->scan.clear();
+   for (size_t n=0; n<networks.size(); n++)
+   {
+      simNetwork_t *net = networks[n];
+      if (!net->up) { continue; }
+      wifi_ap_record_t record;
+      memset(&record, 0, sizeof(record));
+      record.bssid[0] = 0x02;
+      record.bssid[5] = (uint8_t)n;
+      strncpy((char*)record.ssid, net->ssid.c_str(), sizeof(record.ssid) - 1);
+      record.primary = 1 + (n % 11);
+      record.rssi = deviceRSSI(dev, net);
+      record.authmode = net->authmode;
+      dev->scan.push_back(record);
+   }
+}
+
+static void resolveScan(simDevice_t *dev)
+{
+   if (dev->scanRunning && (dev->nowUS >= dev->scanDueUS))
+   {
+      dev->scanRunning = false;
+      fillScan(dev);
+   }
+}
+
+bool WiFiClass::mode(wifi_mode_t m)
+{
+   simCoreScope scope;
+   if (!current) { return false; }
+   if (!(m & WIFI_STA))
+   {
+      cancelJoin(current);
+      dropConnection(current, current->nowUS, SIM_REASON_ASSOC_LEAVE);
+   }
+   current->mode = m;
+   return true;
+}
+
+wifi_mode_t WiFiClass::getMode()
+{
+   return current ? current->mode : WIFI_OFF;
+}
+
+bool WiFiClass::enableAP(bool enable)
+{
+   wifi_mode_t m = getMode();
+   return mode((wifi_mode_t)(enable ? (m | WIFI_AP) : (m & ~WIFI_AP)));
+}
+
+bool WiFiClass::enableSTA(bool enable)
+{
+   wifi_mode_t m = getMode();
+   return mode((wifi_mode_t)(enable ? (m | WIFI_STA) : (m & ~WIFI_STA)));
+}
+
+bool WiFiClass::softAPConfig(IPAddress local, IPAddress gateway, IPAddress subnet)
+{
+   (void)gateway;
+   (void)subnet;
+   if (!current) { return false; }
+   current->softAPIP = local;
+   return true;
+}
+
+bool WiFiClass::softAP(const char *ssid, const char *passphrase)
+{
+   simCoreScope scope;
+   (void)passphrase;
+   if ((!current) || (!ssid) || (!(current->mode & WIFI_AP))) { return false; }
+   current->softAPSSID = ssid;
+   return true;
+}
+
+bool WiFiClass::softAPdisconnect(bool wifiOff)
+{
+   (void)wifiOff;
+   return enableAP(false);
+}
+
+IPAddress WiFiClass::softAPIP()
+{
+   return current ? current->softAPIP : IPAddress();
+}
+
+int WiFiClass::begin(const char *ssid, const char *passphrase)
+{
+   simCoreScope scope;
+   if ((!current) || (!ssid)) { return WL_CONNECT_FAILED; }
+   simDevice_t *dev = current;
+   if (!(dev->mode & WIFI_STA)) { dev->mode = (wifi_mode_t)(dev->mode | WIFI_STA); }
+   dropConnection(dev, dev->nowUS, SIM_REASON_ASSOC_LEAVE);
+   simNetwork_t *net = simFindNetwork(ssid);
+   uint32_t connectMS = net ? net->connectMS : SIM_DEFAULT_CONNECT_MS;
+   uint32_t jitterMS = (net && (net->connectJitterMS > 0)) ? nextRandom(dev) % net->connectJitterMS : 0;
+   dev->joining = net;
+   dev->joinAdmitted = net && ((net->authmode == WIFI_AUTH_OPEN) ||
+                               (net->password == (passphrase ? passphrase : "")));
+   dev->joinDueUS = dev->nowUS + (uint64_t)(connectMS + jitterMS) * 1000;
+   if (eventHook) { eventHook(dev, dev->joinDueUS); }
+   return WL_DISCONNECTED;
+}
+
+bool WiFiClass::disconnect(bool wifiOff)
+{
+   simCoreScope scope;
+   if (!current) { return false; }
+   cancelJoin(current);
+   dropConnection(current, current->nowUS, SIM_REASON_ASSOC_LEAVE);
+   if (wifiOff) { current->mode = WIFI_OFF; }
+   return true;
+}
+
+bool WiFiClass::isConnected()
+{
+   return current && current->network;
+}
+
+wl_status_t WiFiClass::status()
+{
+   return isConnected() ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+bool WiFiClass::setHostname(const char *hostname)
+{
+   simCoreScope scope;
+   if ((!current) || (!hostname)) { return false; }
+   current->hostname = hostname;
+   return true;
+}
+
+bool WiFiClass::setSleep(bool enable)
+{
+   if (!current) { return false; }
+   current->sleep = enable;
+   return true;
+}
+
+bool WiFiClass::getSleep()
+{
+   return current && current->sleep;
+}
+
+IPAddress WiFiClass::localIP()
+{
+   return current ? current->ip : IPAddress();
+}
+
+uint8_t *WiFiClass::macAddress(uint8_t *mac)
+{
+   if (current) { memcpy(mac, current->mac, 6); }
+   return mac;
+}
+
+String WiFiClass::macAddress()
+{
+   uint8_t mac[6] = { 0 };
+   char buf[18];
+   macAddress(mac);
+   snprintf(buf, sizeof(buf), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+   return String(buf);
+}
+
+String WiFiClass::SSID()
+{
+   return (current && current->network) ? String(current->network->ssid.c_str()) : String();
+}
+
+String WiFiClass::SSID(uint8_t i)
+{
+   return (current && (i < current->scan.size())) ? String((const char*)current->scan[i].ssid) : String();
+}
+
+int32_t WiFiClass::RSSI()
+{
+   return (current && current->network) ? deviceRSSI(current, current->network) : 0;
+}
+
+int32_t WiFiClass::RSSI(uint8_t i)
+{
+   return (current && (i < current->scan.size())) ? current->scan[i].rssi : 0;
+}
+
+wifi_auth_mode_t WiFiClass::encryptionType(uint8_t i)
+{
+   return (current && (i < current->scan.size())) ? current->scan[i].authmode : WIFI_AUTH_OPEN;
+}
+
+// a blocking scan returns at once, an async one completes after SIM_SCAN_MS
+int16_t WiFiClass::scanNetworks(bool async, bool showHidden, bool passive, uint32_t maxMSPerChannel)
+{
+   simCoreScope scope;
+   (void)showHidden;
+   (void)passive;
+   (void)maxMSPerChannel;
+   if (!current) { return WIFI_SCAN_FAILED; }
+   if (current->scanRunning) { return WIFI_SCAN_RUNNING; }
+   if (async)
+   {
+      current->scan.clear();
+      current->scanRunning = true;
+      current->scanDueUS = current->nowUS + SIM_SCAN_MS * 1000ULL;
+      if (eventHook) { eventHook(current, current->scanDueUS); }
+      return WIFI_SCAN_RUNNING;
+   }
+   fillScan(current);
+   return current->scan.size();
+}
+
+int16_t WiFiClass::scanComplete()
+{
+   if (!current) { return WIFI_SCAN_FAILED; }
+   deviceNow();
+   resolveScan(current);
+   if (current->scanRunning) { return WIFI_SCAN_RUNNING; }
+   return current->scan.size();
+}
+
+void WiFiClass::scanDelete()
+{
+   simCoreScope scope;
+   if (current) { current->scan.clear(); }
+}
+
+void *WiFiClass::getScanInfoByIndex(int i)
+{
+   if ((!current) || (i < 0) || ((size_t)i >= current->scan.size())) { return NULL; }
+   return &current->scan[i];
+}
+
+wifi_event_id_t WiFiClass::onEvent(WiFiEventFuncCb cb, system_event_id_t event)
+{
+   simCoreScope scope;
+   if (!current) { return 0; }
+   wifi_event_id_t id = ++current->nextHandlerId;
+   simHandler_t handler;
+   handler.filter = event;
+   handler.cb = cb;
+   current->handlers[id] = handler;
+   return id;
+}
+
+void WiFiClass::removeEvent(wifi_event_id_t id)
+{
+   simCoreScope scope;
+   if (current) { current->handlers.erase(id); }
+}
+
+/*
+ * TCP
+ */
+
+uint8_t WiFiClient::connected()
+{
+   return conn && (!conn->deviceClosed) && ((!conn->peerClosed) || (!conn->toDevice.empty()));
+}
+
+int WiFiClient::available()
+{
+   return (conn && (!conn->deviceClosed)) ? conn->toDevice.size() : 0;
+}
+
+int WiFiClient::read()
+{
+   if ((!conn) || conn->toDevice.empty()) { return -1; }
+   uint8_t c = conn->toDevice.front();
+   conn->toDevice.pop_front();
+   return c;
+}
+
+int WiFiClient::read(uint8_t *buf, size_t size)
+{
+   size_t n = 0;
+   if (!conn) { return -1; }
+   while ((n < size) && (!conn->toDevice.empty()))
+   {
+      buf[n++] = conn->toDevice.front();
+      conn->toDevice.pop_front();
+   }
+   return n;
+}
+
+int WiFiClient::peek()
+{
+   return (conn && (!conn->toDevice.empty())) ? conn->toDevice.front() : -1;
+}
+
+void WiFiClient::stop()
+{
+   if (conn) { conn->deviceClosed = true; }
+   conn.reset();
+}
+
+size_t WiFiClient::write(uint8_t c)
+{
+   return write(&c, 1);
+}
+
+size_t WiFiClient::write(const uint8_t *buffer, size_t size)
+{
+   simCoreScope scope;
+   if ((!conn) || conn->deviceClosed || conn->peerClosed) { return 0; }
+   conn->toPeer.append((const char*)buffer, size);
+   return size;
+}
+
+IPAddress WiFiClient::remoteIP()
+{
+   return conn ? conn->remote : IPAddress();
+}
+
+static simListener_t *findListener(simDevice_t *dev, const uint16_t port)
+{
+   for (size_t i=0; dev && (i<dev->listeners.size()); i++)
+   {
+      if (dev->listeners[i].port == port) { return &dev->listeners[i]; }
+   }
+   return NULL;
+}
+
+void WiFiServer::begin(uint16_t portN)
+{
+   simCoreScope scope;
+   if (portN > 0) { port = portN; }
+   if (!current) { return; }
+   dev = current;
+   if (!findListener(dev, port))
+   {
+      simListener_t listener;
+      listener.port = port;
+      dev->listeners.push_back(listener);
+   }
+}
+
+void WiFiServer::stop()
+{
+   simCoreScope scope;
+   if (!dev) { return; }
+   for (size_t i=0; i<dev->listeners.size(); i++)
+   {
+      if (dev->listeners[i].port == port)
+      {
+         dev->listeners.erase(dev->listeners.begin() + i);
+         break;
+      }
+   }
+   dev = NULL;
+}
+
+bool WiFiServer::hasClient()
+{
+   simListener_t *listener = findListener(dev, port);
+   return listener && (!listener->backlog.empty());
+}
+
+WiFiClient WiFiServer::available()
+{
+   simCoreScope scope;
+   simListener_t *listener = findListener(dev, port);
+   if ((!listener) || listener->backlog.empty()) { return WiFiClient(); }
+   std::shared_ptr<simConn_t> conn = listener->backlog.front();
+   listener->backlog.pop_front();
+   return WiFiClient(conn);
+}
+
+/*
+ * UDP
+ */
+
+static simUdpSocket_t *findSocket(simDevice_t *dev, const uint16_t port)
+{
+   for (size_t i=0; dev && (i<dev->udp.size()); i++)
+   {
+      if (dev->udp[i].port == port) { return &dev->udp[i]; }
+   }
+   return NULL;
+}
+
+uint8_t WiFiUDP::begin(uint16_t portN)
+{
+   simCoreScope scope;
+   if (!current) { return 0; }
+   stop();
+   dev = current;
+   port = portN;
+   if (!findSocket(dev, port))
+   {
+      simUdpSocket_t socket;
+      socket.port = port;
+      dev->udp.push_back(socket);
+   }
+   return 1;
+}
+
+void WiFiUDP::stop()
+{
+   simCoreScope scope;
+   if (!dev) { return; }
+   for (size_t i=0; i<dev->udp.size(); i++)
+   {
+      if (dev->udp[i].port == port)
+      {
+         dev->udp.erase(dev->udp.begin() + i);
+         break;
+      }
+   }
+   dev = NULL;
+}
+
+int WiFiUDP::parsePacket()
+{
+   simCoreScope scope;
+   simUdpSocket_t *socket = findSocket(dev, port);
+   rx.clear();
+   rxPos = 0;
+   if ((!socket) || socket->inbox.empty()) { return 0; }
+   rx = socket->inbox.front().data;
+   remote = socket->inbox.front().from;
+   remotePortN = socket->inbox.front().fromPort;
+   socket->inbox.pop_front();
+   return rx.size();
+}
+
+int WiFiUDP::available()
+{
+   return rx.size() - rxPos;
+}
+
+int WiFiUDP::read()
+{
+   return (rxPos < rx.size()) ? (uint8_t)rx[rxPos++] : -1;
+}
+
+int WiFiUDP::read(uint8_t *buffer, size_t len)
+{
+   size_t n = std::min(len, rx.size() - rxPos);
+   memcpy(buffer, rx.data() + rxPos, n);
+   rxPos += n;
+   return n;
+}
+
+int WiFiUDP::peek()
+{
+   return (rxPos < rx.size()) ? (uint8_t)rx[rxPos] : -1;
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t portN)
+{
+   simCoreScope scope;
+   txIP = ip;
+   txPort = portN;
+   tx.clear();
+   return 1;
+}
+
+size_t WiFiUDP::write(uint8_t c)
+{
+   return write(&c, 1);
+}
+
+size_t WiFiUDP::write(const uint8_t *buffer, size_t size)
+{
+   simCoreScope scope;
+   tx.append((const char*)buffer, size);
+   return size;
+}
+
+int WiFiUDP::endPacket()
+{
+   simCoreScope scope;
+   if (udpHook && dev) { udpHook(dev, txIP, txPort, (const uint8_t*)tx.data(), tx.size()); }
+   tx.clear();
+   return 1;
+}
+
+/*
+ * EEPROM, flash backed like the NVS blob of the core
+ */
+
+bool EEPROMClass::begin(size_t size)
+{
+   simCoreScope scope;
+   if (!current) { return false; }
+   current->eeprom.assign(size, 0);
+   memcpy(current->eeprom.data(), current->flash.data(), std::min(size, current->flash.size()));
+   return true;
+}
+
+void EEPROMClass::end()
+{
+   simCoreScope scope;
+   if (current) { current->eeprom.clear(); }
+}
+
+uint8_t EEPROMClass::read(int address)
+{
+   if ((!current) || (address < 0) || ((size_t)address >= current->eeprom.size())) { return 0; }
+   return current->eeprom[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value)
+{
+   if ((!current) || (address < 0) || ((size_t)address >= current->eeprom.size())) { return; }
+   current->eeprom[address] = value;
+}
+
+bool EEPROMClass::commit()
+{
+   simCoreScope scope;
+   if ((!current) || current->eeprom.empty()) { return false; }
+   current->flash = current->eeprom;
+   current->commits++;
+   return true;
+}
+
+uint8_t *EEPROMClass::getDataPtr()
+{
+   return (current && (!current->eeprom.empty())) ? current->eeprom.data() : NULL;
+}
+
+const uint8_t *EEPROMClass::getConstDataPtr() const
+{
+   return (current && (!current->eeprom.empty())) ? current->eeprom.data() : NULL;
+}
+
+uint16_t EEPROMClass::length()
+{
+   return current ? current->eeprom.size() : 0;
+}
+
+/*
+ * mDNS
+ */
+
+bool MDNSResponder::begin(const char *hostName)
+{
+   simCoreScope scope;
+   if ((!current) || (!hostName)) { return false; }
+   current->mdnsHost = hostName;
+   return true;
+}
+
+void MDNSResponder::end()
+{
+   simCoreScope scope;
+   if (current)
+   {
+      current->mdnsHost.clear();
+      current->mdnsTxt.clear();
+   }
+}
+
+bool MDNSResponder::addService(const char *service, const char *proto, uint16_t port)
+{
+   simCoreScope scope;
+   char value[8];
+   if ((!current) || current->mdnsHost.empty()) { return false; }
+   snprintf(value, sizeof(value), "%u", port);
+   current->mdnsTxt[std::string("_") + service + "._" + proto] = value;
+   return true;
+}
+
+bool MDNSResponder::addServiceTxt(const char *service, const char *proto, const char *key, const char *value)
+{
+   simCoreScope scope;
+   if ((!current) || current->mdnsHost.empty()) { return false; }
+   current->mdnsTxt[std::string("_") + service + "._" + proto + "/" + key] = value;
+   return true;
+}
+
+void MDNSResponder::enableArduino(uint16_t port, bool auth)
+{
+   (void)port;
+   (void)auth;
+}
+
+/*
+ * Update and the running image
+ */
+
+bool UpdateClass::begin(size_t size, int command)
+{
+   simCoreScope scope;
+   if ((!current) || current->updateRunning || (command != U_FLASH)) { return false; }
+   current->update.clear();
+   current->update.reserve((size == UPDATE_SIZE_UNKNOWN) ? 0 : size);
+   current->updateSize = size;
+   current->updateMD5.clear();
+   current->updateRunning = true;
+   current->updateError = false;
+   return true;
+}
+
+size_t UpdateClass::write(uint8_t *data, size_t len)
+{
+   simCoreScope scope;
+   if ((!current) || (!current->updateRunning) || current->updateError) { return 0; }
+   if ((current->updateSize != UPDATE_SIZE_UNKNOWN) && (current->update.size() + len > current->updateSize))
+   {
+      current->updateError = true;
+      return 0;
+   }
+   current->update.insert(current->update.end(), data, data + len);
+   return len;
+}
+
+bool UpdateClass::setMD5(const char *expectedMD5)
+{
+   simCoreScope scope;
+   if ((!current) || (!expectedMD5) || (strlen(expectedMD5) != 32)) { return false; }
+   current->updateMD5 = expectedMD5;
+   std::transform(current->updateMD5.begin(), current->updateMD5.end(), current->updateMD5.begin(), ::tolower);
+   return true;
+}
+
+bool UpdateClass::end(bool evenIfRemaining)
+{
+   simCoreScope scope;
+   char md5[33];
+   if ((!current) || (!current->updateRunning)) { return false; }
+   current->updateRunning = false;
+   if (current->updateError) { return false; }
+   if ((!evenIfRemaining) && (current->updateSize != UPDATE_SIZE_UNKNOWN) &&
+       (current->update.size() != current->updateSize))
+   {
+      current->updateError = true;
+      return false;
+   }
+   simMD5Hex(current->update.data(), current->update.size(), md5);
+   if ((!current->updateMD5.empty()) && (current->updateMD5 != md5))
+   {
+      current->updateError = true;
+      return false;
+   }
+   current->nextImage = current->update;
+   current->nextImageMD5 = md5;
+   return true;
+}
+
+void UpdateClass::abort()
+{
+   if (current)
+   {
+      current->updateRunning = false;
+      current->updateError = true;
+   }
+}
+
+bool UpdateClass::hasError()
+{
+   return current && current->updateError;
+}
+
+bool UpdateClass::isRunning()
+{
+   return current && current->updateRunning;
+}
+
+void UpdateClass::printError(Print &out)
+{
+   out.println("Update error");
+}
+
+const esp_partition_t *esp_ota_get_running_partition()
+{
+   static esp_partition_t running = { 0x10000, 0, "app0" };
+   running.size = current ? current->image.size() : 0;
+   return &running;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t srcOffset, void *dst, size_t size)
+{
+   (void)partition;
+   if ((!current) || (srcOffset > current->image.size()) || (size > current->image.size() - srcOffset))
+   {
+      return ESP_FAIL;
+   }
+   memcpy(dst, &current->image[srcOffset], size);
+   return ESP_OK;
+}
+
+/*
+ * ArduinoOTA, an offered image is received within one handle() call
+ */
+
+ArduinoOTAClass &ArduinoOTAClass::setPort(uint16_t port)
+{
+   (void)port;
+   return *this;
+}
+
+ArduinoOTAClass &ArduinoOTAClass::setHostname(const char *hostname)
+{
+   simCoreScope scope;
+   if (current && hostname) { current->otaHostname = hostname; }
+   return *this;
+}
+
+ArduinoOTAClass &ArduinoOTAClass::setPassword(const char *password)
+{
+   simCoreScope scope;
+   if (current && password) { current->otaPassword = password; }
+   return *this;
+}
+
+ArduinoOTAClass &ArduinoOTAClass::setMdnsEnabled(bool enabled)
+{
+   (void)enabled;
+   return *this;
+}
+
+ArduinoOTAClass &ArduinoOTAClass::onStart(THandlerFunction fn)
+{
+   simCoreScope scope;
+   if (current) { current->otaOnStart = fn; }
+   return *this;
+}
+
+ArduinoOTAClass &ArduinoOTAClass::onEnd(THandlerFunction fn)
+{
+   simCoreScope scope;
+   if (current) { current->otaOnEnd = fn; }
+   return *this;
+}
+
+ArduinoOTAClass &ArduinoOTAClass::onError(THandlerFunction_Error fn)
+{
+   simCoreScope scope;
+   if (current) { current->otaOnError = fn; }
+   return *this;
+}
+
+ArduinoOTAClass &ArduinoOTAClass::onProgress(THandlerFunction_Progress fn)
+{
+   simCoreScope scope;
+   if (current) { current->otaOnProgress = fn; }
+   return *this;
+}
+
+void ArduinoOTAClass::begin()
+{
+   simCoreScope scope;
+   if (!current) { return; }
+   current->otaStarted = true;
+   if (current->mdnsHost.empty()) { MDNS.begin(current->otaHostname.c_str()); }
+}
+
+void ArduinoOTAClass::end()
+{
+   if (current) { current->otaStarted = false; }
+}
+
+int ArduinoOTAClass::getCommand()
+{
+   return U_FLASH;
+}
+
+void ArduinoOTAClass::handle()
+{
+   simDevice_t *dev = current;
+   if ((!dev) || (!dev->otaStarted) || (dev->otaOffer.empty() && (!dev->otaStream.read))) { return; }
+
+   std::vector<uint8_t> image;
+   std::string password;
+   simOtaStream_t stream;
+   {
+      simCoreScope scope;
+      image.swap(dev->otaOffer);
+      password.swap(dev->otaOfferPassword);
+      stream = dev->otaStream;
+      dev->otaStream = simOtaStream_t();
+      if (stream.read) { image.resize(dev->otaChunk); }
+   }
+   size_t len = stream.read ? stream.len : image.size();
+   if ((!dev->otaPassword.empty()) && (password != dev->otaPassword))
+   {
+      if (dev->otaOnError) { dev->otaOnError(OTA_AUTH_ERROR); }
+      return;
+   }
+   if (!Update.begin(len, U_FLASH))
+   {
+      if (dev->otaOnError) { dev->otaOnError(OTA_BEGIN_ERROR); }
+      return;
+   }
+   if (dev->otaOnStart) { dev->otaOnStart(); }
+   char md5[33];
+   if (stream.read)
+   {
+      snprintf(md5, sizeof(md5), "%s", stream.md5.c_str());
+   }
+   else
+   {
+      simMD5Hex(image.data(), image.size(), md5);
+   }
+   Update.setMD5(md5);
+   size_t written = 0;
+   if (dev->otaOnProgress) { dev->otaOnProgress(0, len); }
+   while (written < len)
+   {
+      size_t n = std::min((size_t)dev->otaChunk, len - written);
+      uint8_t *data = &image[written];
+      if (stream.read)
+      {
+         n = stream.read(image.data(), n);
+         data = image.data();
+      }
+      if (!realtime) { dev->nowUS += dev->otaChunkUS; }
+      if ((n == 0) || (Update.write(data, n) != n))
+      {
+         Update.abort();
+         if (dev->otaOnError) { dev->otaOnError(OTA_RECEIVE_ERROR); }
+         return;
+      }
+      written += n;
+      if (stream.reply)
+      {
+         char taken[12];
+         snprintf(taken, sizeof(taken), "%u", (unsigned)n);
+         stream.reply(taken);
+      }
+      if (dev->otaOnProgress) { dev->otaOnProgress(written, len); }
+   }
+   if (!Update.end())
+   {
+      if (dev->otaOnError) { dev->otaOnError(OTA_END_ERROR); }
+      return;
+   }
+   if (stream.reply) { stream.reply("OK"); }
+   if (dev->otaOnEnd) { dev->otaOnEnd(); }
+   ESP.restart();
+}
+
+/*
+ * sleep and enterprise credentials
+ */
+
+esp_err_t esp_sleep_pd_config(esp_sleep_pd_domain_t domain, esp_sleep_pd_option_t option)
+{
+   (void)domain;
+   (void)option;
+   return ESP_OK;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause()
+{
+   return (current && (current->resetReason == SIM_RST_DEEPSLEEP)) ? ESP_SLEEP_WAKEUP_TIMER : ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+esp_reset_reason_t esp_reset_reason()
+{
+   if (!current) { return ESP_RST_UNKNOWN; }
+   switch (current->resetReason)
+   {
+      case SIM_RST_POWERON:
+           return ESP_RST_POWERON;
+      case SIM_RST_EXT:
+           return ESP_RST_EXT;
+      case SIM_RST_DEEPSLEEP:
+           return ESP_RST_DEEPSLEEP;
+      default:
+           return ESP_RST_SW;
+   }
+}
+
+void esp_deep_sleep(uint64_t timeUS)
+{
+   simReboot_t reboot = { timeUS };
+   throw reboot;
+}
+
+esp_err_t esp_wifi_sta_wpa2_ent_set_identity(const unsigned char *identity, int len)
+{
+   simCoreScope scope;
+   if (current) { current->eapIdentity.assign((const char*)identity, len); }
+   return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_wpa2_ent_set_username(const unsigned char *username, int len)
+{
+   simCoreScope scope;
+   if (current) { current->eapUsername.assign((const char*)username, len); }
+   return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_wpa2_ent_set_password(const unsigned char *password, int len)
+{
+   simCoreScope scope;
+   if (current) { current->eapPassword.assign((const char*)password, len); }
+   return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_wpa2_ent_enable()
+{
+   if (current) { current->enterprise = true; }
+   return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_wpa2_ent_disable()
+{
+   if (current) { current->enterprise = false; }
+   return ESP_OK;
+}
+
+/*
+ * simulator
+ */
+
+simDevice_t *simCreateDevice(const uint32_t id)
+{
+   simCoreScope scope;
+   simDevice_t *dev = new simDevice_t();
+   static const uint8_t sketch[] = "iotconfig host sketch";
+
+   dev->id = id;
+   dev->mac[0] = 0x24;
+   dev->mac[1] = 0x0A;
+   dev->mac[2] = 0xC4;
+   dev->mac[3] = (uint8_t)(id >> 16);
+   dev->mac[4] = (uint8_t)(id >> 8);
+   dev->mac[5] = (uint8_t)id;
+   dev->rng = 0x9E3779B9u ^ (id * 2654435761u);
+   if (dev->rng == 0) { dev->rng = 1; }
+   dev->nowUS = realtime ? wallUS() : fallbackUS;
+   dev->image.assign(sketch, sketch + sizeof(sketch) - 1);
+   for (size_t i=0; i<sizeof(dev->pins)/sizeof(dev->pins[0]); i++) { dev->pins[i] = HIGH; }
+   devices.push_back(dev);
+   simBoot(dev, SIM_RST_POWERON);
+   return dev;
+}
+
+void simDestroyDevice(simDevice_t *dev)
+{
+   simCoreScope scope;
+   if (!dev) { return; }
+   if (dev->network) { dev->network->clients--; }
+   devices.erase(std::remove(devices.begin(), devices.end(), dev), devices.end());
+   if (current == dev) { current = NULL; }
+   delete dev;
+}
+
+void simSelect(simDevice_t *dev)
+{
+   current = dev;
+}
+
+simDevice_t *simCurrent()
+{
+   return current;
+}
+
+void simBoot(simDevice_t *dev, const simResetReason_t reason)
+{
+   simCoreScope scope;
+   if (dev->network) { dev->network->clients--; }
+   dev->network = NULL;
+   dev->ip = IPAddress();
+   cancelJoin(dev);
+   dev->mode = WIFI_OFF;
+   dev->sleep = true;
+   dev->enterprise = false;
+   dev->scan.clear();
+   dev->scanRunning = false;
+   dev->events.clear();
+   dev->handlers.clear();
+   dev->listeners.clear();
+   dev->udp.clear();
+   dev->eeprom.clear();
+   dev->mdnsHost.clear();
+   dev->mdnsTxt.clear();
+   dev->otaStarted = false;
+   dev->otaOnStart = NULL;
+   dev->otaOnEnd = NULL;
+   dev->otaOnError = NULL;
+   dev->otaOnProgress = NULL;
+   dev->otaOffer.clear();
+   dev->otaStream = simOtaStream_t();
+   dev->updateRunning = false;
+   if (!dev->nextImage.empty())
+   {
+      dev->image.swap(dev->nextImage);
+      dev->nextImage.clear();
+   }
+   if (realtime) { dev->nowUS = wallUS(); }
+   dev->bootUS = dev->nowUS;
+   dev->wakeUS = 0;
+   dev->resetReason = reason;
+   dev->boots++;
+}
+
+void simSetSketch(simDevice_t *dev, const uint8_t *image, const size_t len)
+{
+   simCoreScope scope;
+   dev->image.assign(image, image + len);
+}
+
+void simSetRealtime(const bool realtimeN)
+{
+   realtime = realtimeN;
+}
+
+bool simRealtime()
+{
+   return realtime;
+}
+
+void simSetTime(simDevice_t *dev, const uint64_t nowUS)
+{
+   if (nowUS > dev->nowUS) { dev->nowUS = nowUS; }
+}
+
+void simAdvance(simDevice_t *dev, const uint64_t us)
+{
+   dev->nowUS += us;
+}
+
+uint64_t simNextEvent(simDevice_t *dev)
+{
+   uint64_t next = dev->joinDueUS;
+   if (dev->scanRunning) { next = std::min(next, dev->scanDueUS); }
+   if (!dev->events.empty()) { next = std::min(next, dev->events.front().atUS); }
+   return next;
+}
+
+void simDeliver(simDevice_t *dev)
+{
+   simDevice_t *previous = current;
+
+   current = dev;
+   deviceNow();
+   resolveJoin(dev);
+   resolveScan(dev);
+   while ((!dev->events.empty()) && (dev->events.front().atUS <= dev->nowUS))
+   {
+      simEvent_t ev = dev->events.front();
+      std::vector<WiFiEventFuncCb> callbacks;
+      {
+         simCoreScope scope;
+         dev->events.pop_front();
+         for (std::map<wifi_event_id_t, simHandler_t>::iterator it = dev->handlers.begin(); it != dev->handlers.end(); ++it)
+         {
+            if ((it->second.filter == SYSTEM_EVENT_MAX) || (it->second.filter == ev.event))
+            {
+               callbacks.push_back(it->second.cb);
+            }
+         }
+      }
+      system_event_info_t info;
+      info.reason = ev.reason;
+      for (size_t i=0; i<callbacks.size(); i++)
+      {
+         callbacks[i](ev.event, info);
+      }
+      simCoreScope scope;
+      callbacks.clear();
+   }
+   current = previous;
+}
+
+void simSetEventHook(void (*hook)(simDevice_t *dev, uint64_t atUS))
+{
+   eventHook = hook;
+}
+
+void simSetPollHook(void (*hook)())
+{
+   pollHook = hook;
+}
+
+simNetwork_t *simAddNetwork(const char *ssid, const char *password, const wifi_auth_mode_t authmode, const int8_t rssi)
+{
+   simCoreScope scope;
+   simNetwork_t *net = new simNetwork_t();
+   net->ssid = ssid;
+   net->password = password ? password : "";
+   net->authmode = authmode;
+   net->rssi = rssi;
+   net->up = true;
+   net->connectMS = SIM_DEFAULT_CONNECT_MS;
+   net->admitSecond = UINT64_MAX;
+   networks.push_back(net);
+   return net;
+}
+
+simNetwork_t *simFindNetwork(const char *ssid)
+{
+   for (size_t n=0; n<networks.size(); n++)
+   {
+      if (networks[n]->ssid == ssid) { return networks[n]; }
+   }
+   return NULL;
+}
+
+// a network going down drops its clients, each notices it at its own clock
+void simSetNetworkUp(simNetwork_t *net, const bool up)
+{
+   net->up = up;
+   if (up) { return; }
+   for (size_t i=0; i<devices.size(); i++)
+   {
+      if (devices[i]->network == net)
+      {
+         dropConnection(devices[i], devices[i]->nowUS, SIM_REASON_BEACON_TIMEOUT);
+      }
+   }
+}
+
+void simClearNetworks()
+{
+   simCoreScope scope;
+   for (size_t i=0; i<devices.size(); i++)
+   {
+      devices[i]->network = NULL;
+      cancelJoin(devices[i]);
+   }
+   for (size_t n=0; n<networks.size(); n++) { delete networks[n]; }
+   networks.clear();
+}
+
+std::shared_ptr<simConn_t> simConnect(simDevice_t *dev, const uint16_t port, const IPAddress &from)
+{
+   simCoreScope scope;
+   simListener_t *listener = findListener(dev, port);
+   if (!listener) { return std::shared_ptr<simConn_t>(); }
+   std::shared_ptr<simConn_t> conn(new simConn_t());
+   conn->dev = dev;
+   conn->port = port;
+   conn->remote = from;
+   conn->deviceClosed = false;
+   conn->peerClosed = false;
+   listener->backlog.push_back(conn);
+   return conn;
+}
+
+void simSend(const std::shared_ptr<simConn_t> &conn, const void *data, const size_t len)
+{
+   simCoreScope scope;
+   if ((!conn) || conn->peerClosed) { return; }
+   conn->toDevice.insert(conn->toDevice.end(), (const uint8_t*)data, (const uint8_t*)data + len);
+}
+
+std::string simReceive(const std::shared_ptr<simConn_t> &conn)
+{
+   simCoreScope scope;
+   std::string data;
+   if (conn) { data.swap(conn->toPeer); }
+   return data;
+}
+
+void simClose(const std::shared_ptr<simConn_t> &conn)
+{
+   if (conn) { conn->peerClosed = true; }
+}
+
+bool simListening(simDevice_t *dev, const uint16_t port)
+{
+   return findListener(dev, port) != NULL;
+}
+
+bool simSendUdp(simDevice_t *dev, const uint16_t port, const IPAddress &from, const uint16_t fromPort,
+                const void *data, const size_t len)
+{
+   simCoreScope scope;
+   simUdpSocket_t *socket = findSocket(dev, port);
+   if (!socket) { return false; }
+   simDatagram_t datagram;
+   datagram.from = from;
+   datagram.fromPort = fromPort;
+   datagram.data.assign((const char*)data, len);
+   socket->inbox.push_back(datagram);
+   return true;
+}
+
+void simSetUdpHook(void (*hook)(simDevice_t *dev, const IPAddress &to, const uint16_t port,
+                                const uint8_t *data, const size_t len))
+{
+   udpHook = hook;
+}
+
+void simSerialInput(simDevice_t *dev, const void *data, const size_t len)
+{
+   simCoreScope scope;
+   dev->serialIn.insert(dev->serialIn.end(), (const uint8_t*)data, (const uint8_t*)data + len);
+}
+
+void simSetSerialHook(void (*hook)(simDevice_t *dev, const uint8_t *data, const size_t len))
+{
+   serialHook = hook;
+}
+
+void simOfferOTA(simDevice_t *dev, const uint8_t *image, const size_t len, const char *password,
+                 const uint32_t chunk, const uint32_t chunkUS)
+{
+   simCoreScope scope;
+   dev->otaOffer.assign(image, image + len);
+   dev->otaOfferPassword = password ? password : "";
+   dev->otaChunk = chunk ? chunk : 1460;
+   dev->otaChunkUS = chunkUS;
+}
+
+void simStreamOTA(simDevice_t *dev, const simOtaStream_t &stream, const char *password, const uint32_t chunk)
+{
+   simCoreScope scope;
+   dev->otaStream = stream;
+   dev->otaOfferPassword = password ? password : "";
+   dev->otaChunk = chunk ? chunk : 1460;
+}
@@ -0,0 +1,4 @@
+#ifndef HOST_DRIVER_RTC_IO_H
+#define HOST_DRIVER_RTC_IO_H HOST_DRIVER_RTC_IO_H
+
+#endif
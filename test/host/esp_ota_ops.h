@@ -0,0 +1,9 @@
+#ifndef HOST_ESP_OTA_OPS_H
+#define HOST_ESP_OTA_OPS_H HOST_ESP_OTA_OPS_H
+
+#include "esp_partition.h"
+
+// the running image of the selected device
+const esp_partition_t *esp_ota_get_running_partition();
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef HOST_ESP_PARTITION_H
+#define HOST_ESP_PARTITION_H HOST_ESP_PARTITION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+typedef int esp_err_t;
+
+typedef struct
+{
+   uint32_t address;
+   uint32_t size;
+   char label[17];
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t srcOffset, void *dst, size_t size);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef HOST_ESP_SLEEP_H
+#define HOST_ESP_SLEEP_H HOST_ESP_SLEEP_H
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+typedef enum { ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_DOMAIN_RTC_SLOW_MEM, ESP_PD_DOMAIN_RTC_FAST_MEM } esp_sleep_pd_domain_t;
+typedef enum { ESP_PD_OPTION_OFF, ESP_PD_OPTION_ON, ESP_PD_OPTION_AUTO } esp_sleep_pd_option_t;
+typedef enum
+{
+   ESP_SLEEP_WAKEUP_UNDEFINED,
+   ESP_SLEEP_WAKEUP_ALL,
+   ESP_SLEEP_WAKEUP_EXT0,
+   ESP_SLEEP_WAKEUP_EXT1,
+   ESP_SLEEP_WAKEUP_TIMER
+} esp_sleep_wakeup_cause_t;
+
+esp_err_t esp_sleep_pd_config(esp_sleep_pd_domain_t domain, esp_sleep_pd_option_t option);
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause();
+// throws simReboot_t, the harness boots the device again when the timer expires
+void esp_deep_sleep(uint64_t timeUS) __attribute__((noreturn));
+
+#endif
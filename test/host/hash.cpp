@@ -0,0 +1,226 @@
+/*
+ * MD5 (RFC 1321), SHA-256 (FIPS 180-4) and HMAC-SHA256 (RFC 2104) for the
+ * host port: sketch MD5, Update MD5 check, mbedtls_md_hmac().
+ */
+
+#include "sim.h"
+#include "mbedtls/md.h"
+
+static uint32_t rotl(const uint32_t x, const int n)
+{
+   return (x << n) | (x >> (32 - n));
+}
+
+static uint32_t rotr(const uint32_t x, const int n)
+{
+   return (x >> n) | (x << (32 - n));
+}
+
+static void md5Block(uint32_t state[4], const uint8_t *block)
+{
+   static const uint32_t k[64] = {
+      0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+      0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+      0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+      0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+      0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+      0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+      0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+      0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+   };
+   static const int r[64] = {
+      7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+      5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+      4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+      6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+   };
+   uint32_t m[16];
+   uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+   for (int i=0; i<16; i++)
+   {
+      m[i] = (uint32_t)block[i*4] | ((uint32_t)block[i*4+1] << 8) |
+             ((uint32_t)block[i*4+2] << 16) | ((uint32_t)block[i*4+3] << 24);
+   }
+   for (int i=0; i<64; i++)
+   {
+      uint32_t f;
+      int g;
+      if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+      else if (i < 32) { f = (d & b) | (~d & c); g = (5*i + 1) % 16; }
+      else if (i < 48) { f = b ^ c ^ d;          g = (3*i + 5) % 16; }
+      else             { f = c ^ (b | ~d);       g = (7*i) % 16; }
+      uint32_t t = d;
+      d = c;
+      c = b;
+      b = b + rotl(a + f + k[i] + m[g], r[i]);
+      a = t;
+   }
+   state[0] += a;
+   state[1] += b;
+   state[2] += c;
+   state[3] += d;
+}
+
+void simMD5(const uint8_t *data, const size_t len, uint8_t digest[16])
+{
+   uint32_t state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+   uint8_t tail[128];
+   size_t full = len & ~(size_t)63;
+   size_t rest = len - full;
+   uint64_t bits = (uint64_t)len * 8;
+
+   for (size_t i=0; i<full; i+=64)
+   {
+      md5Block(state, &data[i]);
+   }
+   memset(tail, 0, sizeof(tail));
+   memcpy(tail, &data[full], rest);
+   tail[rest] = 0x80;
+   size_t tailLen = (rest < 56) ? 64 : 128;
+   for (int i=0; i<8; i++)
+   {
+      tail[tailLen-8+i] = (uint8_t)(bits >> (8*i));
+   }
+   for (size_t i=0; i<tailLen; i+=64)
+   {
+      md5Block(state, &tail[i]);
+   }
+   for (int i=0; i<16; i++)
+   {
+      digest[i] = (uint8_t)(state[i/4] >> (8*(i%4)));
+   }
+}
+
+void simMD5Hex(const uint8_t *data, const size_t len, char hex[33])
+{
+   uint8_t digest[16];
+
+   simMD5(data, len, digest);
+   for (int i=0; i<16; i++)
+   {
+      snprintf(&hex[i*2], 3, "%02x", digest[i]);
+   }
+}
+
+static void sha256Block(uint32_t state[8], const uint8_t *block)
+{
+   static const uint32_t k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+   };
+   uint32_t w[64];
+   uint32_t v[8];
+
+   for (int i=0; i<16; i++)
+   {
+      w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4+1] << 16) |
+             ((uint32_t)block[i*4+2] << 8) | (uint32_t)block[i*4+3];
+   }
+   for (int i=16; i<64; i++)
+   {
+      uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+      uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+      w[i] = w[i-16] + s0 + w[i-7] + s1;
+   }
+   memcpy(v, state, sizeof(v));
+   for (int i=0; i<64; i++)
+   {
+      uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+      uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+      uint32_t t1 = v[7] + s1 + ch + k[i] + w[i];
+      uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+      uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+      uint32_t t2 = s0 + maj;
+      memmove(&v[1], &v[0], 7*sizeof(uint32_t));
+      v[4] += t1;
+      v[0] = t1 + t2;
+   }
+   for (int i=0; i<8; i++)
+   {
+      state[i] += v[i];
+   }
+}
+
+// two buffers back to back, so HMAC does not have to concatenate
+static void sha256Two(const uint8_t *a, const size_t aLen, const uint8_t *b, const size_t bLen, uint8_t digest[32])
+{
+   uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+   uint8_t block[64];
+   size_t fill = 0;
+   uint64_t bits = (uint64_t)(aLen + bLen) * 8;
+
+   for (size_t i=0; i<aLen+bLen; i++)
+   {
+      block[fill++] = (i < aLen) ? a[i] : b[i-aLen];
+      if (fill == 64)
+      {
+         sha256Block(state, block);
+         fill = 0;
+      }
+   }
+   block[fill++] = 0x80;
+   if (fill > 56)
+   {
+      memset(&block[fill], 0, 64-fill);
+      sha256Block(state, block);
+      fill = 0;
+   }
+   memset(&block[fill], 0, 56-fill);
+   for (int i=0; i<8; i++)
+   {
+      block[56+i] = (uint8_t)(bits >> (56 - 8*i));
+   }
+   sha256Block(state, block);
+   for (int i=0; i<32; i++)
+   {
+      digest[i] = (uint8_t)(state[i/4] >> (24 - 8*(i%4)));
+   }
+}
+
+void simSHA256(const uint8_t *data, const size_t len, uint8_t digest[32])
+{
+   sha256Two(data, len, NULL, 0, digest);
+}
+
+void simHmacSHA256(const uint8_t *key, const size_t keyLen, const uint8_t *data, const size_t len, uint8_t mac[32])
+{
+   uint8_t k[64];
+   uint8_t pad[64];
+   uint8_t inner[32];
+
+   memset(k, 0, sizeof(k));
+   if (keyLen > sizeof(k))
+   {
+      simSHA256(key, keyLen, k);
+   }
+   else
+   {
+      memcpy(k, key, keyLen);
+   }
+   for (int i=0; i<64; i++) { pad[i] = k[i] ^ 0x36; }
+   sha256Two(pad, sizeof(pad), data, len, inner);
+   for (int i=0; i<64; i++) { pad[i] = k[i] ^ 0x5c; }
+   sha256Two(pad, sizeof(pad), inner, sizeof(inner), mac);
+}
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t mdType)
+{
+   static const mbedtls_md_info_t sha256 = { MBEDTLS_MD_SHA256 };
+   return (mdType == MBEDTLS_MD_SHA256) ? &sha256 : NULL;
+}
+
+int mbedtls_md_hmac(const mbedtls_md_info_t *mdInfo, const unsigned char *key, size_t keyLen,
+                    const unsigned char *input, size_t inputLen, unsigned char *output)
+{
+   if ((!mdInfo) || (mdInfo->type != MBEDTLS_MD_SHA256)) { return -1; }
+   simHmacSHA256(key, keyLen, input, inputLen, output);
+   return 0;
+}
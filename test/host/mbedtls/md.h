@@ -0,0 +1,18 @@
+#ifndef HOST_MBEDTLS_MD_H
+#define HOST_MBEDTLS_MD_H HOST_MBEDTLS_MD_H
+
+#include <stddef.h>
+
+// only HMAC-SHA256 is provided
+typedef enum { MBEDTLS_MD_NONE = 0, MBEDTLS_MD_SHA256 = 6 } mbedtls_md_type_t;
+
+typedef struct
+{
+   mbedtls_md_type_t type;
+} mbedtls_md_info_t;
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t mdType);
+int mbedtls_md_hmac(const mbedtls_md_info_t *mdInfo, const unsigned char *key, size_t keyLen,
+                    const unsigned char *input, size_t inputLen, unsigned char *output);
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef HOST_SIM_H
+#define HOST_SIM_H HOST_SIM_H
+
+/*
+ * Host port of the ESP32 core, enough to build iotconfig.cpp with g++ and
+ * run any number of devices in one process:
+ *
+ *   g++ -std=gnu++11 -I. -Itest/host iotconfig.cpp test/host/core.cpp test/host/hash.cpp test/<test>.cpp
+ *
+ * The core singletons (WiFi, EEPROM, Serial, ESP, MDNS, ArduinoOTA,
+ * Update) act on the device chosen with simSelect(), so every iotConfig
+ * instance has to be called with its own device selected. Each device
+ * has its own clock: millis() and micros() count from its last boot,
+ * delay() and yield() advance it (virtual time) or wait for the wall
+ * clock (simSetRealtime()). The radio is a list of simNetwork_t, a
+ * connection attempt resolves after connectMS into GOT_IP or
+ * DISCONNECTED. Deep sleep and restart throw simReboot_t, the harness
+ * then deletes the instance and boots a new one on the same device with
+ * simBoot(). Peers talk to the device through in-memory TCP connections
+ * (simConnect()) and datagrams (simSendUdp(), simSetUdpHook()).
+ */
+
+#include "WiFi.h"
+#include "WiFiUdp.h"
+#include "ArduinoOTA.h"
+#include "esp_sleep.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#define SIM_MAX_DEVICES 65536
+
+// an update fed by the harness, like the TCP connection ArduinoOTA opens back to the sender
+typedef struct
+{
+   size_t len;
+   std::string md5;
+   size_t (*read)(uint8_t *buf, const size_t max);   // blocks for the next bytes, 0 once the sender is gone
+   void (*reply)(const char *text);                   // bytes taken after every chunk, "OK" at the end
+} simOtaStream_t;
+
+typedef struct
+{
+   std::string ssid;
+   std::string password;        // PSK, or the EAP password
+   std::string identity;        // EAP identity, empty for PSK networks
+   wifi_auth_mode_t authmode;
+   int8_t rssi;
+   bool up;
+   uint32_t connectMS;          // time an attempt takes, plus up to connectJitterMS
+   uint32_t connectJitterMS;
+   uint32_t admitPerSecond;     // 0 = unlimited, further attempts in the same second fail
+   // statistics
+   uint32_t attempts;
+   uint32_t admitted;
+   uint32_t rejected;
+   uint32_t clients;
+   uint64_t admitSecond;
+   uint32_t admitCount;
+} simNetwork_t;
+
+// thrown by esp_deep_sleep() and ESP.restart()
+typedef struct
+{
+   uint64_t sleepUS;            // 0 for a restart
+} simReboot_t;
+
+typedef enum
+{
+   SIM_RST_POWERON,
+   SIM_RST_EXT,                 // reset pin, e.g. the DTR/RTS auto reset of a flasher
+   SIM_RST_SW,
+   SIM_RST_DEEPSLEEP
+} simResetReason_t;
+
+typedef struct
+{
+   uint64_t atUS;
+   system_event_id_t event;
+   uint8_t reason;
+} simEvent_t;
+
+typedef struct
+{
+   system_event_id_t filter;    // SYSTEM_EVENT_MAX for all events
+   WiFiEventFuncCb cb;
+} simHandler_t;
+
+typedef struct simConn_t
+{
+   struct simDevice_t *dev;
+   uint16_t port;
+   IPAddress remote;
+   std::deque<uint8_t> toDevice;
+   std::string toPeer;
+   bool deviceClosed;
+   bool peerClosed;
+} simConn_t;
+
+typedef struct
+{
+   uint16_t port;
+   std::deque<std::shared_ptr<simConn_t> > backlog;
+} simListener_t;
+
+typedef struct
+{
+   IPAddress from;
+   uint16_t fromPort;
+   std::string data;
+} simDatagram_t;
+
+typedef struct
+{
+   uint16_t port;
+   std::deque<simDatagram_t> inbox;
+} simUdpSocket_t;
+
+typedef struct simDevice_t
+{
+   uint32_t id;
+   uint8_t mac[6];
+   // clocks
+   uint64_t nowUS;
+   uint64_t bootUS;
+   uint64_t wakeUS;             // deep sleep ends, see simReboot_t
+   simResetReason_t resetReason;
+   uint32_t boots;
+   uint32_t rng;
+   // persistent state
+   std::vector<uint8_t> flash;  // EEPROM contents as committed
+   std::vector<uint8_t> eeprom; // RAM copy between EEPROM.begin() and commit()
+   uint32_t commits;
+   std::vector<uint8_t> image;  // running sketch
+   std::vector<uint8_t> nextImage;
+   std::string nextImageMD5;
+   bool updateRunning;
+   bool updateError;
+   std::vector<uint8_t> update;
+   size_t updateSize;
+   std::string updateMD5;
+   // radio
+   wifi_mode_t mode;
+   bool sleep;
+   std::string hostname;
+   std::string softAPSSID;
+   IPAddress softAPIP;
+   simNetwork_t *joining;
+   uint64_t joinDueUS;
+   bool joinAdmitted;
+   simNetwork_t *network;
+   IPAddress ip;
+   bool enterprise;
+   std::string eapIdentity;
+   std::string eapUsername;
+   std::string eapPassword;
+   std::vector<wifi_ap_record_t> scan;
+   bool scanRunning;
+   uint64_t scanDueUS;
+   std::deque<simEvent_t> events;
+   std::map<wifi_event_id_t, simHandler_t> handlers;
+   wifi_event_id_t nextHandlerId;
+   // sockets
+   std::vector<simListener_t> listeners;
+   std::vector<simUdpSocket_t> udp;
+   // serial line
+   std::deque<uint8_t> serialIn;
+   std::string serialOut;
+   bool captureSerial;
+   uint32_t serialBaud;         // realtime: Serial.write() takes as long as on a UART, 0 = instant
+   // mDNS and ArduinoOTA
+   std::string mdnsHost;
+   std::map<std::string, std::string> mdnsTxt;
+   bool otaStarted;
+   std::string otaHostname;
+   std::string otaPassword;
+   ArduinoOTAClass::THandlerFunction otaOnStart;
+   ArduinoOTAClass::THandlerFunction otaOnEnd;
+   ArduinoOTAClass::THandlerFunction_Error otaOnError;
+   ArduinoOTAClass::THandlerFunction_Progress otaOnProgress;
+   std::vector<uint8_t> otaOffer;
+   std::string otaOfferPassword;
+   uint32_t otaChunk;
+   uint32_t otaChunkUS;
+   simOtaStream_t otaStream;
+   int pins[40];
+} simDevice_t;
+
+// device management
+simDevice_t *simCreateDevice(const uint32_t id);
+void simDestroyDevice(simDevice_t *dev);
+void simSelect(simDevice_t *dev);
+simDevice_t *simCurrent();
+// power cycle (RTC contexts are the harness's business), restart or deep sleep wake
+void simBoot(simDevice_t *dev, const simResetReason_t reason);
+void simSetSketch(simDevice_t *dev, const uint8_t *image, const size_t len);
+
+// time
+void simSetRealtime(const bool realtime);
+bool simRealtime();
+void simSetTime(simDevice_t *dev, const uint64_t nowUS);
+void simAdvance(simDevice_t *dev, const uint64_t us);
+// earliest pending radio event (connect result, scan done), UINT64_MAX if none
+uint64_t simNextEvent(simDevice_t *dev);
+// delivers the WiFi events due at the device's clock, with the device selected
+void simDeliver(simDevice_t *dev);
+// called whenever a device gets a new radio event, so a scheduler can wake it
+void simSetEventHook(void (*hook)(simDevice_t *dev, uint64_t atUS));
+// called from yield() and delay() in realtime mode
+void simSetPollHook(void (*hook)());
+
+// networks
+simNetwork_t *simAddNetwork(const char *ssid, const char *password, const wifi_auth_mode_t authmode, const int8_t rssi);
+simNetwork_t *simFindNetwork(const char *ssid);
+void simSetNetworkUp(simNetwork_t *net, const bool up);
+void simClearNetworks();
+
+// peers
+std::shared_ptr<simConn_t> simConnect(simDevice_t *dev, const uint16_t port, const IPAddress &from);
+void simSend(const std::shared_ptr<simConn_t> &conn, const void *data, const size_t len);
+std::string simReceive(const std::shared_ptr<simConn_t> &conn);
+void simClose(const std::shared_ptr<simConn_t> &conn);
+bool simListening(simDevice_t *dev, const uint16_t port);
+bool simSendUdp(simDevice_t *dev, const uint16_t port, const IPAddress &from, const uint16_t fromPort,
+                const void *data, const size_t len);
+void simSetUdpHook(void (*hook)(simDevice_t *dev, const IPAddress &to, const uint16_t port,
+                                const uint8_t *data, const size_t len));
+void simSerialInput(simDevice_t *dev, const void *data, const size_t len);
+void simSetSerialHook(void (*hook)(simDevice_t *dev, const uint8_t *data, const size_t len));
+
+// ArduinoOTA: the next ArduinoOTA.handle() on the device receives image
+void simOfferOTA(simDevice_t *dev, const uint8_t *image, const size_t len, const char *password,
+                 const uint32_t chunk = 1460, const uint32_t chunkUS = 1000);
+// ArduinoOTA: the next ArduinoOTA.handle() reads the image from stream, in reads of at most chunk bytes
+void simStreamOTA(simDevice_t *dev, const simOtaStream_t &stream, const char *password, const uint32_t chunk = 1460);
+
+// hashes used by the core (sketch MD5, Update, mbedtls)
+void simMD5(const uint8_t *data, const size_t len, uint8_t digest[16]);
+void simMD5Hex(const uint8_t *data, const size_t len, char hex[33]);
+void simSHA256(const uint8_t *data, const size_t len, uint8_t digest[32]);
+void simHmacSHA256(const uint8_t *key, const size_t keyLen, const uint8_t *data, const size_t len, uint8_t mac[32]);
+
+// heap accounting: allocations of the core itself are not charged to the caller
+extern int simCoreDepth;
+struct simCoreScope
+{
+   simCoreScope() { simCoreDepth++; }
+   ~simCoreScope() { simCoreDepth--; }
+};
+
+#endif
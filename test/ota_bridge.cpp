@@ -0,0 +1,281 @@
+/*
+ * Stand-in for a device on the network, so ArduinoOTA transfers through
+ * iotConfig can be measured on Linux without hardware. One simulated
+ * device runs on the wall clock and answers ArduinoOTA invitations on a
+ * real UDP port; the image is then streamed from the sender's TCP port
+ * into handle(), chunk by chunk, as on the device.
+ *
+ *   g++ -std=gnu++11 -O2 -I. -Itest/host iotconfig.cpp test/host/core.cpp test/host/hash.cpp \
+ *       test/ota_bridge.cpp -o ota_bridge
+ *   ./ota_bridge [--port 3232] [--password otapass] [--baud 115200] [--updates 1] [--limit 60] &
+ *   tools/iotconfig_ota.py --size 1048576 --host 127.0.0.1 --password otapass --json
+ *
+ * --baud makes Serial as slow as a UART of that speed (0: instant), so the
+ * cost of the progress output shows. For every update the device's own
+ * OTA statistics and how long loop() did not run are printed as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+#define BRIDGE_SSID "plant"
+#define BRIDGE_PSK "plantpsk"
+#define BRIDGE_NAME "ota-bench"
+#define BRIDGE_USER_SIZE 16
+#define BRIDGE_READ_TIMEOUT_MS 10000
+
+typedef struct
+{
+   otaStats_t stats;
+   uint32_t handleMS;           // the handle() call that ran the update, as loop() saw it
+   uint32_t maxReadWaitUS;      // longest wait for the sender between two chunks
+} update_t;
+
+static simDevice_t *dev;
+static iotConfigRTC_t rtc;
+static iotConfig *config;
+static int udp = -1;
+static int tcp = -1;
+static char nonce[33];
+static struct sockaddr_in inviter;
+static uint32_t imageSize;
+static char imageMD5[33];
+static uint32_t readWaitUS;
+
+static uint64_t wallUS()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t readSender(uint8_t *buf, const size_t max)
+{
+   struct pollfd pfd = { tcp, POLLIN, 0 };
+   uint64_t start = wallUS();
+
+   if (poll(&pfd, 1, BRIDGE_READ_TIMEOUT_MS) <= 0) { return 0; }
+   ssize_t len = recv(tcp, buf, max, 0);
+   readWaitUS = std::max(readWaitUS, (uint32_t)(wallUS() - start));
+   return (len > 0) ? len : 0;
+}
+
+static void replySender(const char *text)
+{
+   send(tcp, text, strlen(text), MSG_NOSIGNAL);
+}
+
+static void replyInviter(const char *text)
+{
+   sendto(udp, text, strlen(text), 0, (struct sockaddr*)&inviter, sizeof(inviter));
+}
+
+// the TCP connection the device opens back to the sender
+static void startUpdate(const uint16_t senderPort, const char *password)
+{
+   struct sockaddr_in addr = inviter;
+
+   addr.sin_port = htons(senderPort);
+   if (tcp >= 0) { close(tcp); }
+   tcp = socket(AF_INET, SOCK_STREAM, 0);
+   int one = 1;
+   setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   if (connect(tcp, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+   {
+      perror("connect");
+      return;
+   }
+   simOtaStream_t stream;
+   stream.len = imageSize;
+   stream.md5 = imageMD5;
+   stream.read = readSender;
+   stream.reply = replySender;
+   readWaitUS = 0;
+   simStreamOTA(dev, stream, password);
+}
+
+/*
+ * ArduinoOTA invitation: "0 <sender port> <size> <md5>\n", answered with
+ * "OK", or with "AUTH <nonce>" when the device has an OTA password. The
+ * sender then proves the password with "200 <cnonce> <md5(md5(password):nonce:cnonce)>\n".
+ */
+static void pollInvitation()
+{
+   static unsigned senderPort;
+   char line[128];
+   socklen_t fromLen = sizeof(inviter);
+   ssize_t len = recvfrom(udp, line, sizeof(line) - 1, 0, (struct sockaddr*)&inviter, &fromLen);
+
+   if (len <= 0) { return; }
+   line[len] = 0;
+   unsigned cmd = 0;
+   unsigned invitedPort = 0;
+   unsigned size = 0;
+   char md5[33] = "";
+   char cnonce[33] = "";
+   char response[33] = "";
+   if ((sscanf(line, "%u %u %u %32s", &cmd, &invitedPort, &size, md5) == 4) && (cmd == U_FLASH))
+   {
+      senderPort = invitedPort;
+      imageSize = size;
+      snprintf(imageMD5, sizeof(imageMD5), "%s", md5);
+      if (dev->otaPassword.empty())
+      {
+         replyInviter("OK");
+         startUpdate(senderPort, NULL);
+         return;
+      }
+      char seed[32];
+      snprintf(seed, sizeof(seed), "%llu", (unsigned long long)wallUS());
+      simMD5Hex((const uint8_t*)seed, strlen(seed), nonce);
+      snprintf(line, sizeof(line), "AUTH %s", nonce);
+      replyInviter(line);
+   }
+   else if ((sscanf(line, "%u %32s %32s", &cmd, cnonce, response) == 3) && (cmd == 200) && nonce[0])
+   {
+      char passMD5[33];
+      char expected[33];
+      std::string proof;
+      simMD5Hex((const uint8_t*)dev->otaPassword.data(), dev->otaPassword.size(), passMD5);
+      proof = std::string(passMD5) + ":" + nonce + ":" + cnonce;
+      simMD5Hex((const uint8_t*)proof.data(), proof.size(), expected);
+      nonce[0] = 0;
+      if (strcmp(expected, response) != 0)
+      {
+         replyInviter("Authentication Failed");
+         return;
+      }
+      replyInviter("OK");
+      startUpdate(senderPort, dev->otaPassword.c_str());
+   }
+}
+
+// factory provisioning of the fresh device, through the serial protocol
+static void provision(const char *otaPassword)
+{
+   const char *fields[][2] = { { "\x03", BRIDGE_SSID }, { "\x05", BRIDGE_PSK }, { "\x01", BRIDGE_NAME }, { "\x06", otaPassword } };
+   uint8_t frame[IOT_SERIAL_FRAME_MAX];
+   uint8_t payload[255];
+
+   for (size_t f=0; f<sizeof(fields)/sizeof(fields[0]); f++)
+   {
+      payload[0] = fields[f][0][0];
+      size_t len = strlen(fields[f][1]);
+      memcpy(&payload[1], fields[f][1], len);
+      simSerialInput(dev, frame, iotConfigSerialFrame(frame, IOT_SERIAL_PROV_SYNC, IOT_SERIAL_CMD_SET_FIELD, payload, len + 1));
+   }
+   simSerialInput(dev, frame, iotConfigSerialFrame(frame, IOT_SERIAL_PROV_SYNC, IOT_SERIAL_CMD_COMMIT, NULL, 0));
+   simSerialInput(dev, frame, iotConfigSerialFrame(frame, IOT_SERIAL_PROV_SYNC, IOT_SERIAL_CMD_DONE, NULL, 0));
+}
+
+static void boot(const simResetReason_t reason)
+{
+   simBoot(dev, reason);
+   config = new iotConfig(&rtc);
+   config->enableSerialProvisioning(100);
+   config->begin("node", "admin", BRIDGE_USER_SIZE, 0, 0);
+}
+
+int main(int argc, char **argv)
+{
+   uint16_t port = 3232;
+   const char *password = "otapass";
+   uint32_t baud = 115200;
+   uint32_t wanted = 1;
+   uint32_t limitS = 60;
+
+   for (int i=1; i+1<argc; i+=2)
+   {
+      if (strcmp(argv[i], "--port") == 0) { port = atoi(argv[i+1]); }
+      else if (strcmp(argv[i], "--password") == 0) { password = argv[i+1]; }
+      else if (strcmp(argv[i], "--baud") == 0) { baud = atoi(argv[i+1]); }
+      else if (strcmp(argv[i], "--updates") == 0) { wanted = atoi(argv[i+1]); }
+      else if (strcmp(argv[i], "--limit") == 0) { limitS = atoi(argv[i+1]); }
+      else { fprintf(stderr, "unknown option %s\n", argv[i]); return 2; }
+   }
+
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   udp = socket(AF_INET, SOCK_DGRAM, 0);
+   if ((udp < 0) || (bind(udp, (struct sockaddr*)&addr, sizeof(addr)) != 0))
+   {
+      perror("bind");
+      return 2;
+   }
+   fcntl(udp, F_SETFL, O_NONBLOCK);
+
+   simSetRealtime(true);
+   simAddNetwork(BRIDGE_SSID, BRIDGE_PSK, WIFI_AUTH_WPA2_PSK, -60);
+   memset(&rtc, 0, sizeof(rtc));
+   rtc.firstBoot = 1;
+   dev = simCreateDevice(1);
+   simSelect(dev);
+   dev->serialBaud = baud;
+   provision(password);
+   boot(SIM_RST_POWERON);
+
+   std::vector<update_t> updates;
+   const uint64_t startUS = wallUS();
+   bool announced = false;
+   while ((updates.size() < wanted) && (wallUS() - startUS < limitS * 1000000ULL))
+   {
+      if (config->isOnline() && !announced)
+      {
+         fprintf(stderr, "ota_bridge: %s online, invitations on 127.0.0.1:%u\n", BRIDGE_NAME, port);
+         announced = true;
+      }
+      pollInvitation();
+      uint64_t handleStart = wallUS();
+      try
+      {
+         config->handle();
+      }
+      catch (simReboot_t &)
+      {
+         update_t update;
+         update.stats = config->getOTAStats();
+         update.handleMS = (wallUS() - handleStart) / 1000;
+         update.maxReadWaitUS = readWaitUS;
+         updates.push_back(update);
+         delete config;
+         boot(SIM_RST_SW);
+         announced = false;
+      }
+      delay(1);
+   }
+
+   printf("{\n");
+   printf("  \"baud\": %u,\n", baud);
+   printf("  \"image_bytes\": %u,\n", imageSize);
+   printf("  \"updates\": [");
+   for (size_t u=0; u<updates.size(); u++)
+   {
+      const otaStats_t &st = updates[u].stats;
+      printf("%s\n    {\"bytes\": %u, \"ms\": %u, \"bytes_per_second\": %u, \"chunks\": %u, \"max_chunk_ms\": %u, "
+             "\"max_sender_wait_us\": %u, \"progress_print_us\": %u, \"loop_starved_ms\": %u, \"handle_ms\": %u}",
+             u ? "," : "", st.bytes, st.durationMS,
+             (st.durationMS > 0) ? (uint32_t)((uint64_t)st.bytes * 1000 / st.durationMS) : 0,
+             st.chunks, st.maxChunkLatencyMS, updates[u].maxReadWaitUS, st.progressPrintUS, st.maxLoopStarvedMS,
+             updates[u].handleMS);
+   }
+   printf("\n  ],\n");
+   printf("  \"failures\": %u\n", config->getOTAStats().failures);
+   printf("}\n");
+
+   delete config;
+   simDestroyDevice(dev);
+   if (tcp >= 0) { close(tcp); }
+   close(udp);
+   return (updates.size() == wanted) ? 0 : 1;
+}
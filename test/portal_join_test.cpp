@@ -0,0 +1,149 @@
+/*
+ * Host test of the portal's join request on the simulated ESP32 core:
+ * every field at its maximum length and every byte sent as "%XX" has to
+ * fit IOT_REQUEST_LINE_MAX, and the device has to come up with exactly
+ * these credentials, also after a restart.
+ *
+ *   g++ -std=gnu++11 -I. -Itest/host iotconfig.cpp test/host/core.cpp test/host/hash.cpp \
+ *       test/portal_join_test.cpp -o portal_join_test && ./portal_join_test
+ */
+
+#include <stdio.h>
+#include <string>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static simDevice_t *dev;
+static iotConfigRTC_t rtc;
+static iotConfig *config;
+
+// a field of length len, mixing characters a form would encode anyway
+static std::string field(const size_t len, const char seed)
+{
+   static const char chars[] = "aZ9 &=%+?/#~";
+   std::string s;
+
+   for (size_t i=0; i<len; i++) { s += chars[(seed + i) % (sizeof(chars)-1)]; }
+   return s;
+}
+
+static std::string encode(const std::string &s)
+{
+   std::string out;
+   char hex[4];
+
+   for (size_t i=0; i<s.size(); i++)
+   {
+      snprintf(hex, sizeof(hex), "%%%02X", (uint8_t)s[i]);
+      out += hex;
+   }
+   return out;
+}
+
+static void boot(const simResetReason_t reason)
+{
+   simBoot(dev, reason);
+   config = new iotConfig(&rtc);
+   config->begin("node", "admin", 16, 0, 0);
+}
+
+// loop() until the device closes the connection, returns the response
+static std::string request(const std::string &line)
+{
+   std::shared_ptr<simConn_t> conn = simConnect(dev, 80, IPAddress(192, 168, 4, 2));
+   std::string request = line + "\r\n\r\n";
+   std::string response;
+
+   simSend(conn, request.data(), request.size());
+   for (uint32_t ms=0; (ms<5000) && !conn->deviceClosed; ms+=10)
+   {
+      simDeliver(dev);
+      config->handle();
+      delay(10);
+   }
+   response = simReceive(conn);
+   simClose(conn);
+   return response;
+}
+
+static bool runUntilOnline(const uint32_t limitMS)
+{
+   for (uint32_t ms=0; ms<limitMS; ms+=10)
+   {
+      simDeliver(dev);
+      try
+      {
+         config->handle();
+      }
+      catch (simReboot_t &sleep)
+      {
+         delete config;
+         simAdvance(dev, sleep.sleepUS);
+         boot(sleep.sleepUS ? SIM_RST_DEEPSLEEP : SIM_RST_SW);
+      }
+      if (config->isOnline()) { return true; }
+      delay(10);
+   }
+   return false;
+}
+
+int main()
+{
+   const std::string ident = field(IOT_IDENTITY_MAX, 0);
+   const std::string pass = field(IOT_PASSPHRASE_MAX, 3);
+   const std::string fname = field(IOT_SSID_MAX, 5);
+   const std::string ota = field(IOT_OTA_PASSWORD_MAX, 7);
+   simNetwork_t *net = simAddNetwork("campus", pass.c_str(), WIFI_AUTH_WPA2_ENTERPRISE, -50);
+
+   net->identity = ident;
+   dev = simCreateDevice(1);
+   simSelect(dev);
+   memset(&rtc, 0, sizeof(rtc));
+   rtc.firstBoot = 1;
+   boot(SIM_RST_POWERON);
+
+   // the first page starts the scan and refreshes until the list is there
+   CHECK(request("GET / HTTP/1.1").find("Scanning") != std::string::npos);
+   CHECK(request("GET / HTTP/1.1").find("/join/1") != std::string::npos);
+   CHECK(request("GET /join/1 HTTP/1.1").find("name=\"ident\"") != std::string::npos);
+
+   // the longest line the form can produce, one byte short of it with the index "20"
+   std::string line = "GET /join/1?ident=" + encode(ident) + "&pass=" + encode(pass) +
+                      "&fname=" + encode(fname) + "&ota=" + encode(ota) + "&otar=" + encode(ota) + " HTTP/1.1";
+   CHECK(line.size() + 1 + 1 == IOT_REQUEST_LINE_MAX);
+   request(line);
+   CHECK(config->getPortalStats().evictedOversize == 0);
+   CHECK(runUntilOnline(30000));
+   CHECK(dev->eapIdentity == ident);
+   CHECK(dev->eapPassword == pass);
+   CHECK(fname == config->getFriendlyName());
+   CHECK(dev->otaPassword == ota);
+
+   // the records hold the full lengths
+   delete config;
+   boot(SIM_RST_SW);
+   CHECK(runUntilOnline(30000));
+   CHECK(dev->eapIdentity == ident);
+   CHECK(fname == config->getFriendlyName());
+   CHECK(dev->otaPassword == ota);
+
+   // anything longer is still refused as too long
+   delete config;
+   memset(&rtc, 0, sizeof(rtc));
+   rtc.firstBoot = 1;
+   simDestroyDevice(dev);
+   dev = simCreateDevice(2);
+   simSelect(dev);
+   boot(SIM_RST_POWERON);
+   request("GET /" + std::string(IOT_REQUEST_LINE_MAX, 'a') + " HTTP/1.1");
+   CHECK(config->getPortalStats().evictedOversize == 1);
+
+   delete config;
+   simDestroyDevice(dev);
+   if (failures == 0) { printf("portal_join_test: OK\n"); }
+   return failures ? 1 : 0;
+}
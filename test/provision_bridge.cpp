@@ -0,0 +1,212 @@
+/*
+ * Stand-in for a crate of fresh devices behind a real UDP port, so the
+ * provisioning sender can be tried on Linux without hardware. Every
+ * datagram to the port is broadcast to all simulated devices on the
+ * staging network, their acks go back to the sender. The bridge exits
+ * once every device is online on the network from the blob.
+ *
+ *   g++ -std=gnu++11 -O2 -I. -Itest/host iotconfig.cpp test/host/core.cpp test/host/hash.cpp \
+ *       test/provision_bridge.cpp -o provision_bridge
+ *   ./provision_bridge --devices 20 [--port 4210] [--ssid plant --psk plantpsk] [--limit 60] [--speed 1] &
+ *   tools/iotconfig_provision.py send --target 127.0.0.1 --ssid plant --password plantpsk \
+ *       --name node-%m --ota otapass --key admin --expect 20
+ *
+ * The devices run on a virtual clock paced to --speed times real time;
+ * the admin password of the crate is "admin". Results are printed as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <thread>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+#define BRIDGE_STAGING_SSID "staging"
+#define BRIDGE_STAGING_PSK "stagingpsk"
+#define BRIDGE_ADMIN_PASSWORD "admin"
+#define BRIDGE_TICK_US 10000
+
+typedef struct
+{
+   simDevice_t *dev;
+   iotConfigRTC_t rtc;
+   iotConfig *config;
+   uint64_t ackUS;
+   uint64_t onlineUS;
+   uint8_t ackStatus;
+} node_t;
+
+static std::vector<node_t> nodes;
+static int sock = -1;
+static uint32_t acksSent;
+
+static uint64_t wallUS()
+{
+   return std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void onDatagram(simDevice_t *dev, const IPAddress &to, const uint16_t port, const uint8_t *data, const size_t len)
+{
+   struct sockaddr_in addr;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   for (int i=0; i<4; i++) { ((uint8_t*)&addr.sin_addr)[i] = to[i]; }
+   sendto(sock, data, len, 0, (struct sockaddr*)&addr, sizeof(addr));
+   acksSent++;
+   if ((len == IOT_PROVISION_ACK_SIZE) && (nodes[dev->id].ackUS == 0))
+   {
+      nodes[dev->id].ackUS = dev->nowUS;
+      nodes[dev->id].ackStatus = data[5];
+   }
+}
+
+static void boot(node_t &node, const simResetReason_t reason)
+{
+   simBoot(node.dev, reason);
+   node.config = new iotConfig(&node.rtc);
+   node.config->enableBulkProvisioning(IOT_PROVISION_PORT, BRIDGE_STAGING_SSID, BRIDGE_STAGING_PSK);
+   node.config->begin("node", BRIDGE_ADMIN_PASSWORD, 16, 0, 0);
+}
+
+// hands every waiting datagram to the devices listening on the staging network
+static uint32_t pollSocket(const simNetwork_t *staging)
+{
+   uint8_t data[IOT_PROVISION_BLOB_MAX + 1];
+   struct sockaddr_in from;
+   socklen_t fromLen = sizeof(from);
+   uint32_t received = 0;
+   ssize_t len;
+
+   while ((len = recvfrom(sock, data, sizeof(data), 0, (struct sockaddr*)&from, &fromLen)) >= 0)
+   {
+      const uint8_t *ip = (const uint8_t*)&from.sin_addr;
+      received++;
+      for (size_t n=0; n<nodes.size(); n++)
+      {
+         if (nodes[n].dev->network == staging)
+         {
+            simSendUdp(nodes[n].dev, IOT_PROVISION_PORT, IPAddress(ip[0], ip[1], ip[2], ip[3]), ntohs(from.sin_port), data, len);
+         }
+      }
+      fromLen = sizeof(from);
+   }
+   return received;
+}
+
+int main(int argc, char **argv)
+{
+   uint32_t devices = 20;
+   uint16_t port = IOT_PROVISION_PORT;
+   const char *ssid = "plant";
+   const char *psk = "plantpsk";
+   uint32_t limitS = 60;
+   double speed = 1.0;
+
+   for (int i=1; i+1<argc; i+=2)
+   {
+      if (strcmp(argv[i], "--devices") == 0) { devices = atoi(argv[i+1]); }
+      else if (strcmp(argv[i], "--port") == 0) { port = atoi(argv[i+1]); }
+      else if (strcmp(argv[i], "--ssid") == 0) { ssid = argv[i+1]; }
+      else if (strcmp(argv[i], "--psk") == 0) { psk = argv[i+1]; }
+      else if (strcmp(argv[i], "--limit") == 0) { limitS = atoi(argv[i+1]); }
+      else if (strcmp(argv[i], "--speed") == 0) { speed = atof(argv[i+1]); }
+      else { fprintf(stderr, "unknown option %s\n", argv[i]); return 2; }
+   }
+   if ((devices == 0) || (speed <= 0)) { return 2; }
+
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   sock = socket(AF_INET, SOCK_DGRAM, 0);
+   if ((sock < 0) || (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0))
+   {
+      perror("bind");
+      return 2;
+   }
+   fcntl(sock, F_SETFL, O_NONBLOCK);
+
+   simNetwork_t *staging = simAddNetwork(BRIDGE_STAGING_SSID, BRIDGE_STAGING_PSK, WIFI_AUTH_WPA2_PSK, -55);
+   simNetwork_t *plant = simAddNetwork(ssid, psk, WIFI_AUTH_WPA2_PSK, -60);
+   simSetUdpHook(onDatagram);
+   nodes.assign(devices, node_t());
+   for (uint32_t n=0; n<devices; n++)
+   {
+      memset(&nodes[n].rtc, 0, sizeof(nodes[n].rtc));
+      nodes[n].rtc.firstBoot = 1;
+      nodes[n].dev = simCreateDevice(n);
+      simSelect(nodes[n].dev);
+      boot(nodes[n], SIM_RST_POWERON);
+   }
+   fprintf(stderr, "provision_bridge: %u devices on 127.0.0.1:%u\n", devices, port);
+
+   const uint64_t startUS = wallUS();
+   uint64_t nowUS = 0;
+   uint32_t received = 0;
+   uint32_t online = 0;
+   while ((online < devices) && (nowUS < limitS * 1000000ULL * speed))
+   {
+      received += pollSocket(staging);
+      online = 0;
+      for (size_t n=0; n<nodes.size(); n++)
+      {
+         node_t &node = nodes[n];
+         simSetTime(node.dev, nowUS);
+         simSelect(node.dev);
+         try
+         {
+            simDeliver(node.dev);
+            node.config->handle();
+         }
+         catch (simReboot_t &reboot)
+         {
+            delete node.config;
+            simAdvance(node.dev, reboot.sleepUS);
+            boot(node, (reboot.sleepUS > 0) ? SIM_RST_DEEPSLEEP : SIM_RST_SW);
+         }
+         if (node.config->isOnline() && (node.dev->network == plant))
+         {
+            if (node.onlineUS == 0) { node.onlineUS = node.dev->nowUS; }
+            online++;
+         }
+      }
+      simSelect(NULL);
+      nowUS += BRIDGE_TICK_US;
+      int64_t aheadUS = (int64_t)(nowUS / speed) - (int64_t)(wallUS() - startUS);
+      if (aheadUS > 0) { std::this_thread::sleep_for(std::chrono::microseconds(aheadUS)); }
+   }
+
+   uint32_t accepted = 0;
+   uint64_t lastOnlineUS = 0;
+   for (size_t n=0; n<nodes.size(); n++)
+   {
+      if ((nodes[n].ackUS > 0) && (nodes[n].ackStatus == IOT_PROVISION_ACK_OK)) { accepted++; }
+      lastOnlineUS = std::max(lastOnlineUS, nodes[n].onlineUS);
+   }
+   printf("{\n");
+   printf("  \"devices\": %u,\n", devices);
+   printf("  \"datagrams\": %u,\n", received);
+   printf("  \"acks_sent\": %u,\n", acksSent);
+   printf("  \"accepted\": %u,\n", accepted);
+   printf("  \"online\": %u,\n", online);
+   printf("  \"all_online_ms\": %llu\n", (unsigned long long)((online == devices) ? lastOnlineUS / 1000 : 0));
+   printf("}\n");
+
+   for (size_t n=0; n<nodes.size(); n++)
+   {
+      simSelect(nodes[n].dev);
+      delete nodes[n].config;
+      simDestroyDevice(nodes[n].dev);
+   }
+   close(sock);
+   return (online == devices) ? 0 : 1;
+}
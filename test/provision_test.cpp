@@ -0,0 +1,105 @@
+/*
+ * Host test of the bulk provisioning blob codec, against a blob written by
+ * tools/iotconfig_provision.py:
+ *
+ *   g++ -std=gnu++11 -I. -Itest/host test/host/hash.cpp test/provision_test.cpp -o provision_test && ./provision_test
+ */
+
+#include <stdio.h>
+#include "iotconfigprovision.h"
+#include "sim.h"
+
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+// iotconfig_provision.py make BLOB --ssid plant --password plantpsk --name node-%m --ota otapass --key admin --sequence 1
+static const uint8_t toolBlob[] = {
+   0x49, 0x4f, 0x54, 0x50, 0x02, 0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x70,
+   0x6c, 0x61, 0x6e, 0x74, 0x00, 0x08, 0x70, 0x6c, 0x61, 0x6e, 0x74, 0x70,
+   0x73, 0x6b, 0x07, 0x6e, 0x6f, 0x64, 0x65, 0x2d, 0x25, 0x6d, 0x07, 0x6f,
+   0x74, 0x61, 0x70, 0x61, 0x73, 0x73, 0x1e, 0xe1, 0xbf, 0xdb, 0xbe, 0x0a,
+   0x82, 0x05, 0xb5, 0xc7, 0xb9, 0xfc, 0xc2, 0x85, 0xf0, 0x57, 0x11, 0x39,
+   0xc0, 0xaf, 0xa5, 0x49, 0xfa, 0x7a, 0xd8, 0xfc, 0xb8, 0xaf, 0xe1, 0x2f,
+   0xc0, 0x9b
+};
+
+// the field sizes of the library, terminating zero included
+static const size_t fieldMax[IOT_PROVISION_FIELDS] = { 33, 65, 65, 33, 32 };
+
+static void testToolBlob()
+{
+   const char *fields[IOT_PROVISION_FIELDS] = { "plant", "", "plantpsk", "node-%m", "otapass" };
+   uint8_t blob[IOT_PROVISION_BLOB_MAX];
+   iotConfigProvisionBlob_t parsed;
+
+   size_t payloadLen = iotConfigProvisionBuild(blob, sizeof(blob), 1, fields);
+   simHmacSHA256((const uint8_t*)"admin", 5, blob, payloadLen, &blob[payloadLen]);
+   CHECK(payloadLen + IOT_PROVISION_HMAC_SIZE == sizeof(toolBlob));
+   CHECK(memcmp(blob, toolBlob, sizeof(toolBlob)) == 0);
+
+   CHECK(iotConfigProvisionParse(toolBlob, sizeof(toolBlob), fieldMax, &parsed) == IOT_PROVISION_ACK_OK);
+   CHECK(parsed.sequence == 1);
+   CHECK(parsed.payloadLen == payloadLen);
+   CHECK((parsed.fieldLen[0] == 5) && (memcmp(parsed.field[0], "plant", 5) == 0));
+   CHECK(parsed.fieldLen[1] == 0);
+   CHECK((parsed.fieldLen[4] == 7) && (memcmp(parsed.field[4], "otapass", 7) == 0));
+}
+
+static void testBadFormat()
+{
+   uint8_t blob[IOT_PROVISION_BLOB_MAX + 1];
+   iotConfigProvisionBlob_t parsed;
+
+   memcpy(blob, toolBlob, sizeof(toolBlob));
+   blob[4] = 1;
+   CHECK(iotConfigProvisionParse(blob, sizeof(toolBlob), fieldMax, &parsed) == IOT_PROVISION_ACK_BAD_FORMAT);
+   memcpy(blob, toolBlob, sizeof(toolBlob));
+   blob[0] = 'X';
+   CHECK(iotConfigProvisionParse(blob, sizeof(toolBlob), fieldMax, &parsed) == IOT_PROVISION_ACK_BAD_FORMAT);
+   // a byte missing from, or added to, the fields shifts the HMAC boundary
+   CHECK(iotConfigProvisionParse(toolBlob, sizeof(toolBlob) - 1, fieldMax, &parsed) == IOT_PROVISION_ACK_BAD_FORMAT);
+   memcpy(blob, toolBlob, sizeof(toolBlob));
+   blob[sizeof(toolBlob)] = 0;
+   CHECK(iotConfigProvisionParse(blob, sizeof(toolBlob) + 1, fieldMax, &parsed) == IOT_PROVISION_ACK_BAD_FORMAT);
+   CHECK(iotConfigProvisionParse(toolBlob, IOT_PROVISION_HEADER_SIZE + IOT_PROVISION_HMAC_SIZE - 1, fieldMax, &parsed) ==
+         IOT_PROVISION_ACK_BAD_FORMAT);
+   CHECK(iotConfigProvisionParse(blob, IOT_PROVISION_BLOB_MAX + 1, fieldMax, &parsed) == IOT_PROVISION_ACK_BAD_FORMAT);
+
+   // a field has to leave room for the terminating zero
+   const size_t tight[IOT_PROVISION_FIELDS] = { 5, 65, 65, 33, 32 };
+   CHECK(iotConfigProvisionParse(toolBlob, sizeof(toolBlob), tight, &parsed) == IOT_PROVISION_ACK_BAD_FORMAT);
+   const std::string longPassword(65, 'p');
+   const char *fields[IOT_PROVISION_FIELDS] = { "plant", "", longPassword.c_str(), "node", "" };
+   size_t payloadLen = iotConfigProvisionBuild(blob, sizeof(blob), 2, fields);
+   CHECK(iotConfigProvisionParse(blob, payloadLen + IOT_PROVISION_HMAC_SIZE, fieldMax, &parsed) == IOT_PROVISION_ACK_BAD_FORMAT);
+   // and the builder refuses what does not fit
+   CHECK(iotConfigProvisionBuild(blob, payloadLen + IOT_PROVISION_HMAC_SIZE - 1, 2, fields) == 0);
+}
+
+static void testAckAndName()
+{
+   const uint8_t mac[6] = { 0x24, 0x0A, 0xC4, 0x12, 0x34, 0x56 };
+   uint8_t ack[IOT_PROVISION_ACK_SIZE];
+   char name[12];
+
+   iotConfigProvisionAck(ack, IOT_PROVISION_ACK_REPLAY, mac);
+   CHECK(memcmp(ack, "IOTA\x02\x03\x24\x0A\xC4\x12\x34\x56", IOT_PROVISION_ACK_SIZE) == 0);
+
+   iotConfigExpandNamePattern("node-%m", 7, mac, name, sizeof(name));
+   CHECK(strcmp(name, "node-123456") == 0);
+   iotConfigExpandNamePattern("%M", 2, mac, name, sizeof(name));
+   CHECK(strcmp(name, "240AC412345") == 0);
+   iotConfigExpandNamePattern("a%xb%", 5, mac, name, sizeof(name));
+   CHECK(strcmp(name, "a%xb%") == 0);
+}
+
+int main()
+{
+   testToolBlob();
+   testBadFormat();
+   testAckAndName();
+
+   if (failures == 0) { printf("provision_test: OK\n"); }
+   return failures ? 1 : 0;
+}
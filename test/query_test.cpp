@@ -0,0 +1,62 @@
+/*
+ * Host test of the portal's URL query decoding:
+ *
+ *   g++ -std=gnu++11 -I. test/query_test.cpp -o query_test && ./query_test
+ */
+
+#include <stdio.h>
+#include "iotconfigquery.h"
+
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static void testDecode()
+{
+   char out[16];
+
+   CHECK(iotConfigQueryDecode("a%41+b%2b", 9, out, sizeof(out)) == 5);
+   CHECK(strcmp(out, "aA b+") == 0);
+   // malformed escapes are copied as they are
+   CHECK(iotConfigQueryDecode("%4g%", 4, out, sizeof(out)) == 4);
+   CHECK(strcmp(out, "%4g%") == 0);
+   CHECK(iotConfigQueryDecode("%2", 2, out, sizeof(out)) == 2);
+   // queryLen bounds the input, decodedSize the output
+   CHECK(iotConfigQueryDecode("abcdef", 3, out, sizeof(out)) == 3);
+   CHECK(strcmp(out, "abc") == 0);
+   CHECK(iotConfigQueryDecode("%61%62%63%64", 12, out, 3) == 2);
+   CHECK(strcmp(out, "ab") == 0);
+   CHECK(iotConfigQueryDecode("abc", 3, out, 0) == 0);
+}
+
+static void testParam()
+{
+   char value[8];
+   const char *query = "/join/3?ota=x%26y&otar=x%26y&pass=&fname=node+1";
+
+   CHECK(iotConfigQueryParam(query, "ota", value, sizeof(value)));
+   CHECK(strcmp(value, "x&y") == 0);
+   CHECK(iotConfigQueryParam(query, "otar", value, sizeof(value)));
+   CHECK(strcmp(value, "x&y") == 0);
+   CHECK(iotConfigQueryParam(query, "fname", value, sizeof(value)));
+   CHECK(strcmp(value, "node 1") == 0);
+   // present but empty, and missing, both leave an empty value
+   CHECK(iotConfigQueryParam(query, "pass", value, sizeof(value)));
+   CHECK(value[0] == 0);
+   CHECK(!iotConfigQueryParam(query, "ident", value, sizeof(value)));
+   CHECK(value[0] == 0);
+   // the path is not part of the query
+   CHECK(!iotConfigQueryParam(query, "/join/3?ota", value, sizeof(value)));
+   // a value longer than the buffer is cut
+   CHECK(iotConfigQueryParam("fname=abcdefghij", "fname", value, sizeof(value)));
+   CHECK(strcmp(value, "abcdefg") == 0);
+}
+
+int main()
+{
+   testDecode();
+   testParam();
+
+   if (failures == 0) { printf("query_test: OK\n"); }
+   return failures ? 1 : 0;
+}
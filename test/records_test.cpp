@@ -0,0 +1,174 @@
+/*
+ * Host test of the EEPROM record codec, and of the upgrade from the fixed
+ * size layout on the simulated ESP32 core:
+ *
+ *   g++ -std=gnu++11 -I. -Itest/host iotconfig.cpp test/host/core.cpp test/host/hash.cpp \
+ *       test/records_test.cpp -o records_test && ./records_test
+ */
+
+#include <stdio.h>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+// the fields of the library at their sizes
+static char name[IOT_SSID_MAX+1];
+static char apPassword[IOT_PASSPHRASE_MAX+1];
+static char ssid[IOT_SSID_MAX+1];
+static char username[IOT_IDENTITY_MAX+1];
+static char password[IOT_PASSPHRASE_MAX+1];
+static char otaPassword[IOT_OTA_PASSWORD_MAX+1];
+static const iotConfigRecordField_t fields[IOT_CONFIG_FIELDS] = {
+   { name, sizeof(name) }, { apPassword, sizeof(apPassword) }, { ssid, sizeof(ssid) },
+   { username, sizeof(username) }, { password, sizeof(password) }, { otaPassword, sizeof(otaPassword) }
+};
+
+static void fill(const char *n, const char *s, const char *u, const char *p, const char *o)
+{
+   for (int f=0; f<IOT_CONFIG_FIELDS; f++) { memset(fields[f].value, 0, fields[f].size); }
+   strcpy(name, n);
+   strcpy(ssid, s);
+   strcpy(username, u);
+   strcpy(password, p);
+   strcpy(otaPassword, o);
+}
+
+static void testRoundTrip()
+{
+   uint8_t header[IOT_CONFIG_HEADER_SIZE];
+   uint8_t area[512];
+   uint32_t sequence;
+   size_t length;
+   std::string longPassword(IOT_PASSPHRASE_MAX, 'p');
+
+   fill("node-1", "plant", "", longPassword.c_str(), "ota");
+   CHECK(iotConfigRecordsEncode(header, area, sizeof(area), fields, 7));
+   // four non-empty fields plus the sequence, no padding
+   CHECK(iotConfigRecordsLength(header, sizeof(area), &length));
+   CHECK(length == 5*IOT_CONFIG_RECORD_OVERHEAD + 6 + 5 + IOT_PASSPHRASE_MAX + 3 + 4);
+   fill("x", "x", "x", "x", "x");
+   CHECK(iotConfigRecordsDecode(header, area, sizeof(area), fields, &sequence) == iotConfigRecordsOk);
+   CHECK(strcmp(name, "node-1") == 0);
+   CHECK(apPassword[0] == 0);
+   CHECK(strcmp(ssid, "plant") == 0);
+   CHECK(username[0] == 0);
+   CHECK(password == longPassword);
+   CHECK(strcmp(otaPassword, "ota") == 0);
+   CHECK(sequence == 7);
+
+   // an area too small for the records is refused as a whole
+   CHECK(!iotConfigRecordsEncode(header, area, length-1, fields, 7));
+   // so is a length beyond the area
+   CHECK(iotConfigRecordsDecode(header, area, length-1, fields, &sequence) == iotConfigRecordsNoFormat);
+   header[0] = 0xff;
+   CHECK(iotConfigRecordsDecode(header, area, sizeof(area), fields, &sequence) == iotConfigRecordsNoFormat);
+   CHECK(name[0] == 0);
+}
+
+static void testTruncated()
+{
+   uint8_t header[IOT_CONFIG_HEADER_SIZE];
+   uint8_t area[64];
+   uint32_t sequence;
+
+   fill("node", "plant", "", "psk", "");
+   CHECK(iotConfigRecordsEncode(header, area, sizeof(area), fields, 0));
+   // the last record, "psk", loses its final byte
+   iotConfigRecordsSetHeader(header, 2+4 + 2+5 + 2+3 - 1);
+   CHECK(iotConfigRecordsDecode(header, area, sizeof(area), fields, &sequence) == iotConfigRecordsTruncated);
+   CHECK(strcmp(name, "node") == 0);
+   CHECK(strcmp(ssid, "plant") == 0);
+   CHECK(password[0] == 0);
+   // a lone id without its length byte is ignored
+   iotConfigRecordsSetHeader(header, 2+4 + 1);
+   CHECK(iotConfigRecordsDecode(header, area, sizeof(area), fields, &sequence) == iotConfigRecordsOk);
+   CHECK(strcmp(name, "node") == 0);
+}
+
+static void testUnknownTag()
+{
+   // written by a later version: an unknown id, an oversized name and a sequence of another width
+   const uint8_t area[] = {
+      0x42, 3, 'a', 'b', 'c',
+      IOT_FIELD_FRIENDLY_NAME, IOT_SSID_MAX+1, 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n',
+         'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n', 'n',
+      IOT_RECORD_PROVISION_SEQUENCE, 2, 1, 0,
+      IOT_FIELD_SSID, 5, 'p', 'l', 'a', 'n', 't'
+   };
+   uint8_t header[IOT_CONFIG_HEADER_SIZE];
+   uint32_t sequence;
+
+   fill("x", "x", "x", "x", "x");
+   iotConfigRecordsSetHeader(header, sizeof(area));
+   CHECK(iotConfigRecordsDecode(header, area, sizeof(area), fields, &sequence) == iotConfigRecordsOk);
+   CHECK(name[0] == 0);
+   CHECK(sequence == 0);
+   CHECK(strcmp(ssid, "plant") == 0);
+}
+
+// flash as an earlier version left it: CRC, six 32 byte fields, user variables, profile table
+static void testLegacyUpgrade()
+{
+   const char *legacyFields[IOT_CONFIG_FIELDS] = { "old-node", "appass", "plant", "", "plantpsk",
+                                                   "0123456789012345678901234567890123" };
+   const uint32_t userValue = 0xC0FFEE;
+   uint8_t legacy[4 + 6*IOT_LEGACY_FIELD_SIZE + sizeof(userValue)];
+   uint32_t crc;
+   uint32_t counter = 0;
+   iotConfigRTC_t rtc;
+
+   memset(legacy, 0, sizeof(legacy));
+   for (int f=0; f<IOT_CONFIG_FIELDS; f++)
+   {
+      // the OTA password fills its field without a terminating zero
+      memcpy(&legacy[4 + f*IOT_LEGACY_FIELD_SIZE], legacyFields[f], strnlen(legacyFields[f], IOT_LEGACY_FIELD_SIZE));
+   }
+   memcpy(&legacy[4 + 6*IOT_LEGACY_FIELD_SIZE], &userValue, sizeof(userValue));
+   crc = iotConfigCRC(&legacy[4], sizeof(legacy)-4, NULL, 0);
+   memcpy(legacy, &crc, sizeof(crc));
+
+   fill("x", "x", "x", "x", "x");
+   iotConfigRecordsFromLegacy(&legacy[4], fields);
+   CHECK(strcmp(name, "old-node") == 0);
+   CHECK(username[0] == 0);
+   CHECK(strlen(otaPassword) == IOT_OTA_PASSWORD_MAX);
+   CHECK(strncmp(otaPassword, legacyFields[5], IOT_OTA_PASSWORD_MAX) == 0);
+
+   simAddNetwork("plant", "plantpsk", WIFI_AUTH_WPA2_PSK, -50);
+   simDevice_t *dev = simCreateDevice(1);
+   simSelect(dev);
+   // the profile table behind it is blank, its CRC does not match
+   dev->flash.assign(1024, 0);
+   memcpy(dev->flash.data(), legacy, sizeof(legacy));
+   memset(&rtc, 0, sizeof(rtc));
+
+   for (int boot=0; boot<2; boot++)
+   {
+      simBoot(dev, boot ? SIM_RST_SW : SIM_RST_POWERON);
+      iotConfig *config = new iotConfig(&rtc);
+      CHECK(config->begin("node", "admin", sizeof(counter), 0, 0));
+      CHECK(config->assignVariableEEPROM((uint8_t*)&counter, sizeof(counter)));
+      CHECK(counter == userValue);
+      CHECK(strcmp(config->getFriendlyName(), "old-node") == 0);
+      CHECK(strcmp(config->getSSID(), "plant") == 0);
+      CHECK(dev->flash[4] == IOT_CONFIG_FORMAT);
+      delete config;
+   }
+   // the upgrade was committed once, the second boot read the records
+   CHECK(dev->commits == 1);
+   simDestroyDevice(dev);
+}
+
+int main()
+{
+   testRoundTrip();
+   testTruncated();
+   testUnknownTag();
+   testLegacyUpgrade();
+
+   if (failures == 0) { printf("records_test: OK\n"); }
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Host test of serial provisioning on the simulated ESP32 core: the
+ * window opens on a cold boot or with the strap pin low, never on a deep
+ * sleep wake or a software reset, and a session built with the frame
+ * codec of iotconfigserial.h provisions the device. The same session over
+ * a pseudo terminal: test/serial_pty_bridge.cpp and tools/iotconfig_serial.py.
+ *
+ *   g++ -std=gnu++11 -I. -Itest/host iotconfig.cpp test/host/core.cpp test/host/hash.cpp \
+ *       test/serial_provisioning_test.cpp -o serial_provisioning_test && ./serial_provisioning_test
+ */
+
+#include <stdio.h>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+#define WINDOW_MS 3000
+#define STRAP_PIN 0
+
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static simDevice_t *dev;
+static iotConfigRTC_t rtc;
+
+// runs setup() after a reset, returns how long begin() took in ms
+static uint32_t boot(const simResetReason_t reason)
+{
+   simBoot(dev, reason);
+   iotConfig *config = new iotConfig(&rtc);
+   config->enableSerialProvisioning(WINDOW_MS, STRAP_PIN);
+   unsigned long start = millis();
+   config->begin("node", "admin", 16, 0, 0);
+   uint32_t took = millis() - start;
+   delete config;
+   return took;
+}
+
+static void testWindowGate()
+{
+   CHECK(boot(SIM_RST_POWERON) >= WINDOW_MS);
+   CHECK(boot(SIM_RST_EXT) >= WINDOW_MS);
+   CHECK(boot(SIM_RST_DEEPSLEEP) < WINDOW_MS);
+   CHECK(boot(SIM_RST_SW) < WINDOW_MS);
+   dev->pins[STRAP_PIN] = LOW;
+   CHECK(boot(SIM_RST_DEEPSLEEP) >= WINDOW_MS);
+   dev->pins[STRAP_PIN] = HIGH;
+}
+
+static void request(const uint8_t cmd, const void *payload, const uint8_t len)
+{
+   uint8_t frame[IOT_SERIAL_FRAME_MAX];
+   simSerialInput(dev, frame, iotConfigSerialFrame(frame, IOT_SERIAL_PROV_SYNC, cmd, (const uint8_t*)payload, len));
+}
+
+// statuses of the valid reply frames in the captured output, the log text around them is skipped
+static std::vector<uint8_t> replies(std::vector<std::string> *payloads)
+{
+   std::vector<uint8_t> statuses;
+   const std::string &out = dev->serialOut;
+
+   for (size_t pos=0; pos+7<=out.size(); pos++)
+   {
+      const uint8_t *frame = (const uint8_t*)&out[pos];
+      if ((frame[0] == IOT_SERIAL_PROV_REPLY) && (pos+7+frame[2] <= out.size()) && iotConfigSerialFrameValid(&frame[1]))
+      {
+         statuses.push_back(frame[1]);
+         payloads->push_back(std::string((const char*)&frame[3], frame[2]));
+         pos += 6 + frame[2];
+      }
+   }
+   return statuses;
+}
+
+static void testSession()
+{
+   const uint8_t userVar[] = { 0x08, 0x00, 0xde, 0xad };
+   const uint8_t readBack[] = { 0x08, 0x00, 0x02 };
+   uint8_t frame[IOT_SERIAL_FRAME_MAX];
+   std::vector<std::string> payloads;
+
+   dev->serialIn.clear();
+   request(IOT_SERIAL_CMD_HELLO, NULL, 0);
+   request(IOT_SERIAL_CMD_SET_FIELD, "\x03plant", 6);
+   request(IOT_SERIAL_CMD_SET_FIELD, "\x05plantpsk", 9);
+   request(IOT_SERIAL_CMD_SET_FIELD, "\x09x", 2);
+   // a frame damaged on the line is refused, the session goes on
+   size_t len = iotConfigSerialFrame(frame, IOT_SERIAL_PROV_SYNC, IOT_SERIAL_CMD_SET_FIELD, (const uint8_t*)"\x01wrong", 6);
+   frame[4] ^= 0x20;
+   simSerialInput(dev, frame, len);
+   request(IOT_SERIAL_CMD_WRITE, userVar, sizeof(userVar));
+   request(IOT_SERIAL_CMD_COMMIT, NULL, 0);
+   request(IOT_SERIAL_CMD_READ, readBack, sizeof(readBack));
+   request(IOT_SERIAL_CMD_DONE, NULL, 0);
+
+   dev->captureSerial = true;
+   dev->serialOut.clear();
+   simBoot(dev, SIM_RST_POWERON);
+   iotConfig *config = new iotConfig(&rtc);
+   config->enableSerialProvisioning(WINDOW_MS, STRAP_PIN);
+   unsigned long start = millis();
+   config->begin("node", "admin", 16, 0, 0);
+   CHECK(millis() - start < WINDOW_MS);
+
+   const uint8_t expected[] = { IOT_SERIAL_ACK, IOT_SERIAL_ACK, IOT_SERIAL_ACK, IOT_SERIAL_NAK_ARG, IOT_SERIAL_NAK_CRC,
+                                IOT_SERIAL_ACK, IOT_SERIAL_ACK, IOT_SERIAL_ACK, IOT_SERIAL_ACK };
+   std::vector<uint8_t> statuses = replies(&payloads);
+   CHECK(statuses == std::vector<uint8_t>(expected, expected + sizeof(expected)));
+   if (payloads.size() == sizeof(expected))
+   {
+      const std::string &hello = payloads[0];
+      CHECK((hello.size() == 13) && (hello[0] == IOT_SERIAL_PROV_VERSION));
+      CHECK(memcmp(&hello[5], "\x24\x0A\xC4\x00\x00\x01", 6) == 0);
+      CHECK((hello.size() == 13) && ((uint8_t)hello[11] == 4 + IOT_CONFIG_HEADER_SIZE + 16) && (hello[12] == 0));
+      CHECK(payloads[7] == "\xde\xad");
+      uint32_t crc;
+      memcpy(&crc, payloads[6].data(), sizeof(crc));
+      CHECK((payloads[6].size() == 4) && (memcmp(&dev->flash[0], &crc, sizeof(crc)) == 0));
+   }
+   CHECK(strcmp(config->getSSID(), "plant") == 0);
+   CHECK(dev->serialOut.find("INFO: Serial provisioning session ended") != std::string::npos);
+   delete config;
+   dev->captureSerial = false;
+}
+
+int main()
+{
+   dev = simCreateDevice(1);
+   simSelect(dev);
+   memset(&rtc, 0, sizeof(rtc));
+   rtc.firstBoot = 1;
+
+   testWindowGate();
+   testSession();
+
+   simDestroyDevice(dev);
+   if (failures == 0) { printf("serial_provisioning_test: OK\n"); }
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Stand-in for a freshly flashed device on a USB serial adapter, so the
+ * serial provisioning tool can be tried on Linux without hardware. The
+ * Serial port of one simulated device is wired to a pseudo terminal, the
+ * device cold boots with the provisioning window open and runs on the
+ * wall clock until it is online on the network it was given, or --limit
+ * seconds passed.
+ *
+ *   g++ -std=gnu++11 -I. -Itest/host iotconfig.cpp test/host/core.cpp test/host/hash.cpp \
+ *       test/serial_pty_bridge.cpp -o serial_pty_bridge
+ *   ./serial_pty_bridge --link /tmp/iotserial [--window 10000] [--ssid plant --psk plantpsk] [--limit 30] &
+ *   tools/iotconfig_serial.py /tmp/iotserial --ssid plant --password plantpsk --name node-1 --ota otapass
+ *
+ * The terminal is printed on stderr; the result is printed as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+#define BRIDGE_USER_SIZE 16
+
+static simDevice_t *dev;
+static int master = -1;
+static uint32_t bytesIn;
+static uint32_t bytesOut;
+static uint64_t startUS;
+
+// ms since the cold boot, across the reboots that may follow it
+static unsigned long sinceStart()
+{
+   millis();
+   return (dev->nowUS - startUS) / 1000;
+}
+
+// what the host wrote to the terminal becomes Serial input of the device
+static void pollTerminal()
+{
+   uint8_t data[256];
+   ssize_t len;
+
+   while ((len = read(master, data, sizeof(data))) > 0)
+   {
+      simSerialInput(dev, data, len);
+      bytesIn += len;
+   }
+}
+
+static void onSerial(simDevice_t *from, const uint8_t *data, const size_t len)
+{
+   (void)from;
+   // like a UART nobody listens to, what does not fit into the terminal is lost
+   ssize_t written = write(master, data, len);
+   if (written > 0) { bytesOut += written; }
+}
+
+int main(int argc, char **argv)
+{
+   const char *link = NULL;
+   const char *ssid = "plant";
+   const char *psk = "plantpsk";
+   uint32_t windowMS = 10000;
+   uint32_t limitS = 30;
+
+   for (int i=1; i+1<argc; i+=2)
+   {
+      if (strcmp(argv[i], "--link") == 0) { link = argv[i+1]; }
+      else if (strcmp(argv[i], "--ssid") == 0) { ssid = argv[i+1]; }
+      else if (strcmp(argv[i], "--psk") == 0) { psk = argv[i+1]; }
+      else if (strcmp(argv[i], "--window") == 0) { windowMS = atoi(argv[i+1]); }
+      else if (strcmp(argv[i], "--limit") == 0) { limitS = atoi(argv[i+1]); }
+      else { fprintf(stderr, "unknown option %s\n", argv[i]); return 2; }
+   }
+
+   master = posix_openpt(O_RDWR | O_NOCTTY);
+   if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0))
+   {
+      perror("posix_openpt");
+      return 2;
+   }
+   const char *path = ptsname(master);
+   // raw and kept open, so nothing is echoed back and the master survives the host closing its end
+   int slave = open(path, O_RDWR | O_NOCTTY);
+   struct termios tio;
+   if ((slave < 0) || (tcgetattr(slave, &tio) != 0))
+   {
+      perror(path);
+      return 2;
+   }
+   cfmakeraw(&tio);
+   tcsetattr(slave, TCSANOW, &tio);
+   fcntl(master, F_SETFL, O_NONBLOCK);
+   if (link)
+   {
+      unlink(link);
+      if (symlink(path, link) != 0)
+      {
+         perror(link);
+         return 2;
+      }
+   }
+   fprintf(stderr, "serial_pty_bridge: %s, window %u ms\n", link ? link : path, windowMS);
+
+   simSetRealtime(true);
+   simSetPollHook(pollTerminal);
+   simSetSerialHook(onSerial);
+   simNetwork_t *plant = simAddNetwork(ssid, psk, WIFI_AUTH_WPA2_PSK, -60);
+
+   iotConfigRTC_t rtc;
+   memset(&rtc, 0, sizeof(rtc));
+   rtc.firstBoot = 1;
+   dev = simCreateDevice(1);
+   simSelect(dev);
+   dev->captureSerial = true;
+   simBoot(dev, SIM_RST_POWERON);
+   iotConfig *config = new iotConfig(&rtc);
+   config->enableSerialProvisioning(windowMS);
+   startUS = dev->nowUS;
+   config->begin("node", "admin", BRIDGE_USER_SIZE, 0, 0);
+   unsigned long beginMS = sinceStart();
+   bool session = dev->serialOut.find("INFO: Serial provisioning session ended") != std::string::npos;
+
+   unsigned long onlineMS = 0;
+   while ((onlineMS == 0) && (sinceStart() < limitS * 1000UL))
+   {
+      try
+      {
+         config->handle();
+      }
+      catch (simReboot_t &)
+      {
+         delete config;
+         simBoot(dev, SIM_RST_SW);
+         config = new iotConfig(&rtc);
+         config->begin("node", "admin", BRIDGE_USER_SIZE, 0, 0);
+      }
+      if (config->isOnline() && (dev->network == plant)) { onlineMS = sinceStart(); }
+      delay(10);
+   }
+
+   printf("{\n");
+   printf("  \"window_ms\": %u,\n", windowMS);
+   printf("  \"begin_ms\": %lu,\n", beginMS);
+   printf("  \"session\": %s,\n", session ? "true" : "false");
+   printf("  \"bytes_in\": %u,\n", bytesIn);
+   printf("  \"bytes_out\": %u,\n", bytesOut);
+   printf("  \"ssid\": \"%s\",\n", config->getSSID());
+   printf("  \"friendly_name\": \"%s\",\n", config->getFriendlyName());
+   printf("  \"online_ms\": %lu\n", onlineMS);
+   printf("}\n");
+
+   delete config;
+   simDestroyDevice(dev);
+   if (link) { unlink(link); }
+   close(slave);
+   close(master);
+   return (session && (onlineMS > 0)) ? 0 : 1;
+}
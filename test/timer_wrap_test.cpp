@@ -0,0 +1,117 @@
+/*
+ * Host test of the library timers across the 32 bit millis() wrap,
+ * driven by a virtual clock:
+ *
+ *   g++ -std=gnu++11 -I. test/timer_wrap_test.cpp -o timer_wrap_test && ./timer_wrap_test
+ */
+
+#include <stdio.h>
+#include "iotconfigtimer.h"
+
+static uint32_t virtualNow;
+static int failures;
+
+static uint32_t virtualClock()
+{
+   return virtualNow;
+}
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static void testWrapDuringInterval()
+{
+   iotConfigClock_t clock = virtualClock;
+   iotConfigTimer_t timer;
+
+   // started 256 ms before the wrap, runs 512 ms
+   virtualNow = 0xFFFFFF00;
+   iotConfigTimerStart(&timer, clock(), 0x200);
+   CHECK(!iotConfigTimerExpired(&timer, clock()));
+   CHECK(iotConfigTimerRemaining(&timer, clock()) == 0x200);
+
+   virtualNow = 0xFFFFFFFF;
+   CHECK(!iotConfigTimerExpired(&timer, clock()));
+   CHECK(iotConfigTimerElapsed(&timer, clock()) == 0xFF);
+
+   virtualNow = 0;
+   CHECK(!iotConfigTimerExpired(&timer, clock()));
+   CHECK(iotConfigTimerRemaining(&timer, clock()) == 0x100);
+
+   virtualNow = 0xFF;
+   CHECK(!iotConfigTimerExpired(&timer, clock()));
+   CHECK(iotConfigTimerRemaining(&timer, clock()) == 1);
+
+   virtualNow = 0x100;
+   CHECK(iotConfigTimerExpired(&timer, clock()));
+   CHECK(iotConfigTimerRemaining(&timer, clock()) == 0);
+}
+
+static void testStartAfterWrap()
+{
+   iotConfigTimer_t timer;
+
+   virtualNow = 5;
+   iotConfigTimerStart(&timer, virtualClock(), 10);
+   virtualNow = 14;
+   CHECK(!iotConfigTimerExpired(&timer, virtualClock()));
+   virtualNow = 15;
+   CHECK(iotConfigTimerExpired(&timer, virtualClock()));
+}
+
+static void testLongIntervalAcrossWrap()
+{
+   iotConfigTimer_t timer;
+
+   // a 30 day timeout started 10 days before the wrap
+   const uint32_t day = 24UL*3600*1000;
+   virtualNow = 0xFFFFFFFF - 10*day;
+   iotConfigTimerStart(&timer, virtualClock(), 30*day);
+   virtualNow += 29*day;
+   CHECK(!iotConfigTimerExpired(&timer, virtualClock()));
+   CHECK(iotConfigTimerRemaining(&timer, virtualClock()) == day);
+   virtualNow += day;
+   CHECK(iotConfigTimerExpired(&timer, virtualClock()));
+}
+
+static void testStopped()
+{
+   iotConfigTimer_t timer;
+
+   virtualNow = 0xFFFFFFF0;
+   iotConfigTimerStart(&timer, virtualClock(), 0);
+   timer.armed = false;
+   virtualNow = 0x10;
+   CHECK(!iotConfigTimerExpired(&timer, virtualClock()));
+   CHECK(iotConfigTimerRemaining(&timer, virtualClock()) == UINT32_MAX);
+}
+
+// the mDNS/metrics uptime keeps counting past the 32 bit wrap (~49.7 days)
+static void testUptimeAcrossWrap()
+{
+   iotConfigUptime_t uptime = { 0, 0 };
+
+   virtualNow = 0xFFFFF000;
+   CHECK(iotConfigUptimeExtend(&uptime, virtualClock()) == 0xFFFFF000ULL);
+   virtualNow = 0x1000;
+   CHECK(iotConfigUptimeExtend(&uptime, virtualClock()) == 0x100001000ULL);
+   CHECK(iotConfigUptimeExtend(&uptime, virtualClock()) == 0x100001000ULL);
+   virtualNow = 0xFFFFFFFF;
+   CHECK(iotConfigUptimeExtend(&uptime, virtualClock()) == 0x1FFFFFFFFULL);
+   virtualNow = 0;
+   CHECK(iotConfigUptimeExtend(&uptime, virtualClock()) == 0x200000000ULL);
+   CHECK(iotConfigUptimeExtend(&uptime, virtualClock()) / 1000 > 0xFFFFFFFFULL / 1000);
+}
+
+int main()
+{
+   testWrapDuringInterval();
+   testStartAfterWrap();
+   testLongIntervalAcrossWrap();
+   testStopped();
+   testUptimeAcrossWrap();
+   if (failures == 0)
+   {
+      printf("timer_wrap_test: OK\n");
+   }
+   return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+/*
+ * Host test of the warm boot snapshot on the simulated ESP32 core: a
+ * provisioned device started with coldBootAPtime 0 (firstBoot stays set)
+ * has to restore its configuration from RTC memory on every deep sleep
+ * wake, and load it from flash after a power-on or software reset.
+ *
+ *   g++ -std=gnu++11 -DIOTCONFIG_FEATURE_SNAPSHOT=1 -I. -Itest/host iotconfig.cpp \
+ *       test/host/core.cpp test/host/hash.cpp test/warm_boot_test.cpp -o warm_boot_test && ./warm_boot_test
+ */
+
+#include <stdio.h>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static simDevice_t *dev;
+static iotConfigRTC_t rtc;
+static iotConfig *config;
+static uint32_t counter;
+
+// setup() of the sketch, true if the configuration came from the snapshot
+static bool boot(const uint16_t coldBootAPtime)
+{
+   config = new iotConfig(&rtc);
+   config->enableWarmBootSnapshot();
+   config->enableBulkProvisioning(IOT_PROVISION_PORT, "staging", "stagingpsk");
+   config->begin("node", "admin", sizeof(counter), 0, coldBootAPtime);
+   // begin() only opens the EEPROM when it has to read the flash copy
+   bool warm = dev->eeprom.empty();
+   config->assignVariableEEPROM((uint8_t*)&counter, sizeof(counter));
+   return warm;
+}
+
+// loop() until cond holds or limitMS passed
+static bool runUntil(bool (*cond)(), const uint32_t limitMS)
+{
+   for (uint32_t ms=0; ms<limitMS; ms+=10)
+   {
+      simDeliver(dev);
+      config->handle();
+      if (cond()) { return true; }
+      delay(10);
+   }
+   return false;
+}
+
+static bool onPlant()
+{
+   return config->isOnline() && (strcmp(WiFi.SSID().c_str(), "plant") == 0);
+}
+
+static void reset(const simResetReason_t reason)
+{
+   delete config;
+   config = NULL;
+   if (reason == SIM_RST_POWERON)
+   {
+      memset(&rtc, 0, sizeof(rtc));
+      rtc.firstBoot = 1;
+   }
+   simBoot(dev, reason);
+}
+
+// reboot() of the library, deep sleep for 2 s
+static void reboot()
+{
+   try
+   {
+      config->reboot();
+   }
+   catch (simReboot_t &sleep)
+   {
+      CHECK(sleep.sleepUS > 0);
+      simAdvance(dev, sleep.sleepUS);
+      reset(SIM_RST_DEEPSLEEP);
+   }
+}
+
+static void provision()
+{
+   uint8_t blob[IOT_PROVISION_BLOB_MAX];
+   const char *fields[IOT_PROVISION_FIELDS] = { "plant", "", "plantpsk", "node-%m", "otapass" };
+   size_t payloadLen = iotConfigProvisionBuild(blob, sizeof(blob), 1, fields);
+
+   simHmacSHA256((const uint8_t*)"admin", 5, blob, payloadLen, &blob[payloadLen]);
+   CHECK(simSendUdp(dev, IOT_PROVISION_PORT, IPAddress(10, 0, 0, 1), 40000, blob, payloadLen + IOT_PROVISION_HMAC_SIZE));
+}
+
+int main()
+{
+   simAddNetwork("staging", "stagingpsk", WIFI_AUTH_WPA2_PSK, -50);
+   simAddNetwork("plant", "plantpsk", WIFI_AUTH_WPA2_PSK, -60);
+   dev = simCreateDevice(1);
+   simSelect(dev);
+   memset(&rtc, 0, sizeof(rtc));
+   rtc.firstBoot = 1;
+
+   // delivery state: portal plus staging network, provisioned over UDP
+   CHECK(!boot(0));
+   CHECK(runUntil([]() { return config->isOnline(); }, 10000));
+   provision();
+   CHECK(runUntil(onPlant, 20000));
+   counter = 42;
+   config->markDirty();
+   config->flush();
+
+   // power cycle: firstBoot is set again and stays set, the AP window is 0
+   reset(SIM_RST_POWERON);
+   CHECK(!boot(0));
+   CHECK(rtc.firstBoot == 1);
+   CHECK(counter == 42);
+   CHECK(runUntil(onPlant, 20000));
+
+   // first and second deep sleep wake use the snapshot
+   for (int wake=0; wake<2; wake++)
+   {
+      reboot();
+      counter = 0;
+      CHECK(boot(0));
+      CHECK(counter == 42);
+      CHECK(runUntil(onPlant, 20000));
+   }
+
+   // a changed variable invalidates the snapshot until the commit takes a new one
+   counter = 43;
+   config->markDirty();
+   config->flush();
+   reboot();
+   counter = 0;
+   CHECK(boot(0));
+   CHECK(counter == 43);
+
+   // a software reset does not count as a wake
+   reset(SIM_RST_SW);
+   counter = 0;
+   CHECK(!boot(0));
+   CHECK(counter == 43);
+
+   delete config;
+   simDestroyDevice(dev);
+   if (failures == 0) { printf("warm_boot_test: OK\n"); }
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * Host test of the heap-free mode on the simulated ESP32 core: built with
+ * IOTCONFIG_NO_HEAP, the library must not allocate after begin(), neither
+ * while serving the portal nor once online (reconnects, EEPROM updates,
+ * metrics scrapes). The allocations of the core itself (WiFi, TCP, mDNS)
+ * run inside simCoreScope and are not counted.
+ *
+ *   g++ -std=gnu++11 -DIOTCONFIG_NO_HEAP -I. -Itest/host iotconfig.cpp test/host/core.cpp \
+ *       test/host/hash.cpp test/zero_alloc_test.cpp -o zero_alloc_test && ./zero_alloc_test
+ *
+ * glibc only: malloc() and friends are interposed, operator new ends up there as well.
+ */
+
+#include <stdio.h>
+#include <string>
+#include "iotconfig.hpp"
+#include "sim.h"
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+#define MAX_RECORDED 16
+
+static bool counting;
+static uint32_t allocations;
+static size_t recorded[MAX_RECORDED];
+
+static void count(const size_t size)
+{
+   if (counting && (simCoreDepth == 0))
+   {
+      if (allocations < MAX_RECORDED) { recorded[allocations] = size; }
+      allocations++;
+   }
+}
+
+extern "C" void *malloc(size_t size)
+{
+   count(size);
+   return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t countN, size_t size)
+{
+   count(countN * size);
+   return __libc_calloc(countN, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+   count(size);
+   return __libc_realloc(ptr, size);
+}
+
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static simDevice_t *dev;
+static iotConfigRTC_t rtc;
+static iotConfig *config;
+static uint32_t counter;
+
+static void boot(const simResetReason_t reason)
+{
+   simBoot(dev, reason);
+   config = new iotConfig(&rtc);
+   config->enableMetrics();
+   config->enableServiceAdvertisement(80, "1.0");
+   config->begin("node", "admin", sizeof(counter), 0, 0);
+   config->assignVariableEEPROM((uint8_t*)&counter, sizeof(counter));
+}
+
+// one loop() pass, counted; a restart boots outside the count
+static void loopOnce()
+{
+   counting = true;
+   try
+   {
+      simDeliver(dev);
+      config->handle();
+      delay(10);
+      counting = false;
+   }
+   catch (simReboot_t &sleep)
+   {
+      counting = false;
+      delete config;
+      simAdvance(dev, sleep.sleepUS);
+      boot(sleep.sleepUS ? SIM_RST_DEEPSLEEP : SIM_RST_SW);
+   }
+}
+
+// loop() until the device closes the connection, returns the response
+static std::string request(const uint16_t port, const std::string &line)
+{
+   std::shared_ptr<simConn_t> conn = simConnect(dev, port, IPAddress(192, 168, 4, 2));
+   std::string request = line + "\r\n\r\n";
+
+   simSend(conn, request.data(), request.size());
+   for (uint32_t ms=0; (ms<5000) && !conn->deviceClosed; ms+=10)
+   {
+      loopOnce();
+   }
+   std::string response = simReceive(conn);
+   simClose(conn);
+   return response;
+}
+
+static void run(const uint32_t ms)
+{
+   for (uint32_t t=0; t<ms; t+=10) { loopOnce(); }
+}
+
+static bool runUntil(bool (*cond)(), const uint32_t limitMS)
+{
+   for (uint32_t ms=0; ms<limitMS; ms+=10)
+   {
+      loopOnce();
+      if (cond()) { return true; }
+   }
+   return false;
+}
+
+static bool online()
+{
+   return config->isOnline();
+}
+
+static bool offline()
+{
+   return !config->isOnline();
+}
+
+static void report(const char *scenario)
+{
+   if (allocations == 0) { return; }
+   printf("FAIL %s: %u allocations, sizes:", scenario, allocations);
+   for (uint32_t i=0; (i<allocations) && (i<MAX_RECORDED); i++) { printf(" %zu", recorded[i]); }
+   printf("\n");
+   failures++;
+}
+
+// a fresh device: scan list, join form, join with %-encoded credentials
+static void testPortal()
+{
+   allocations = 0;
+   CHECK(request(80, "GET / HTTP/1.1").find("Scanning") != std::string::npos);
+   CHECK(request(80, "GET / HTTP/1.1").find("/join/") != std::string::npos);
+   CHECK(request(80, "GET /join/1 HTTP/1.1").find("name=\"pass\"") != std::string::npos);
+   CHECK(request(80, "GET /nothing HTTP/1.1").size() > 0);
+   request(80, "GET /join/1?pass=plant%20psk&fname=node%2D1&ota=otapass&otar=otapass HTTP/1.1");
+   CHECK(runUntil(online, 30000));
+   report("portal");
+}
+
+// online: EEPROM updates, metrics scrapes, losing and regaining the network
+static void testClient(simNetwork_t *plant)
+{
+   allocations = 0;
+   for (int i=0; i<5; i++)
+   {
+      counter++;
+      counting = true;
+      config->updateEEPROM();
+      counting = false;
+      run(1000);
+   }
+   CHECK(request(IOT_METRICS_PORT, "GET /metrics HTTP/1.1").find("iotconfig_") != std::string::npos);
+   simSetNetworkUp(plant, false);
+   CHECK(runUntil(offline, 30000));
+   run(5000);
+   simSetNetworkUp(plant, true);
+   CHECK(runUntil(online, 120000));
+   CHECK(request(IOT_METRICS_PORT, "GET /metrics HTTP/1.1").find("iotconfig_") != std::string::npos);
+   report("client");
+}
+
+// the interposition works: a String built outside the core is counted
+static void testCounter()
+{
+   allocations = 0;
+   counting = true;
+   String s("counted");
+   counting = false;
+   CHECK(allocations == 1);
+}
+
+int main()
+{
+   simNetwork_t *plant = simAddNetwork("plant", "plant psk", WIFI_AUTH_WPA2_PSK, -50);
+
+   dev = simCreateDevice(1);
+   simSelect(dev);
+   memset(&rtc, 0, sizeof(rtc));
+   rtc.firstBoot = 1;
+   boot(SIM_RST_POWERON);
+
+   testCounter();
+   testPortal();
+   testClient(plant);
+
+   delete config;
+   simDestroyDevice(dev);
+   if (failures == 0) { printf("zero_alloc_test: OK\n"); }
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+"""
+Host side of the iotConfig delta OTA protocol (see enableDeltaOTA()).
+
+  iotconfig_delta.py make  OLD.bin NEW.bin PATCH --password OTAPASS
+  iotconfig_delta.py apply OLD.bin PATCH NEW.bin --password OTAPASS
+  iotconfig_delta.py send  PATCH HOST [--port 3233]
+
+"make" builds a patch that turns the running image OLD.bin into NEW.bin,
+"apply" rebuilds the target from a patch exactly like the device does
+(HMAC, source MD5, bounds and target MD5 checks), so patches can be
+tested on the host, "send" uploads a patch to a device.
+
+Patch layout: "IOTD", version (1), 3 reserved bytes, MD5 of the running
+image, target size (LE32), MD5 of the target image, HMAC-SHA256 over these
+44 header bytes keyed with the OTA password, then the op stream:
+COPY (0x01, offset LE32, length LE32), ADD (0x02, length LE16, bytes),
+RUN (0x03, length LE16, fill byte) and END (0x00).
+"""
+
+import argparse
+import hashlib
+import hmac
+import socket
+import struct
+import sys
+
+MAGIC = b"IOTD"
+VERSION = 1
+HEADER_SIZE = 44
+HMAC_SIZE = 32
+OP_END = 0x00
+OP_COPY = 0x01
+OP_ADD = 0x02
+OP_RUN = 0x03
+DEFAULT_PORT = 3233
+
+BLOCK = 16         # match key length
+STEP = 4           # source positions indexed
+MIN_COPY = 24      # shorter matches are sent as literals
+MIN_RUN = 8
+MAX_SHORT = 0xFFFF
+
+
+def make_header(old, new, password):
+    header = MAGIC + bytes([VERSION, 0, 0, 0]) + hashlib.md5(old).digest() + \
+             struct.pack("<I", len(new)) + hashlib.md5(new).digest()
+    assert len(header) == HEADER_SIZE
+    return header + hmac.new(password.encode(), header, hashlib.sha256).digest()
+
+
+def emit_literal(out, data):
+    """ADD and RUN ops for a literal stretch."""
+    pos = 0
+    start = 0
+    while pos < len(data):
+        run = 1
+        while pos + run < len(data) and data[pos + run] == data[pos] and run < MAX_SHORT:
+            run += 1
+        if run >= MIN_RUN:
+            emit_add(out, data[start:pos])
+            out += struct.pack("<BHB", OP_RUN, run, data[pos])
+            pos += run
+            start = pos
+        else:
+            pos += run
+    emit_add(out, data[start:])
+
+
+def emit_add(out, data):
+    for i in range(0, len(data), MAX_SHORT):
+        chunk = data[i:i + MAX_SHORT]
+        out += struct.pack("<BH", OP_ADD, len(chunk)) + chunk
+
+
+def make_ops(old, new):
+    index = {}
+    for off in range(0, len(old) - BLOCK + 1, STEP):
+        index.setdefault(old[off:off + BLOCK], []).append(off)
+
+    out = bytearray()
+    literal_start = 0
+    pos = 0
+    while pos + BLOCK <= len(new):
+        best_off, best_len = 0, 0
+        for off in index.get(new[pos:pos + BLOCK], ())[-8:]:
+            n = BLOCK
+            while pos + n < len(new) and off + n < len(old) and new[pos + n] == old[off + n]:
+                n += 1
+            if n > best_len:
+                best_off, best_len = off, n
+        if best_len < MIN_COPY:
+            pos += 1
+            continue
+        # grow the match backwards into the pending literal
+        while pos > literal_start and best_off > 0 and new[pos - 1] == old[best_off - 1]:
+            pos -= 1
+            best_off -= 1
+            best_len += 1
+        emit_literal(out, new[literal_start:pos])
+        out += struct.pack("<BII", OP_COPY, best_off, best_len)
+        pos += best_len
+        literal_start = pos
+    emit_literal(out, new[literal_start:])
+    out.append(OP_END)
+    return bytes(out)
+
+
+def make_patch(old, new, password):
+    return make_header(old, new, password) + make_ops(old, new)
+
+
+def apply_patch(old, patch, password):
+    """Rebuilds the target image, raises ValueError where the device would fail."""
+    if len(patch) < HEADER_SIZE + HMAC_SIZE:
+        raise ValueError("patch too short")
+    header = patch[:HEADER_SIZE]
+    mac = patch[HEADER_SIZE:HEADER_SIZE + HMAC_SIZE]
+    if header[:4] != MAGIC or header[4] != VERSION:
+        raise ValueError("bad magic or version")
+    if not hmac.compare_digest(mac, hmac.new(password.encode(), header, hashlib.sha256).digest()):
+        raise ValueError("authentication failed")
+    if header[8:24] != hashlib.md5(old).digest():
+        raise ValueError("patch does not match the running image")
+    target_size = struct.unpack("<I", header[24:28])[0]
+
+    out = bytearray()
+    pos = HEADER_SIZE + HMAC_SIZE
+    while True:
+        if pos >= len(patch):
+            raise ValueError("op stream truncated")
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            offset, length = struct.unpack("<II", patch[pos:pos + 8])
+            pos += 8
+            if offset > len(old) or length > len(old) - offset:
+                raise ValueError("copy outside the running image")
+            data = old[offset:offset + length]
+        elif op == OP_ADD:
+            length = struct.unpack("<H", patch[pos:pos + 2])[0]
+            pos += 2
+            data = patch[pos:pos + length]
+            if len(data) != length:
+                raise ValueError("op stream truncated")
+            pos += length
+        elif op == OP_RUN:
+            length, fill = struct.unpack("<HB", patch[pos:pos + 3])
+            pos += 3
+            data = bytes([fill]) * length
+        else:
+            raise ValueError("unknown op 0x%02x" % op)
+        if len(data) > target_size - len(out):
+            raise ValueError("target size exceeded")
+        out += data
+    if len(out) != target_size:
+        raise ValueError("target size mismatch")
+    if hashlib.md5(out).digest() != header[28:44]:
+        raise ValueError("target MD5 mismatch")
+    return bytes(out)
+
+
+def send_patch(patch, host, port, timeout=30):
+    with socket.create_connection((host, port), timeout=timeout) as sock:
+        sock.sendall(patch)
+        sock.shutdown(socket.SHUT_WR)
+        reply = b""
+        while True:
+            data = sock.recv(64)
+            if not data:
+                break
+            reply += data
+    return reply.strip().decode(errors="replace")
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="iotConfig delta OTA patch tool")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("make", help="build a patch from OLD to NEW")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("patch")
+    p.add_argument("--password", required=True)
+    p = sub.add_parser("apply", help="apply a patch on the host, as the device does")
+    p.add_argument("old")
+    p.add_argument("patch")
+    p.add_argument("new")
+    p.add_argument("--password", required=True)
+    p = sub.add_parser("send", help="upload a patch to a device")
+    p.add_argument("patch")
+    p.add_argument("host")
+    p.add_argument("--port", type=int, default=DEFAULT_PORT)
+    args = parser.parse_args()
+
+    if args.cmd == "make":
+        old, new = read(args.old), read(args.new)
+        patch = make_patch(old, new, args.password)
+        if apply_patch(old, patch, args.password) != new:
+            sys.exit("internal error: patch does not rebuild the target")
+        with open(args.patch, "wb") as f:
+            f.write(patch)
+        print("%d -> %d bytes, patch %d bytes" % (len(old), len(new), len(patch)))
+    elif args.cmd == "apply":
+        try:
+            new = apply_patch(read(args.old), read(args.patch), args.password)
+        except ValueError as e:
+            sys.exit("ERROR: %s" % e)
+        with open(args.new, "wb") as f:
+            f.write(new)
+        print("OK, %d bytes" % len(new))
+    else:
+        reply = send_patch(read(args.patch), args.host, args.port)
+        print(reply)
+        sys.exit(0 if reply == "OK" else 1)
+
+
+if __name__ == "__main__":
+    main()
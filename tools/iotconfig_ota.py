@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+"""
+ArduinoOTA sender that measures the transfer (see arduinoOTAsetup()).
+
+  iotconfig_ota.py (IMAGE | --size BYTES) --host HOST [--port 3232] [--password OTAPASS]
+                   [--chunk 1460] [--timeout 10] [--json]
+
+Speaks the protocol of the stock uploader (espota.py): a UDP invitation
+"0 <port> <size> <md5>\\n" to the device, the MD5 challenge if the device
+has an OTA password, then the device connects back to <port> and the image
+is sent in chunks, each answered with the number of bytes taken, "OK" at the
+end. Chunks are sent one at a time, so the answer time is the chunk latency
+of the device. --size sends a reproducible pseudo random image instead of a
+file, for benchmarks; the device then fails the MD5 check of a real flash,
+so use it against test/ota_bridge.cpp or a device that may be bricked.
+
+Reported: invitation and connect time, transfer time and throughput, and
+the chunk latency distribution. The device prints its own view as an
+"OTA-STATS {...}" line on its serial port.
+"""
+
+import argparse
+import hashlib
+import json
+import random
+import socket
+import sys
+import time
+
+DEFAULT_PORT = 3232
+FLASH = 0
+AUTH = 200
+
+
+class OtaError(Exception):
+    pass
+
+
+def invite(host, port, local_port, image, password, timeout):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(timeout)
+    md5 = hashlib.md5(image).hexdigest()
+    try:
+        sock.sendto(("%d %d %d %s\n" % (FLASH, local_port, len(image), md5)).encode(), (host, port))
+        try:
+            answer = sock.recv(128).decode(errors="replace")
+        except socket.timeout:
+            raise OtaError("no answer to the invitation")
+        if answer.startswith("AUTH"):
+            if password is None:
+                raise OtaError("the device needs an OTA password")
+            nonce = answer.split()[1]
+            cnonce = hashlib.md5(("%s%d%d%s" % (host, local_port, len(image), time.time())).encode()).hexdigest()
+            proof = "%s:%s:%s" % (hashlib.md5(password.encode()).hexdigest(), nonce, cnonce)
+            sock.sendto(("%d %s %s\n" % (AUTH, cnonce, hashlib.md5(proof.encode()).hexdigest())).encode(), (host, port))
+            try:
+                answer = sock.recv(128).decode(errors="replace")
+            except socket.timeout:
+                raise OtaError("no answer to the authentication")
+        if answer != "OK":
+            raise OtaError("invitation refused: %s" % answer)
+    finally:
+        sock.close()
+
+
+def percentile(values, p):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p / 100))]
+
+
+def send(host, port, image, password, chunk, timeout):
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.bind(("", 0))
+    server.listen(1)
+    server.settimeout(timeout)
+    result = {"bytes": len(image), "chunk": chunk}
+    start = time.monotonic()
+    try:
+        invite(host, port, server.getsockname()[1], image, password, timeout)
+        result["invitation_ms"] = round((time.monotonic() - start) * 1000, 1)
+        try:
+            conn, _ = server.accept()
+        except socket.timeout:
+            raise OtaError("the device did not connect")
+    finally:
+        server.close()
+    connected = time.monotonic()
+    result["connect_ms"] = round((connected - start) * 1000, 1)
+
+    latencies = []
+    answers = b""
+    conn.settimeout(timeout)
+    conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    try:
+        for offset in range(0, len(image), chunk):
+            sent = time.monotonic()
+            conn.sendall(image[offset:offset + chunk])
+            try:
+                answer = conn.recv(64)
+            except socket.timeout:
+                raise OtaError("no answer after %d bytes" % offset)
+            if not answer:
+                raise OtaError("the device closed the connection after %d bytes" % offset)
+            latencies.append((time.monotonic() - sent) * 1000)
+            answers = (answers + answer)[-64:]
+        while b"OK" not in answers:
+            try:
+                answer = conn.recv(64)
+            except socket.timeout:
+                raise OtaError("no OK after the image")
+            if not answer:
+                raise OtaError("the device closed the connection without OK: %s" % answers.decode(errors="replace"))
+            answers = (answers + answer)[-64:]
+    finally:
+        conn.close()
+    done = time.monotonic()
+
+    transfer = done - connected
+    result.update({
+        "transfer_ms": round(transfer * 1000, 1),
+        "bytes_per_second": int(len(image) / transfer) if transfer > 0 else 0,
+        "chunks": len(latencies),
+        "chunk_ms": {"min": round(min(latencies), 3), "p50": round(percentile(latencies, 50), 3),
+                     "p95": round(percentile(latencies, 95), 3), "max": round(max(latencies), 3)},
+        "total_ms": round((done - start) * 1000, 1)})
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ArduinoOTA sender with transfer statistics")
+    parser.add_argument("image", nargs="?", help="firmware image")
+    parser.add_argument("--size", type=int, help="send a pseudo random image of this size instead")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--host", required=True)
+    parser.add_argument("--port", type=int, default=DEFAULT_PORT)
+    parser.add_argument("--password")
+    parser.add_argument("--chunk", type=int, default=1460)
+    parser.add_argument("--timeout", type=float, default=10.0)
+    parser.add_argument("--json", action="store_true")
+    args = parser.parse_args()
+
+    if (args.image is None) == (args.size is None):
+        sys.exit("ERROR: give either an image or --size")
+    if args.image:
+        with open(args.image, "rb") as f:
+            image = f.read()
+    else:
+        image = random.Random(args.seed).randbytes(args.size)
+    if not image:
+        sys.exit("ERROR: empty image")
+
+    try:
+        result = send(args.host, args.port, image, args.password, args.chunk, args.timeout)
+    except (OtaError, OSError) as e:
+        sys.exit("ERROR: %s" % e)
+    if args.json:
+        print(json.dumps(result, indent=2))
+    else:
+        c = result["chunk_ms"]
+        print("%d bytes in %.1f ms, %d bytes/s, %d chunks, latency p50 %.3f p95 %.3f max %.3f ms" % (
+            result["bytes"], result["transfer_ms"], result["bytes_per_second"], result["chunks"],
+            c["p50"], c["p95"], c["max"]))
+
+
+if __name__ == "__main__":
+    main()
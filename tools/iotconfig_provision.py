@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""
+Host side of the iotConfig bulk provisioning protocol (see enableBulkProvisioning()).
+
+  iotconfig_provision.py make BLOB --ssid SSID --password PSK --name PATTERN --ota OTAPASS --key KEY
+  iotconfig_provision.py send [BLOB] [--ssid ... --key KEY] [--target 255.255.255.255] [--port 4210]
+                              [--expect N] [--repeat 10] [--interval 1] [--json]
+
+"make" writes a signed blob to a file, "send" broadcasts a blob (from a file
+or built from the same options) until --expect devices acknowledged it or
+--repeat rounds are done, and lists every MAC that answered. A multicast
+--target (224.0.0.0/4) is sent with TTL 1. The key is the admin password
+given to begin() for devices in delivery state, or their OTA password.
+
+Blob layout: "IOTP", version (2), flags (0), sequence (LE32), five strings
+with a length byte each (SSID, EAP identity, password, friendly name pattern,
+OTA password), HMAC-SHA256 over all of it keyed with KEY. Ack: "IOTA",
+version (2), status, station MAC.
+
+test/provision_bridge.cpp puts a crate of simulated devices behind a local
+UDP port, to try the sender without hardware.
+"""
+
+import argparse
+import hashlib
+import hmac
+import ipaddress
+import json
+import socket
+import struct
+import sys
+import time
+
+MAGIC = b"IOTP"
+ACK_MAGIC = b"IOTA"
+VERSION = 2
+ACK_SIZE = 12
+HMAC_SIZE = 32
+BLOB_MAX = 320
+DEFAULT_PORT = 4210
+STATUS = {0: "ok", 1: "bad format", 2: "bad signature", 3: "replay"}
+
+
+def make_blob(ssid, identity, password, name, ota, key, sequence):
+    blob = MAGIC + struct.pack("<BBI", VERSION, 0, sequence)
+    for field, limit in ((ssid, 32), (identity, 64), (password, 64), (name, 32), (ota, 31)):
+        value = field.encode()
+        if len(value) > limit:
+            raise ValueError("%r is longer than %d bytes" % (field, limit))
+        blob += bytes([len(value)]) + value
+    blob += hmac.new(key.encode(), blob, hashlib.sha256).digest()
+    if len(blob) > BLOB_MAX:
+        raise ValueError("blob is longer than %d bytes" % BLOB_MAX)
+    return blob
+
+
+def parse_ack(data):
+    """(MAC string, status) of an ack, None for anything else."""
+    if len(data) != ACK_SIZE or data[:4] != ACK_MAGIC or data[4] != VERSION:
+        return None
+    return ":".join("%02X" % b for b in data[6:12]), data[5]
+
+
+def send_blob(blob, target, port, expect, repeat, interval):
+    """Sends blob every interval seconds, returns {mac: (status, ip, seconds)}."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+    if ipaddress.ip_address(target).is_multicast:
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+    sock.bind(("", 0))
+    acks = {}
+    start = time.monotonic()
+    for _ in range(repeat):
+        sock.sendto(blob, (target, port))
+        deadline = time.monotonic() + interval
+        while time.monotonic() < deadline:
+            sock.settimeout(max(0.0, deadline - time.monotonic()))
+            try:
+                data, (ip, _) = sock.recvfrom(64)
+            except socket.timeout:
+                break
+            ack = parse_ack(data)
+            if ack is None:
+                continue
+            mac, status = ack
+            # a repeated blob is a replay for devices that took the first one
+            if mac not in acks or acks[mac][0] != 0:
+                acks[mac] = (status, ip, time.monotonic() - start)
+        if expect and sum(1 for a in acks.values() if a[0] == 0) >= expect:
+            break
+    sock.close()
+    return acks
+
+
+def blob_from_args(args):
+    for option in ("ssid", "name", "key"):
+        if getattr(args, option) is None:
+            sys.exit("ERROR: --%s is needed to build a blob" % option)
+    sequence = args.sequence if args.sequence is not None else int(time.time())
+    try:
+        return make_blob(args.ssid, args.identity, args.password, args.name, args.ota, args.key, sequence)
+    except ValueError as e:
+        sys.exit("ERROR: %s" % e)
+
+
+def add_blob_options(p):
+    p.add_argument("--ssid")
+    p.add_argument("--identity", default="", help="EAP identity, empty for PSK networks")
+    p.add_argument("--password", default="")
+    p.add_argument("--name", help='friendly name pattern, "%%m"/"%%M" insert the MAC')
+    p.add_argument("--ota", default="", help="OTA password, only applied in delivery state")
+    p.add_argument("--key", help="admin password (delivery state) or OTA password")
+    p.add_argument("--sequence", type=int, help="has to grow between blobs, default: unix time")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="iotConfig bulk provisioning sender")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("make", help="write a signed blob to a file")
+    p.add_argument("blob")
+    add_blob_options(p)
+
+    p = sub.add_parser("send", help="broadcast a blob and collect the acks")
+    p.add_argument("blob", nargs="?", help="blob file, otherwise built from the options")
+    add_blob_options(p)
+    p.add_argument("--target", default="255.255.255.255", help="broadcast, multicast or unicast address")
+    p.add_argument("--port", type=int, default=DEFAULT_PORT)
+    p.add_argument("--expect", type=int, default=0, help="stop after this many devices accepted")
+    p.add_argument("--repeat", type=int, default=10)
+    p.add_argument("--interval", type=float, default=1.0)
+    p.add_argument("--json", action="store_true")
+
+    args = parser.parse_args()
+    if args.cmd == "make":
+        blob = blob_from_args(args)
+        with open(args.blob, "wb") as f:
+            f.write(blob)
+        print("%d bytes" % len(blob))
+        return
+
+    if args.blob:
+        with open(args.blob, "rb") as f:
+            blob = f.read()
+    else:
+        blob = blob_from_args(args)
+    acks = send_blob(blob, args.target, args.port, args.expect, args.repeat, args.interval)
+    accepted = sum(1 for a in acks.values() if a[0] == 0)
+    if args.json:
+        print(json.dumps({"accepted": accepted, "devices": [
+            {"mac": mac, "status": STATUS.get(s, s), "ip": ip, "ack_s": round(t, 3)}
+            for mac, (s, ip, t) in sorted(acks.items())]}, indent=2))
+    else:
+        for mac, (s, ip, t) in sorted(acks.items()):
+            print("%s %-13s %-15s %.3f s" % (mac, STATUS.get(s, s), ip, t))
+        print("%d of %d devices accepted" % (accepted, len(acks)))
+    sys.exit(0 if accepted >= max(args.expect, 1) else 1)
+
+
+if __name__ == "__main__":
+    main()
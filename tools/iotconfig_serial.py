@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+"""
+Host side of the iotConfig serial provisioning protocol (see enableSerialProvisioning()).
+
+  iotconfig_serial.py PORT [--ssid SSID] [--identity ID] [--password PSK] [--name NAME]
+                           [--ap-password PASS] [--ota OTAPASS] [--write OFFSET:HEX ...]
+                           [--baud 115200] [--wait 10] [--json]
+
+Opens PORT raw (a USB serial adapter resets the board, which opens the
+window after the cold boot), repeats HELLO until the device answers or
+--wait seconds passed, sets the given fields, writes raw bytes with
+--write (offset into the EEPROM layout, the application variables start
+at 8), commits, reads the CRC protected store back to verify it and ends
+the session with DONE.
+
+Request: 0xA5, command, length, payload, CRC32 little endian over command,
+length and payload. Reply: 0x5A, status, length, payload, CRC32. The CRC is
+the nibble table CRC-32 of the EEPROM store, inverted after every byte.
+
+test/serial_pty_bridge.cpp puts a simulated device behind a pseudo
+terminal, to try the tool without hardware.
+"""
+
+import argparse
+import json
+import os
+import select
+import struct
+import sys
+import termios
+import time
+import tty
+
+SYNC = 0xA5
+REPLY = 0x5A
+VERSION = 2
+HELLO, SET_FIELD, WRITE, READ, COMMIT, DONE = range(1, 7)
+STATUS = {0: "ack", 1: "bad CRC", 2: "bad command or argument"}
+# option, field id, longest value
+FIELDS = (("name", 1, 32), ("ap_password", 2, 64), ("ssid", 3, 32),
+          ("identity", 4, 64), ("password", 5, 64), ("ota", 6, 31))
+CRC_TABLE = (0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+             0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c)
+CONFIG_FORMAT = 0xC1
+READ_CHUNK = 255
+
+
+class ProvisioningError(Exception):
+    pass
+
+
+def crc32(data):
+    crc = 0xFFFFFFFF
+    for b in data:
+        crc = CRC_TABLE[(crc ^ b) & 0x0F] ^ (crc >> 4)
+        crc = CRC_TABLE[(crc ^ (b >> 4)) & 0x0F] ^ (crc >> 4)
+        crc = ~crc & 0xFFFFFFFF
+    return crc
+
+
+def frame(sync, code, payload=b""):
+    body = bytes([code, len(payload)]) + payload
+    return bytes([sync]) + body + struct.pack("<I", crc32(body))
+
+
+class Port:
+    def __init__(self, path, baud):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+        speed = getattr(termios, "B%d" % baud, None)
+        if speed is not None:
+            attr = termios.tcgetattr(self.fd)
+            attr[4] = attr[5] = speed
+            termios.tcsetattr(self.fd, termios.TCSANOW, attr)
+        self.buf = bytearray()
+
+    def close(self):
+        os.close(self.fd)
+
+    def send(self, data):
+        os.write(self.fd, data)
+
+    def fill(self, deadline):
+        timeout = deadline - time.monotonic()
+        if timeout <= 0 or not select.select([self.fd], [], [], timeout)[0]:
+            return False
+        self.buf += os.read(self.fd, 4096)
+        return True
+
+    def discard(self, quiet):
+        """drops everything until the line was quiet for that many seconds"""
+        while self.fill(time.monotonic() + quiet):
+            pass
+        self.buf.clear()
+
+    def reply(self, timeout):
+        """(status, payload) of the next reply with a valid CRC; log text and broken frames are skipped"""
+        deadline = time.monotonic() + timeout
+        while True:
+            start = self.buf.find(REPLY)
+            if start < 0:
+                self.buf.clear()
+            else:
+                del self.buf[:start]
+                if len(self.buf) >= 3 and len(self.buf) >= 7 + self.buf[2]:
+                    end = 3 + self.buf[2]
+                    body, crc = bytes(self.buf[1:end]), struct.unpack("<I", self.buf[end:end + 4])[0]
+                    if crc == crc32(body):
+                        del self.buf[:end + 4]
+                        return body[0], body[2:]
+                    del self.buf[:1]
+                    continue
+            if not self.fill(deadline):
+                return None
+
+
+def request(port, cmd, payload=b"", timeout=0.5):
+    port.send(frame(SYNC, cmd, payload))
+    answer = port.reply(timeout)
+    if answer is None:
+        raise ProvisioningError("no reply to command %d" % cmd)
+    if answer[0] != 0:
+        raise ProvisioningError("command %d: %s" % (cmd, STATUS.get(answer[0], answer[0])))
+    return answer[1]
+
+
+def hello(port, wait):
+    deadline = time.monotonic() + wait
+    while time.monotonic() < deadline:
+        port.send(frame(SYNC, HELLO))
+        answer = port.reply(0.25)
+        if answer is not None and answer[0] == 0:
+            # answers to HELLOs sent while the device was still busy would be taken for later replies
+            port.discard(0.05)
+            return answer[1]
+    raise ProvisioningError("no device answered within %g s" % wait)
+
+
+def decode_records(store, config_start, eeprom_size):
+    """{field id: value} of the record area, None without a valid header"""
+    fmt, _, length = struct.unpack("<BBH", store[4:8])
+    if fmt != CONFIG_FORMAT or config_start + length > eeprom_size:
+        return None, 0
+    fields, pos, records = {}, 0, store[config_start:config_start + length]
+    while pos + 2 <= length:
+        field, size = records[pos], records[pos + 1]
+        fields[field] = records[pos + 2:pos + 2 + size]
+        pos += 2 + size
+    return fields, length
+
+
+def provision(port, fields, writes, wait):
+    started = time.monotonic()
+    info = hello(port, wait)
+    if len(info) < 13 or info[0] != VERSION:
+        raise ProvisioningError("unsupported device, HELLO returned %s" % info.hex())
+    answered = time.monotonic()
+    eeprom_size, total_size = struct.unpack("<HH", info[1:5])
+    config_start = struct.unpack("<H", info[11:13])[0]
+    result = {"mac": ":".join("%02X" % b for b in info[5:11]), "eeprom_size": eeprom_size,
+              "eeprom_total_size": total_size, "config_start": config_start}
+
+    for field, value in fields.items():
+        request(port, SET_FIELD, bytes([field]) + value)
+    for offset, data in writes:
+        request(port, WRITE, struct.pack("<H", offset) + data)
+    crc = struct.unpack("<I", request(port, COMMIT))[0]
+
+    store = b""
+    while len(store) < eeprom_size:
+        count = min(READ_CHUNK, eeprom_size - len(store))
+        store += request(port, READ, struct.pack("<HB", len(store), count))
+    records, length = decode_records(store, config_start, eeprom_size)
+    problems = []
+    if struct.unpack("<I", store[:4])[0] != crc or crc32(store[4:config_start + length]) != crc:
+        problems.append("CRC")
+    for field, value in fields.items():
+        if records is None or records.get(field, b"") != value:
+            problems.append("field %d" % field)
+    for offset, data in writes:
+        # bytes beyond the CRC protected store (profiles) are not read back
+        if offset + len(data) <= eeprom_size and store[offset:offset + len(data)] != data:
+            problems.append("write at %d" % offset)
+    request(port, DONE)
+
+    result.update({"crc": "%08x" % crc, "verified": not problems, "problems": problems,
+                   "session_ms": round((time.monotonic() - answered) * 1000, 1),
+                   "total_ms": round((time.monotonic() - started) * 1000, 1)})
+    return result
+
+
+def parse_write(text):
+    offset, _, data = text.partition(":")
+    try:
+        return int(offset, 0), bytes.fromhex(data)
+    except ValueError:
+        raise argparse.ArgumentTypeError("expected OFFSET:HEX, got %r" % text)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="iotConfig serial provisioning")
+    parser.add_argument("port")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--wait", type=float, default=10.0, help="seconds to wait for the window to open")
+    for option, _, limit in FIELDS:
+        parser.add_argument("--" + option.replace("_", "-"), help="at most %d bytes" % limit)
+    parser.add_argument("--write", type=parse_write, action="append", default=[], metavar="OFFSET:HEX",
+                        help="raw bytes into the EEPROM layout, application variables start at 8")
+    parser.add_argument("--json", action="store_true")
+    args = parser.parse_args()
+
+    fields = {}
+    for option, field, limit in FIELDS:
+        value = getattr(args, option)
+        if value is not None:
+            if len(value.encode()) > limit:
+                sys.exit("ERROR: --%s is longer than %d bytes" % (option.replace("_", "-"), limit))
+            fields[field] = value.encode()
+
+    port = Port(args.port, args.baud)
+    try:
+        result = provision(port, fields, args.write, args.wait)
+    except ProvisioningError as e:
+        sys.exit("ERROR: %s" % e)
+    finally:
+        port.close()
+    if args.json:
+        print(json.dumps(result, indent=2))
+    else:
+        print("%s: %s, %d fields, %d writes, CRC %s in %.1f ms" % (
+            result["mac"], "verified" if result["verified"] else "NOT verified (%s)" % ", ".join(result["problems"]),
+            len(fields), len(args.write), result["crc"], result["session_ms"]))
+    sys.exit(0 if result["verified"] else 1)
+
+
+if __name__ == "__main__":
+    main()